@@ -0,0 +1,332 @@
+// A micro-benchmark suite for the hot paths of the IGMP elements: the router
+// filter's report processing and forwarding lookups, the membership report
+// codec, the IGMP checksum and the IGMP code conversions. Every benchmark
+// reports the mean time per operation and the mean number of heap allocations
+// per operation.
+//
+// Usage: igmp-bench [name...]
+//
+// With no arguments, every benchmark is run. Otherwise, only the benchmarks
+// whose names contain one of the arguments are run.
+
+#include <click/config.h>
+#include <click/glue.hh>
+#include <click/ipaddress.hh>
+#include <click/vector.hh>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+#include "IgmpMessage.hh"
+#include "IgmpMessageManip.hh"
+#include "IgmpRouterFilter.hh"
+
+CLICK_DECLS
+
+/// The number of heap allocations that have happened so far.
+static uint64_t allocation_count = 0;
+
+/// A sink for benchmark results, so that the compiler can't optimize the
+/// benchmarked code away.
+static volatile uint64_t sink = 0;
+
+/// The minimal amount of time that every benchmark runs for, in nanoseconds.
+static const uint64_t min_run_time_ns = 200 * 1000 * 1000;
+
+static uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// A small, deterministic pseudo-random number generator (xorshift64).
+class BenchRandom final
+{
+  public:
+    BenchRandom()
+        : state(0x9E3779B97F4A7C15ull)
+    {
+    }
+
+    uint32_t next(uint32_t bound)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return (uint32_t)(state % bound);
+    }
+
+  private:
+    uint64_t state;
+};
+
+/// Gets the address of the given multicast group.
+static IPAddress group_address(int index)
+{
+    return IPAddress(htonl(0xE8000000u + 1 + index));
+}
+
+/// Gets the address of the given source.
+static IPAddress source_address(int index)
+{
+    return IPAddress(htonl(0x0A000000u + 1 + index));
+}
+
+/// Creates a source list of the given size.
+static Vector<IPAddress> source_list(int source_count)
+{
+    Vector<IPAddress> sources;
+    for (int i = 0; i < source_count; i++)
+    {
+        sources.push_back(source_address(i));
+    }
+    return sources;
+}
+
+static int name_filter_count;
+static char **name_filters;
+
+/// Tests if the benchmark with the given name should be run.
+static bool should_run(const char *name)
+{
+    if (name_filter_count == 0)
+    {
+        return true;
+    }
+
+    for (int i = 0; i < name_filter_count; i++)
+    {
+        if (strstr(name, name_filters[i]) != nullptr)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Runs the given operation over and over, on the operation indices 0, 1, 2, ...,
+/// until the minimal run time has elapsed, and prints its time and allocations
+/// per operation. The operation is run once per index before it's measured, so
+/// that scratch buffers have settled.
+template <typename TOperation>
+static void run(const char *name, int groups, int sources, const TOperation &operation)
+{
+    if (!should_run(name))
+    {
+        return;
+    }
+
+    const uint64_t warmup_count = 1024;
+    for (uint64_t i = 0; i < warmup_count; i++)
+    {
+        operation(i);
+    }
+
+    uint64_t op_count = 0;
+    uint64_t batch_size = 1024;
+    uint64_t start_allocations = allocation_count;
+    uint64_t start = now_ns();
+    uint64_t elapsed = 0;
+    while (elapsed < min_run_time_ns)
+    {
+        for (uint64_t i = 0; i < batch_size; i++)
+        {
+            operation(op_count + i);
+        }
+        op_count += batch_size;
+        batch_size *= 2;
+        elapsed = now_ns() - start;
+    }
+    uint64_t allocations = allocation_count - start_allocations;
+
+    printf(
+        "%-28s groups %6d sources %4d %10.1f ns/op %8.3f allocs/op\n",
+        name, groups, sources, (double)elapsed / op_count, (double)allocations / op_count);
+}
+
+/// An SSM-only router filter without timers, which keeps a single source record
+/// per group inline.
+typedef IgmpBasicRouterFilter<IgmpRouterFilterPolicy<false, false, 1>> SsmBenchRouterFilter;
+
+/// Creates a router filter with the given number of groups, whose records have
+/// the given filter mode and number of sources. Timers are disabled, because
+/// they need a running router.
+template <typename TFilter = IgmpTimerlessRouterFilter>
+static TFilter *create_filter(int groups, IgmpFilterMode filter_mode, const Vector<IPAddress> &sources)
+{
+    auto filter = new TFilter(nullptr);
+    IgmpFilterRecord record = {filter_mode, sources};
+    for (int i = 0; i < groups; i++)
+    {
+        filter->receive_current_state_record(group_address(i), record);
+    }
+    filter->publish();
+    return filter;
+}
+
+static void bench_filter(int groups, int sources)
+{
+    auto source_addresses = source_list(sources);
+
+    // A current-state report that refreshes a group, as hosts send in response to
+    // every general query. Each report is published, as the router does.
+    for (auto filter_mode : {IgmpFilterMode::Include, IgmpFilterMode::Exclude})
+    {
+        auto filter = create_filter(groups, filter_mode, source_addresses);
+        IgmpFilterRecord record = {filter_mode, source_addresses};
+        run(filter_mode == IgmpFilterMode::Include ? "filter.refresh_is_in" : "filter.refresh_is_ex",
+            groups, sources, [&](uint64_t i) {
+                filter->receive_current_state_record(group_address(i % groups), record);
+                filter->publish();
+            });
+        delete filter;
+    }
+
+    // The same refresh in an SSM-only filter, whose records keep their first
+    // source record inline and have no EXCLUDE-mode state at all.
+    {
+        auto filter = create_filter<SsmBenchRouterFilter>(groups, IgmpFilterMode::Include, source_addresses);
+        IgmpFilterRecord record = {IgmpFilterMode::Include, source_addresses};
+        run("filter.ssm_refresh_is_in", groups, sources, [&](uint64_t i) {
+            filter->receive_current_state_record(group_address(i % groups), record);
+            filter->publish();
+        });
+        delete filter;
+    }
+
+    // A forwarding lookup for a random group and source, half of which are
+    // unknown.
+    for (auto filter_mode : {IgmpFilterMode::Include, IgmpFilterMode::Exclude})
+    {
+        auto filter = create_filter(groups, filter_mode, source_addresses);
+        BenchRandom random;
+        const int lookup_count = 4096;
+        Vector<IPAddress> lookup_groups, lookup_sources;
+        for (int i = 0; i < lookup_count; i++)
+        {
+            lookup_groups.push_back(group_address(random.next(groups * 2)));
+            lookup_sources.push_back(source_address(random.next(sources * 2 + 1)));
+        }
+        run(filter_mode == IgmpFilterMode::Include ? "filter.lookup_include" : "filter.lookup_exclude",
+            groups, sources, [&](uint64_t i) {
+                int index = i % lookup_count;
+                sink += filter->is_listening_to(lookup_groups[index], lookup_sources[index]);
+            });
+        delete filter;
+    }
+}
+
+static void bench_codec(int groups, int sources)
+{
+    IgmpV3MembershipReport report;
+    IgmpFilterRecord record = {IgmpFilterMode::Include, source_list(sources)};
+    for (int i = 0; i < groups; i++)
+    {
+        report.group_records.push_back(IgmpV3GroupRecord(group_address(i), record, false));
+    }
+
+    Vector<unsigned char> buffer(report.get_size(), 0);
+    report.write(buffer.begin());
+
+    run("report.write", groups, sources, [&](uint64_t) {
+        sink += report.write(buffer.begin()) - buffer.begin();
+    });
+
+    run("report.read", groups, sources, [&](uint64_t) {
+        const unsigned char *data = buffer.begin();
+        sink += IgmpV3MembershipReport::read(data).group_records.size();
+    });
+
+    run("report.view", groups, sources, [&](uint64_t) {
+        IgmpV3MembershipReportView view(buffer.begin(), buffer.size());
+        for (const auto &group : view)
+        {
+            sink += group.get_source_addresses().size();
+        }
+    });
+
+    run("checksum", groups, sources, [&](uint64_t) {
+        sink += compute_igmp_checksum(buffer.begin(), buffer.size());
+    });
+}
+
+static void bench_codes()
+{
+    // Every value that a code can represent, not just the small ones.
+    run("igmp_value_to_code", 0, 0, [](uint64_t i) {
+        sink += igmp_value_to_code((unsigned int)(i % 32768));
+    });
+
+    run("igmp_code_to_value", 0, 0, [](uint64_t i) {
+        sink += igmp_code_to_value((uint8_t)i);
+    });
+}
+
+CLICK_ENDDECLS
+
+void *operator new(size_t size)
+{
+    allocation_count++;
+    void *ptr = malloc(size ? size : 1);
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+int main(int argc, char **argv)
+{
+    name_filter_count = argc - 1;
+    name_filters = argv + 1;
+
+    const int group_counts[] = {16, 256, 4096};
+    const int source_counts[] = {0, 8, 64};
+    for (int groups : group_counts)
+    {
+        for (int sources : source_counts)
+        {
+            bench_filter(groups, sources);
+        }
+    }
+
+    // Reports hold far fewer group records than a router has groups.
+    const int record_counts[] = {1, 16, 64};
+    for (int records : record_counts)
+    {
+        for (int sources : source_counts)
+        {
+            bench_codec(records, sources);
+        }
+    }
+
+    bench_codes();
+    return 0;
+}
@@ -8,42 +8,41 @@ CLICK_DECLS
 
 /// A timer that with a strongly-typed callback. Both the timer and
 /// the callback's resources are reclaimed once they are no longer
-/// necessary.
+/// necessary. The timer and its callback share a single pooled block.
 template <typename TCallback>
 class CallbackTimer final
 {
   public:
     template <typename... TArgs>
     CallbackTimer(const TArgs &... args)
-        : callback(args...)
+        : state(args...)
     {
-        timer = make_rc<Timer>(&callback_thunk, callback.get());
     }
 
     /// Initializes this timer by assigning it to an owner.
     void initialize(Element *owner)
     {
-        timer->initialize(owner);
+        state->timer.initialize(owner);
     }
 
     /// Tests if this timer has been initialized yet.
     bool initialized() const
     {
-        return timer->initialized();
+        return state->timer.initialized();
     }
 
     /// Tests if this timer is scheduled to expire at some point.
     bool scheduled() const
     {
-        return timer->scheduled();
+        return state->timer.scheduled();
     }
 
     /// Schedules the timer to fire after the given amount of seconds.
     void schedule_after_sec(uint32_t delta_sec)
     {
-        if (timer->initialized())
+        if (state->timer.initialized())
         {
-            timer->schedule_after_sec(delta_sec);
+            state->timer.schedule_after_sec(delta_sec);
         }
     }
 
@@ -56,9 +55,18 @@ class CallbackTimer final
     /// Schedules the timer to fire after the given amount of milliseconds.
     void schedule_after_msec(uint32_t delta_msec)
     {
-        if (timer->initialized())
+        if (state->timer.initialized())
         {
-            timer->schedule_after_msec(delta_msec);
+            state->timer.schedule_after_msec(delta_msec);
+        }
+    }
+
+    /// Schedules the timer to fire at the given steady timestamp.
+    void schedule_at_steady(const Timestamp &expiry)
+    {
+        if (state->timer.initialized())
+        {
+            state->timer.schedule_at_steady(expiry);
         }
     }
 
@@ -73,25 +81,25 @@ class CallbackTimer final
     /// past the previous expiration time.
     void reschedule_after_msec(uint32_t delta_msec)
     {
-        if (timer->initialized())
+        if (state->timer.initialized())
         {
-            timer->reschedule_after_msec(delta_msec);
+            state->timer.reschedule_after_msec(delta_msec);
         }
     }
 
     /// Unschedules this timer.
     void unschedule()
     {
-        if (timer->initialized())
+        if (state->timer.initialized())
         {
-            timer->unschedule();
+            state->timer.unschedule();
         }
     }
 
     /// Gets the amount of time remaining until this timer fires, in milliseconds.
     uint32_t remaining_time_msec() const
     {
-        return (timer->expiry_steady() - Timestamp::recent_steady()).msec();
+        return (state->timer.expiry_steady() - Timestamp::recent_steady()).msec();
     }
 
     /// Gets the amount of time remaining until this timer fires, in deciseconds.
@@ -100,15 +108,33 @@ class CallbackTimer final
         return remaining_time_msec() / 100;
     }
 
+    /// Gets this timer's callback.
+    TCallback &get_callback() const
+    {
+        return state->callback;
+    }
+
   private:
+    /// A timer and its callback.
+    struct State
+    {
+        template <typename... TArgs>
+        State(const TArgs &... args)
+            : callback(args...), timer(&callback_thunk, this)
+        {
+        }
+
+        TCallback callback;
+        Timer timer;
+    };
+
     static void callback_thunk(Timer *, void *data)
     {
-        TCallback *func = (TCallback *)data;
-        (*func)();
+        State *state = (State *)data;
+        state->callback();
     }
 
-    Rc<Timer> timer;
-    Rc<TCallback> callback;
+    Rc<State> state;
 };
 
 CLICK_ENDDECLS
\ No newline at end of file
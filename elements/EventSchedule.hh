@@ -1,109 +1,182 @@
 #pragma once
 
 #include <click/config.h>
-#include <click/hashmap.hh>
 #include <click/element.hh>
-#include "CallbackTimer.hh"
+#include <click/vector.hh>
+#include "TimerWheel.hh"
 
 CLICK_DECLS
 
 /// Represents a schedule of events which have yet to fire.
-template <typename TEvent>
+///
+/// Every scheduled event occupies a slot that owns an entry in a timer wheel, so
+/// the whole schedule is driven by a single Click timer. Slots are returned to a
+/// free list as soon as their event fires or is cancelled, and are reused by later
+/// events, so a schedule with a steady rate of events stops allocating once it has
+/// grown to its working size.
+///
+/// Like a timer wheel, a schedule without an owner element has no Click timer, and
+/// whoever created it must call run to fire the events that are due.
+template <typename TEvent, typename TClock = TimerWheelSteadyClock>
 class EventSchedule final
 {
   public:
-    EventSchedule(Element *owner)
-        : owner(owner), id_counter(0), events()
+    /// A handle to a scheduled event. Handles stay safe to use after their
+    /// event has fired or has been cancelled: they just stop referring to
+    /// anything.
+    struct Handle
+    {
+        Handle()
+            : index(-1), generation(0)
+        {
+        }
+
+        Handle(int index, uint32_t generation)
+            : index(index), generation(generation)
+        {
+        }
+
+        int index;
+        uint32_t generation;
+    };
+
+    explicit EventSchedule(Element *owner)
+        : timers(owner), free_list(-1), scheduled_count(0)
     {
     }
 
-    /// Makes the given event fire after the given number of milliseconds.
-    void schedule_after_msec(uint32_t delta_msec, const TEvent &event)
+    EventSchedule(const EventSchedule &) = delete;
+    EventSchedule &operator=(const EventSchedule &) = delete;
+
+    /// Makes the given event fire after the given number of deciseconds.
+    Handle schedule_after_dsec(uint32_t delta_dsec, const TEvent &event)
     {
-        // First, get rid of all expired events.
-        for (const auto &item : expired_events)
+        int index = free_list;
+        if (index < 0)
+        {
+            index = slots.size();
+            slots.push_back(Slot());
+            slots[index].timer = timers.create(Fire(this, index));
+        }
+        else
         {
-            events.erase(item);
+            free_list = slots[index].next_free;
         }
-        expired_events.clear();
-
-        // Generate an id.
-        auto id = id_counter++;
-        // Create a timer with a callback.
-        CallbackTimer<EventCallback> timer{id, event, this};
-        // Initialize the timer and schedule its expiry.
-        timer.initialize(owner);
-        timer.schedule_after_msec(delta_msec);
-
-        // Add the timer to the list of scheduled events.
-        // (to keep it alive)
-        events.insert(id, timer);
+
+        auto &slot = slots[index];
+        slot.event = event;
+        slot.in_use = true;
+        timers.schedule_after_dsec(slot.timer, delta_dsec);
+        scheduled_count++;
+        return Handle(index, slot.generation);
     }
 
-    /// Makes the given event fire after the given number of deciseconds.
-    void schedule_after_dsec(uint32_t delta_dsec, const TEvent &event)
+    /// Tests if the event with the given handle has yet to fire.
+    bool scheduled(const Handle &handle) const
+    {
+        return is_current(handle);
+    }
+
+    /// Cancels the event with the given handle. A Boolean result tells if the
+    /// event was still scheduled.
+    bool cancel(const Handle &handle)
     {
-        schedule_after_msec(delta_dsec * 100, event);
+        if (!is_current(handle))
+        {
+            return false;
+        }
+
+        timers.unschedule(slots[handle.index].timer);
+        release(handle.index);
+        return true;
     }
 
     /// Clears this schedule.
     void clear()
     {
-        events.clear();
-        expired_events.clear();
+        for (int index = 0; index < slots.size(); index++)
+        {
+            if (slots[index].in_use)
+            {
+                timers.unschedule(slots[index].timer);
+                release(index);
+            }
+        }
     }
 
+    /// Gets the number of events that have yet to fire.
+    int size() const { return scheduled_count; }
+
+    /// Fires all events that are due. The Click timer of a schedule with an owner
+    /// does this by itself.
+    void run() { timers.run(); }
+
   private:
-    struct EventCallback
+    /// The timer wheel callback of a slot.
+    struct Fire
     {
-        EventCallback()
-            : id(), event(), schedule(nullptr)
+        Fire()
+            : schedule(nullptr), index(-1)
         {
         }
-        EventCallback(uint64_t id, const TEvent &event, EventSchedule *schedule)
-            : id(id), event(event), schedule(schedule)
+        Fire(EventSchedule *schedule, int index)
+            : schedule(schedule), index(index)
         {
         }
-
-        uint64_t id;
-        TEvent event;
         EventSchedule *schedule;
+        int index;
 
-        void operator()()
-        {
-            if (schedule == nullptr)
-            {
-                return;
-            }
+        void operator()() const { schedule->fire(index); }
+    };
 
-            // Run the event.
-            event();
-
-            // Mark the event as expired.
-            schedule->expired_events.push_back(id);
-
-            // NOTE: the event's timer is not removed directly here
-            // because that could have funny consequences.
-            //
-            // Suppose that we did this:
-            //
-            //     events.erase(id);
-            //
-            // Then the callback for that event would be deleted by the hashmap,
-            // i.e., its destructor would be called and the memory would be recycled.
-            // Now keep in mind that this method _is part of_ that callback.
-            // I might be wrong, but I think that destroying an object that still has
-            // an active call frame on the stack is undefined behavior, so not a good
-            // idea.
-            //
-            // To work around this, schedule_after_msec erases expired events afterward.
+    struct Slot
+    {
+        Slot()
+            : timer(TimerWheel<Fire, TClock>::null_handle), generation(0), next_free(-1), in_use(false), event()
+        {
         }
+
+        typename TimerWheel<Fire, TClock>::handle_type timer;
+
+        /// Bumped every time the slot is released, which invalidates all
+        /// outstanding handles to the slot.
+        uint32_t generation;
+
+        int next_free;
+        bool in_use;
+        TEvent event;
     };
 
-    Element *owner;
-    uint64_t id_counter;
-    HashMap<uint64_t, CallbackTimer<EventCallback>> events;
-    Vector<uint64_t> expired_events;
+    bool is_current(const Handle &handle) const
+    {
+        return handle.index >= 0 && handle.index < slots.size() && slots[handle.index].in_use &&
+            slots[handle.index].generation == handle.generation;
+    }
+
+    void release(int index)
+    {
+        auto &slot = slots[index];
+        slot.in_use = false;
+        slot.generation++;
+        slot.event = TEvent();
+        slot.next_free = free_list;
+        free_list = index;
+        scheduled_count--;
+    }
+
+    void fire(int index)
+    {
+        // The slot is released before the event runs, so the event is free to
+        // schedule new events, which may well end up in this very slot.
+        TEvent event = slots[index].event;
+        release(index);
+        event();
+    }
+
+    TimerWheel<Fire, TClock> timers;
+    Vector<Slot> slots;
+    int free_list;
+    int scheduled_count;
 };
 
-CLICK_ENDDECLS
\ No newline at end of file
+CLICK_ENDDECLS
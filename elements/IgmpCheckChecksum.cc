@@ -27,9 +27,7 @@ int IgmpCheckChecksum::configure(Vector<String> &conf, ErrorHandler *errh)
 
 void IgmpCheckChecksum::push(int port, Packet *packet)
 {
-    auto checksum = get_igmp_checksum(packet->data());
-    auto correct_checksum = compute_igmp_checksum(packet->data(), packet->length());
-    if (checksum == correct_checksum)
+    if (is_igmp_checksum_valid(packet->data(), packet->length()))
     {
         output(0).push(packet);
     }
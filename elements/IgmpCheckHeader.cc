@@ -27,14 +27,14 @@ int IgmpCheckHeader::configure(Vector<String> &conf, ErrorHandler *errh)
 
 void IgmpCheckHeader::push(int port, Packet *packet)
 {
-    WritablePacket *result = packet->uniqueify();
-    if (get_igmp_checksum(result->data()) == compute_igmp_checksum(result->data(), result->length()))
+    // Checking the header only reads the packet, so there is no need to make it writable.
+    if (is_igmp_checksum_valid(packet->data(), packet->length()))
     {
-        output(0).push(result);
+        output(0).push(packet);
     }
     else
     {
-        output(1).push(result);
+        output(1).push(packet);
     }
 }
 
@@ -0,0 +1,563 @@
+#pragma once
+
+#include <click/config.h>
+#include <click/atomic.hh>
+#include <click/glue.hh>
+#include <click/ipaddress.hh>
+#include <click/vector.hh>
+#include <clicknet/ip.h>
+
+CLICK_DECLS
+
+/// A set of forwarding index slots, as a bitset in which bit j of word i stands for
+/// slot 32 * i + j. It holds every slot that a paint annotation can name.
+class IgmpSlotMask final
+{
+  public:
+    /// The number of slots that a mask can hold: one for every paint annotation.
+    static const int max_slots = 256;
+
+    /// The number of 32-bit words in a mask.
+    static const int word_count = max_slots / 32;
+
+    IgmpSlotMask()
+    {
+        clear();
+    }
+
+    /// Removes all slots from this mask.
+    void clear()
+    {
+        for (int i = 0; i < word_count; i++)
+        {
+            words[i] = 0;
+        }
+    }
+
+    /// Adds the slots 0 up to, but not including, the given count to this mask.
+    void set_first(int count)
+    {
+        for (int i = 0; i < word_count && 32 * i < count; i++)
+        {
+            words[i] = count - 32 * i >= 32 ? ~(uint32_t)0 : ((uint32_t)1 << (count - 32 * i)) - 1;
+        }
+    }
+
+    /// Adds the given slot to this mask.
+    void set(int slot) { words[slot >> 5] |= (uint32_t)1 << (slot & 31); }
+
+    /// Removes the given slot from this mask.
+    void reset(int slot) { words[slot >> 5] &= ~((uint32_t)1 << (slot & 31)); }
+
+    /// Tests if the given slot is in this mask.
+    bool test(int slot) const { return (words[slot >> 5] >> (slot & 31)) & 1; }
+
+    /// Tests if this mask holds no slots at all.
+    bool empty() const
+    {
+        for (int i = 0; i < word_count; i++)
+        {
+            if (words[i] != 0)
+                return false;
+        }
+        return true;
+    }
+
+    /// Finds the first slot in this mask that is at least the given slot, or -1 if
+    /// there is none. The given slot may be max_slots, which finds nothing.
+    int find_next(int slot) const
+    {
+        for (int i = slot >> 5; i < word_count; i++)
+        {
+            uint32_t word = words[i];
+            if (i == slot >> 5)
+                word &= ~(uint32_t)0 << (slot & 31);
+            if (word != 0)
+                return 32 * i + __builtin_ctz(word);
+        }
+        return -1;
+    }
+
+    /// Gets the given word of this mask.
+    uint32_t word(int index) const { return words[index]; }
+
+    /// Gets a reference to the given word of this mask.
+    uint32_t &word(int index) { return words[index]; }
+
+  private:
+    uint32_t words[word_count];
+};
+
+/// A compact forwarding index that maps (group, source) pairs to forward/drop
+/// verdicts. It mirrors the state of one or more IGMP router filters, but without
+/// any of the timers, so the data path can decide what to do with a packet by
+/// probing a flat, open-addressed table.
+///
+/// Every group that has state in a filter has a wildcard entry (G, 0.0.0.0),
+/// whose verdict is the group's default: drop for INCLUDE groups and forward for
+/// EXCLUDE groups. Sources that deviate from the default, i.e., the sources of an
+/// INCLUDE group and the excluded sources of an EXCLUDE group, get an entry of
+/// their own.
+///
+/// Filters that share an index each own a slot, which is a bit in every entry's
+/// masks, so a single lookup tells which of the filters forward a packet. A
+/// router with one filter per interface thus finds every interface that a
+/// packet should be forwarded onto with one or two probes, no matter how many
+/// interfaces it has. The masks are only as wide as the highest slot in use
+/// needs, so the common router with a handful of interfaces pays for one word
+/// per mask.
+class IgmpForwardingIndex final
+{
+  public:
+    /// The maximal number of filters that can share an index.
+    static const int max_slots = IgmpSlotMask::max_slots;
+
+    IgmpForwardingIndex()
+        : count(0), mask_words(1)
+    {
+        resize(initial_capacity);
+    }
+
+    /// Sets the given slot's verdict for the given group and source. A source
+    /// address of 0.0.0.0 sets the group's default verdict.
+    void set(const IPAddress &multicast_address, const IPAddress &source_address, int slot, bool forward)
+    {
+        if (slot >= 32 * mask_words)
+        {
+            widen((slot >> 5) + 1);
+        }
+        if (2 * (count + 1) > entries.size())
+        {
+            resize(2 * entries.size());
+        }
+
+        uint32_t group = multicast_address.addr();
+        uint32_t source = source_address.addr();
+        int index = probe(group, source);
+        auto &entry = entries[index];
+        if (entry.slot_count == 0)
+        {
+            entry.group = group;
+            entry.source = source;
+            count++;
+        }
+
+        uint32_t bit = (uint32_t)1 << (slot & 31);
+        uint32_t &present = present_word(index, slot >> 5);
+        uint32_t &forwarded = forward_word(index, slot >> 5);
+        if ((present & bit) == 0)
+        {
+            present |= bit;
+            entry.slot_count++;
+        }
+        if (forward)
+            forwarded |= bit;
+        else
+            forwarded &= ~bit;
+    }
+
+    /// Sets the given slot's default verdict for the given group.
+    void set_default(const IPAddress &multicast_address, int slot, bool forward)
+    {
+        set(multicast_address, IPAddress(), slot, forward);
+    }
+
+    /// Removes the given slot's verdict for the given group and source, if there
+    /// is one. The entry itself goes once no slot has a verdict in it anymore.
+    void erase(const IPAddress &multicast_address, const IPAddress &source_address, int slot)
+    {
+        if (slot >= 32 * mask_words)
+        {
+            return;
+        }
+
+        int index = probe(multicast_address.addr(), source_address.addr());
+        auto &entry = entries[index];
+        uint32_t bit = (uint32_t)1 << (slot & 31);
+        uint32_t &present = present_word(index, slot >> 5);
+        if ((present & bit) == 0)
+        {
+            return;
+        }
+
+        present &= ~bit;
+        forward_word(index, slot >> 5) &= ~bit;
+        if (--entry.slot_count != 0)
+        {
+            return;
+        }
+
+        // Linear probing allows for deletion without tombstones: walk the
+        // cluster that follows the hole and move back every entry that can no
+        // longer be found if the hole stays empty.
+        int mask = entries.size() - 1;
+        int hole = index;
+        int next = (hole + 1) & mask;
+        while (entries[next].slot_count != 0)
+        {
+            int home = hash(entries[next].group, entries[next].source) & mask;
+            if (((next - home) & mask) >= ((next - hole) & mask))
+            {
+                move_entry(hole, next);
+                hole = next;
+            }
+            next = (next + 1) & mask;
+        }
+        clear_entry(hole);
+        count--;
+    }
+
+    /// Removes the given slot's default verdict for the given group, if there is
+    /// one.
+    void erase_default(const IPAddress &multicast_address, int slot)
+    {
+        erase(multicast_address, IPAddress(), slot);
+    }
+
+    /// Gets the set of slots whose filters forward traffic from the given source
+    /// to the given group. Groups without an entry are not forwarded.
+    IgmpSlotMask lookup_mask(const IPAddress &multicast_address, const IPAddress &source_address) const
+    {
+        IgmpSlotMask result;
+        uint32_t group = multicast_address.addr();
+        int index = probe(group, source_address.addr());
+        int default_index = -1;
+        for (int i = 0; i < mask_words; i++)
+        {
+            uint32_t present = present_word(index, i);
+            result.word(i) = forward_word(index, i);
+            if (present == ~(uint32_t)0)
+            {
+                continue;
+            }
+
+            // Slots without a verdict for the source fall back to the group's
+            // default verdict.
+            if (default_index < 0)
+                default_index = probe(group, 0);
+            result.word(i) |= forward_word(default_index, i) & ~present;
+        }
+        return result;
+    }
+
+    /// Tests if the given slot's filter forwards traffic from the given source to
+    /// the given group. This is lookup_mask for a single slot.
+    bool lookup(const IPAddress &multicast_address, const IPAddress &source_address, int slot) const
+    {
+        if (slot >= 32 * mask_words)
+        {
+            return false;
+        }
+
+        uint32_t group = multicast_address.addr();
+        int index = probe(group, source_address.addr());
+        if ((present_word(index, slot >> 5) >> (slot & 31)) & 1)
+        {
+            return (forward_word(index, slot >> 5) >> (slot & 31)) & 1;
+        }
+        return (forward_word(probe(group, 0), slot >> 5) >> (slot & 31)) & 1;
+    }
+
+    /// Removes all verdicts from this index.
+    void clear()
+    {
+        for (auto &entry : entries)
+        {
+            entry.slot_count = 0;
+        }
+        for (auto &word : masks)
+        {
+            word = 0;
+        }
+        count = 0;
+    }
+
+    /// Gets the number of entries in this index.
+    int size() const { return count; }
+
+  private:
+    static const int initial_capacity = 64;
+
+    /// An entry's key. An entry holds a verdict for every slot whose bit is set in
+    /// its present mask, and an entry without any verdicts is empty. A slot
+    /// forwards if its bit is set in the forward mask as well, so the forward mask
+    /// is a subset of the present mask, and empty entries have neither. The masks
+    /// live apart from the keys, so that probing only touches the keys.
+    struct Entry
+    {
+        uint32_t group;
+        uint32_t source;
+
+        /// The number of slots with a verdict, i.e., the number of bits in the
+        /// present mask.
+        int slot_count;
+    };
+
+    static uint32_t hash(uint32_t group, uint32_t source)
+    {
+        uint64_t key = ((uint64_t)group << 32) | source;
+        key *= 0x9E3779B97F4A7C15ull;
+        return (uint32_t)(key >> 32);
+    }
+
+    /// Finds the slot that holds the given key, or the empty slot where it
+    /// would go if it is not in the index.
+    int probe(uint32_t group, uint32_t source) const
+    {
+        int mask = entries.size() - 1;
+        int index = hash(group, source) & mask;
+        while (entries[index].slot_count != 0 &&
+               (entries[index].group != group || entries[index].source != source))
+        {
+            index = (index + 1) & mask;
+        }
+        return index;
+    }
+
+    /// Gets the given word of the given entry's present mask. The masks of an entry
+    /// are stored next to each other: the present mask first, then the forward mask.
+    uint32_t &present_word(int index, int word) { return masks[2 * mask_words * index + word]; }
+    uint32_t present_word(int index, int word) const { return masks[2 * mask_words * index + word]; }
+
+    /// Gets the given word of the given entry's forward mask.
+    uint32_t &forward_word(int index, int word) { return masks[2 * mask_words * index + mask_words + word]; }
+    uint32_t forward_word(int index, int word) const { return masks[2 * mask_words * index + mask_words + word]; }
+
+    void move_entry(int to, int from)
+    {
+        entries[to] = entries[from];
+        for (int i = 0; i < 2 * mask_words; i++)
+        {
+            masks[2 * mask_words * to + i] = masks[2 * mask_words * from + i];
+        }
+    }
+
+    void clear_entry(int index)
+    {
+        entries[index].slot_count = 0;
+        for (int i = 0; i < 2 * mask_words; i++)
+        {
+            masks[2 * mask_words * index + i] = 0;
+        }
+    }
+
+    /// Rebuilds the table with the given capacity and the given number of words per
+    /// mask, which is at least the current number.
+    void rebuild(int capacity, int words)
+    {
+        Vector<Entry> old_entries;
+        Vector<uint32_t> old_masks;
+        old_entries.swap(entries);
+        old_masks.swap(masks);
+        int old_words = mask_words;
+
+        Entry empty_entry = {0, 0, 0};
+        entries.resize(capacity, empty_entry);
+        masks.resize(2 * words * capacity, 0);
+        mask_words = words;
+        for (int index = 0; index < old_entries.size(); index++)
+        {
+            if (old_entries[index].slot_count == 0)
+            {
+                continue;
+            }
+
+            int new_index = probe(old_entries[index].group, old_entries[index].source);
+            entries[new_index] = old_entries[index];
+            for (int i = 0; i < old_words; i++)
+            {
+                present_word(new_index, i) = old_masks[2 * old_words * index + i];
+                forward_word(new_index, i) = old_masks[2 * old_words * index + old_words + i];
+            }
+        }
+    }
+
+    void resize(int capacity) { rebuild(capacity, mask_words); }
+
+    void widen(int words) { rebuild(entries.size(), words); }
+
+    Vector<Entry> entries;
+    Vector<uint32_t> masks;
+    int count;
+    int mask_words;
+};
+
+/// A forwarding index that a single writer can update while any number of readers
+/// on other threads look up verdicts, without ever taking a lock.
+///
+/// The index keeps two copies of its table. Readers only ever look at the active
+/// copy; the writer only ever changes the standby copy, and logs every change it
+/// makes. Publishing the changes makes the standby copy active, waits until the
+/// last reader has left the copy that used to be active, and then replays the log
+/// on that copy, so that both copies are in sync again. Readers never wait, and
+/// the writer only waits for lookups that were already in flight.
+class IgmpSharedForwardingIndex final
+{
+  public:
+    IgmpSharedForwardingIndex()
+    {
+        active = 0;
+        readers[0].count = 0;
+        readers[1].count = 0;
+    }
+
+    IgmpSharedForwardingIndex(const IgmpSharedForwardingIndex &) = delete;
+    IgmpSharedForwardingIndex &operator=(const IgmpSharedForwardingIndex &) = delete;
+
+    /// Sets the given slot's verdict for the given group and source. The change
+    /// becomes visible to readers once it is published.
+    void set(const IPAddress &multicast_address, const IPAddress &source_address, int slot, bool forward)
+    {
+        standby().set(multicast_address, source_address, slot, forward);
+        log.push_back(Change(forward ? forward_change : drop_change, multicast_address, source_address, slot));
+    }
+
+    /// Sets the given slot's default verdict for the given group. The change
+    /// becomes visible to readers once it is published.
+    void set_default(const IPAddress &multicast_address, int slot, bool forward)
+    {
+        set(multicast_address, IPAddress(), slot, forward);
+    }
+
+    /// Removes the given slot's verdict for the given group and source, if there
+    /// is one. The change becomes visible to readers once it is published.
+    void erase(const IPAddress &multicast_address, const IPAddress &source_address, int slot)
+    {
+        standby().erase(multicast_address, source_address, slot);
+        log.push_back(Change(erase_change, multicast_address, source_address, slot));
+    }
+
+    /// Removes the given slot's default verdict for the given group, if there is
+    /// one. The change becomes visible to readers once it is published.
+    void erase_default(const IPAddress &multicast_address, int slot)
+    {
+        erase(multicast_address, IPAddress(), slot);
+    }
+
+    /// Makes all changes since the last publication visible to readers. This must
+    /// only be called by the writer. Filters that share an index publish each
+    /// other's changes as well.
+    void publish()
+    {
+        if (log.size() == 0)
+        {
+            return;
+        }
+
+        // Swapping the active copy is a full barrier, so every reader that shows up
+        // from now on either sees the new active copy or backs off and retries.
+        uint32_t old_side = active.swap(1 - active.value());
+        while (readers[old_side].count.value() != 0)
+        {
+            click_relax_fence();
+        }
+
+        // Nobody is looking at the old copy anymore, so it's ours.
+        auto &old_copy = copies[old_side];
+        for (const auto &change : log)
+        {
+            if (change.kind == erase_change)
+                old_copy.erase(change.multicast_address, change.source_address, change.slot);
+            else
+                old_copy.set(
+                    change.multicast_address, change.source_address, change.slot, change.kind == forward_change);
+        }
+        log.clear();
+    }
+
+    /// Gets the set of slots whose filters forward traffic from the given source
+    /// to the given group, according to the last published changes. This is safe
+    /// to call from any thread.
+    IgmpSlotMask lookup_mask(const IPAddress &multicast_address, const IPAddress &source_address) const
+    {
+        uint32_t side = enter();
+        IgmpSlotMask result = copies[side].lookup_mask(multicast_address, source_address);
+        --readers[side].count;
+        return result;
+    }
+
+    /// Tests if the given slot's filter forwards traffic from the given source to
+    /// the given group, according to the last published changes. This is safe to
+    /// call from any thread.
+    bool lookup(const IPAddress &multicast_address, const IPAddress &source_address, int slot) const
+    {
+        uint32_t side = enter();
+        bool result = copies[side].lookup(multicast_address, source_address, slot);
+        --readers[side].count;
+        return result;
+    }
+
+    /// Gets the number of entries in this index, including unpublished changes.
+    int size() const { return copies[1 - active.value()].size(); }
+
+  private:
+    enum ChangeKind
+    {
+        forward_change,
+        drop_change,
+        erase_change
+    };
+
+    /// A logged change to the index.
+    struct Change
+    {
+        Change()
+            : kind(erase_change), multicast_address(), source_address(), slot(0)
+        {
+        }
+
+        Change(ChangeKind kind, const IPAddress &multicast_address, const IPAddress &source_address, int slot)
+            : kind(kind), multicast_address(multicast_address), source_address(source_address), slot(slot)
+        {
+        }
+
+        ChangeKind kind;
+        IPAddress multicast_address;
+        IPAddress source_address;
+        int slot;
+    };
+
+    static const size_t cache_line_size = 64;
+
+    /// A reader count, on a cache line of its own so that readers of one copy
+    /// don't slow down readers of the other. The index lives in a heap-allocated
+    /// element, and the heap doesn't honor the alignment of over-aligned types,
+    /// so the counts are padded by hand instead: every count is followed by the
+    /// rest of a cache line, and the first one is preceded by a whole line.
+    struct ReaderCount
+    {
+        mutable atomic_uint32_t count;
+        char padding[cache_line_size - sizeof(atomic_uint32_t)];
+    };
+
+    IgmpForwardingIndex &standby()
+    {
+        return copies[1 - active.value()];
+    }
+
+    /// Registers a reader with the active copy and returns the copy's index.
+    uint32_t enter() const
+    {
+        while (true)
+        {
+            // Incrementing the count is a full barrier, so if the active copy
+            // is still the same after we've registered, the writer will wait
+            // for us before it touches that copy.
+            uint32_t side = active.value();
+            ++readers[side].count;
+            if (active.value() == side)
+            {
+                return side;
+            }
+            --readers[side].count;
+        }
+    }
+
+    IgmpForwardingIndex copies[2];
+    atomic_uint32_t active;
+    char readers_padding[cache_line_size];
+    ReaderCount readers[2];
+    Vector<Change> log;
+};
+
+CLICK_ENDDECLS
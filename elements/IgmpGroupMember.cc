@@ -13,21 +13,41 @@
 
 CLICK_DECLS
 IgmpGroupMember::IgmpGroupMember()
-    : state_changed_schedule(this)
 {
 }
 
 IgmpGroupMember::~IgmpGroupMember()
 {
+    clear_state_changed_packets();
 }
 
+/// The smallest MTU an IPv4 network can have.
+static const uint32_t min_mtu = 68;
+
 int IgmpGroupMember::configure(Vector<String> &conf, ErrorHandler *errh)
 {
-    if (cp_va_kparse(conf, this, errh, cpEnd) < 0)
+    if (cp_va_kparse(conf, this, errh, "MTU", cpkN, cpUnsigned, &mtu, cpEnd) < 0)
         return -1;
+    if (mtu < min_mtu)
+        return errh->error("MTU must be at least %u", min_mtu);
+
+    IgmpQueryResponse response;
+    response.elem = this;
+    response_timer = CallbackTimer<IgmpQueryResponse>(response);
+    response_timer.initialize(this);
     return 0;
 }
 
+#if IGMP_LATENCY_STATS
+int IgmpGroupMember::initialize(ErrorHandler *)
+{
+    query_latency.initialize(master()->nthreads());
+    lookup_latency.initialize(master()->nthreads());
+    timer_latency.initialize(master()->nthreads());
+    return 0;
+}
+#endif
+
 void IgmpGroupMember::push_listen(const IPAddress &multicast_address, const IgmpFilterRecord &record)
 {
     // Here's a relevant excerpt from the spec:
@@ -72,38 +92,38 @@ void IgmpGroupMember::push_listen(const IPAddress &multicast_address, const Igmp
 
     click_chatter("IGMP group member: changing mode for %s", multicast_address.unparse().c_str());
 
-    auto retransmission_count_ptr = state_change_transmission_counts.findp(multicast_address);
-    if (retransmission_count_ptr == nullptr)
-    {
-        state_change_transmission_counts.insert(multicast_address, robustness_variable);
-    }
-    else
-    {
-        *retransmission_count_ptr = robustness_variable;
-    }
+    filter.find(multicast_address)->pending_state_changes = get_robustness_variable();
 
-    IgmpTransmitStateChanged event;
-    event.elem = this;
+    // The report's contents have changed, so it has to be encoded anew.
+    state_changed_packets_valid = false;
 
     // Transmit a report right away.
-    event();
+    bool has_pending_changes = transmit_state_changed_report();
 
-    // Queue [Robustness Variable] - 1 transmissions, at intervals chosen at random from the
+    // Retransmit it [Robustness Variable] - 1 times, at intervals chosen at random from the
     // range (0, [Unsolicited Report Interval]).
 
     // SPEC INTERPRETATION: 'at intervals' means that we should space the transmissions
     // with spacing chosen randomly from (0, [Unsolicited Report Interval]).
-
-    state_changed_schedule.clear();
-    uint32_t delta_dsec = 0;
-    for (int i = 0; i < robustness_variable - 1; i++)
+    //
+    // Every group counts its own transmissions, so a single timer can drive the
+    // retransmissions of all groups. If it's running already, the merged report
+    // simply takes the old report's place at its next expiry, which is still less
+    // than [Unsolicited Report Interval] away.
+    if (!state_changed_timer.initialized())
     {
-        delta_dsec += click_random(1, unsolicited_report_interval - 1);
-        state_changed_schedule.schedule_after_dsec(delta_dsec, event);
+        IgmpTransmitStateChanged event;
+        event.elem = this;
+        state_changed_timer = CallbackTimer<IgmpTransmitStateChanged>(event);
+        state_changed_timer.initialize(this);
+    }
+    if (has_pending_changes && !state_changed_timer.scheduled())
+    {
+        state_changed_timer.schedule_after_dsec(click_random(1, unsolicited_report_interval - 1));
     }
 }
 
-IgmpV3MembershipReport IgmpGroupMember::pop_state_changed_report()
+IgmpV3MembershipReport IgmpGroupMember::build_state_changed_report() const
 {
     // Behold the spec:
     //
@@ -157,36 +177,80 @@ IgmpV3MembershipReport IgmpGroupMember::pop_state_changed_report()
     //       TO_IN    All in the current interface state that must be forwarded
     //       TO_EX    All in the current interface state that must be blocked
 
-    Vector<IPAddress> dead_addresses;
+    // Groups without reception state are kept in INCLUDE mode without sources, so
+    // their records are TO_IN({}).
     IgmpV3MembershipReport report;
-    for (auto iterator = state_change_transmission_counts.begin(); iterator != state_change_transmission_counts.end(); iterator++)
+    for (const auto &group : filter)
     {
-        auto record_ptr = filter.get_record_or_null(iterator.key());
-        IgmpFilterRecord record;
-        if (record_ptr == nullptr)
+        if (group.pending_state_changes > 0)
         {
-            record.filter_mode = IgmpFilterMode::Include;
+            report.group_records.push_back(IgmpV3GroupRecord(group.multicast_address, group.record, true));
         }
-        else
+    }
+    return report;
+}
+
+bool IgmpGroupMember::transmit_state_changed_report()
+{
+    if (!state_changed_packets_valid)
+    {
+        clear_state_changed_packets();
+        encode_membership_report(build_state_changed_report(), state_changed_packets);
+        state_changed_packets_valid = true;
+    }
+
+    // The encoded report is kept for retransmissions, so only clones are sent.
+    // They share the report's data until something writes to them.
+    for (auto packet : state_changed_packets)
+    {
+        Packet *copy = packet->clone();
+        if (copy != nullptr)
+        {
+            output(0).push(copy);
+        }
+    }
+
+    // Count the transmission. A group that has been sent [Robustness Variable]
+    // times drops out of the report, which changes the report. The filter is
+    // walked back to front, so that groups can be forgotten along the way.
+    bool has_pending_changes = false;
+    for (int i = filter.size() - 1; i >= 0; i--)
+    {
+        auto &group = filter[i];
+        if (group.pending_state_changes <= 0)
         {
-            record = *record_ptr;
+            continue;
         }
-        report.group_records.push_back(IgmpV3GroupRecord(iterator.key(), record, true));
 
-        auto &val = iterator.value();
-        if (--val <= 0)
+        if (--group.pending_state_changes > 0)
         {
-            dead_addresses.push_back(iterator.key());
+            has_pending_changes = true;
+        }
+        else
+        {
+            state_changed_packets_valid = false;
+            filter.forget_if_idle(i);
         }
     }
-    for (const auto &address : dead_addresses)
+
+    if (!has_pending_changes)
     {
-        state_change_transmission_counts.erase(address);
+        clear_state_changed_packets();
     }
-    return report;
+    return has_pending_changes;
 }
 
-void IgmpGroupMember::transmit_membership_report(const IgmpV3MembershipReport &report)
+void IgmpGroupMember::clear_state_changed_packets()
+{
+    for (auto packet : state_changed_packets)
+    {
+        packet->kill();
+    }
+    state_changed_packets.clear();
+    state_changed_packets_valid = false;
+}
+
+void IgmpGroupMember::encode_membership_report(const IgmpV3MembershipReport &report, Vector<Packet *> &packets) const
 {
     // Well-hidden paragraph from the spec:
     //
@@ -197,19 +261,37 @@ void IgmpGroupMember::transmit_membership_report(const IgmpV3MembershipReport &r
         return;
     }
 
-    size_t tailroom = 0;
-    size_t packetsize = report.get_size();
-    size_t headroom = sizeof(click_ether) + sizeof(click_ip);
-    WritablePacket *packet = Packet::make(headroom, 0, packetsize, tailroom);
-    if (packet == 0)
-        return click_chatter("cannot make packet!");
+    // Split the report into reports that fit in the MTU, so none of them
+    // ever needs to be fragmented.
+    Vector<IgmpV3MembershipReport> reports;
+    split_igmp_v3_membership_report(report, mtu - igmp_ip_header_size, reports);
 
-    auto data_ptr = packet->data();
-    report.write(data_ptr);
+    for (const auto &part : reports)
+    {
+        size_t tailroom = 0;
+        size_t packetsize = part.get_size();
+        size_t headroom = sizeof(click_ether) + igmp_ip_header_size;
+        WritablePacket *packet = Packet::make(headroom, 0, packetsize, tailroom);
+        if (packet == 0)
+            return click_chatter("cannot make packet!");
+
+        auto data_ptr = packet->data();
+        part.write(data_ptr);
 
-    packet->set_dst_ip_anno(report_multicast_address);
+        packet->set_dst_ip_anno(report_multicast_address);
+
+        packets.push_back(packet);
+    }
+}
 
-    output(0).push(packet);
+void IgmpGroupMember::transmit_membership_report(const IgmpV3MembershipReport &report)
+{
+    Vector<Packet *> packets;
+    encode_membership_report(report, packets);
+    for (auto packet : packets)
+    {
+        output(0).push(packet);
+    }
 }
 
 int IgmpGroupMember::join(const String &conf, Element *e, void *, ErrorHandler *errh)
@@ -241,17 +323,47 @@ int IgmpGroupMember::config(const String &conf, Element *e, void *, ErrorHandler
     IgmpGroupMember *self = (IgmpGroupMember *)e;
     if (cp_va_kparse(
             conf, self, errh, "ROBUSTNESS", cpkN, cpUnsigned, &self->robustness_variable,
-            "UNSOLICITED_REPORT_INTERVAL", cpkN, cpUnsigned, &self->unsolicited_report_interval, cpEnd) < 0)
+            "UNSOLICITED_REPORT_INTERVAL", cpkN, cpUnsigned, &self->unsolicited_report_interval,
+            "MTU", cpkN, cpUnsigned, &self->mtu, cpEnd) < 0)
         return -1;
-    else
-        return 0;
+    else if (self->mtu < min_mtu)
+        return errh->error("MTU must be at least %u", min_mtu);
+
+    // The MTU decides how the state-changed report is split.
+    self->state_changed_packets_valid = false;
+    return 0;
+}
+
+#if IGMP_LATENCY_STATS
+String IgmpGroupMember::read_latency(Element *e, void *)
+{
+    IgmpGroupMember *self = (IgmpGroupMember *)e;
+    StringAccum sa;
+    self->query_latency.unparse(sa, "query");
+    self->lookup_latency.unparse(sa, "lookup");
+    self->timer_latency.unparse(sa, "timer");
+    return sa.take_string();
 }
 
+int IgmpGroupMember::reset_latency(const String &, Element *e, void *, ErrorHandler *)
+{
+    IgmpGroupMember *self = (IgmpGroupMember *)e;
+    self->query_latency.clear();
+    self->lookup_latency.clear();
+    self->timer_latency.clear();
+    return 0;
+}
+#endif
+
 void IgmpGroupMember::add_handlers()
 {
     add_write_handler("join", &join, (void *)0);
     add_write_handler("leave", &leave, (void *)0);
     add_write_handler("config", &config, (void *)0);
+#if IGMP_LATENCY_STATS
+    add_read_handler("latency", &read_latency, (void *)0);
+    add_write_handler("reset_latency", &reset_latency, (void *)0);
+#endif
 }
 
 void IgmpGroupMember::push(int port, Packet *packet)
@@ -259,7 +371,13 @@ void IgmpGroupMember::push(int port, Packet *packet)
     if (port == 0)
     {
         auto ip_header = (click_ip *)packet->data();
-        if (filter.is_listening_to(ip_header->ip_dst, ip_header->ip_src))
+        bool listening;
+        {
+            IGMP_LATENCY_SCOPE(lookup_latency);
+            listening = filter.is_listening_to(ip_header->ip_dst, ip_header->ip_src);
+        }
+
+        if (listening)
         {
             output(1).push(packet);
         }
@@ -271,7 +389,9 @@ void IgmpGroupMember::push(int port, Packet *packet)
     else
     {
         assert(port == 1);
-        if (is_igmp_membership_query(packet->data()))
+        // A query that is too short for its source addresses would make the
+        // parser read past the packet, so it's ignored.
+        if (is_complete_igmp_membership_query(packet->data(), packet->length()))
         {
             auto data_ptr = packet->data();
             accept_query(IgmpMembershipQuery::read(data_ptr));
@@ -281,6 +401,8 @@ void IgmpGroupMember::push(int port, Packet *packet)
 
 void IgmpGroupMember::accept_query(const IgmpMembershipQuery &query)
 {
+    IGMP_LATENCY_SCOPE(query_latency);
+
     // The spec dictates the following:
     //
     //     When a system receives a Query, it does not respond immediately.
@@ -321,17 +443,34 @@ void IgmpGroupMember::accept_query(const IgmpMembershipQuery &query)
     //            response is scheduled using the group timer. The new response is
     //            scheduled to be sent at the earliest of the remaining time for the
     //            pending report and the selected delay.
-
-    if (!general_response_timer.initialized())
-    {
-        IgmpGeneralQueryResponse response;
-        response.elem = this;
-        general_response_timer = CallbackTimer<IgmpGeneralQueryResponse>(response);
-        general_response_timer.initialize(this);
-    }
-
-    uint32_t response_delay = click_random(1, query.max_resp_time - 1);
-    if (general_response_timer.scheduled() && general_response_timer.remaining_time_dsec() <= response_delay)
+    //
+    //         5. If the received Query is a Group-and-Source-Specific Query and
+    //            there is a pending response for this group with a non-empty
+    //            source-list, then the group source list is augmented to contain
+    //            the list of sources in the new Query and a single response is
+    //            scheduled using the group timer. The new response is scheduled to
+    //            be sent at the earliest of the remaining time for the pending
+    //            report and the selected delay.
+
+    // Hosts go along with the querier's robustness, so that the router hears as
+    // many copies of every state-change report as it asks for. According to the
+    // spec:
+    //
+    //     If non-zero, the QRV field contains the [Robustness Variable] value
+    //     used by the querier, i.e., the sender of the Query. [...] Routers
+    //     adopt the QRV value from the most recently received Query as their
+    //     own [Robustness Variable] value, unless that most recently received
+    //     QRV was zero, in which case the receivers use the default [Robustness
+    //     Variable] value specified in section 8.1 or a statically configured
+    //     value.
+    querier_robustness_variable = query.robustness_variable;
+
+    // A Max Resp Time below two deciseconds leaves nothing of the range
+    // (0, [Max Resp Time]) in whole deciseconds, so such queries get the
+    // shortest delay there is.
+    uint32_t response_delay = click_random(1, query.max_resp_time > 2 ? query.max_resp_time - 1 : 1);
+    Timestamp due = Timestamp::now_steady() + Timestamp::make_msec((Timestamp::value_type)response_delay * 100);
+    if (general_response_pending && general_response_due <= due)
     {
         // Case #1. Do nothing.
         return;
@@ -339,30 +478,73 @@ void IgmpGroupMember::accept_query(const IgmpMembershipQuery &query)
     else if (query.is_general_query())
     {
         // Case #2. (Re)schedule the response.
-        general_response_timer.schedule_after_dsec(response_delay);
+        general_response_pending = true;
+        general_response_due = due;
+        schedule_query_response(due);
         return;
     }
 
-    auto response_timer_ptr = group_response_timers.findp(query.group_address);
-    if (response_timer_ptr == nullptr)
+    // A group without reception state wouldn't get a response anyway, so it
+    // doesn't need to be scheduled.
+    auto group_ptr = filter.find(query.group_address);
+    if (group_ptr == nullptr || !group_ptr->has_reception_state())
     {
-        IgmpGroupQueryResponse response;
-        response.elem = this;
-        response.group_address = query.group_address;
-        group_response_timers.insert(query.group_address, response);
-        response_timer_ptr = group_response_timers.findp(query.group_address);
-        assert(response_timer_ptr != nullptr);
-        response_timer_ptr->initialize(this);
+        return;
+    }
+
+    if (!group_ptr->response_pending)
+    {
+        // Case #3. Schedule a response for the group, and record the queried
+        // sources, if any.
+        group_ptr->response_pending = true;
+        group_ptr->response_due = due;
+        group_ptr->queried_sources = query.source_addresses;
+        pending_group_responses.push_back(query.group_address);
+    }
+    else if (query.source_addresses.size() == 0 || group_ptr->queried_sources.size() == 0)
+    {
+        // Case #4. Respond with the group's full state.
+        group_ptr->queried_sources.clear();
+    }
+    else
+    {
+        // Case #5. Respond about the sources of both queries.
+        for (const auto &address : query.source_addresses)
+        {
+            if (!in_vector(address, group_ptr->queried_sources))
+            {
+                group_ptr->queried_sources.push_back(address);
+            }
+        }
     }
-    if (!response_timer_ptr->scheduled() && response_timer_ptr->remaining_time_dsec() <= response_delay && query.source_addresses.size() == 0)
+
+    // Both of the last two cases respond at the earliest of the two times.
+    if (due < group_ptr->response_due)
     {
-        // Cases #3 and #4. Schedule a group-specific query, but only if that speeds
-        // up our response.
-        response_timer_ptr->schedule_after_dsec(response_delay);
+        group_ptr->response_due = due;
     }
+    schedule_query_response(group_ptr->response_due);
+}
+
+void IgmpGroupMember::schedule_query_response(const Timestamp &due)
+{
+    // The timer only ever moves forward here. When it expires, it settles on the
+    // next pending response.
+    if (!response_timer.scheduled() || due < response_timer_expiry)
+    {
+        response_timer_expiry = due;
+        response_timer.schedule_at_steady(due);
+    }
+}
+
+void IgmpGroupMember::IgmpQueryResponse::operator()() const
+{
+    IGMP_LATENCY_SCOPE(elem->timer_latency);
+
+    elem->respond_to_queries();
 }
 
-void IgmpGroupMember::IgmpGeneralQueryResponse::operator()() const
+void IgmpGroupMember::respond_to_queries()
 {
     // Here's what the spec says about this.
     //
@@ -381,22 +563,6 @@ void IgmpGroupMember::IgmpGeneralQueryResponse::operator()() const
     //            messages, to the extent possible.
     //
     //            [...]
-
-    // Create a membership report and fill it with group records for all the multicast
-    // addresses.
-    IgmpV3MembershipReport report;
-    for (auto iterator = elem->filter.begin(); iterator != elem->filter.end(); iterator++)
-    {
-        report.group_records.push_back(IgmpV3GroupRecord(iterator.key(), iterator.value(), false));
-    }
-
-    // Transmit the report.
-    elem->transmit_membership_report(report);
-}
-
-void IgmpGroupMember::IgmpGroupQueryResponse::operator()() const
-{
-    // According to the spec:
     //
     //         2. If the expired timer is a group timer and the list of recorded
     //            sources for the that group is empty (i.e., it is a pending
@@ -405,34 +571,136 @@ void IgmpGroupMember::IgmpGroupQueryResponse::operator()() const
     //            Current-State Record is sent for that address. The Current-State
     //            Record carries the multicast address and its associated filter
     //            mode (MODE_IS_INCLUDE or MODE_IS_EXCLUDE) and source list.
+    //
+    //         3. If the expired timer is a group timer and the list of recorded
+    //            sources for that group is non-empty (i.e., it is a pending
+    //            response to a Group-and-Source-Specific Query), then if and only
+    //            if the interface has reception state for that group address, the
+    //            contents of the responding Current-State Record is determined
+    //            from the interface state and the pending response record, as
+    //            specified in the following table:
+    //
+    //                              set of sources in the
+    //            interface state  pending response record  Current-State Record
+    //            ---------------  -----------------------  --------------------
+    //             INCLUDE (A)                B                   IS_IN (A*B)
+    //
+    //             EXCLUDE (A)                B                   IS_IN (B-A)
+    //
+    //            If the resulting Current-State Record has an empty set of source
+    //            addresses, then no response is sent.
+    //
+    // All responses that are due go out in a single report, which is split
+    // only to fit in the MTU. A response to a general query reports every
+    // group, so it answers all group-specific queries as well.
+    //
+    // Well-hidden paragraph from the spec:
+    //
+    //     If the resulting Current-State Record has an empty set of source
+    //     addresses, then no response is sent.
+    //
+    // I think this can be interpreted as: "if a group member's state for a multicast address
+    // is 'mode-is-include({})'", then don't transmit anything. My reasoning for doing so is
+    // that 'mode-is-include({})' really does have an empty set of source addresses.
+
+    Timestamp now = Timestamp::now_steady();
+    bool general_response_due_now = general_response_pending && general_response_due <= now;
+    if (general_response_due_now)
+    {
+        general_response_pending = false;
+    }
 
-    // Create a membership report and give it a group record for a single multicast
-    // address.
     IgmpV3MembershipReport report;
-    auto record_ptr = elem->filter.get_record_or_null(group_address);
-    if (record_ptr == nullptr)
+    bool has_next = general_response_pending;
+    Timestamp next = general_response_due;
+    for (int i = pending_group_responses.size() - 1; i >= 0; i--)
     {
-        // Well-hidden paragraph from the spec:
-        //
-        //     If the resulting Current-State Record has an empty set of source
-        //     addresses, then no response is sent.
-        //
-        // I think this can be interpreted as: "if a group member's state for a multicast address
-        // is 'mode-is-include({})'", then don't transmit anything. My reasoning for doing so is
-        // that 'mode-is-include({})' really does have an empty set of source addresses.
+        auto group_ptr = filter.find(pending_group_responses[i]);
+        if (!general_response_due_now && now < group_ptr->response_due)
+        {
+            if (!has_next || group_ptr->response_due < next)
+            {
+                next = group_ptr->response_due;
+                has_next = true;
+            }
+            continue;
+        }
 
-        return;
+        // The group keeps its state for as long as its response is pending, so
+        // it's still there.
+        group_ptr->response_pending = false;
+        if (!general_response_due_now && group_ptr->has_reception_state())
+        {
+            if (group_ptr->queried_sources.size() == 0)
+            {
+                report.group_records.push_back(
+                    IgmpV3GroupRecord(group_ptr->multicast_address, group_ptr->record, false));
+            }
+            else
+            {
+                add_queried_sources_record(report, *group_ptr);
+            }
+        }
+        group_ptr->queried_sources.clear();
+        filter.forget_if_idle(group_ptr->multicast_address);
+
+        pending_group_responses[i] = pending_group_responses.back();
+        pending_group_responses.pop_back();
     }
 
-    report.group_records.push_back(IgmpV3GroupRecord(group_address, *record_ptr, false));
+    if (general_response_due_now)
+    {
+        // Fill the report with group records for all the multicast addresses that
+        // have reception state.
+        for (const auto &group : filter)
+        {
+            if (group.has_reception_state())
+            {
+                report.group_records.push_back(IgmpV3GroupRecord(group.multicast_address, group.record, false));
+            }
+        }
+    }
 
-    // And transmit it.
-    elem->transmit_membership_report(report);
+    if (has_next)
+    {
+        response_timer_expiry = next;
+        response_timer.schedule_at_steady(next);
+    }
+
+    // Transmit the report.
+    transmit_membership_report(report);
+}
+
+void IgmpGroupMember::add_queried_sources_record(IgmpV3MembershipReport &report, const IgmpMemberGroupState &group)
+{
+    // The queried sources that the group listens to are those that INCLUDE mode
+    // lists and those that EXCLUDE mode doesn't.
+    bool include = group.record.filter_mode == IgmpFilterMode::Include;
+    IgmpV3GroupRecord record;
+    record.type = IgmpV3GroupRecordType::ModeIsInclude;
+    record.multicast_address = group.multicast_address;
+    for (const auto &address : group.queried_sources)
+    {
+        if (in_vector(address, group.record.source_addresses) == include)
+        {
+            record.source_addresses.push_back(address);
+        }
+    }
+
+    if (record.source_addresses.size() != 0)
+    {
+        report.group_records.push_back(record);
+    }
 }
 
 void IgmpGroupMember::IgmpTransmitStateChanged::operator()() const
 {
-    elem->transmit_membership_report(elem->pop_state_changed_report());
+    IGMP_LATENCY_SCOPE(elem->timer_latency);
+
+    if (elem->transmit_state_changed_report())
+    {
+        elem->state_changed_timer.schedule_after_dsec(click_random(1, elem->unsolicited_report_interval - 1));
+    }
 }
 
 CLICK_ENDDECLS
@@ -4,9 +4,9 @@
 #include <click/element.hh>
 #include <click/hashmap.hh>
 #include "CallbackTimer.hh"
-#include "EventSchedule.hh"
 #include "IgmpMessageManip.hh"
 #include "IgmpMemberFilter.hh"
+#include "LatencyHistogram.hh"
 
 CLICK_DECLS
 
@@ -40,34 +40,37 @@ public:
   const char *processing() const { return PUSH; }
 
   int configure(Vector<String> &, ErrorHandler *);
+#if IGMP_LATENCY_STATS
+  int initialize(ErrorHandler *);
+#endif
 
   static int join(const String &conf, Element *e, void *thunk, ErrorHandler *errh);
   static int leave(const String &conf, Element *e, void *thunk, ErrorHandler *errh);
   static int config(const String &conf, Element *e, void *thunk, ErrorHandler *errh);
 
+  // When built with IGMP_LATENCY_STATS, the 'latency' handler prints cycle
+  // histograms of the time it takes to process a query, to decide whether a
+  // data packet is delivered, and to run a timer callback. Writing to
+  // 'reset_latency' clears them.
+#if IGMP_LATENCY_STATS
+  static String read_latency(Element *e, void *thunk);
+  static int reset_latency(const String &conf, Element *e, void *thunk, ErrorHandler *errh);
+#endif
+
   void add_handlers();
 
   void push(int port, Packet *packet);
 
 private:
-  /// A timer callback that responds to IGMP general queries.
-  struct IgmpGeneralQueryResponse
+  /// A timer callback that sends every query response that is due.
+  struct IgmpQueryResponse
   {
     IgmpGroupMember *elem;
 
     void operator()() const;
   };
 
-  /// A timer callback that responds to IGMP group-specific queries.
-  struct IgmpGroupQueryResponse
-  {
-    IgmpGroupMember *elem;
-    IPAddress group_address;
-
-    void operator()() const;
-  };
-
-  /// A timer callback that transmits state-changed records.
+  /// A timer callback that retransmits state-changed records.
   struct IgmpTransmitStateChanged
   {
     IgmpGroupMember *elem;
@@ -79,28 +82,99 @@ private:
   void accept_query(const IgmpMembershipQuery &query);
   void transmit_membership_report(const IgmpV3MembershipReport &report);
 
-  /// Creates a state-changed report.
-  IgmpV3MembershipReport pop_state_changed_report();
+  /// Splits the given report so that its parts fit in the MTU, and appends a
+  /// packet for each part to the given vector.
+  void encode_membership_report(const IgmpV3MembershipReport &report, Vector<Packet *> &packets) const;
+
+  /// Creates a state-changed report, which has a record for every group with
+  /// pending state changes.
+  IgmpV3MembershipReport build_state_changed_report() const;
+
+  /// Transmits the state-changed report and counts the transmission against
+  /// every group in it. A Boolean result tells if any group has state changes
+  /// pending still.
+  bool transmit_state_changed_report();
+
+  /// Releases the encoded state-changed report.
+  void clear_state_changed_packets();
+
+  /// Appends the record that answers a group-and-source-specific query for the
+  /// given group: an IS_IN record of the queried sources that the group listens
+  /// to. Nothing is appended if it listens to none of them.
+  static void add_queried_sources_record(IgmpV3MembershipReport &report, const IgmpMemberGroupState &group);
+
+  /// Sends a single report that answers every pending query whose response is
+  /// due, and schedules the response timer for the next one.
+  void respond_to_queries();
+
+  /// Makes sure that the response timer expires no later than the given steady
+  /// time.
+  void schedule_query_response(const Timestamp &due);
+
+  /// Gets the robustness variable that this group member currently uses: the
+  /// querier's, if its last query had a nonzero QRV, or the configured one
+  /// otherwise.
+  uint8_t get_robustness_variable() const
+  {
+    return querier_robustness_variable != 0 ? querier_robustness_variable : robustness_variable;
+  }
 
   /// The robustness variable for this group member. This field's
   /// default value is 2.
   uint8_t robustness_variable = 2;
 
+  /// The QRV of the last query that was received, or zero if there was none,
+  /// or if that query's QRV was zero.
+  uint8_t querier_robustness_variable = 0;
+
   // The Unsolicited Report Interval is the time between repetitions of a
   // host’s initial report of membership in a group. Default: 1 second.
   uint32_t unsolicited_report_interval = 10;
 
-  /// The filter for this IGMP group member.
-  IgmpMemberFilter filter;
+  /// The MTU of the network on which reports are sent. Reports are split so
+  /// that none of them needs to be fragmented. This field's default value is
+  /// 1500, which is the MTU of an Ethernet.
+  uint32_t mtu = 1500;
 
-  /// A schedule of state-changed transmissions.
-  EventSchedule<IgmpTransmitStateChanged> state_changed_schedule;
-  /// A map from IP multicast addresses to the number of times they should
-  /// be included in a state-changed report.
-  HashMap<IPAddress, int> state_change_transmission_counts;
+  /// The filter for this IGMP group member. Its groups also keep track of the
+  /// number of times they should be included in a state-changed report, and of
+  /// their pending responses to group-specific queries.
+  IgmpMemberFilter filter;
 
-  CallbackTimer<IgmpGeneralQueryResponse> general_response_timer;
-  HashMap<IPAddress, CallbackTimer<IgmpGroupQueryResponse>> group_response_timers;
+  /// The timer that drives state-changed retransmissions. It keeps running for
+  /// as long as any group has state changes pending.
+  CallbackTimer<IgmpTransmitStateChanged> state_changed_timer;
+
+  /// The state-changed report that was transmitted last, split and encoded.
+  /// Retransmissions send clones of these packets for as long as the report's
+  /// contents stay the same, so a report is encoded once per change rather than
+  /// once per transmission.
+  Vector<Packet *> state_changed_packets;
+  bool state_changed_packets_valid = false;
+
+  /// A single timer answers all queries, no matter how many groups they are
+  /// for, and all responses that are due at the same time go out in a single
+  /// report. The timer expires at the earliest pending response.
+  CallbackTimer<IgmpQueryResponse> response_timer;
+  Timestamp response_timer_expiry;
+
+  /// Tells if a response to a general query is pending, and when it is due. It
+  /// reports every group, so it covers the groups' own pending responses too.
+  bool general_response_pending = false;
+  Timestamp general_response_due;
+
+  /// The groups whose responses to group-specific queries are pending, in no
+  /// particular order. Their due times are kept with their group states.
+  Vector<IPAddress> pending_group_responses;
+
+#if IGMP_LATENCY_STATS
+  /// The time it takes to process a query.
+  LatencyHistogram query_latency;
+  /// The time it takes to decide whether a data packet is delivered.
+  LatencyHistogram lookup_latency;
+  /// The time it takes to run a timer callback.
+  LatencyHistogram timer_latency;
+#endif
 };
 
 CLICK_ENDDECLS
\ No newline at end of file
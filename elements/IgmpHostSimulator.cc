@@ -0,0 +1,671 @@
+#include "IgmpHostSimulator.hh"
+
+#include <click/config.h>
+#include <click/confparse.hh>
+#include <click/error.hh>
+#include <click/glue.hh>
+#include <click/straccum.hh>
+#include <clicknet/ether.h>
+#include <clicknet/ip.h>
+#include <clicknet/udp.h>
+#include "IgmpMessage.hh"
+#include "IgmpMessageManip.hh"
+
+CLICK_DECLS
+
+IgmpHostSimulator::IgmpHostSimulator()
+    : first_host("10.1.0.1"), first_group("232.1.0.1"), first_source("10.0.0.1"),
+      retransmissions(this), tick_timer(this)
+{
+}
+
+IgmpHostSimulator::~IgmpHostSimulator()
+{
+}
+
+/// The size of the payload of a generated data packet.
+static const size_t data_payload_size = 32;
+
+int IgmpHostSimulator::configure(Vector<String> &conf, ErrorHandler *errh)
+{
+    String mode;
+    if (cp_va_kparse(
+            conf, this, errh,
+            "HOSTS", cpkN, cpUnsigned, &host_count,
+            "GROUPS", cpkN, cpUnsigned, &group_count,
+            "SOURCES", cpkN, cpUnsigned, &source_count,
+            "MODE", cpkN, cpString, &mode,
+            "FIRST_HOST", cpkN, cpIPAddress, &first_host,
+            "FIRST_GROUP", cpkN, cpIPAddress, &first_group,
+            "FIRST_SOURCE", cpkN, cpIPAddress, &first_source,
+            "INITIAL", cpkN, cpUnsigned, &initial_count,
+            "JOIN_RATE", cpkN, cpUnsigned, &join_rate,
+            "LEAVE_RATE", cpkN, cpUnsigned, &leave_rate,
+            "ZAP_RATE", cpkN, cpUnsigned, &zap_rate,
+            "DATA_RATE", cpkN, cpUnsigned, &data_rate,
+            "ROBUSTNESS", cpkN, cpUnsigned, &robustness_variable,
+            "UNSOLICITED_REPORT_INTERVAL", cpkN, cpUnsigned, &unsolicited_report_interval,
+            "ACTIVE", cpkN, cpBool, &active,
+            cpEnd) < 0)
+        return -1;
+
+    if (host_count == 0 || group_count == 0)
+        return errh->error("HOSTS and GROUPS must be positive");
+    if (initial_count > host_count)
+        return errh->error("INITIAL must not exceed HOSTS");
+    if (!first_group.is_multicast())
+        return errh->error("FIRST_GROUP must be a multicast address");
+    if (robustness_variable == 0)
+        return errh->error("ROBUSTNESS must be positive");
+    if (unsolicited_report_interval < 2)
+        return errh->error("UNSOLICITED_REPORT_INTERVAL must be at least 2");
+
+    if (mode == "")
+        filter_mode = source_count > 0 ? IgmpFilterMode::Include : IgmpFilterMode::Exclude;
+    else if (mode == "include")
+        filter_mode = IgmpFilterMode::Include;
+    else if (mode == "exclude")
+        filter_mode = IgmpFilterMode::Exclude;
+    else
+        return errh->error("MODE must be 'include' or 'exclude', got '%s'", mode.c_str());
+
+    // INCLUDE({}) is the state of a host that isn't a member at all.
+    if (filter_mode == IgmpFilterMode::Include && source_count == 0)
+        return errh->error("MODE include requires at least one source");
+
+    sources.clear();
+    for (uint32_t i = 0; i < source_count; i++)
+    {
+        sources.push_back(IPAddress(htonl(ntohl(first_source.addr()) + i)));
+    }
+    return 0;
+}
+
+int IgmpHostSimulator::initialize(ErrorHandler *)
+{
+    hosts.resize(host_count, Host());
+    groups.resize(group_count, Group());
+    idle_hosts.clear();
+    for (int i = 0; i < hosts.size(); i++)
+    {
+        hosts[i].group = -1;
+        hosts[i].position = idle_hosts.size();
+        hosts[i].pending = -1;
+        idle_hosts.push_back(i);
+    }
+    pending_reports.clear();
+    retransmissions.clear();
+
+    // The initial members are taken from the back of the idle list, which is the
+    // end of the host range, but their groups are random.
+    for (uint32_t i = 0; i < initial_count; i++)
+    {
+        add_member(idle_hosts.back(), click_random(0, group_count - 1));
+    }
+
+    tick_timer.initialize(this);
+    tick_timer.schedule_after_msec(tick_msec);
+    return 0;
+}
+
+IPAddress IgmpHostSimulator::get_host_address(int host) const
+{
+    return IPAddress(htonl(ntohl(first_host.addr()) + host));
+}
+
+IPAddress IgmpHostSimulator::get_group_address(int group) const
+{
+    return IPAddress(htonl(ntohl(first_group.addr()) + group));
+}
+
+int IgmpHostSimulator::get_group_index(const IPAddress &address) const
+{
+    uint32_t index = ntohl(address.addr()) - ntohl(first_group.addr());
+    return index < group_count ? (int)index : -1;
+}
+
+void IgmpHostSimulator::add_member(int host, int group)
+{
+    assert(hosts[host].group == -1);
+
+    // Take the host out of the idle list. The last idle host fills its spot.
+    int last_idle = idle_hosts.back();
+    idle_hosts[hosts[host].position] = last_idle;
+    hosts[last_idle].position = hosts[host].position;
+    idle_hosts.pop_back();
+
+    auto &group_state = groups[group];
+    if (group_state.members.size() == 0)
+    {
+        member_group_count++;
+        if (group_state.emptied)
+        {
+            // The group's previous leave is over now: traffic that arrives from
+            // here on is wanted again.
+            uint64_t latency_msec = 0;
+            if (group_state.last_unwanted_at > group_state.emptied_at)
+            {
+                latency_msec = (group_state.last_unwanted_at - group_state.emptied_at).msecval();
+            }
+            stats.leave_latency_count++;
+            stats.leave_latency_total_msec += latency_msec;
+            if (latency_msec > stats.leave_latency_max_msec)
+            {
+                stats.leave_latency_max_msec = latency_msec;
+            }
+            group_state.emptied = false;
+        }
+    }
+
+    hosts[host].group = group;
+    hosts[host].position = group_state.members.size();
+    group_state.members.push_back(host);
+}
+
+void IgmpHostSimulator::remove_member(int host)
+{
+    int group = hosts[host].group;
+    assert(group != -1);
+
+    // Take the host out of its group's member list. The group's last member fills
+    // its spot.
+    auto &group_state = groups[group];
+    int last_member = group_state.members.back();
+    group_state.members[hosts[host].position] = last_member;
+    hosts[last_member].position = hosts[host].position;
+    group_state.members.pop_back();
+
+    if (group_state.members.size() == 0)
+    {
+        member_group_count--;
+        group_state.emptied = true;
+        group_state.emptied_at = Timestamp::recent_steady();
+        group_state.last_unwanted_at = group_state.emptied_at;
+    }
+
+    hosts[host].group = -1;
+    hosts[host].position = idle_hosts.size();
+    idle_hosts.push_back(host);
+}
+
+void IgmpHostSimulator::add_change_record(IgmpV3MembershipReport &report, int group, bool join) const
+{
+    // A simulated host is either not a member, which is INCLUDE({}), or a member
+    // with the configured source list. According to the table in section 5.1 of
+    // the spec, the state-change records for those transitions are:
+    //
+    //      Old State         New State         State-Change Record Sent
+    //      ---------         ---------         ------------------------
+    //
+    //      INCLUDE ({})      INCLUDE (B)       ALLOW (B)
+    //      INCLUDE ({})      EXCLUDE (B)       TO_EX (B)
+    //      INCLUDE (B)       INCLUDE ({})      BLOCK (B)
+    //      EXCLUDE (B)       INCLUDE ({})      TO_IN ({})
+    IgmpV3GroupRecord record;
+    record.multicast_address = get_group_address(group);
+    if (filter_mode == IgmpFilterMode::Include)
+    {
+        record.type = join ? IgmpV3GroupRecordType::AllowNewSources : IgmpV3GroupRecordType::BlockOldSources;
+        record.source_addresses = sources;
+    }
+    else if (join)
+    {
+        record.type = IgmpV3GroupRecordType::ChangeToExcludeMode;
+        record.source_addresses = sources;
+    }
+    else
+    {
+        record.type = IgmpV3GroupRecordType::ChangeToIncludeMode;
+    }
+    report.group_records.push_back(record);
+}
+
+void IgmpHostSimulator::add_current_state_record(IgmpV3MembershipReport &report, int host) const
+{
+    IgmpFilterRecord record = {filter_mode, sources};
+    report.group_records.push_back(IgmpV3GroupRecord(get_group_address(hosts[host].group), record, false));
+}
+
+void IgmpHostSimulator::transmit_report(int host, const IgmpV3MembershipReport &report)
+{
+    // The spec says:
+    //
+    //     Every IGMP message described in this document is sent with an IP
+    //     Time-to-Live of 1, IP Precedence of Internetwork Control (e.g.,
+    //     Type of Service 0xc0), and carries an IP Router Alert option
+    //     [RFC-2113] in its IP header.
+    //
+    // Every host needs a source address of its own, so the IP header is built
+    // here rather than by an IPEncap.
+    size_t packetsize = igmp_ip_header_size + report.get_size();
+    WritablePacket *packet = Packet::make(sizeof(click_ether), 0, packetsize, 0);
+    if (packet == 0)
+        return click_chatter("cannot make packet!");
+
+    auto ip_header = (click_ip *)packet->data();
+    memset(ip_header, 0, igmp_ip_header_size);
+    ip_header->ip_v = 4;
+    ip_header->ip_hl = igmp_ip_header_size >> 2;
+    ip_header->ip_tos = 0xc0;
+    ip_header->ip_len = htons(packetsize);
+    ip_header->ip_ttl = 1;
+    ip_header->ip_p = IP_PROTO_IGMP;
+    ip_header->ip_src = get_host_address(host).in_addr();
+    ip_header->ip_dst = report_multicast_address.in_addr();
+
+    // The Router Alert option: type 148, length 4, value 0.
+    auto options = packet->data() + sizeof(click_ip);
+    options[0] = 148;
+    options[1] = 4;
+    ip_header->ip_sum = (uint16_t)~fold_ones_complement_sum(add_ones_complement_sum(0, packet->data(), igmp_ip_header_size));
+
+    report.write(packet->data() + igmp_ip_header_size);
+
+    packet->set_ip_header(ip_header, igmp_ip_header_size);
+    packet->set_dst_ip_anno(report_multicast_address);
+
+    stats.reports_sent++;
+    stats.records_sent += report.group_records.size();
+    output(0).push(packet);
+}
+
+void IgmpHostSimulator::join_random_host()
+{
+    if (idle_hosts.size() == 0)
+    {
+        return;
+    }
+
+    int host = idle_hosts[click_random(0, idle_hosts.size() - 1)];
+    int group = click_random(0, group_count - 1);
+    add_member(host, group);
+    stats.joins++;
+    report_change(host, -1, group);
+}
+
+void IgmpHostSimulator::leave_random_host()
+{
+    if (idle_hosts.size() == hosts.size())
+    {
+        return;
+    }
+
+    // Pick a random member by picking a random host until it's a member. Most of
+    // the hosts may be idle, so give up after a few attempts and skip this leave.
+    for (int attempt = 0; attempt < 16; attempt++)
+    {
+        int host = click_random(0, hosts.size() - 1);
+        int group = hosts[host].group;
+        if (group == -1)
+        {
+            continue;
+        }
+
+        remove_member(host);
+        stats.leaves++;
+        report_change(host, group, -1);
+        return;
+    }
+}
+
+void IgmpHostSimulator::zap_random_host()
+{
+    if (idle_hosts.size() == hosts.size() || group_count < 2)
+    {
+        return;
+    }
+
+    for (int attempt = 0; attempt < 16; attempt++)
+    {
+        int host = click_random(0, hosts.size() - 1);
+        int old_group = hosts[host].group;
+        if (old_group == -1)
+        {
+            continue;
+        }
+
+        int new_group = click_random(0, group_count - 2);
+        if (new_group >= old_group)
+        {
+            new_group++;
+        }
+
+        remove_member(host);
+        add_member(host, new_group);
+        stats.zaps++;
+
+        // A zap is a single state change to the host, so both records travel in
+        // a single report.
+        report_change(host, old_group, new_group);
+        return;
+    }
+}
+
+void IgmpHostSimulator::report_change(int host, int left_group, int joined_group)
+{
+    // IgmpGroupMember follows the spec here:
+    //
+    //    To cover the possibility of the State-Change Report being missed by
+    //    one or more multicast routers, it is retransmitted [Robustness
+    //    Variable] - 1 more times, at intervals chosen at random from the
+    //    range (0, [Unsolicited Report Interval]).
+    //
+    // and merges changes that occur before all retransmissions are done into a
+    // single report, which becomes the first of [Robustness Variable]
+    // transmissions of the new change. Simulated hosts do the same.
+    int index = hosts[host].pending;
+    if (index == -1)
+    {
+        index = pending_reports.size();
+        pending_reports.push_back(PendingReport());
+        pending_reports[index].host = host;
+        hosts[host].pending = index;
+    }
+
+    auto &pending = pending_reports[index];
+    if (left_group != -1)
+    {
+        add_pending_record(pending, left_group, false);
+    }
+    if (joined_group != -1)
+    {
+        add_pending_record(pending, joined_group, true);
+    }
+    retransmissions.cancel(pending.retransmission);
+    transmit_pending_report(index);
+}
+
+void IgmpHostSimulator::add_pending_record(PendingReport &pending, int group, bool join) const
+{
+    PendingRecord record;
+    record.group = group;
+    record.join = join;
+    record.remaining = get_robustness_variable();
+    for (auto &other : pending.records)
+    {
+        if (other.group == group)
+        {
+            other = record;
+            return;
+        }
+    }
+    pending.records.push_back(record);
+}
+
+void IgmpHostSimulator::transmit_pending_report(int index)
+{
+    auto &pending = pending_reports[index];
+    int host = pending.host;
+    IgmpV3MembershipReport report;
+    int kept = 0;
+    for (int i = 0; i < pending.records.size(); i++)
+    {
+        auto record = pending.records[i];
+        add_change_record(report, record.group, record.join);
+        if (--record.remaining > 0)
+        {
+            pending.records[kept++] = record;
+        }
+    }
+    pending.records.resize(kept);
+
+    if (kept == 0)
+    {
+        // The host is done. The last pending report fills its spot.
+        hosts[pending_reports.back().host].pending = index;
+        pending_reports[index] = pending_reports.back();
+        pending_reports.pop_back();
+        hosts[host].pending = -1;
+    }
+    else
+    {
+        uint32_t interval_dsec = click_random(1, unsolicited_report_interval - 1);
+        pending.retransmission = retransmissions.schedule_after_dsec(interval_dsec, Retransmit(this, host));
+    }
+
+    // Pushing the report may make a directly connected router answer with
+    // queries, so the pending reports are left alone from here on.
+    transmit_report(host, report);
+}
+
+void IgmpHostSimulator::Retransmit::operator()() const
+{
+    elem->stats.retransmissions++;
+    elem->transmit_pending_report(elem->hosts[host].pending);
+}
+
+void IgmpHostSimulator::accept_query(const IgmpMembershipQuery &query)
+{
+    stats.queries_received++;
+
+    // Hosts go along with the querier's robustness, like IgmpGroupMember.
+    querier_robustness_variable = query.robustness_variable;
+
+    ResponseSweep sweep;
+    sweep.cursor = 0;
+    sweep.start = Timestamp::recent_steady();
+    sweep.duration_msec = query.max_resp_time * 100;
+    if (query.is_general_query())
+    {
+        sweep.group = -1;
+        sweep.host_count = hosts.size();
+    }
+    else
+    {
+        // SPEC INTERPRETATION: group-and-source-specific queries are answered like
+        // group-specific queries, with the host's full current state. The router
+        // handles the extra sources just fine.
+        sweep.group = get_group_index(query.group_address);
+        if (sweep.group == -1 || groups[sweep.group].members.size() == 0)
+        {
+            return;
+        }
+        sweep.hosts = groups[sweep.group].members;
+        sweep.host_count = sweep.hosts.size();
+    }
+    sweeps.push_back(sweep);
+}
+
+void IgmpHostSimulator::run_sweeps()
+{
+    // Reports are pushed downstream right away, and a router that is connected
+    // directly may well answer them with queries before the push returns. Those
+    // queries add sweeps, so sweeps are always accessed by index.
+    Timestamp now = Timestamp::recent_steady();
+    for (int i = sweeps.size() - 1; i >= 0; i--)
+    {
+        // Every host that is due by now responds.
+        uint64_t elapsed_msec = (now - sweeps[i].start).msecval();
+        int due = sweeps[i].host_count;
+        if (elapsed_msec < sweeps[i].duration_msec)
+        {
+            due = (int)((uint64_t)sweeps[i].host_count * elapsed_msec / sweeps[i].duration_msec);
+        }
+
+        while (sweeps[i].cursor < due)
+        {
+            int group = sweeps[i].group;
+            int host = group == -1 ? sweeps[i].cursor : sweeps[i].hosts[sweeps[i].cursor];
+            sweeps[i].cursor++;
+            if (hosts[host].group == -1 || (group != -1 && hosts[host].group != group))
+            {
+                // The host isn't a member, or has left the group since it was queried.
+                continue;
+            }
+
+            IgmpV3MembershipReport report;
+            add_current_state_record(report, host);
+            transmit_report(host, report);
+        }
+
+        if (sweeps[i].cursor >= sweeps[i].host_count)
+        {
+            sweeps[i] = sweeps.back();
+            sweeps.pop_back();
+        }
+    }
+}
+
+void IgmpHostSimulator::transmit_data()
+{
+    size_t packetsize = sizeof(click_ip) + sizeof(click_udp) + data_payload_size;
+    WritablePacket *packet = Packet::make(sizeof(click_ether), 0, packetsize, 0);
+    if (packet == 0)
+        return click_chatter("cannot make packet!");
+
+    memset(packet->data(), 0, packetsize);
+    auto ip_header = (click_ip *)packet->data();
+    IPAddress group_address = get_group_address(data_cursor);
+    ip_header->ip_v = 4;
+    ip_header->ip_hl = sizeof(click_ip) >> 2;
+    ip_header->ip_len = htons(packetsize);
+    ip_header->ip_ttl = 64;
+    ip_header->ip_p = IP_PROTO_UDP;
+    ip_header->ip_src = first_source.in_addr();
+    ip_header->ip_dst = group_address.in_addr();
+    ip_header->ip_sum = (uint16_t)~fold_ones_complement_sum(add_ones_complement_sum(0, packet->data(), sizeof(click_ip)));
+
+    // A zero UDP checksum means that there is none.
+    auto udp_header = (click_udp *)(packet->data() + sizeof(click_ip));
+    udp_header->uh_sport = htons(1234);
+    udp_header->uh_dport = htons(1234);
+    udp_header->uh_ulen = htons(sizeof(click_udp) + data_payload_size);
+
+    packet->set_ip_header(ip_header, sizeof(click_ip));
+    packet->set_dst_ip_anno(group_address);
+
+    data_cursor = (data_cursor + 1) % group_count;
+    stats.data_sent++;
+    output(1).push(packet);
+}
+
+void IgmpHostSimulator::run_events(uint64_t &credit, uint32_t rate, void (IgmpHostSimulator::*event)())
+{
+    credit += (uint64_t)rate * tick_msec;
+    for (; credit >= 1000; credit -= 1000)
+    {
+        (this->*event)();
+    }
+}
+
+void IgmpHostSimulator::tick()
+{
+    if (active)
+    {
+        run_events(join_credit, join_rate, &IgmpHostSimulator::join_random_host);
+        run_events(leave_credit, leave_rate, &IgmpHostSimulator::leave_random_host);
+        run_events(zap_credit, zap_rate, &IgmpHostSimulator::zap_random_host);
+    }
+    run_events(data_credit, data_rate, &IgmpHostSimulator::transmit_data);
+    run_sweeps();
+
+    tick_timer.reschedule_after_msec(tick_msec);
+}
+
+void IgmpHostSimulator::Tick::operator()() const
+{
+    elem->tick();
+}
+
+void IgmpHostSimulator::push(int port, Packet *packet)
+{
+    if (port == 0)
+    {
+        // Queries come straight from the router, but a runt would make the
+        // parser read past the end of the packet all the same.
+        if (is_complete_igmp_membership_query(packet->data(), packet->length()))
+        {
+            auto data_ptr = packet->data();
+            accept_query(IgmpMembershipQuery::read(data_ptr));
+        }
+    }
+    else
+    {
+        assert(port == 1);
+        auto ip_header = (const click_ip *)packet->data();
+        int group = get_group_index(ip_header->ip_dst);
+        if (group != -1 && groups[group].members.size() > 0)
+        {
+            stats.delivered++;
+        }
+        else
+        {
+            stats.unwanted++;
+            if (group != -1 && groups[group].emptied)
+            {
+                groups[group].last_unwanted_at = Timestamp::recent_steady();
+            }
+        }
+    }
+    packet->kill();
+}
+
+enum
+{
+    h_stats,
+    h_leave_latency,
+    h_active
+};
+
+String IgmpHostSimulator::read_handler(Element *e, void *thunk)
+{
+    IgmpHostSimulator *self = (IgmpHostSimulator *)e;
+    const Stats &stats = self->stats;
+    uint64_t mean_msec = stats.leave_latency_count == 0 ? 0 : stats.leave_latency_total_msec / stats.leave_latency_count;
+
+    StringAccum sa;
+    switch ((intptr_t)thunk)
+    {
+    case h_stats:
+        sa << "joined_hosts " << self->hosts.size() - self->idle_hosts.size() << '\n'
+           << "member_groups " << self->member_group_count << '\n'
+           << "joins " << stats.joins << '\n'
+           << "leaves " << stats.leaves << '\n'
+           << "zaps " << stats.zaps << '\n'
+           << "reports_sent " << stats.reports_sent << '\n'
+           << "records_sent " << stats.records_sent << '\n'
+           << "retransmissions " << stats.retransmissions << '\n'
+           << "queries_received " << stats.queries_received << '\n'
+           << "data_sent " << stats.data_sent << '\n'
+           << "delivered " << stats.delivered << '\n'
+           << "unwanted " << stats.unwanted << '\n'
+           << "leave_latency_count " << stats.leave_latency_count << '\n'
+           << "leave_latency_mean_msec " << mean_msec << '\n'
+           << "leave_latency_max_msec " << stats.leave_latency_max_msec << '\n';
+        return sa.take_string();
+    case h_leave_latency:
+        sa << stats.leave_latency_count << ' ' << mean_msec << ' ' << stats.leave_latency_max_msec;
+        return sa.take_string();
+    case h_active:
+        return cp_unparse_bool(self->active);
+    default:
+        return String();
+    }
+}
+
+int IgmpHostSimulator::write_active(const String &conf, Element *e, void *, ErrorHandler *errh)
+{
+    IgmpHostSimulator *self = (IgmpHostSimulator *)e;
+    if (!cp_bool(cp_uncomment(conf), &self->active))
+        return errh->error("active must be a Boolean");
+    return 0;
+}
+
+int IgmpHostSimulator::reset_stats(const String &, Element *e, void *, ErrorHandler *)
+{
+    IgmpHostSimulator *self = (IgmpHostSimulator *)e;
+    self->stats = Stats();
+    return 0;
+}
+
+void IgmpHostSimulator::add_handlers()
+{
+    add_read_handler("stats", &read_handler, (void *)h_stats);
+    add_read_handler("leave_latency", &read_handler, (void *)h_leave_latency);
+    add_read_handler("active", &read_handler, (void *)h_active);
+    add_write_handler("active", &write_active, (void *)0);
+    add_write_handler("reset_stats", &reset_stats, (void *)0);
+}
+
+CLICK_ENDDECLS
+EXPORT_ELEMENT(IgmpHostSimulator)
@@ -0,0 +1,343 @@
+#pragma once
+
+#include <click/config.h>
+#include <click/element.hh>
+#include <click/ipaddress.hh>
+#include <click/timestamp.hh>
+#include <click/vector.hh>
+#include "CallbackTimer.hh"
+#include "EventSchedule.hh"
+#include "IgmpMessageManip.hh"
+
+CLICK_DECLS
+
+/// Emulates a large population of IGMPv3 hosts in a single element, for scale
+/// tests of the router. Every host has an IP address of its own and is either
+/// idle or a member of exactly one multicast group, like a set-top box that is
+/// tuned to a single channel. Hosts join, leave and zap (switch from one group
+/// to another) at configurable rates, and answer queries on behalf of all of
+/// them, spread over the queries' Max Resp Times. Like IgmpGroupMember, a host
+/// retransmits every state change [Robustness Variable] - 1 times, and goes
+/// along with the querier's QRV.
+///
+/// Where IgmpGroupMember keeps a full filter, timers and handlers per host, a
+/// simulated host takes up a handful of integers, so tens of thousands of them
+/// fit in a single router's LAN.
+class IgmpHostSimulator : public Element
+{
+  public:
+    IgmpHostSimulator();
+    ~IgmpHostSimulator();
+
+    // Description of ports:
+    //
+    //     Input:
+    //         0. Incoming IGMP packets, with their IP headers stripped, such
+    //            as the queries that an IgmpRouter generates.
+    //
+    //         1. Incoming multicast data packets. They are counted as either
+    //            delivered or unwanted and are then discarded.
+    //
+    //     Output:
+    //         0. Generated IGMP membership reports, as complete IP packets
+    //            whose source addresses are those of the hosts that sent
+    //            them.
+    //
+    //         1. Generated multicast data packets, if DATA_RATE is nonzero.
+    //            They are sent to every group in turn, from FIRST_SOURCE.
+    //
+    // Configuration keywords:
+    //
+    //     HOSTS, GROUPS: the number of hosts and groups. Default: 1000, 100.
+    //     FIRST_HOST, FIRST_GROUP, FIRST_SOURCE: the first of the consecutive
+    //         host, group and source addresses. Default: 10.1.0.1, 232.1.0.1,
+    //         10.0.0.1.
+    //     SOURCES: the number of sources in every host's source list. Default: 0.
+    //     MODE: the filter mode of every host's source list, 'include' or
+    //         'exclude'. Default: 'include' if there are sources, 'exclude'
+    //         otherwise.
+    //     INITIAL: the number of hosts that are members of a random group right
+    //         from the start. They don't report until they are queried.
+    //         Default: 0.
+    //     JOIN_RATE, LEAVE_RATE, ZAP_RATE: the number of joins, leaves and zaps
+    //         per second, over all hosts. Default: 0.
+    //     DATA_RATE: the number of data packets per second. Default: 0.
+    //     ROBUSTNESS: the hosts' Robustness Variable, which they use until a
+    //         query advertises a nonzero QRV. Default: 2.
+    //     UNSOLICITED_REPORT_INTERVAL: the hosts' Unsolicited Report Interval,
+    //         in deciseconds, of at least 2. Default: 10.
+    //     ACTIVE: whether the hosts join, leave and zap. Default: true.
+    //
+    // Handlers:
+    //
+    //     stats: the number of joined hosts and groups with members; joins,
+    //         leaves and zaps; reports and group records sent, of which
+    //         retransmissions; queries
+    //         received; data packets sent, delivered and unwanted; and the
+    //         leave latency.
+    //     leave_latency: the count, mean and maximum in milliseconds of the
+    //         time between a group's last member leaving and the last data
+    //         packet for the group arriving, over all groups that have since
+    //         been joined again. On a shared LAN, only the leave of a group's
+    //         last member can stop traffic.
+    //     active: reads or writes ACTIVE.
+    //     reset_stats: resets the statistics.
+
+    const char *class_name() const { return "IgmpHostSimulator"; }
+    const char *port_count() const { return "2/2"; }
+    const char *processing() const { return PUSH; }
+
+    int configure(Vector<String> &, ErrorHandler *);
+    int initialize(ErrorHandler *);
+
+    static String read_handler(Element *e, void *thunk);
+    static int write_active(const String &conf, Element *e, void *thunk, ErrorHandler *errh);
+    static int reset_stats(const String &conf, Element *e, void *thunk, ErrorHandler *errh);
+
+    void add_handlers();
+
+    void push(int port, Packet *packet);
+
+  private:
+    /// A timer callback that drives the simulation.
+    struct Tick
+    {
+        Tick()
+            : elem(nullptr)
+        {
+        }
+        Tick(IgmpHostSimulator *elem)
+            : elem(elem)
+        {
+        }
+        IgmpHostSimulator *elem;
+
+        void operator()() const;
+    };
+
+    /// An event that retransmits a host's pending report.
+    struct Retransmit
+    {
+        Retransmit()
+            : elem(nullptr), host(-1)
+        {
+        }
+        Retransmit(IgmpHostSimulator *elem, int host)
+            : elem(elem), host(host)
+        {
+        }
+        IgmpHostSimulator *elem;
+        int host;
+
+        void operator()() const;
+    };
+
+    /// A simulated host.
+    struct Host
+    {
+        /// The group that the host is a member of, or -1 if it's idle.
+        int group;
+
+        /// The host's index in the idle host list if it's idle, or in its
+        /// group's member list otherwise.
+        int position;
+
+        /// The host's index in the pending report list, or -1 if it has no
+        /// state changes to retransmit.
+        int pending;
+    };
+
+    /// A group record that a host has yet to retransmit.
+    struct PendingRecord
+    {
+        /// The group that the host has joined or left.
+        int group;
+
+        /// Tells if the host has joined the group, rather than left it.
+        bool join;
+
+        /// The number of transmissions that the record has left.
+        uint32_t remaining;
+    };
+
+    /// The state changes that a host has yet to retransmit. Like IgmpGroupMember,
+    /// a host merges a new change into its pending report, sends the merged report
+    /// right away and then retransmits it at random intervals, dropping every
+    /// record once it has been sent [Robustness Variable] times.
+    struct PendingReport
+    {
+        int host;
+        Vector<PendingRecord> records;
+
+        /// The report's next retransmission.
+        EventSchedule<Retransmit>::Handle retransmission;
+    };
+
+    /// A multicast group, as the simulated hosts see it.
+    struct Group
+    {
+        Group()
+            : members(), emptied(false), emptied_at(), last_unwanted_at()
+        {
+        }
+
+        /// The hosts that are members of the group.
+        Vector<int> members;
+
+        /// Tells if the group has had members, but has none anymore.
+        bool emptied;
+
+        /// The time at which the group's last member left.
+        Timestamp emptied_at;
+
+        /// The time at which the last data packet arrived for the group after
+        /// its last member left.
+        Timestamp last_unwanted_at;
+    };
+
+    /// A pending response to a query. The responding hosts are spread evenly over
+    /// the query's Max Resp Time, so that a general query doesn't make every host
+    /// respond at once.
+    struct ResponseSweep
+    {
+        /// The queried group, or -1 for a general query.
+        int group;
+
+        /// The hosts that should respond. For a general query, this is empty and
+        /// every host is considered.
+        Vector<int> hosts;
+
+        /// The number of hosts that are considered.
+        int host_count;
+
+        /// The number of hosts that have been considered so far.
+        int cursor;
+
+        Timestamp start;
+        uint32_t duration_msec;
+    };
+
+    /// The simulation runs in ticks of this many milliseconds.
+    static const uint32_t tick_msec = 10;
+
+    void tick();
+    void run_events(uint64_t &credit, uint32_t rate, void (IgmpHostSimulator::*event)());
+    void join_random_host();
+    void leave_random_host();
+    void zap_random_host();
+
+    /// Reports that the given host has left the given group and joined another,
+    /// where -1 stands for no group. The report is sent right away and is then
+    /// retransmitted.
+    void report_change(int host, int left_group, int joined_group);
+    /// Adds a record for the given change to the given pending report, in place of
+    /// any record that it has for the same group.
+    void add_pending_record(PendingReport &pending, int group, bool join) const;
+    /// Sends the pending report with the given index, and schedules its next
+    /// retransmission or drops it if it's done.
+    void transmit_pending_report(int index);
+    void accept_query(const IgmpMembershipQuery &query);
+    void run_sweeps();
+    void transmit_data();
+
+    /// Adds the given idle host to the given group.
+    void add_member(int host, int group);
+    /// Removes the given host from its group, which makes it idle.
+    void remove_member(int host);
+
+    /// Appends the group record that reports the change from the given host not being
+    /// a member of the given group to being one, or the other way around.
+    void add_change_record(IgmpV3MembershipReport &report, int group, bool join) const;
+    /// Appends the group record that reports the given host's current state.
+    void add_current_state_record(IgmpV3MembershipReport &report, int host) const;
+    void transmit_report(int host, const IgmpV3MembershipReport &report);
+
+    /// Gets the Robustness Variable that the hosts currently use: the querier's,
+    /// if its last query had a nonzero QRV, or the configured one otherwise.
+    uint32_t get_robustness_variable() const
+    {
+        return querier_robustness_variable != 0 ? querier_robustness_variable : robustness_variable;
+    }
+
+    IPAddress get_host_address(int host) const;
+    IPAddress get_group_address(int group) const;
+    int get_group_index(const IPAddress &address) const;
+
+    uint32_t host_count = 1000;
+    uint32_t group_count = 100;
+    uint32_t source_count = 0;
+    IPAddress first_host;
+    IPAddress first_group;
+    IPAddress first_source;
+    IgmpFilterMode filter_mode = IgmpFilterMode::Exclude;
+    uint32_t initial_count = 0;
+    uint32_t join_rate = 0;
+    uint32_t leave_rate = 0;
+    uint32_t zap_rate = 0;
+    uint32_t data_rate = 0;
+    uint32_t robustness_variable = 2;
+    uint32_t unsolicited_report_interval = 10;
+    bool active = true;
+
+    /// The QRV of the last query that was received, or zero if there was none,
+    /// or if that query's QRV was zero.
+    uint32_t querier_robustness_variable = 0;
+
+    /// The source list that every host reports.
+    Vector<IPAddress> sources;
+
+    Vector<Host> hosts;
+    Vector<Group> groups;
+    Vector<int> idle_hosts;
+    int member_group_count = 0;
+
+    /// Event credits, in thousandths of an event, which carry the fractions of
+    /// events that don't fit in a tick over to the next tick.
+    uint64_t join_credit = 0;
+    uint64_t leave_credit = 0;
+    uint64_t zap_credit = 0;
+    uint64_t data_credit = 0;
+
+    /// The next group to send a data packet to.
+    int data_cursor = 0;
+
+    Vector<ResponseSweep> sweeps;
+
+    /// The reports of the hosts that have state changes to retransmit, in no
+    /// particular order.
+    Vector<PendingReport> pending_reports;
+
+    /// The next retransmission of every pending report. A new state change
+    /// cancels its host's retransmission and sends the merged report right away.
+    EventSchedule<Retransmit> retransmissions;
+
+    CallbackTimer<Tick> tick_timer;
+
+    struct Stats
+    {
+        Stats()
+            : joins(0), leaves(0), zaps(0), reports_sent(0), records_sent(0), retransmissions(0), queries_received(0),
+              data_sent(0), delivered(0), unwanted(0), leave_latency_count(0), leave_latency_total_msec(0),
+              leave_latency_max_msec(0)
+        {
+        }
+
+        uint64_t joins;
+        uint64_t leaves;
+        uint64_t zaps;
+        uint64_t reports_sent;
+        uint64_t records_sent;
+        uint64_t retransmissions;
+        uint64_t queries_received;
+        uint64_t data_sent;
+        uint64_t delivered;
+        uint64_t unwanted;
+        uint64_t leave_latency_count;
+        uint64_t leave_latency_total_msec;
+        uint64_t leave_latency_max_msec;
+    };
+
+    Stats stats;
+};
+
+CLICK_ENDDECLS
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <click/config.h>
+#include <click/glue.hh>
+#include <click/hashmap.hh>
+#include <click/ipaddress.hh>
+#include <click/packet.hh>
+#include <click/timestamp.hh>
+#include <click/vector.hh>
+
+CLICK_DECLS
+
+/// A token bucket that holds up to a given number of packets' worth of tokens and
+/// refills at a given number of packets per second. Tokens are kept in thousandths
+/// of a packet, so that slow rates still refill a little every millisecond.
+struct IgmpTokenBucket
+{
+    IgmpTokenBucket()
+        : tokens(0), last_refill()
+    {
+    }
+
+    /// The number of tokens in the bucket, in thousandths of a packet.
+    uint64_t tokens;
+
+    /// The steady time at which the bucket was last refilled.
+    Timestamp last_refill;
+};
+
+/// Limits the rate at which each host may send IGMP packets to the router, with a
+/// token bucket per source address. A host that floods the router with reports
+/// only drains its own bucket, so the other hosts on its network are still heard.
+///
+/// Buckets are only kept for hosts that have sent something recently: a bucket
+/// that has filled up again says nothing that a new bucket wouldn't, so a full
+/// bucket makes room for a new host when the table runs out of room. A clock hand
+/// sweeps the table for full buckets, a few buckets per new host, so a flood of
+/// packets from spoofed source addresses costs no more per packet than any other
+/// flood. If the buckets in the hand's way are still in use, the hosts that don't
+/// fit share one bucket.
+class IgmpHostRateLimiter final
+{
+  public:
+    IgmpHostRateLimiter()
+        : rate(0), burst(0), max_hosts(default_max_hosts), clock_hand(0)
+    {
+    }
+
+    /// The default number of hosts that buckets are kept for.
+    static const int default_max_hosts = 4096;
+
+    /// Tells if this rate limiter admits every packet.
+    bool enabled() const { return rate != 0; }
+
+    /// Gets the number of packets per second that each host may send.
+    uint32_t get_rate() const { return rate; }
+
+    /// Gets the number of packets that each host may send in a single burst.
+    uint32_t get_burst() const { return burst; }
+
+    /// Sets the number of packets per second that each host may send, and the
+    /// number of packets that it may send in a burst. A rate of zero turns rate
+    /// limiting off. All buckets start out full again.
+    void configure(uint32_t new_rate, uint32_t new_burst)
+    {
+        rate = new_rate;
+        burst = new_burst != 0 ? new_burst : new_rate;
+        slot_indices.clear();
+        slots.clear();
+        clock_hand = 0;
+        shared_bucket = IgmpTokenBucket();
+        shared_bucket.tokens = get_capacity();
+        shared_bucket.last_refill = Timestamp::recent_steady();
+    }
+
+    /// Takes a token from the given host's bucket at the given steady time. A
+    /// Boolean result tells if there was one, that is, if the host's packet is
+    /// admitted.
+    bool admit(const IPAddress &host, const Timestamp &now)
+    {
+        if (!enabled())
+        {
+            return true;
+        }
+
+        IgmpTokenBucket *bucket;
+        int *slot_index = slot_indices.findp(host);
+        if (slot_index != nullptr)
+        {
+            bucket = &slots[*slot_index].bucket;
+        }
+        else
+        {
+            int index = slots.size();
+            if (index < max_hosts)
+            {
+                slots.push_back(Slot());
+            }
+            else
+            {
+                index = evict_full_bucket(now);
+            }
+
+            if (index < 0)
+            {
+                bucket = &shared_bucket;
+            }
+            else
+            {
+                slots[index].host = host;
+                slots[index].bucket.tokens = get_capacity();
+                slots[index].bucket.last_refill = now;
+                slot_indices.insert(host, index);
+                bucket = &slots[index].bucket;
+            }
+        }
+
+        refill(*bucket, now);
+        if (bucket->tokens < tokens_per_packet)
+        {
+            return false;
+        }
+        bucket->tokens -= tokens_per_packet;
+        return true;
+    }
+
+  private:
+    /// A host's bucket in the table.
+    struct Slot
+    {
+        IPAddress host;
+        IgmpTokenBucket bucket;
+    };
+
+    /// The number of tokens that a packet costs.
+    static const uint64_t tokens_per_packet = 1000;
+
+    /// The most buckets that the clock hand looks at for a single new host.
+    static const int max_eviction_probes = 8;
+
+    uint64_t get_capacity() const { return (uint64_t)burst * tokens_per_packet; }
+
+    /// Adds the tokens that the given bucket has earned since it was last refilled.
+    void refill(IgmpTokenBucket &bucket, const Timestamp &now) const
+    {
+        if (now <= bucket.last_refill)
+        {
+            return;
+        }
+
+        // A rate of R packets per second earns R thousandths of a packet every
+        // millisecond. Only whole milliseconds are credited, and the bucket's
+        // refill time only moves on by as many, so that the rest of a millisecond
+        // is credited by the next refill rather than lost. Buckets that have been
+        // idle for longer than it takes to fill them up are simply full.
+        uint64_t elapsed_msec = (now - bucket.last_refill).msecval();
+        uint64_t capacity = get_capacity();
+        if (elapsed_msec >= capacity / rate + 1)
+        {
+            bucket.tokens = capacity;
+            bucket.last_refill = now;
+            return;
+        }
+
+        bucket.tokens += elapsed_msec * rate;
+        if (bucket.tokens >= capacity)
+        {
+            bucket.tokens = capacity;
+            bucket.last_refill = now;
+        }
+        else
+        {
+            bucket.last_refill += Timestamp::make_msec((Timestamp::value_type)elapsed_msec);
+        }
+    }
+
+    /// Moves the clock hand over a few buckets, and frees the slot of the first
+    /// one that would be full at the given time. Gets the index of the freed
+    /// slot, or -1 if none of the buckets was full.
+    int evict_full_bucket(const Timestamp &now)
+    {
+        for (int probe = 0; probe < max_eviction_probes; probe++)
+        {
+            int index = clock_hand;
+            clock_hand = clock_hand + 1 == slots.size() ? 0 : clock_hand + 1;
+
+            Slot &slot = slots[index];
+            refill(slot.bucket, now);
+            if (slot.bucket.tokens >= get_capacity())
+            {
+                slot_indices.erase(slot.host);
+                return index;
+            }
+        }
+        return -1;
+    }
+
+    uint32_t rate;
+    uint32_t burst;
+    int max_hosts;
+
+    /// The hosts' buckets, and the index of every host's bucket in them.
+    Vector<Slot> slots;
+    HashMap<IPAddress, int> slot_indices;
+
+    /// The index of the next bucket that the clock hand looks at.
+    int clock_hand;
+
+    IgmpTokenBucket shared_bucket;
+};
+
+/// A bounded first-in, first-out queue of packets. The queue owns the packets in
+/// it, so those that are still queued when it is destroyed are killed.
+class IgmpPacketQueue final
+{
+  public:
+    IgmpPacketQueue()
+        : head(0), count(0)
+    {
+    }
+
+    ~IgmpPacketQueue() { clear(); }
+
+    IgmpPacketQueue(const IgmpPacketQueue &) = delete;
+    IgmpPacketQueue &operator=(const IgmpPacketQueue &) = delete;
+
+    /// Sets the number of packets that the queue can hold. Packets that are
+    /// still queued are killed.
+    void set_capacity(int capacity)
+    {
+        clear();
+        slots.resize(capacity, nullptr);
+    }
+
+    /// Gets the number of packets that the queue can hold.
+    int get_capacity() const { return slots.size(); }
+
+    /// Gets the number of packets in the queue.
+    int size() const { return count; }
+
+    bool empty() const { return count == 0; }
+
+    bool full() const { return count == slots.size(); }
+
+    /// Appends the given packet to the queue, which must not be full.
+    void push(Packet *packet)
+    {
+        assert(!full());
+        int tail = head + count;
+        if (tail >= slots.size())
+        {
+            tail -= slots.size();
+        }
+        slots[tail] = packet;
+        count++;
+    }
+
+    /// Removes the packet at the front of the queue, which must not be empty, and
+    /// hands it to the caller.
+    Packet *pop()
+    {
+        assert(!empty());
+        Packet *packet = slots[head];
+        slots[head] = nullptr;
+        head = head + 1 == slots.size() ? 0 : head + 1;
+        count--;
+        return packet;
+    }
+
+    /// Kills every packet in the queue.
+    void clear()
+    {
+        while (!empty())
+        {
+            pop()->kill();
+        }
+        head = 0;
+    }
+
+  private:
+    Vector<Packet *> slots;
+    int head;
+    int count;
+};
+
+CLICK_ENDDECLS
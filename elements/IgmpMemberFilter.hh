@@ -2,6 +2,7 @@
 
 #include <click/config.h>
 #include <click/hashmap.hh>
+#include <click/timestamp.hh>
 #include <click/vector.hh>
 #include <clicknet/ip.h>
 #include "IgmpMessage.hh"
@@ -130,29 +131,156 @@ bool set_equality_vectors(const Vector<T> &left, const Vector<T> &right)
     return is_subset_vectors(left, right) && is_subset_vectors(right, left);
 }
 
+/// The state that a group member keeps for a single multicast group: its
+/// reception state, along with the bookkeeping for reports about the group.
+struct IgmpMemberGroupState
+{
+    IgmpMemberGroupState()
+        : multicast_address(), record(create_igmp_leave_record()), pending_state_changes(0), response_pending(false),
+          response_due(), queried_sources()
+    {
+    }
+
+    explicit IgmpMemberGroupState(const IPAddress &multicast_address)
+        : multicast_address(multicast_address), record(create_igmp_leave_record()), pending_state_changes(0),
+          response_pending(false), response_due(), queried_sources()
+    {
+    }
+
+    /// The group's multicast address.
+    IPAddress multicast_address;
+
+    /// The group's filter mode and source list. A group without reception state
+    /// is in INCLUDE mode and has no sources.
+    IgmpFilterRecord record;
+
+    /// The number of state-change reports that the group has yet to be included in.
+    int pending_state_changes;
+
+    /// Tells if a response to a group-specific query for the group is pending.
+    bool response_pending;
+
+    /// The steady time at which the pending response to a group-specific query is
+    /// due, if there is one.
+    Timestamp response_due;
+
+    /// The sources that the group-and-source-specific queries answered by the
+    /// pending response have asked about. It's empty if the pending response
+    /// answers a group-specific query, which asks about every source.
+    Vector<IPAddress> queried_sources;
+
+    /// Tests if the group has reception state, i.e., if the host listens to any of
+    /// its sources.
+    bool has_reception_state() const
+    {
+        return record.filter_mode == IgmpFilterMode::Exclude || record.source_addresses.size() != 0;
+    }
+
+    /// Tests if the group can be forgotten: it has no reception state and nothing
+    /// is pending for it.
+    bool is_idle() const
+    {
+        return !has_reception_state() && pending_state_changes <= 0 && !response_pending;
+    }
+};
+
 /// A "filter" for IGMP packets. It decides which addresses are listened to and which are not.
+///
+/// A host that proxies thousands of groups walks all of them to build its reports,
+/// so the groups are kept in a dense vector that is iterated contiguously. A hash
+/// table maps multicast addresses to indices in that vector. Groups that no longer
+/// have reception state stay in the vector for as long as reports about them are
+/// pending, and are then swapped out by forget_if_idle.
 class IgmpMemberFilter
 {
   public:
-    /// Returns a pointer to the record for the given multicast address, or null if it is not found.
+    typedef typename Vector<IgmpMemberGroupState>::const_iterator iterator;
+    typedef typename Vector<IgmpMemberGroupState>::const_iterator const_iterator;
+
+    /// Returns a pointer to the record for the given multicast address, or null if the
+    /// filter has no reception state for it.
     const IgmpFilterRecord *get_record_or_null(const IPAddress &multicast_address) const
     {
-        return records.findp(multicast_address);
+        auto group_ptr = find(multicast_address);
+        return group_ptr != nullptr && group_ptr->has_reception_state() ? &group_ptr->record : nullptr;
     }
 
-    typedef typename HashMap<IPAddress, IgmpFilterRecord>::const_iterator iterator;
-    typedef typename HashMap<IPAddress, IgmpFilterRecord>::const_iterator const_iterator;
-
-    /// Gets a constant iterator to the start of this filter's records.
+    /// Gets a constant iterator to the start of this filter's groups, including the
+    /// groups without reception state that have yet to be forgotten.
     const_iterator begin() const
     {
-        return records.begin();
+        return groups.begin();
     }
 
-    /// Gets a constant iterator to the end of this filter's records.
+    /// Gets a constant iterator to the end of this filter's groups.
     const_iterator end() const
     {
-        return records.end();
+        return groups.end();
+    }
+
+    /// Gets the number of groups in this filter, including the groups without
+    /// reception state that have yet to be forgotten.
+    int size() const { return groups.size(); }
+
+    /// Gets the group at the given index.
+    IgmpMemberGroupState &operator[](int index) { return groups[index]; }
+    const IgmpMemberGroupState &operator[](int index) const { return groups[index]; }
+
+    /// Finds the state for the given multicast address, or returns null if there is none.
+    IgmpMemberGroupState *find(const IPAddress &multicast_address)
+    {
+        auto index_ptr = positions.findp(multicast_address);
+        return index_ptr == nullptr ? nullptr : &groups[*index_ptr];
+    }
+
+    /// Finds the state for the given multicast address, or returns null if there is none.
+    const IgmpMemberGroupState *find(const IPAddress &multicast_address) const
+    {
+        auto index_ptr = positions.findp(multicast_address);
+        return index_ptr == nullptr ? nullptr : &groups[*index_ptr];
+    }
+
+    /// Finds the state for the given multicast address, and creates it if there is none.
+    IgmpMemberGroupState &find_or_insert(const IPAddress &multicast_address)
+    {
+        auto index_ptr = positions.findp(multicast_address);
+        if (index_ptr != nullptr)
+        {
+            return groups[*index_ptr];
+        }
+
+        positions.insert(multicast_address, groups.size());
+        groups.push_back(IgmpMemberGroupState(multicast_address));
+        return groups.back();
+    }
+
+    /// Forgets the group at the given index if it is idle, by moving the last group
+    /// into its place. A Boolean result tells if the group was forgotten. Groups
+    /// after the given index are unaffected, so a loop that forgets groups while it
+    /// walks the filter should walk it back to front.
+    bool forget_if_idle(int index)
+    {
+        if (!groups[index].is_idle())
+        {
+            return false;
+        }
+
+        positions.erase(groups[index].multicast_address);
+        if (index != groups.size() - 1)
+        {
+            groups[index] = groups.back();
+            positions[groups[index].multicast_address] = index;
+        }
+        groups.pop_back();
+        return true;
+    }
+
+    /// Forgets the group with the given multicast address if it is idle. A Boolean
+    /// result tells if the group was forgotten.
+    bool forget_if_idle(const IPAddress &multicast_address)
+    {
+        auto index_ptr = positions.findp(multicast_address);
+        return index_ptr != nullptr && forget_if_idle(*index_ptr);
     }
 
     /// Listens to the given multicast address. A list of source addresses are either explicitly included
@@ -175,37 +303,39 @@ class IgmpMemberFilter
         //       the requested filter mode and source list. If no such entry is
         //       present, a new entry is created, using the parameters specified in
         //       the request.
+        //
+        // A deleted entry is represented by a group in INCLUDE mode without any
+        // sources, which the caller forgets once it no longer needs it.
 
         if (filter_mode == IgmpFilterMode::Include && source_addresses.size() == 0)
         {
-            if (records.findp(multicast_address) == nullptr)
+            auto group_ptr = find(multicast_address);
+            if (group_ptr == nullptr || !group_ptr->has_reception_state())
             {
                 return false;
             }
             else
             {
-                records.erase(multicast_address);
+                group_ptr->record = create_igmp_leave_record();
                 return true;
             }
         }
 
         bool has_changed = false;
-        IgmpFilterRecord *record_ptr = records.findp(multicast_address);
-        if (record_ptr == nullptr)
+        auto &group = find_or_insert(multicast_address);
+        if (!group.has_reception_state())
         {
-            records.insert(multicast_address, IgmpFilterRecord());
-            record_ptr = records.findp(multicast_address);
             has_changed = true;
         }
-        if (record_ptr->filter_mode != filter_mode)
+        if (group.record.filter_mode != filter_mode)
         {
-            record_ptr->filter_mode = filter_mode;
+            group.record.filter_mode = filter_mode;
             has_changed = true;
         }
-        
-        if (!set_equality_vectors(record_ptr->source_addresses, source_addresses))
+
+        if (!set_equality_vectors(group.record.source_addresses, source_addresses))
         {
-            record_ptr->source_addresses = source_addresses;
+            group.record.source_addresses = source_addresses;
             has_changed = true;
         }
 
@@ -250,7 +380,7 @@ class IgmpMemberFilter
             return true;
         }
 
-        IgmpFilterRecord *record_ptr = records.findp(multicast_address);
+        auto record_ptr = get_record_or_null(multicast_address);
         if (record_ptr == nullptr)
         {
             return false;
@@ -261,7 +391,11 @@ class IgmpMemberFilter
     }
 
   private:
-    HashMap<IPAddress, IgmpFilterRecord> records;
+    /// The groups, in no particular order.
+    Vector<IgmpMemberGroupState> groups;
+
+    /// The index of every group in the groups vector, by multicast address.
+    HashMap<IPAddress, int> positions;
 };
 
 CLICK_ENDDECLS
\ No newline at end of file
@@ -30,6 +30,43 @@ const uint8_t igmp_membership_query_type = 0x11;
 /// The type of IGMP version 3 membership report messages.
 const uint8_t igmp_v3_membership_report_type = 0x22;
 
+/// Computes the value of a floating-point IGMP code, i.e., of a code of 128 or
+/// more. See `igmp_code_to_value'.
+constexpr unsigned int igmp_float_code_to_value(uint8_t code)
+{
+    return ((code & 0x0F) | 0x10) << (((code >> 4) & 0x07) + 3);
+}
+
+#define IGMP_FLOAT_CODE_VALUE(exp, mant) igmp_float_code_to_value(0x80 | ((exp) << 4) | (mant))
+#define IGMP_FLOAT_CODE_ROW(exp)                                                                               \
+    IGMP_FLOAT_CODE_VALUE(exp, 0), IGMP_FLOAT_CODE_VALUE(exp, 1), IGMP_FLOAT_CODE_VALUE(exp, 2),               \
+        IGMP_FLOAT_CODE_VALUE(exp, 3), IGMP_FLOAT_CODE_VALUE(exp, 4), IGMP_FLOAT_CODE_VALUE(exp, 5),           \
+        IGMP_FLOAT_CODE_VALUE(exp, 6), IGMP_FLOAT_CODE_VALUE(exp, 7), IGMP_FLOAT_CODE_VALUE(exp, 8),           \
+        IGMP_FLOAT_CODE_VALUE(exp, 9), IGMP_FLOAT_CODE_VALUE(exp, 10), IGMP_FLOAT_CODE_VALUE(exp, 11),         \
+        IGMP_FLOAT_CODE_VALUE(exp, 12), IGMP_FLOAT_CODE_VALUE(exp, 13), IGMP_FLOAT_CODE_VALUE(exp, 14),        \
+        IGMP_FLOAT_CODE_VALUE(exp, 15)
+
+/// The values of all floating-point IGMP codes, 128 through 255, computed at
+/// compile time. A code's value grows with its exponent first and its mantissa
+/// second, so the table is sorted. It's a template only so that its definition
+/// can live in this header.
+template <typename T = void>
+struct IgmpFloatCodeTable
+{
+    static constexpr unsigned int values[128] = {
+        IGMP_FLOAT_CODE_ROW(0), IGMP_FLOAT_CODE_ROW(1), IGMP_FLOAT_CODE_ROW(2), IGMP_FLOAT_CODE_ROW(3),
+        IGMP_FLOAT_CODE_ROW(4), IGMP_FLOAT_CODE_ROW(5), IGMP_FLOAT_CODE_ROW(6), IGMP_FLOAT_CODE_ROW(7)};
+};
+
+template <typename T>
+constexpr unsigned int IgmpFloatCodeTable<T>::values[128];
+
+#undef IGMP_FLOAT_CODE_ROW
+#undef IGMP_FLOAT_CODE_VALUE
+
+static_assert(IgmpFloatCodeTable<>::values[0] == 128, "the smallest floating-point code must be worth 128");
+static_assert(IgmpFloatCodeTable<>::values[127] == 31744, "the largest floating-point code must be worth 31744");
+
 /// Converts an IGMP code to an integer value as follows:
 ///
 ///     * If Code < 128, return Code
@@ -43,6 +80,8 @@ const uint8_t igmp_v3_membership_report_type = 0x22;
 ///       +-+-+-+-+-+-+-+-+
 ///
 ///       return (mant | 0x10) << (exp + 3)
+///
+/// Floating-point codes are looked up in a precomputed table.
 inline unsigned int igmp_code_to_value(uint8_t code)
 {
     if (code < 128)
@@ -51,9 +90,7 @@ inline unsigned int igmp_code_to_value(uint8_t code)
     }
     else
     {
-        unsigned int mantissa = code & 0x0F;
-        unsigned int exponent = code & 0x70;
-        return (mantissa | 0x10) << (exponent + 3);
+        return IgmpFloatCodeTable<>::values[code - 128];
     }
 }
 
@@ -68,15 +105,9 @@ inline uint8_t igmp_value_to_code(unsigned int value)
     }
     else
     {
-        // Values in the [128, 255] range are harder.
-        // I'm betting they're also pretty rare, and that lower (~128)
-        // values are more common than higher (~255) values.
-        //
-        // So we can use following trivial algorithm: we iterate over
-        // all possible codes, compute the value for each code and pick
-        // either the code with a value that is equal to the value
-        // we want to generate a code for, or the code with the next
-        // lower value.
+        // Values of 128 and up need a floating-point code. We pick either the
+        // code with a value that is equal to the value we want to generate a code
+        // for, or the code with the next lower value.
         //
         // The next lower value rule is derived from this paragraph from
         // the spec:
@@ -84,17 +115,24 @@ inline uint8_t igmp_value_to_code(unsigned int value)
         //     When converting a configured time to a Max Resp Code
         //     value, it is recommended to use the exact value if possible, or the
         //     next lower value if the requested value is not exactly representable.
-
-        for (uint8_t code = 128; code < 255; code++)
+        //
+        // The table of code values is sorted, so a binary search finds that code
+        // in seven steps. Values beyond the largest code's value get the largest
+        // code.
+        const unsigned int *values = IgmpFloatCodeTable<>::values;
+        int low = 0;
+        int high = 128;
+        while (high - low > 1)
         {
-            auto code_val = igmp_code_to_value(code);
-            if (code_val == value)
-                return code;
-            else if (code_val > value)
-                return code - 1;
+            // values[low] <= value always holds, and values[high] > value holds
+            // if high is a valid index.
+            int middle = (low + high) / 2;
+            if (values[middle] <= value)
+                low = middle;
+            else
+                high = middle;
         }
-        // Return the highest code.
-        return 255;
+        return (uint8_t)(128 + low);
     }
 }
 
@@ -251,7 +289,25 @@ enum class IgmpV3GroupRecordType : uint8_t
     /// in this Group Record contain the interface’s new
     /// source list for the specified multicast address,
     /// if it is non-empty.
-    ChangeToExcludeMode = 4
+    ChangeToExcludeMode = 4,
+
+    /// ALLOW_NEW_SOURCES - indicates that the Source Address [i]
+    /// fields in this Group Record contain a list of the additional
+    /// sources that the system wishes to hear from, for packets sent
+    /// to the specified multicast address. If the change was to an
+    /// INCLUDE source list, these are the addresses that were added
+    /// to the list; if the change was to an EXCLUDE source list, these
+    /// are the addresses that were deleted from the list.
+    AllowNewSources = 5,
+
+    /// BLOCK_OLD_SOURCES - indicates that the Source Address [i]
+    /// fields in this Group Record contain a list of the sources
+    /// that the system no longer wishes to hear from, for packets
+    /// sent to the specified multicast address. If the change was
+    /// to an INCLUDE source list, these are the addresses that were
+    /// deleted from the list; if the change was to an EXCLUDE source
+    /// list, these are the addresses that were added to the list.
+    BlockOldSources = 6
 };
 
 /// Describes the header of group record in a membership report.
@@ -285,6 +341,66 @@ struct IgmpV3GroupRecordHeader
     }
 } CLICK_SIZE_PACKED_ATTRIBUTE;
 
+/// A non-owning view of a list of source addresses in an IGMP message. The addresses
+/// are read straight from the message's bytes, which need not be aligned.
+class IgmpSourceSpan final
+{
+  public:
+    /// An iterator over the addresses in a source span.
+    class const_iterator final
+    {
+      public:
+        const_iterator(const unsigned char *data)
+            : data(data)
+        {
+        }
+
+        IPAddress operator*() const
+        {
+            uint32_t addr;
+            memcpy(&addr, data, sizeof(addr));
+            return IPAddress(addr);
+        }
+
+        const_iterator &operator++()
+        {
+            data += sizeof(uint32_t);
+            return *this;
+        }
+
+        bool operator==(const const_iterator &other) const { return data == other.data; }
+        bool operator!=(const const_iterator &other) const { return data != other.data; }
+
+      private:
+        const unsigned char *data;
+    };
+
+    IgmpSourceSpan()
+        : data(nullptr), count(0)
+    {
+    }
+
+    IgmpSourceSpan(const unsigned char *data, int count)
+        : data(data), count(count)
+    {
+    }
+
+    int size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    IPAddress operator[](int index) const
+    {
+        return *const_iterator(data + index * sizeof(uint32_t));
+    }
+
+    const_iterator begin() const { return const_iterator(data); }
+    const_iterator end() const { return const_iterator(data + count * sizeof(uint32_t)); }
+
+  private:
+    const unsigned char *data;
+    int count;
+};
+
 /// Gets the type of the given IGMP packet.
 inline uint8_t get_igmp_message_type(const unsigned char *data)
 {
@@ -298,6 +414,20 @@ inline bool is_igmp_membership_query(const unsigned char *data)
     return get_igmp_message_type(data) == igmp_membership_query_type;
 }
 
+/// Tests if the given IGMP packet, of the given size, is an IGMP membership query
+/// that is long enough to hold its header and all of its source addresses, so
+/// that IgmpMembershipQuery::read can't read past its end.
+inline bool is_complete_igmp_membership_query(const unsigned char *data, size_t size)
+{
+    if (size < sizeof(IgmpMembershipQueryHeader) || !is_igmp_membership_query(data))
+    {
+        return false;
+    }
+
+    auto header = reinterpret_cast<const IgmpMembershipQueryHeader *>(data);
+    return size - sizeof(IgmpMembershipQueryHeader) >= (size_t)ntohs(header->number_of_sources) * sizeof(uint32_t);
+}
+
 /// Tests if the given IGMP packet is an IGMPv3 membership report.
 inline bool is_igmp_v3_membership_report(const unsigned char *data)
 {
@@ -320,14 +450,84 @@ inline uint16_t get_igmp_checksum(const unsigned char *data)
     return header->checksum;
 }
 
+/// Adds the given data to a running 64-bit one's complement sum. The data is read
+/// as 32-bit words in native byte order, which allows for about four billion words
+/// to be summed before the accumulator can overflow; the carries are folded back in
+/// by fold_ones_complement_sum. Summing native words yields the same result
+/// as summing 16-bit words in network byte order, once folded and stored.
+inline uint64_t add_ones_complement_sum(uint64_t sum, const unsigned char *data, size_t size)
+{
+    // Four words per iteration gives the compiler some room to vectorize.
+    while (size >= 16)
+    {
+        uint32_t words[4];
+        memcpy(words, data, sizeof(words));
+        sum += (uint64_t)words[0] + words[1] + words[2] + words[3];
+        data += 16;
+        size -= 16;
+    }
+    while (size >= 4)
+    {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        sum += word;
+        data += 4;
+        size -= 4;
+    }
+    if (size >= 2)
+    {
+        uint16_t half_word;
+        memcpy(&half_word, data, sizeof(half_word));
+        sum += half_word;
+        data += 2;
+        size -= 2;
+    }
+    if (size == 1)
+    {
+        // A trailing odd byte is padded with a zero byte, as in click_in_cksum.
+        uint16_t half_word = 0;
+        memcpy(&half_word, data, 1);
+        sum += half_word;
+    }
+    return sum;
+}
+
+/// Folds a 64-bit one's complement sum into 16 bits.
+inline uint16_t fold_ones_complement_sum(uint64_t sum)
+{
+    sum = (sum & 0xffffffffu) + (sum >> 32);
+    sum = (sum & 0xffffffffu) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
 /// Computes and returns an IGMP checksum for the IGMP message with the given data and size.
+/// The checksum field is treated as zero. This does not modify or copy the message.
 inline uint16_t compute_igmp_checksum(const unsigned char *data, size_t size)
 {
-    unsigned char *data_copy = new unsigned char[size];
-    memcpy(data_copy, data, size);
-    uint16_t result = update_igmp_checksum(data_copy, size);
-    delete[] data_copy;
-    return result;
+    if (size < 4)
+    {
+        return (uint16_t)~fold_ones_complement_sum(add_ones_complement_sum(0, data, size));
+    }
+
+    // The checksum lives in the second half of the first word. Skip it.
+    uint64_t sum = add_ones_complement_sum(0, data, 2);
+    sum = add_ones_complement_sum(sum, data + 4, size - 4);
+    return (uint16_t)~fold_ones_complement_sum(sum);
+}
+
+/// Tests if the IGMP message with the given data and size has a valid checksum. A message's
+/// one's complement sum, checksum included, is all ones if and only if its checksum is valid.
+inline bool is_igmp_checksum_valid(const unsigned char *data, size_t size)
+{
+    if (size < sizeof(uint32_t))
+    {
+        return false;
+    }
+
+    return fold_ones_complement_sum(add_ones_complement_sum(0, data, size)) == 0xffff;
 }
 
 CLICK_ENDDECLS
\ No newline at end of file
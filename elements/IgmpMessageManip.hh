@@ -1,11 +1,98 @@
 #pragma once
 
 #include <click/config.h>
+#include <stddef.h>
+#include <algorithm>
 #include "IgmpMemberFilter.hh"
 #include "IgmpMessage.hh"
 
 CLICK_DECLS
 
+/// Writes an IGMP message to a buffer and accumulates the message's checksum
+/// along the way, so the message doesn't need to be walked again once it has
+/// been written. Every write must have an even size, which all IGMP fields do.
+class IgmpMessageWriter final
+{
+  public:
+    /// Creates a writer for an IGMP message that starts at the given address.
+    IgmpMessageWriter(unsigned char *buffer)
+        : start(buffer), position(buffer), sum(0)
+    {
+    }
+
+    /// Writes the given bytes to the message.
+    void write(const void *data, size_t size)
+    {
+        memcpy(position, data, size);
+        sum = add_ones_complement_sum(sum, position, size);
+        position += size;
+    }
+
+    /// Writes the given header or field to the message.
+    template <typename T>
+    void write(const T &value)
+    {
+        write(&value, sizeof(T));
+    }
+
+    /// Writes the given address to the message.
+    void write_address(const IPAddress &address)
+    {
+        uint32_t addr = address.addr();
+        write(&addr, sizeof(addr));
+    }
+
+    /// Stores the accumulated checksum in the message's checksum field, which
+    /// must have been written as zero. The address just past the last byte of
+    /// the message is returned.
+    unsigned char *finish()
+    {
+        uint16_t checksum = (uint16_t)~fold_ones_complement_sum(sum);
+        memcpy(start + offsetof(IgmpV3MembershipReportHeader, checksum), &checksum, sizeof(checksum));
+        return position;
+    }
+
+    /// Gets the address just past the last byte that has been written.
+    unsigned char *get_position() const { return position; }
+
+  private:
+    unsigned char *start;
+    unsigned char *position;
+    uint64_t sum;
+};
+
+/// Gets a human-readable description of the given group record type.
+inline String get_igmp_v3_group_record_type_string(IgmpV3GroupRecordType type)
+{
+    switch (type)
+    {
+    case IgmpV3GroupRecordType::ModeIsInclude:
+        return "mode-is-include";
+    case IgmpV3GroupRecordType::ModeIsExclude:
+        return "mode-is-exclude";
+    case IgmpV3GroupRecordType::ChangeToIncludeMode:
+        return "change-to-include";
+    case IgmpV3GroupRecordType::ChangeToExcludeMode:
+        return "change-to-exclude";
+    case IgmpV3GroupRecordType::AllowNewSources:
+        return "allow-new-sources";
+    case IgmpV3GroupRecordType::BlockOldSources:
+        return "block-old-sources";
+    default:
+        return "unknown (0x" + String::make_numeric((String::uint_large_t)type, 16) + ")";
+    }
+}
+
+/// Gets a human-readable description of a group record with the given contents.
+inline String igmp_v3_group_record_to_string(
+    IgmpV3GroupRecordType type, const IPAddress &multicast_address, int number_of_sources)
+{
+    return "IGMPv3 group record: type: " +
+           get_igmp_v3_group_record_type_string(type) + ", multicast address: " +
+           multicast_address.unparse() + ", " +
+           String(number_of_sources) + " source addresses.";
+}
+
 /// Represents a parsed IGMP version 3 group record with no auxiliary data.
 struct IgmpV3GroupRecord
 {
@@ -63,6 +150,14 @@ struct IgmpV3GroupRecord
     /// Writes this record to the given buffer.
     /// The address just past the last byte of the record is returned.
     unsigned char *write(unsigned char *buffer) const
+    {
+        IgmpMessageWriter writer(buffer);
+        write(writer);
+        return writer.get_position();
+    }
+
+    /// Writes this record to the given message writer.
+    void write(IgmpMessageWriter &writer) const
     {
         // Create a header.
         IgmpV3GroupRecordHeader header;
@@ -70,18 +165,12 @@ struct IgmpV3GroupRecord
         header.number_of_sources = htons(source_addresses.size());
         header.multicast_address = multicast_address.addr();
 
-        // Write the header to the buffer.
-        *((IgmpV3GroupRecordHeader *)buffer) = header;
-        buffer += sizeof(IgmpV3GroupRecordHeader);
-
-        // Write the source addresses.
+        // Write the header and the source addresses.
+        writer.write(header);
         for (const auto &ip_address : source_addresses)
         {
-            *((uint32_t *)buffer) = ip_address.addr();
-            buffer += sizeof(uint32_t);
+            writer.write_address(ip_address);
         }
-
-        return buffer;
     }
 
     /// Reads an IGMP version 3 group record from the given buffer and advances
@@ -114,27 +203,12 @@ struct IgmpV3GroupRecord
 
     String get_type_string() const
     {
-        switch (type)
-        {
-        case IgmpV3GroupRecordType::ModeIsInclude:
-            return "mode-is-include";
-        case IgmpV3GroupRecordType::ModeIsExclude:
-            return "mode-is-exclude";
-        case IgmpV3GroupRecordType::ChangeToIncludeMode:
-            return "change-to-include";
-        case IgmpV3GroupRecordType::ChangeToExcludeMode:
-            return "change-to-exclude";
-        default:
-            return "unknown (0x" + String::make_numeric((String::uint_large_t)type, 16) + ")";
-        }
+        return get_igmp_v3_group_record_type_string(type);
     }
 
     String to_string() const
     {
-        return "IGMPv3 group record: type: " +
-               get_type_string() + ", multicast address: " +
-               multicast_address.unparse() + ", " +
-               String(source_addresses.size()) + " source addresses.";
+        return igmp_v3_group_record_to_string(type, multicast_address, source_addresses.size());
     }
 };
 
@@ -155,8 +229,8 @@ struct IgmpV3MembershipReport
         return result;
     }
 
-    /// Writes this record to the given buffer.
-    /// The address just past the last byte of the record is returned.
+    /// Writes this report to the given buffer, checksum included.
+    /// The address just past the last byte of the report is returned.
     unsigned char *write(unsigned char *buffer) const
     {
         // Create a header.
@@ -164,17 +238,15 @@ struct IgmpV3MembershipReport
         header.type = igmp_v3_membership_report_type;
         header.number_of_group_records = htons(group_records.size());
 
-        // Write the header to the buffer.
-        *((IgmpV3MembershipReportHeader *)buffer) = header;
-        buffer += sizeof(IgmpV3MembershipReportHeader);
-
-        // Write the group records.
+        // Write the header and the group records.
+        IgmpMessageWriter writer(buffer);
+        writer.write(header);
         for (const auto &record : group_records)
         {
-            record.write(buffer);
+            record.write(writer);
         }
 
-        return buffer;
+        return writer.finish();
     }
 
     /// Reads an IGMP version 3 group record from the given buffer and advances
@@ -198,6 +270,259 @@ struct IgmpV3MembershipReport
     }
 };
 
+/// The number of bytes an IPv4 header with a Router Alert option takes up. IGMP
+/// messages have to fit in an MTU along with this header.
+const size_t igmp_ip_header_size = 24;
+
+/// Splits the given report into as few reports as possible that are each at most
+/// the given size in bytes.
+///
+/// According to the spec:
+///
+///     If the set of Group Records required in a Report does not fit within
+///     the size limit of a single Report message (as determined by the MTU
+///     of the network on which it will be sent), the Group Records are sent
+///     in as many Report messages as needed to report the entire set.
+///
+///     If a single Group Record contains so many source addresses that it
+///     does not fit within the size limit of a single Report message, if its
+///     Type is not MODE_IS_EXCLUDE or CHANGE_TO_EXCLUDE_MODE, it is split
+///     into multiple Group Records, each containing a different subset of
+///     the source addresses and each sent in a separate Report message. If
+///     its Type is MODE_IS_EXCLUDE or CHANGE_TO_EXCLUDE_MODE, a single Group
+///     Record is sent, containing as many source addresses as can fit, and
+///     the remaining source addresses are not reported; though the choice of
+///     which sources to report is arbitrary, it is preferable to report the
+///     same set of sources in each subsequent report, rather than reporting
+///     different sources each time.
+///
+/// Group records that fit in a report are never split. They are packed into
+/// reports using the first-fit decreasing heuristic, which is within a small
+/// factor of the optimal packing and usually finds it outright.
+inline void split_igmp_v3_membership_report(
+    const IgmpV3MembershipReport &report,
+    size_t max_report_size,
+    Vector<IgmpV3MembershipReport> &results)
+{
+    size_t capacity = max_report_size - sizeof(IgmpV3MembershipReportHeader);
+    int max_sources = (capacity - sizeof(IgmpV3GroupRecordHeader)) / sizeof(uint32_t);
+    assert(max_sources > 0);
+
+    // Split or truncate group records that are too large to fit in a report.
+    Vector<IgmpV3GroupRecord> pieces;
+    for (const auto &record : report.group_records)
+    {
+        if (record.get_size() <= capacity)
+        {
+            pieces.push_back(record);
+            continue;
+        }
+
+        bool is_exclude = record.type == IgmpV3GroupRecordType::ModeIsExclude
+            || record.type == IgmpV3GroupRecordType::ChangeToExcludeMode;
+        int source_count = record.source_addresses.size();
+        for (int start = 0; start < source_count; start += max_sources)
+        {
+            IgmpV3GroupRecord piece;
+            piece.type = record.type;
+            piece.multicast_address = record.multicast_address;
+            for (int i = start; i < source_count && i < start + max_sources; i++)
+            {
+                piece.source_addresses.push_back(record.source_addresses[i]);
+            }
+            pieces.push_back(piece);
+
+            if (is_exclude)
+            {
+                // Only the first batch of sources is reported.
+                break;
+            }
+        }
+    }
+
+    // Pack the pieces, largest first, into the first report that has room for them.
+    Vector<int> order;
+    for (int i = 0; i < pieces.size(); i++)
+    {
+        order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&pieces](int left, int right) {
+        return pieces[left].get_size() > pieces[right].get_size();
+    });
+
+    int first_result = results.size();
+    Vector<size_t> remaining;
+    for (int index : order)
+    {
+        const auto &piece = pieces[index];
+        size_t size = piece.get_size();
+        int bin = 0;
+        while (bin < remaining.size() && remaining[bin] < size)
+        {
+            bin++;
+        }
+        if (bin == remaining.size())
+        {
+            results.push_back(IgmpV3MembershipReport());
+            remaining.push_back(capacity);
+        }
+        results[first_result + bin].group_records.push_back(piece);
+        remaining[bin] -= size;
+    }
+}
+
+/// A non-owning, bounds-checked view of a group record in an IGMP version 3
+/// membership report. Unlike IgmpV3GroupRecord, a view does not copy the record's
+/// source addresses out of the packet.
+class IgmpV3GroupRecordView final
+{
+  public:
+    IgmpV3GroupRecordView()
+        : header()
+    {
+    }
+
+    IgmpV3GroupRecordView(const IgmpV3GroupRecordHeader *header)
+        : header(header)
+    {
+    }
+
+    /// Gets the record type.
+    IgmpV3GroupRecordType get_type() const { return header->type; }
+
+    /// Gets the record's multicast address.
+    IPAddress get_multicast_address() const { return IPAddress(header->multicast_address); }
+
+    /// Gets the record's list of source addresses.
+    IgmpSourceSpan get_source_addresses() const
+    {
+        return IgmpSourceSpan(
+            reinterpret_cast<const unsigned char *>(header + 1),
+            ntohs(header->number_of_sources));
+    }
+
+    /// Tests if this IGMP version 3 group record indicates a change.
+    bool is_change() const
+    {
+        return get_type() != IgmpV3GroupRecordType::ModeIsInclude
+            && get_type() != IgmpV3GroupRecordType::ModeIsExclude;
+    }
+
+    /// Gets the size of this record, in bytes.
+    size_t get_size() const
+    {
+        return sizeof(IgmpV3GroupRecordHeader) + header->get_payload_size();
+    }
+
+    String to_string() const
+    {
+        return igmp_v3_group_record_to_string(get_type(), get_multicast_address(), get_source_addresses().size());
+    }
+
+    /// Copies this view into a group record.
+    IgmpV3GroupRecord to_record() const
+    {
+        IgmpV3GroupRecord result;
+        result.type = get_type();
+        result.multicast_address = get_multicast_address();
+        for (const auto &address : get_source_addresses())
+        {
+            result.source_addresses.push_back(address);
+        }
+        return result;
+    }
+
+  private:
+    const IgmpV3GroupRecordHeader *header;
+};
+
+/// A non-owning, bounds-checked view of an IGMP version 3 membership report.
+/// Iterating over a view yields the report's group records in place. Group
+/// records that do not fit in the message, and everything after them, are
+/// never visited.
+class IgmpV3MembershipReportView final
+{
+  public:
+    /// An iterator over the group records in a membership report view.
+    class const_iterator final
+    {
+      public:
+        const_iterator(const unsigned char *data)
+            : data(data)
+        {
+        }
+
+        IgmpV3GroupRecordView operator*() const
+        {
+            return IgmpV3GroupRecordView(reinterpret_cast<const IgmpV3GroupRecordHeader *>(data));
+        }
+
+        const_iterator &operator++()
+        {
+            data += (**this).get_size();
+            return *this;
+        }
+
+        bool operator==(const const_iterator &other) const { return data == other.data; }
+        bool operator!=(const const_iterator &other) const { return data != other.data; }
+
+      private:
+        const unsigned char *data;
+    };
+
+    /// Creates a view of the IGMP version 3 membership report with the given data
+    /// and size. The group records are checked against the message's size right away.
+    IgmpV3MembershipReportView(const unsigned char *data, size_t size)
+        : records_begin(data), records_end(data), group_record_count(0), truncated(false)
+    {
+        if (size < sizeof(IgmpV3MembershipReportHeader))
+        {
+            truncated = true;
+            return;
+        }
+
+        auto header_ptr = reinterpret_cast<const IgmpV3MembershipReportHeader *>(data);
+        uint16_t number_of_group_records = ntohs(header_ptr->number_of_group_records);
+        const unsigned char *end = data + size;
+        records_begin = data + sizeof(IgmpV3MembershipReportHeader);
+        records_end = records_begin;
+        for (uint16_t i = 0; i < number_of_group_records; i++)
+        {
+            if ((size_t)(end - records_end) < sizeof(IgmpV3GroupRecordHeader))
+            {
+                truncated = true;
+                break;
+            }
+
+            size_t record_size = IgmpV3GroupRecordView(
+                reinterpret_cast<const IgmpV3GroupRecordHeader *>(records_end)).get_size();
+            if ((size_t)(end - records_end) < record_size)
+            {
+                truncated = true;
+                break;
+            }
+
+            records_end += record_size;
+            group_record_count++;
+        }
+    }
+
+    /// Gets the number of complete group records in the report.
+    int size() const { return group_record_count; }
+
+    /// Tells if the report claims to have more group records than fit in the message.
+    bool is_truncated() const { return truncated; }
+
+    const_iterator begin() const { return const_iterator(records_begin); }
+    const_iterator end() const { return const_iterator(records_end); }
+
+  private:
+    const unsigned char *records_begin;
+    const unsigned char *records_end;
+    int group_record_count;
+    bool truncated;
+};
+
 /// Flags for IGMP membership queries.
 struct IgmpMembershipQueryFlags
 {
@@ -306,8 +631,8 @@ struct IgmpMembershipQuery
         return sizeof(IgmpMembershipQueryHeader) + source_addresses.size() * sizeof(uint32_t);
     }
 
-    /// Writes this query to the given buffer.
-    /// The address just past the last byte of the record is returned.
+    /// Writes this query to the given buffer, checksum included.
+    /// The address just past the last byte of the query is returned.
     unsigned char *write(unsigned char *buffer) const
     {
         // Create a header.
@@ -322,18 +647,15 @@ struct IgmpMembershipQuery
         header.query_interval_code = igmp_value_to_code(query_interval);
         header.number_of_sources = htons(source_addresses.size());
 
-        // Write the header to the buffer.
-        *((IgmpMembershipQueryHeader *)buffer) = header;
-        buffer += sizeof(IgmpMembershipQueryHeader);
-
-        // Write the source addresses.
+        // Write the header and the source addresses.
+        IgmpMessageWriter writer(buffer);
+        writer.write(header);
         for (const auto &ip_address : source_addresses)
         {
-            *((uint32_t *)buffer) = ip_address.addr();
-            buffer += sizeof(uint32_t);
+            writer.write_address(ip_address);
         }
 
-        return buffer;
+        return writer.finish();
     }
 
     /// Reads an IGMP membership query from the given buffer and advances
@@ -0,0 +1,154 @@
+#include "IgmpMulticastForwarder.hh"
+
+#include <click/config.h>
+#include <click/confparse.hh>
+#include <click/error.hh>
+#include <click/master.hh>
+#include <click/packet_anno.hh>
+#include <click/straccum.hh>
+#include <clicknet/ip.h>
+#include "IgmpForwardingIndex.hh"
+#include "IgmpRouter.hh"
+
+CLICK_DECLS
+
+IgmpMulticastForwarder::IgmpMulticastForwarder()
+{
+}
+
+IgmpMulticastForwarder::~IgmpMulticastForwarder()
+{
+}
+
+int IgmpMulticastForwarder::configure(Vector<String> &conf, ErrorHandler *errh)
+{
+    Element *router_element = nullptr;
+    if (cp_va_kparse(conf, this, errh, "ROUTER", cpkP + cpkM, cpElement, &router_element, cpEnd) < 0)
+        return -1;
+
+    router = (IgmpRouter *)router_element->cast("IgmpRouter");
+    if (router == nullptr)
+        return errh->error("ROUTER must be an IgmpRouter");
+    return 0;
+}
+
+int IgmpMulticastForwarder::initialize(ErrorHandler *)
+{
+    stats.forwarded.initialize(master()->nthreads());
+    stats.dropped.initialize(master()->nthreads());
+    stats.copies.initialize(master()->nthreads());
+    return 0;
+}
+
+void IgmpMulticastForwarder::push(int, Packet *packet)
+{
+    const click_ip *ip_header = packet->ip_header();
+    IPAddress multicast_address(ip_header->ip_dst);
+
+    // The Local Network Control Block, 224.0.0.0/24, is meant for protocol
+    // traffic on a single network (RFC 5771), so it's never forwarded. This
+    // covers 224.0.0.1 and 224.0.0.22, which every interface listens to.
+    IgmpSlotMask mask;
+    if ((ntohl(multicast_address.addr()) & 0xFFFFFF00) != 0xE0000000)
+    {
+        mask = router->get_forwarding_mask(multicast_address, ip_header->ip_src);
+    }
+
+    // Hosts on the network that the packet arrived on have already received it.
+    // Every paint annotation names a slot, so this needs no bounds check.
+    mask.reset(PAINT_ANNO(packet));
+
+    // A forwarded packet must have a TTL of at least one after it's been
+    // decremented. Multicast packets whose TTL runs out are dropped silently:
+    // ICMP errors are never sent in response to multicast packets (RFC 1812).
+    int iface = mask.find_next(0);
+    if (iface < 0 || ip_header->ip_ttl <= 1)
+    {
+        stats.dropped.increment();
+        output(1).push(packet);
+        return;
+    }
+
+    WritablePacket *writable = packet->uniqueify();
+    if (writable == nullptr)
+    {
+        return;
+    }
+
+    // Decrement the TTL and update the checksum incrementally, as DecIPTTL does.
+    // The TTL is the high byte of its 16-bit word, so the word goes down by 0x100,
+    // and the checksum goes up by as much (RFC 1624).
+    click_ip *writable_header = writable->ip_header();
+    writable_header->ip_ttl--;
+    uint32_t sum = (~ntohs(writable_header->ip_sum) & 0xFFFF) + 0xFEFF;
+    writable_header->ip_sum = ~htons(sum + (sum >> 16));
+
+    stats.forwarded.increment();
+    while (iface >= 0)
+    {
+        // The last interface gets the packet itself, so a packet that is forwarded
+        // onto a single interface isn't cloned at all.
+        int next_iface = mask.find_next(iface + 1);
+        Packet *copy = next_iface >= 0 ? writable->clone() : writable;
+        if (copy != nullptr)
+        {
+            SET_PAINT_ANNO(copy, iface);
+            stats.copies.increment();
+            output(0).push(copy);
+        }
+        iface = next_iface;
+    }
+}
+
+enum
+{
+    h_forwarded,
+    h_dropped,
+    h_copies,
+    h_stats
+};
+
+String IgmpMulticastForwarder::read_stat(Element *e, void *thunk)
+{
+    IgmpMulticastForwarder *self = (IgmpMulticastForwarder *)e;
+    const Stats &stats = self->stats;
+
+    StringAccum sa;
+    switch ((intptr_t)thunk)
+    {
+    case h_forwarded:
+        return String(stats.forwarded.value());
+    case h_dropped:
+        return String(stats.dropped.value());
+    case h_copies:
+        return String(stats.copies.value());
+    case h_stats:
+        sa << "forwarded " << stats.forwarded.value() << '\n'
+           << "dropped " << stats.dropped.value() << '\n'
+           << "copies " << stats.copies.value() << '\n';
+        return sa.take_string();
+    default:
+        return String();
+    }
+}
+
+int IgmpMulticastForwarder::reset_stats(const String &, Element *e, void *, ErrorHandler *)
+{
+    IgmpMulticastForwarder *self = (IgmpMulticastForwarder *)e;
+    self->stats.forwarded.clear();
+    self->stats.dropped.clear();
+    self->stats.copies.clear();
+    return 0;
+}
+
+void IgmpMulticastForwarder::add_handlers()
+{
+    add_read_handler("forwarded", &read_stat, (void *)h_forwarded);
+    add_read_handler("dropped", &read_stat, (void *)h_dropped);
+    add_read_handler("copies", &read_stat, (void *)h_copies);
+    add_read_handler("stats", &read_stat, (void *)h_stats);
+    add_write_handler("reset_stats", &reset_stats, (void *)0);
+}
+
+CLICK_ENDDECLS
+EXPORT_ELEMENT(IgmpMulticastForwarder)
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <click/config.h>
+#include <click/element.hh>
+#include "PerThreadCounter.hh"
+
+CLICK_DECLS
+
+class IgmpRouter;
+
+/// Forwards multicast data packets onto every interface of an IgmpRouter that has
+/// listeners for them. Where a Tee in front of the router's data input makes a
+/// copy of every packet for every interface and looks each copy up separately,
+/// this element looks a packet up once, for all interfaces at the same time, and
+/// only sends it onto the interfaces that want it.
+///
+/// The TTL is decremented and the checksum is updated incrementally once, before
+/// the packet fans out. The copies are clones that share the packet's data, so
+/// nothing is copied unless an element further down the line writes to one of
+/// them. The last interface gets the packet itself.
+class IgmpMulticastForwarder : public Element
+{
+  public:
+    IgmpMulticastForwarder();
+    ~IgmpMulticastForwarder();
+
+    // Description of ports:
+    //
+    //     Input:
+    //         0. Incoming IP multicast packets, with their IP header annotations
+    //            set, as by CheckIPHeader. The paint annotation of each packet is
+    //            the index of the interface it arrived on.
+    //
+    //     Output:
+    //         0. One packet per interface that the incoming packet should be
+    //            forwarded onto, with a decremented TTL. The paint annotation of
+    //            each packet is the index of that interface.
+    //
+    //         1. Incoming packets which are not forwarded: those that nobody
+    //            listens to on any other interface than the one they arrived on,
+    //            those sent to a link-local group in 224.0.0.0/24 and those whose
+    //            TTL would run out.
+    //
+    // Configuration:
+    //
+    //     ROUTER: the IgmpRouter whose membership state decides where packets
+    //         are forwarded. Interfaces are numbered as in that router.
+    //
+    // Handlers:
+    //
+    //     forwarded, dropped: the number of packets that were forwarded onto at
+    //         least one interface, and that were not forwarded at all.
+    //     copies: the number of packets sent to output 0, which is the number of
+    //         forwarded packets times the mean number of interfaces they were
+    //         forwarded onto.
+    //     stats: all of the above.
+    //     reset_stats: resets the statistics.
+    //
+    // Like the router's data input, input 0 may be pushed to from any number of
+    // threads at once.
+
+    const char *class_name() const { return "IgmpMulticastForwarder"; }
+    const char *port_count() const { return "1/2"; }
+    const char *processing() const { return PUSH; }
+
+    int configure(Vector<String> &, ErrorHandler *);
+    int initialize(ErrorHandler *);
+
+    static String read_stat(Element *e, void *thunk);
+    static int reset_stats(const String &conf, Element *e, void *thunk, ErrorHandler *errh);
+
+    void add_handlers();
+
+    void push(int port, Packet *packet);
+
+  private:
+    IgmpRouter *router = nullptr;
+
+    struct Stats
+    {
+        PerThreadCounter forwarded;
+        PerThreadCounter dropped;
+        PerThreadCounter copies;
+    };
+
+    Stats stats;
+};
+
+CLICK_ENDDECLS
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <click/config.h>
+#include <click/glue.hh>
+#include <click/ipaddress.hh>
+
+CLICK_DECLS
+
+/// The querier election state of an interface (RFC 3376, section 6.6.2).
+enum class IgmpQuerierState
+{
+    /// The router is the querier on the interface's network: no router with a
+    /// lower address has sent a query within the last Other Querier Present
+    /// Interval. Only the querier sends queries.
+    Querier,
+
+    /// A router with a lower address is the querier. The router keeps its
+    /// group records up to date but sends no queries of its own, until the
+    /// Other Querier Present timer runs out.
+    NonQuerier
+};
+
+/// Tracks the querier election on a router interface's network, along with the
+/// startup General Queries that the interface has left to send. The router owns
+/// the timers; this class only decides who the querier is and how the next
+/// General Query is spaced.
+class IgmpQuerierElection final
+{
+  public:
+    explicit IgmpQuerierElection(const IPAddress &own_address)
+        : own_address(own_address), querier_address(own_address), state(IgmpQuerierState::Querier),
+          startup_queries_remaining(0)
+    {
+    }
+
+    /// Tests if the router is the querier on this interface's network.
+    bool is_querier() const { return state == IgmpQuerierState::Querier; }
+
+    /// Gets the address of the querier on this interface's network, which is the
+    /// interface's own address if the router is the querier.
+    const IPAddress &get_querier_address() const { return querier_address; }
+
+    /// Gets the number of startup General Queries that are left to send.
+    unsigned int get_startup_queries_remaining() const { return startup_queries_remaining; }
+
+    /// Starts up as the querier, with the given number of startup General Queries.
+    void start(unsigned int startup_query_count)
+    {
+        state = IgmpQuerierState::Querier;
+        querier_address = own_address;
+        startup_queries_remaining = startup_query_count;
+    }
+
+    /// Processes a query from the given source address. A Boolean result tells if
+    /// the source is the querier, in which case the router must (re)start its
+    /// Other Querier Present timer and must not send queries of its own.
+    bool receive_query(const IPAddress &source_address)
+    {
+        // Addresses are compared as the 32-bit numbers they are, in host byte order.
+        // Queries from routers with higher addresses don't affect the election, and
+        // neither do our own queries, should they ever loop back to us.
+        if (ntohl(source_address.addr()) >= ntohl(own_address.addr()))
+        {
+            return false;
+        }
+
+        // Only the querier sends queries, so whoever sent this one is the querier.
+        state = IgmpQuerierState::NonQuerier;
+        querier_address = source_address;
+        startup_queries_remaining = 0;
+        return true;
+    }
+
+    /// Takes over as the querier once the Other Querier Present timer has run out.
+    /// The network has had a querier all along, so there is no startup period.
+    void take_over()
+    {
+        state = IgmpQuerierState::Querier;
+        querier_address = own_address;
+        startup_queries_remaining = 0;
+    }
+
+    /// Counts off a General Query that is being sent. A Boolean result tells if the
+    /// next one is a startup query, which follows after the Startup Query Interval
+    /// instead of the Query Interval.
+    bool count_general_query()
+    {
+        if (startup_queries_remaining > 0)
+        {
+            startup_queries_remaining--;
+        }
+        return startup_queries_remaining > 0;
+    }
+
+  private:
+    IPAddress own_address;
+    IPAddress querier_address;
+    IgmpQuerierState state;
+    unsigned int startup_queries_remaining;
+};
+
+CLICK_ENDDECLS
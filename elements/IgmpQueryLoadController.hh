@@ -0,0 +1,414 @@
+#pragma once
+
+#include <click/config.h>
+#include <click/glue.hh>
+#include <click/hashmap.hh>
+#include <click/ipaddress.hh>
+#include <click/timestamp.hh>
+#include "IgmpMessageManip.hh"
+#include "IgmpRouterVariables.hh"
+
+CLICK_DECLS
+
+/// An optional controller that adapts a querier's Query Interval, Query Response
+/// Interval and Robustness Variable to the report load that its general queries
+/// cause. Every host on a network answers every general query, so a large network
+/// sees a burst of reports after every query: the report implosion. The controller
+/// spreads the burst over a longer Query Response Interval when it is too steep,
+/// queries less often when the Query Response Interval can't grow any further,
+/// and goes back to the configured values as the load drops.
+///
+/// The burst is told apart from the steady trickle of reports that joins, leaves
+/// and group-specific queries cause: records that arrive within the Query Response
+/// Interval of a general query count towards the burst, minus the trickle that
+/// the rest of the query cycle sees over the same amount of time.
+///
+/// The controller also estimates how many reports are lost. Hosts send every
+/// state-change report [Robustness Variable] times, so the router should see as
+/// many identical copies of every state-change record. It raises the Robustness
+/// Variable when too many copies go missing. Hosts that adopt the querier's QRV
+/// send as many copies as the router asks for, but others stick to their own
+/// Robustness Variable, so the number of copies that hosts send is estimated
+/// from the copies that arrive. With n copies sent, each of which arrives with
+/// probability p, the number of copies of a record that arrive follows a
+/// binomial distribution, of which the router sees only the records that arrive
+/// at least once. The mean number of pairs of copies per copy that arrives is
+/// (n - 1) p for every such distribution, which gives p for every n; the n
+/// whose distribution then has the observed mean number of copies per record
+/// wins. Raising the Robustness Variable doesn't help hosts that don't adopt
+/// it, but they don't make a lossless network look lossy either.
+///
+/// The variables are only ever changed right before a general query is sent, and
+/// only within bounds that keep every group timer alive until the hosts have had
+/// a chance to answer the next query:
+///
+///     * QRI < QI, as section 8.3 of RFC 3376 demands, and QRI <= QI / 2, so that
+///       there is a lull between two bursts.
+///
+///     * QRI never exceeds the previous QI. Timers that were set by answers to the
+///       previous query run out [Robustness Variable] times the previous QI plus
+///       the previous QRI after that query, so answers to this query, which are
+///       due within QRI after the previous QI, refresh them in time for any
+///       Robustness Variable of at least two.
+///
+///     * QI and QRI never exceed the largest value that a Max Resp Code or a QQIC
+///       can represent, and the Robustness Variable never exceeds seven, which
+///       is the largest QRV.
+///
+/// Raising QI, QRI or the Robustness Variable only makes the Group Membership
+/// Interval longer. Lowering them makes new timers shorter, but never shortens
+/// the timers that are already running.
+class IgmpQueryLoadController final
+{
+  public:
+    IgmpQueryLoadController()
+        : target_report_rate(0), max_query_interval(0), baseline(), cycle_start(), response_window_dsec(0),
+          in_cycle(false), burst_records(0), background_records(0), mean_records_per_query(0),
+          have_mean_records(false), state_change_copies(), loss_permille(0)
+    {
+    }
+
+    /// Tests if the controller is enabled.
+    bool enabled() const { return target_report_rate != 0; }
+
+    /// Gets the number of group records per second that the controller aims for,
+    /// or zero if the controller is disabled.
+    unsigned int get_target_report_rate() const { return target_report_rate; }
+
+    /// Gets the largest Query Interval that the controller may pick, or zero for
+    /// four times the configured Query Interval.
+    unsigned int get_max_query_interval() const { return max_query_interval; }
+
+    /// Configures the controller. A target rate of zero disables it. The given
+    /// variables are the configured ones, which the controller never goes below.
+    void configure(unsigned int target_rate, unsigned int max_interval, const IgmpRouterVariables &configured)
+    {
+        target_report_rate = target_rate;
+        max_query_interval = max_interval;
+        baseline = configured;
+        in_cycle = false;
+        have_mean_records = false;
+        mean_records_per_query = 0;
+        state_change_copies.clear();
+        loss_permille = 0;
+    }
+
+    /// Tests if the controller is configured with the given settings and variables,
+    /// in which case configuring it again would only throw away what it has
+    /// learned.
+    bool is_configured(unsigned int target_rate, unsigned int max_interval, const IgmpRouterVariables &configured) const
+    {
+        return target_rate == target_report_rate && max_interval == max_query_interval
+            && configured.get_query_interval() == baseline.get_query_interval()
+            && configured.get_query_response_interval() == baseline.get_query_response_interval()
+            && configured.get_robustness_variable() == baseline.get_robustness_variable();
+    }
+
+    /// Puts the configured values back into the given variables, so that they can
+    /// be reconfigured by hand.
+    void restore_baseline(IgmpRouterVariables &vars) const
+    {
+        if (!enabled())
+        {
+            return;
+        }
+
+        vars.get_query_interval() = baseline.get_query_interval();
+        vars.get_query_response_interval() = baseline.get_query_response_interval();
+        vars.get_robustness_variable() = baseline.get_robustness_variable();
+    }
+
+    /// Puts the adapted values from the given adapted variables back into the given
+    /// variables, which have been reconfigured by hand without changing the
+    /// controller's settings.
+    void restore_adapted(IgmpRouterVariables &vars, const IgmpRouterVariables &adapted) const
+    {
+        if (!enabled())
+        {
+            return;
+        }
+
+        vars.get_query_interval() = adapted.get_query_interval();
+        vars.get_query_response_interval() = adapted.get_query_response_interval();
+        vars.get_robustness_variable() = adapted.get_robustness_variable();
+    }
+
+    /// Records the arrival of a current-state group record, as sent in response to
+    /// queries.
+    void observe_current_state_record()
+    {
+        if (!in_cycle)
+        {
+            return;
+        }
+
+        if ((Timestamp::recent_steady() - cycle_start).msecval() < (Timestamp::value_type)response_window_dsec * 100)
+        {
+            burst_records++;
+        }
+        else
+        {
+            background_records++;
+        }
+    }
+
+    /// Records the arrival of a copy of a state-change group record from the given
+    /// host.
+    void observe_state_change_record(const IPAddress &host_address, const IgmpV3GroupRecordView &record)
+    {
+        uint64_t fingerprint = fingerprint_state_change_record(host_address, record);
+        auto count_ptr = state_change_copies.findp(fingerprint);
+        if (count_ptr == nullptr)
+        {
+            // The map is cleared once per query cycle, and a cycle's worth of
+            // distinct state changes is a fair sample. This caps the controller's
+            // memory no matter how busy the network is.
+            if (state_change_copies.size() < max_tracked_state_changes)
+            {
+                state_change_copies.insert(fingerprint, 1);
+            }
+        }
+        else
+        {
+            (*count_ptr)++;
+        }
+    }
+
+    /// Gets the mean number of current-state records that a general query causes.
+    unsigned int get_mean_records_per_query() const { return mean_records_per_query; }
+
+    /// Gets the estimated fraction of state-change records that are lost, in
+    /// thousandths.
+    unsigned int get_loss_permille() const { return loss_permille; }
+
+    /// Adapts the given variables to the load that has been observed since the
+    /// last general query. This is called right before the next general query is
+    /// sent, so that the query advertises the new values.
+    void adjust(IgmpRouterVariables &vars)
+    {
+        if (!enabled())
+        {
+            return;
+        }
+
+        end_cycle();
+        update_loss_estimate();
+
+        unsigned int previous_query_interval = vars.get_query_interval();
+        unsigned int max_interval = get_effective_max_query_interval();
+
+        // The QRI that spreads one query's worth of reports at the target rate.
+        uint64_t wanted_response_interval =
+            ((uint64_t)mean_records_per_query * 10 + target_report_rate - 1) / target_report_rate;
+        unsigned int response_interval = clamp(
+            wanted_response_interval, baseline.get_query_response_interval(),
+            smaller(max_interval / 2, previous_query_interval));
+
+        // Query less often once the answers to a single query take up more than
+        // half of the Query Interval.
+        unsigned int query_interval = clamp(
+            2 * (uint64_t)response_interval, baseline.get_query_interval(), max_interval);
+        if (response_interval >= query_interval)
+        {
+            response_interval = query_interval - 1;
+        }
+
+        vars.get_query_response_interval() = response_interval;
+        vars.get_query_interval() = query_interval;
+
+        // The query that is about to be sent starts the next cycle.
+        cycle_start = Timestamp::recent_steady();
+        response_window_dsec = response_interval;
+        in_cycle = true;
+
+        // Go up one step at a time when too many copies get lost, and come back
+        // down one step at a time when hardly any do.
+        auto &robustness = vars.get_robustness_variable();
+        if (loss_permille > raise_robustness_loss_permille && robustness < max_robustness)
+        {
+            robustness++;
+        }
+        else if (loss_permille < lower_robustness_loss_permille && robustness > baseline.get_robustness_variable())
+        {
+            robustness--;
+        }
+    }
+
+  private:
+    /// The loss rates, in thousandths, above which the Robustness Variable is
+    /// raised and below which it is lowered.
+    static const unsigned int raise_robustness_loss_permille = 100;
+    static const unsigned int lower_robustness_loss_permille = 20;
+
+    /// The largest Robustness Variable that fits in a QRV field.
+    static const unsigned int max_robustness = 7;
+
+    /// The largest time that a Max Resp Code or QQIC can represent.
+    static const unsigned int max_code_value = 31744;
+
+    /// The most state changes that are tracked per query cycle.
+    static const int max_tracked_state_changes = 4096;
+
+    static unsigned int smaller(unsigned int a, unsigned int b) { return a < b ? a : b; }
+
+    static unsigned int clamp(uint64_t value, unsigned int low, unsigned int high)
+    {
+        if (high < low)
+        {
+            high = low;
+        }
+        return value < low ? low : value > high ? high : (unsigned int)value;
+    }
+
+    unsigned int get_effective_max_query_interval() const
+    {
+        unsigned int result = max_query_interval != 0 ? max_query_interval : 4 * baseline.get_query_interval();
+        return smaller(result, max_code_value);
+    }
+
+    /// Computes a fingerprint of a state-change record, which is the same for
+    /// every retransmission of the record.
+    static uint64_t fingerprint_state_change_record(
+        const IPAddress &host_address, const IgmpV3GroupRecordView &record)
+    {
+        // FNV-1a over the host, the group, the type and the sources.
+        uint64_t hash = 0xCBF29CE484222325ull;
+        auto mix = [&hash](uint32_t word) {
+            hash = (hash ^ word) * 0x100000001B3ull;
+        };
+        mix(host_address.addr());
+        mix(record.get_multicast_address().addr());
+        mix((uint32_t)record.get_type());
+        for (const auto &address : record.get_source_addresses())
+        {
+            mix(address.addr());
+        }
+        return hash;
+    }
+
+    /// Folds the records of the query cycle that has just ended into the mean
+    /// number of records that a general query causes.
+    void end_cycle()
+    {
+        if (!in_cycle)
+        {
+            return;
+        }
+        in_cycle = false;
+
+        // The trickle that the rest of the cycle sees would have arrived during
+        // the response window as well.
+        uint64_t cycle_msec = (Timestamp::recent_steady() - cycle_start).msecval();
+        uint64_t window_msec = (uint64_t)response_window_dsec * 100;
+        uint64_t burst = burst_records;
+        if (cycle_msec > window_msec)
+        {
+            uint64_t trickle = (uint64_t)background_records * window_msec / (cycle_msec - window_msec);
+            burst = burst > trickle ? burst - trickle : 0;
+        }
+        burst_records = 0;
+        background_records = 0;
+
+        // A running mean keeps a single lost or delayed query from swinging the
+        // intervals back and forth.
+        if (have_mean_records)
+        {
+            mean_records_per_query = (unsigned int)((3 * (uint64_t)mean_records_per_query + burst) / 4);
+        }
+        else
+        {
+            mean_records_per_query = (unsigned int)burst;
+            have_mean_records = true;
+        }
+    }
+
+    /// Folds the state-change copies that have been seen since the last query
+    /// into the loss estimate. Records that were lost altogether were never seen
+    /// and can't be counted.
+    void update_loss_estimate()
+    {
+        // A host that makes the same change twice, say by joining, leaving and
+        // joining again, sends more copies of the same record than usual. Capping
+        // the count keeps a few of those from skewing the estimate much.
+        uint64_t record_count = 0, copy_count = 0, pair_count = 0;
+        for (auto it = state_change_copies.begin(); it != state_change_copies.end(); ++it)
+        {
+            uint64_t copies = it.value() < max_robustness ? it.value() : max_robustness;
+            record_count++;
+            copy_count += copies;
+            pair_count += copies * (copies - 1);
+        }
+        state_change_copies.clear();
+
+        if (record_count == 0)
+        {
+            return;
+        }
+
+        // Fit the number of copies that hosts send, along with the probability
+        // that a copy arrives, in millionths. A single copy per host fits when
+        // every record arrives just once.
+        const uint64_t one = 1000000;
+        uint64_t observed_mean = copy_count * one / record_count;
+        uint64_t best_error = observed_mean > one ? observed_mean - one : one - observed_mean;
+        uint64_t best_arrival = one;
+        for (uint64_t sent = 2; sent <= max_robustness; sent++)
+        {
+            // Copies that arrive more often than they are sent are duplicates.
+            uint64_t arrival = pair_count * one / (copy_count * (sent - 1));
+            if (arrival > one)
+            {
+                arrival = one;
+            }
+
+            uint64_t none_arrive = one;
+            for (uint64_t i = 0; i < sent; i++)
+            {
+                none_arrive = none_arrive * (one - arrival) / one;
+            }
+            if (none_arrive == one)
+            {
+                continue;
+            }
+
+            uint64_t mean = sent * arrival * one / (one - none_arrive);
+            uint64_t error = mean > observed_mean ? mean - observed_mean : observed_mean - mean;
+            if (error < best_error)
+            {
+                best_error = error;
+                best_arrival = arrival;
+            }
+        }
+
+        unsigned int cycle_loss = (unsigned int)((one - best_arrival) * 1000 / one);
+        loss_permille = (3 * loss_permille + cycle_loss) / 4;
+    }
+
+    unsigned int target_report_rate;
+    unsigned int max_query_interval;
+
+    /// The configured variables, which are the lower bounds of the adapted ones.
+    IgmpRouterVariables baseline;
+
+    /// The time at which the current query cycle's general query was sent, and
+    /// the Query Response Interval that it advertised.
+    Timestamp cycle_start;
+    unsigned int response_window_dsec;
+    bool in_cycle;
+
+    /// The number of current-state records that have arrived within and after the
+    /// current cycle's response window.
+    unsigned int burst_records;
+    unsigned int background_records;
+
+    unsigned int mean_records_per_query;
+    bool have_mean_records;
+
+    /// The number of copies of every state-change record that has been seen since
+    /// the last query, by fingerprint.
+    HashMap<uint64_t, unsigned int> state_change_copies;
+
+    unsigned int loss_permille;
+};
+
+CLICK_ENDDECLS
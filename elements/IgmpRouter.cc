@@ -3,77 +3,440 @@
 #include <click/config.h>
 #include <click/confparse.hh>
 #include <click/error.hh>
+#include <click/master.hh>
+#include <click/packet_anno.hh>
+#include <click/straccum.hh>
 #include <clicknet/ether.h>
 #include <clicknet/ip.h>
 #include <clicknet/udp.h>
 #include "IgmpMessage.hh"
 #include "IgmpMessageManip.hh"
 #include "IgmpRouterFilter.hh"
+#include "IgmpRouterSnapshot.hh"
+#if CLICK_USERLEVEL
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 CLICK_DECLS
+
+/// Logs a message if the router's debug level is at least the given level. The
+/// message's arguments are only evaluated if it is actually logged.
+#define IGMP_ROUTER_DEBUG(level, ...)               \
+    do                                              \
+    {                                               \
+        if (unlikely(debug_level >= (level)))       \
+            click_chatter(__VA_ARGS__);             \
+    } while (0)
+
 IgmpRouter::IgmpRouter()
-    : filter(this, true), query_schedule(this)
+    : igmp_task(this)
 {
 }
 
 IgmpRouter::~IgmpRouter()
 {
+    for (auto iface : interfaces)
+    {
+        delete iface;
+    }
 }
 
 int IgmpRouter::configure(Vector<String> &conf, ErrorHandler *errh)
 {
-    if (cp_va_kparse(conf, this, errh, "ADDRESS", cpkM, cpIPAddress, &address, cpEnd) < 0)
-        return -1;
+    // Every 'ADDRESS addr' argument defines an interface. Click's keyword parser
+    // only keeps the last occurrence of a keyword, so we'll parse the arguments
+    // one by one.
+    uint32_t host_rate = 100, host_burst = 0;
+    int queue_capacity = 1024;
+    for (const auto &arg : conf)
+    {
+        String keyword, rest;
+        IPAddress address;
+        if (cp_keyword(arg, &keyword, &rest) && keyword == "DEBUG")
+        {
+            if (!cp_integer(rest, &debug_level))
+                return errh->error("DEBUG takes an integer, got '%s'", rest.c_str());
+            continue;
+        }
+        if (cp_keyword(arg, &keyword, &rest) && keyword == "HOST_RATE")
+        {
+            if (!cp_integer(rest, &host_rate))
+                return errh->error("HOST_RATE takes an unsigned integer, got '%s'", rest.c_str());
+            continue;
+        }
+        if (cp_keyword(arg, &keyword, &rest) && keyword == "HOST_BURST")
+        {
+            if (!cp_integer(rest, &host_burst) || host_burst == 0)
+                return errh->error("HOST_BURST takes a positive integer, got '%s'", rest.c_str());
+            continue;
+        }
+        if (cp_keyword(arg, &keyword, &rest) && keyword == "QUEUE_CAPACITY")
+        {
+            if (!cp_integer(rest, &queue_capacity) || queue_capacity <= 0)
+                return errh->error("QUEUE_CAPACITY takes a positive integer, got '%s'", rest.c_str());
+            continue;
+        }
+        if (cp_keyword(arg, &keyword, &rest) && keyword == "BUDGET")
+        {
+            if (!cp_integer(rest, &igmp_budget) || igmp_budget <= 0)
+                return errh->error("BUDGET takes a positive integer, got '%s'", rest.c_str());
+            continue;
+        }
+        if (cp_keyword(arg, &keyword, &rest) && keyword == "SNAPSHOT")
+        {
+#if CLICK_USERLEVEL
+            if (!cp_filename(rest, &snapshot_file))
+                return errh->error("SNAPSHOT takes a file name, got '%s'", rest.c_str());
+            continue;
+#else
+            return errh->error("SNAPSHOT is only supported at user level");
+#endif
+        }
+        if (!cp_keyword(arg, &keyword, &rest) || keyword != "ADDRESS")
+            return errh->error("expected 'ADDRESS addr', got '%s'", arg.c_str());
+        if (!cp_ip_address(rest, &address, this))
+            return errh->error("ADDRESS takes an IP address, got '%s'", rest.c_str());
+        if (interfaces.size() >= IgmpForwardingIndex::max_slots)
+            return errh->error(
+                "too many interfaces; the paint annotation tells at most %d interfaces apart",
+                IgmpForwardingIndex::max_slots);
+
+        interfaces.push_back(new Interface(this, interfaces.size(), address));
+        interfaces.back()->filter.set_generation_counter(&generation);
+        interfaces.back()->filter.set_forwarding_index(&forwarding_index, interfaces.size() - 1);
+#if IGMP_LATENCY_STATS
+        interfaces.back()->filter.set_timer_latency_histogram(&latency.timers);
+#endif
+    }
 
-    init_startup_queries();
+    if (interfaces.size() == 0)
+        return errh->error("at least one ADDRESS is required");
+
+    host_rate_limiter.configure(host_rate, host_burst != 0 ? host_burst : 2 * host_rate);
+    igmp_queue.set_capacity(queue_capacity);
+
+    for (auto iface : interfaces)
+    {
+        iface->group_query_timer.initialize(this);
+        iface->general_query_timer.initialize(this);
+        iface->other_querier_present_timer.initialize(this);
+        init_startup_queries(*iface);
+    }
 
     return 0;
 }
 
-void IgmpRouter::init_startup_queries()
+int IgmpRouter::initialize(ErrorHandler *errh)
+{
+    stats.forwarded.initialize(master()->nthreads());
+    stats.dropped.initialize(master()->nthreads());
+#if IGMP_LATENCY_STATS
+    for (auto &histogram : latency.group_records)
+    {
+        histogram.initialize(master()->nthreads());
+    }
+    latency.lookups.initialize(master()->nthreads());
+    latency.timers.initialize(master()->nthreads());
+#endif
+    igmp_task.initialize(this, false);
+    // A snapshot that can't be restored is no reason not to start: the router
+    // relearns its groups from scratch, as it would without one.
+    load_snapshot_file(errh);
+    return 0;
+}
+
+void IgmpRouter::cleanup(CleanupStage stage)
+{
+    if (stage == CLEANUP_ROUTER_INITIALIZED && !snapshot_file.empty())
+    {
+        save_snapshot_file(ErrorHandler::default_handler());
+    }
+}
+
+void IgmpRouter::init_startup_queries(Interface &iface)
 {
     // Keep track of the number of remaining startup general queries. See the SPEC INTERPRATION
     // comment in 'IgmpRouter::SendPeriodicGeneralQuery::operator()() const' for an explanation.
-    startup_general_queries_remaining = filter.get_router_variables().get_startup_query_count();
+    iface.election.start(iface.filter.get_router_variables().get_startup_query_count());
+    iface.general_query_timer.schedule_after_dsec(
+        iface.filter.get_router_variables().get_startup_query_interval());
+}
 
-    general_query_timer = CallbackTimer<SendPeriodicGeneralQuery>(this);
-    general_query_timer.initialize(this);
-    general_query_timer.schedule_after_dsec(
-        filter.get_router_variables().get_startup_query_interval());
+bool IgmpRouter::should_forward(Packet *packet) const
+{
+    IGMP_LATENCY_SCOPE(latency.lookups);
+
+    auto iface = get_interface(PAINT_ANNO(packet));
+    if (iface == nullptr)
+    {
+        return false;
+    }
+
+    auto ip_header = (const click_ip *)packet->data();
+    return iface->filter.is_listening_to(ip_header->ip_dst, ip_header->ip_src);
+}
+
+IgmpSlotMask IgmpRouter::get_forwarding_mask(const IPAddress &multicast_address, const IPAddress &source_address) const
+{
+    IGMP_LATENCY_SCOPE(latency.lookups);
+
+    if (multicast_address == all_systems_multicast_address || multicast_address == report_multicast_address)
+    {
+        // Every interface listens to these, just like IgmpRouterFilter::is_listening_to
+        // says.
+        IgmpSlotMask mask;
+        mask.set_first(interfaces.size());
+        return mask;
+    }
+
+    return forwarding_index.lookup_mask(multicast_address, source_address);
 }
 
 void IgmpRouter::push(int port, Packet *packet)
 {
     if (port == 0)
     {
-        auto ip_header = (click_ip *)packet->data();
-        if (filter.is_listening_to(ip_header->ip_dst, ip_header->ip_src))
+        if (should_forward(packet))
         {
+            stats.forwarded.increment();
             output(1).push(packet);
         }
         else
         {
+            stats.dropped.increment();
             output(2).push(packet);
         }
     }
     else
     {
         assert(port == 1);
-        handle_igmp_packet(packet);
+        enqueue_igmp_packet(packet);
+    }
+}
+
+#if HAVE_BATCH
+/// The verdicts for the packets of a single batch, grouped by destination. The
+/// flows in a batch usually go to a handful of groups, each from a handful of
+/// sources, but flows to different groups are interleaved, so remembering just
+/// the previous packet's verdict misses whenever the destination changes.
+class IgmpBatchVerdicts final
+{
+  public:
+    IgmpBatchVerdicts()
+        : group_count(0), next_group(0), last_group(0)
+    {
+    }
+
+    /// Gets the verdict for a packet with the given destination, source and
+    /// paint annotation. The given lookup function is only called for packets
+    /// whose verdict isn't known yet.
+    template <typename TLookup>
+    bool get(uint32_t dst, uint32_t src, int paint, const TLookup &lookup)
+    {
+        auto &group = find_group(dst, paint);
+        for (int i = 0; i < group.source_count; i++)
+        {
+            if (group.sources[i] == src)
+                return group.verdicts[i];
+        }
+
+        // Sources beyond the first few of a group take turns in its table.
+        bool verdict = lookup();
+        int index = group.source_count < max_sources ? group.source_count++ : group.next_source++ % max_sources;
+        group.sources[index] = src;
+        group.verdicts[index] = verdict;
+        return verdict;
+    }
+
+  private:
+    static const int max_groups = 8;
+    static const int max_sources = 4;
+
+    struct Group
+    {
+        uint32_t dst;
+        int paint;
+        int source_count;
+        int next_source;
+        uint32_t sources[max_sources];
+        bool verdicts[max_sources];
+    };
+
+    /// Finds the given destination's table, or clears one for it.
+    Group &find_group(uint32_t dst, int paint)
+    {
+        if (group_count > 0 && groups[last_group].dst == dst && groups[last_group].paint == paint)
+            return groups[last_group];
+
+        for (int i = 0; i < group_count; i++)
+        {
+            if (groups[i].dst == dst && groups[i].paint == paint)
+            {
+                last_group = i;
+                return groups[i];
+            }
+        }
+
+        last_group = group_count < max_groups ? group_count++ : next_group++ % max_groups;
+        auto &group = groups[last_group];
+        group.dst = dst;
+        group.paint = paint;
+        group.source_count = 0;
+        group.next_source = 0;
+        return group;
+    }
+
+    Group groups[max_groups];
+    int group_count;
+    int next_group;
+    int last_group;
+};
+
+void IgmpRouter::push_batch(int port, PacketBatch *batch)
+{
+    if (port == 1)
+    {
+        FOR_EACH_PACKET_SAFE(batch, packet)
+        {
+            enqueue_igmp_packet(packet);
+        }
+        return;
+    }
+
+    assert(port == 0);
+
+    // Split the batch into a forwarded and a dropped list. Every (interface,
+    // group, source) flow in the batch is only looked up once, even if its
+    // packets are interleaved with those of other flows.
+    Packet *forward_head = nullptr, *forward_tail = nullptr;
+    Packet *drop_head = nullptr, *drop_tail = nullptr;
+    int forward_count = 0, drop_count = 0;
+    IgmpBatchVerdicts verdicts;
+
+    Packet *next = batch->first();
+    while (next != nullptr)
+    {
+        Packet *packet = next;
+        next = packet->next();
+        packet->set_next(nullptr);
+
+        auto ip_header = (const click_ip *)packet->data();
+        bool forward = verdicts.get(
+            ip_header->ip_dst.s_addr, ip_header->ip_src.s_addr, PAINT_ANNO(packet),
+            [this, packet]() { return should_forward(packet); });
+        if (forward)
+        {
+            if (forward_tail == nullptr)
+                forward_head = packet;
+            else
+                forward_tail->set_next(packet);
+            forward_tail = packet;
+            forward_count++;
+        }
+        else
+        {
+            if (drop_tail == nullptr)
+                drop_head = packet;
+            else
+                drop_tail->set_next(packet);
+            drop_tail = packet;
+            drop_count++;
+        }
+    }
+
+    stats.forwarded.add(forward_count);
+    stats.dropped.add(drop_count);
+    if (forward_head != nullptr)
+    {
+        output_push_batch(1, PacketBatch::make_from_simple_list(forward_head, forward_tail, forward_count));
+    }
+    if (drop_head != nullptr)
+    {
+        output_push_batch(2, PacketBatch::make_from_simple_list(drop_head, drop_tail, drop_count));
+    }
+}
+#endif
+
+void IgmpRouter::enqueue_igmp_packet(Packet *packet)
+{
+    // Queries are rate-limited too: they come from hosts like any other packet,
+    // and a real querier sends far fewer of them than any sensible rate.
+    if (!host_rate_limiter.admit(packet->ip_header()->ip_src, Timestamp::recent_steady()))
+    {
+        stats.rate_limited++;
+        output(3).push(packet);
+        return;
+    }
+
+    if (igmp_queue.full())
+    {
+        stats.queue_drops++;
+        output(3).push(packet);
+        return;
+    }
+
+    igmp_queue.push(packet);
+    if (!igmp_task.scheduled())
+    {
+        igmp_task.reschedule();
+    }
+}
+
+bool IgmpRouter::run_task(Task *)
+{
+    int processed = 0;
+    while (processed < igmp_budget && !igmp_queue.empty())
+    {
+        handle_igmp_packet(igmp_queue.pop());
+        processed++;
     }
+
+    // Whatever is left waits for the next run, so that the elements which share
+    // this thread get to run in between.
+    if (!igmp_queue.empty())
+    {
+        igmp_task.fast_reschedule();
+    }
+    return processed > 0;
 }
 
 void IgmpRouter::handle_igmp_packet(Packet *packet)
 {
-    click_chatter(
-        "Received IGMP packet with type %d at router",
-        (int)get_igmp_message_type(packet->data()));
+    IGMP_ROUTER_DEBUG(
+        1, "%s: received IGMP packet with type %d on interface %d",
+        name().c_str(), (int)get_igmp_message_type(packet->data()), (int)PAINT_ANNO(packet));
+
+    auto iface_ptr = get_interface(PAINT_ANNO(packet));
+    if (iface_ptr == nullptr)
+    {
+        IGMP_ROUTER_DEBUG(1, "%s: received IGMP packet on unknown interface %d", name().c_str(), (int)PAINT_ANNO(packet));
+        stats.bad_packets++;
+        packet->kill();
+        return;
+    }
+    auto &iface = *iface_ptr;
+    auto &filter = iface.filter;
 
     if (is_igmp_membership_query(packet->data()))
     {
-        // Handle IGMP membership queries.
+        // Handle IGMP membership queries. A query that is too short for its
+        // source addresses would make the parser read past the packet.
+        stats.queries_received++;
+        if (!is_complete_igmp_membership_query(packet->data(), packet->length()))
+        {
+            IGMP_ROUTER_DEBUG(1, "%s: membership query is truncated; ignoring it", name().c_str());
+            stats.bad_packets++;
+            packet->kill();
+            return;
+        }
         auto data_ptr = packet->data();
-        handle_igmp_membership_query(IgmpMembershipQuery::read(data_ptr), packet->ip_header()->ip_src);
+        handle_igmp_membership_query(iface, IgmpMembershipQuery::read(data_ptr), packet->ip_header()->ip_src);
         packet->kill();
         return;
     }
@@ -85,93 +448,82 @@ void IgmpRouter::handle_igmp_packet(Packet *packet)
         return;
     }
 
-    auto data_ptr = packet->data();
-    auto report = IgmpV3MembershipReport::read(data_ptr);
-    for (const auto &group : report.group_records)
+    stats.reports_received++;
+    IgmpV3MembershipReportView report(packet->data(), packet->length());
+    IPAddress reporter_address = packet->ip_header()->ip_src;
+    if (report.is_truncated())
+    {
+        IGMP_ROUTER_DEBUG(1, "%s: membership report is truncated; ignoring its incomplete group records", name().c_str());
+        stats.bad_packets++;
+    }
+
+    for (const auto &group : report)
     {
-        auto group_string = group.to_string();
-        click_chatter("Received at router: %s", group_string.c_str());
-        IgmpFilterRecord record;
-        switch (group.type)
+        IGMP_ROUTER_DEBUG(2, "%s: %s", name().c_str(), group.to_string().c_str());
+        auto type_index = (int)group.get_type();
+        stats.group_records[type_index < 7 ? type_index : 0]++;
+        IGMP_LATENCY_SCOPE(latency.group_records[type_index < 7 ? type_index : 0]);
+        auto multicast_address = group.get_multicast_address();
+        switch (group.get_type())
         {
         case IgmpV3GroupRecordType::ModeIsInclude:
-        case IgmpV3GroupRecordType::ChangeToIncludeMode:
-            record.filter_mode = IgmpFilterMode::Include;
+            iface.load_controller.observe_current_state_record();
+            filter.receive_current_state_record(
+                multicast_address, IgmpFilterMode::Include, group.get_source_addresses());
+            filter.track_host(multicast_address, reporter_address, group.get_type(), group.get_source_addresses());
             break;
         case IgmpV3GroupRecordType::ModeIsExclude:
-        case IgmpV3GroupRecordType::ChangeToExcludeMode:
-            record.filter_mode = IgmpFilterMode::Exclude;
+            iface.load_controller.observe_current_state_record();
+            filter.receive_current_state_record(
+                multicast_address, IgmpFilterMode::Exclude, group.get_source_addresses());
+            filter.track_host(multicast_address, reporter_address, group.get_type(), group.get_source_addresses());
             break;
-        default:
-            // Ignore group records with unknown types.
-            click_chatter("Found IGMP group record with unknown type %d", (int)group.type);
-            continue;
-        }
-        record.source_addresses = group.source_addresses;
-
-        auto old_record_ptr = filter.get_record(group.multicast_address);
-        bool was_exclude = old_record_ptr != nullptr && old_record_ptr->filter_mode == IgmpFilterMode::Exclude;
-
-        // Update the filter's state.
-        filter.receive_current_state_record(group.multicast_address, record);
-
-        // If the filter record was in EXCLUDE mode and we received a TO_IN group record,
-        // then we need to generate IGMP group-specific queries.
-        if (was_exclude && group.type == IgmpV3GroupRecordType::ChangeToIncludeMode)
-        {
-            if (other_querier_present)
-            {
-                // We're not supposed to transmit requests if we're not the elected querier,
-                // so let's just refrain from doing that.
-                packet->kill();
-                return;
-            }
-
-            // According to the spec:
-            //
-            //
-            //     When a table action "Send Q(G)" is encountered, then the group timer
-            //     must be lowered to LMQT. The router must then immediately send a
-            //     group specific query as well as schedule [Last Member Query Count -
-            //     1] query retransmissions to be sent every [Last Member Query
-            //     Interval] over [Last Member Query Time].
-            //
-            //     When transmitting a group specific query, if the group timer is
-            //     larger than LMQT, the "Suppress Router-Side Processing" bit is set in
-            //     the query message.
-            //
-            //
-            // The reduced version of the spec that I have to implement requires a "Send Q(G)"
-            // on every table entry.
-
-            // Lower the group timer to LMQT.
-            auto record_ptr = filter.get_record(group.multicast_address);
-            if (record_ptr != nullptr)
+        case IgmpV3GroupRecordType::ChangeToIncludeMode:
+        case IgmpV3GroupRecordType::ChangeToExcludeMode:
+        case IgmpV3GroupRecordType::AllowNewSources:
+        case IgmpV3GroupRecordType::BlockOldSources:
+            if (iface.load_controller.enabled())
             {
-                record_ptr->timer.schedule_after_dsec(
-                    filter.get_router_variables().get_last_member_query_time());
+                iface.load_controller.observe_state_change_record(reporter_address, group);
             }
+            filter.receive_state_change_record(
+                multicast_address, group.get_type(), group.get_source_addresses(), query_action);
+            filter.track_host(multicast_address, reporter_address, group.get_type(), group.get_source_addresses());
 
-            // Send one group-specific query right away and schedule more for later.
-            SendGroupSpecificQuery event{this, group.multicast_address};
+            // In fast-leave mode, sources and groups that none of the tracked hosts
+            // want anymore are pruned right away instead of being queried.
+            filter.fast_leave(multicast_address, query_action);
 
-            // Transmit a group-specific query.
-            event();
-
-            // Schedule group-specific queries.
-            uint32_t delta_dsec = 0;
-            for (unsigned int i = 0; i < filter.get_router_variables().get_last_member_query_count() - 1; i++)
+            // We're not supposed to transmit queries if we're not the elected querier,
+            // so let's just refrain from doing that. Only the querier lowers timers in
+            // response to a state change, too.
+            if (iface.is_querier())
             {
-                delta_dsec += filter.get_router_variables().get_last_member_query_interval();
-                query_schedule.schedule_after_dsec(delta_dsec, event);
+                // Queue the queries. The first query of every round is sent as soon
+                // as the report has been processed, along with every other query
+                // that the report's records have triggered.
+                queue_group_specific_queries(iface, multicast_address, query_action);
             }
+            break;
+        default:
+            // Ignore group records with unknown types.
+            IGMP_ROUTER_DEBUG(1, "%s: ignoring group record with unknown type %d", name().c_str(), type_index);
+            continue;
         }
     }
+
+    // Let the data path see the new state all at once.
+    filter.publish();
+
+    flush_group_specific_queries(iface);
     packet->kill();
 }
 
-void IgmpRouter::handle_igmp_membership_query(const IgmpMembershipQuery &query, const IPAddress &source_address)
+void IgmpRouter::handle_igmp_membership_query(
+    Interface &iface, const IgmpMembershipQuery &query, const IPAddress &source_address)
 {
+    auto &filter = iface.filter;
+
     // The spec says the following about membership query handling for routers:
     //
     //
@@ -208,63 +560,26 @@ void IgmpRouter::handle_igmp_membership_query(const IgmpMembershipQuery &query,
     //     compatibility issues between IGMP versions see section 7.
 
     // Update the timers if the S-flag is not set.
-    if (query.is_group_specific_query() && !query.suppress_router_side_processing)
+    //
+    //     Query      Action
+    //     -----      ------
+    //     Q(G,A)     Source Timer for sources in A are lowered to LMQT
+    //     Q(G)       Group Timer is lowered to LMQT
+    if (!query.suppress_router_side_processing)
     {
-        auto record_ptr = filter.get_record(query.group_address);
-        if (record_ptr != nullptr)
+        if (query.is_group_specific_query())
         {
-            record_ptr->timer.schedule_after_dsec(
-                filter.get_router_variables().get_last_member_query_time());
+            filter.lower_group_timer(query.group_address);
+        }
+        else if (!query.is_general_query())
+        {
+            IgmpSourceSet query_sources;
+            query_sources.assign(query.source_addresses);
+            filter.lower_source_timers(query.group_address, query_sources, [](const IPAddress &) {});
         }
     }
 
-    // Check if the our IP address is smaller than the other router's. If so,
-    // then we need to go quiet.
-    if (ntohs(address.addr()) < ntohs(source_address.addr()))
-    {
-        // This meaning of this part of the spec is not abundantly clear:
-        //
-        //     [...] and ceases to send queries on the network if it was
-        //     the previously elected querier. After its Other-Querier Present
-        //     timer expires, it should begin sending General Queries.
-        //
-        // Specifically, it does not answer the following questions:
-        //
-        //     1. When the querier starts to transmit General Queries, should it
-        //        do so as if it was in 'startup' mode? The phrasing of
-        //        "it should begin sending General Queries" seems to hint that
-        //        this is the case.
-        //
-        //     2. Should the querier continue to schedule queries while it is not
-        //        the elected querier and simply not transmit them? Or should
-        //        the scheduling of queries be disabled altogether?
-        //
-        //        The difference between these approaches is observable: if the
-        //        querier schedules a batch of queries and becomes elected querier
-        //        halfway through the batch's schedule, then part of the batch
-        //        will still be transmitted.
-        //
-        // SPEC INTERPRETATION:
-        //
-        //     1. Yes, we should activate 'startup' mode.
-        //
-        //     2. We will clear our schedule and stop the querier from scheduling
-        //        new queries until it becomes the elected querier again.
-        //
-        //        This is arguably a more complicated interpretation than simply
-        //        preventing transmission and it's also a less verbatim way of
-        //        reading the spec, but I believe it to be the most sane approach.
-
-        other_querier_present = true;
-
-        general_query_timer.unschedule();
-        query_schedule.clear();
-
-        other_querier_present_timer = CallbackTimer<OtherQuerierGone>(this);
-        other_querier_present_timer.initialize(this);
-        other_querier_present_timer.schedule_after_dsec(
-            filter.get_router_variables().get_other_querier_present_interval());
-    }
+    elect_querier(iface, source_address);
 
     // Oh, and here's a carefully-hidden part of the spec:
     //
@@ -289,23 +604,91 @@ void IgmpRouter::handle_igmp_membership_query(const IgmpMembershipQuery &query,
     }
 }
 
+void IgmpRouter::elect_querier(Interface &iface, const IPAddress &source_address)
+{
+    // Queries from routers with higher addresses don't affect the election. See
+    // 'IgmpQuerierElection::receive_query'.
+    bool was_querier = iface.is_querier();
+    if (!iface.election.receive_query(source_address))
+    {
+        return;
+    }
+
+    // This meaning of this part of the spec is not abundantly clear:
+    //
+    //     [...] and ceases to send queries on the network if it was
+    //     the previously elected querier. After its Other-Querier Present
+    //     timer expires, it should begin sending General Queries.
+    //
+    // Specifically, it does not answer the following questions:
+    //
+    //     1. When the querier starts to transmit General Queries, should it
+    //        do so as if it was in 'startup' mode?
+    //
+    //     2. Should the querier continue to schedule queries while it is not
+    //        the elected querier and simply not transmit them? Or should
+    //        the scheduling of queries be disabled altogether?
+    //
+    //        The difference between these approaches is observable: if the
+    //        querier schedules a batch of queries and becomes elected querier
+    //        halfway through the batch's schedule, then part of the batch
+    //        will still be transmitted.
+    //
+    // SPEC INTERPRETATION:
+    //
+    //     1. No. The network has had a querier all along, so the hosts' state
+    //        is fresh and a single General Query is enough to bring the new
+    //        querier up to date, without a startup burst that makes every host
+    //        on the network report [Startup Query Count] times. See
+    //        'take_over_as_querier'.
+    //
+    //     2. We will clear our schedule and stop the querier from scheduling
+    //        new queries until it becomes the elected querier again.
+    //
+    //        This is arguably a more complicated interpretation than simply
+    //        preventing transmission and it's also a less verbatim way of
+    //        reading the spec, but I believe it to be the most sane approach.
+
+    auto &vars = iface.filter.get_router_variables();
+    if (was_querier)
+    {
+        IGMP_ROUTER_DEBUG(
+            1, "%s: interface %d yields to querier %s", name().c_str(), iface.index,
+            source_address.unparse().c_str());
+        iface.general_query_timer.unschedule();
+        cancel_group_specific_queries(iface);
+    }
+
+    // The timer is reused: every query from the querier just restarts it.
+    iface.other_querier_present_timer.schedule_after_dsec(vars.get_other_querier_present_interval());
+}
+
+void IgmpRouter::take_over_as_querier(Interface &iface)
+{
+    IGMP_ROUTER_DEBUG(1, "%s: interface %d takes over as querier", name().c_str(), iface.index);
+    iface.election.take_over();
+
+    // Send a single General Query right away and continue at the Query Interval.
+    iface.general_query_timer.schedule_after_dsec(0);
+}
+
 void IgmpRouter::OtherQuerierGone::operator()() const
 {
+    IGMP_LATENCY_SCOPE(elem->latency.timers);
+
     // The spec is somewhat... terse about what happens when the Other-Querier
     // Present timer expires:
     //
     //     After its Other-Querier Present timer expires, it should begin
     //     sending General Queries.
     //
-    // SPEC INTERPRETATION: we will re-initialize the startup period for general
-    // queries once the Other-Querier Present timer expires. We will also set
-    // 'other_querier_present' to false.
+    // SPEC INTERPRETATION: the router becomes the querier again and sends a
+    // General Query right away, but it doesn't restart the startup period.
 
-    elem->other_querier_present = false;
-    elem->init_startup_queries();
+    elem->take_over_as_querier(*iface);
 }
 
-void IgmpRouter::transmit_membership_query(const IgmpMembershipQuery &query)
+void IgmpRouter::transmit_membership_query(Interface &iface, const IgmpMembershipQuery &query)
 {
     // Create the packet.
     size_t tailroom = 0;
@@ -319,50 +702,173 @@ void IgmpRouter::transmit_membership_query(const IgmpMembershipQuery &query)
     auto data_ptr = packet->data();
     query.write(data_ptr);
 
-    // Set its destination IP.
+    // Set its destination IP and the interface to send it on.
     packet->set_dst_ip_anno(all_systems_multicast_address);
+    SET_PAINT_ANNO(packet, iface.index);
+    stats.queries_sent++;
 
     // Push it out.
     output(0).push(packet);
 }
 
-void IgmpRouter::SendGroupSpecificQuery::operator()() const
+void IgmpRouter::queue_group_specific_queries(
+    Interface &iface, const IPAddress &group_address, const IgmpRouterQueryAction &action)
 {
-    click_chatter("IGMP router: querying multicast group %s", group_address.unparse().c_str());
+    // According to the spec:
+    //
+    //     6.6.3.1. Building and Sending Group Specific Queries
+    //
+    //     When a table action "Send Q(G)" is encountered, then the group timer
+    //     must be lowered to LMQT. The router must then immediately send a
+    //     group specific query as well as schedule [Last Member Query Count -
+    //     1] query retransmissions to be sent every [Last Member Query
+    //     Interval] over [Last Member Query Time].
+    //
+    //     6.6.3.2. Building and Sending Group and Source Specific Queries
+    //
+    //     When a table action "Send Q(G,X)" is encountered by a querier in the
+    //     table in section 6.4.2, the following actions must be performed for
+    //     each of the sources in X of group G, with source timer larger than
+    //     LMQT:
+    //
+    //         o Set number of retransmissions for each source to [Last Member
+    //           Query Count].
+    //
+    //         o Lower source timer to LMQT.
+    //
+    //     The router must then immediately send a group and source specific
+    //     query as well as schedule [Last Member Query Count - 1] query
+    //     retransmissions to be sent every [Last Member Query Interval] over
+    //     [Last Member Query Time].
+    //
+    // A new round of queries supersedes whatever was left of the previous round
+    // for the same group or source, so they never have more than one round in
+    // flight.
+    auto pending_ptr = iface.pending_group_queries.findp(group_address);
+    IgmpPendingGroupQuery new_pending;
+    auto &pending = pending_ptr != nullptr ? *pending_ptr : new_pending;
+    if (!iface.filter.queue_group_queries(group_address, action, pending))
+    {
+        return;
+    }
+
+    pending.due = Timestamp::recent_steady();
+    if (pending_ptr == nullptr)
+    {
+        iface.pending_group_queries.insert(group_address, pending);
+    }
+}
+
+void IgmpRouter::flush_group_specific_queries(Interface &iface)
+{
+    if (iface.pending_group_queries.empty())
+    {
+        return;
+    }
+
+    auto &vars = iface.filter.get_router_variables();
+    auto now = Timestamp::recent_steady();
 
+    // Retransmissions are aligned to query timer ticks, so the rounds of all
+    // groups that were left at about the same time become due together and
+    // can be sent in a single batch.
+    auto next_tick = Timestamp::make_msec(
+        (now.msecval() + group_query_tick_msec - 1) / group_query_tick_msec * group_query_tick_msec);
+    auto interval = Timestamp::make_msec(vars.get_last_member_query_interval() * 100);
+
+    // All queries in a batch share everything but their group address, their
+    // source addresses and their S flag.
     IgmpMembershipQuery query;
     // According to the spec:
     //
     //     The Last Member Query Interval is the Max Response Time used to
     //     calculate the Max Resp Code inserted into Group-Specific Queries sent
     //     in response to Leave Group messages.
-    query.max_resp_time = elem->filter.get_router_variables().get_last_member_query_interval();
+    query.max_resp_time = vars.get_last_member_query_interval();
+    query.robustness_variable = vars.get_robustness_variable();
+    query.query_interval = vars.get_query_interval();
 
-    // Set the query's group address.
-    query.group_address = group_address;
+    Vector<IPAddress> finished_groups;
+    Timestamp next_due;
+    for (auto it = iface.pending_group_queries.begin(); it != iface.pending_group_queries.end(); ++it)
+    {
+        auto &pending = it.value();
+        if (pending.due > now)
+        {
+            if (!next_due || pending.due < next_due)
+                next_due = pending.due;
+            continue;
+        }
 
-    // Spec says:
-    //
-    //     When transmitting a group specific query, if the group timer is
-    //     larger than LMQT, the "Suppress Router-Side Processing" bit is set in
-    //     the query message.
-    auto record_ptr = elem->filter.get_record(group_address);
-    auto lmqt = elem->filter.get_router_variables().get_last_member_query_time();
-    if (record_ptr->timer.scheduled() && record_ptr->timer.remaining_time_dsec() > lmqt)
+        // Set the query's group address.
+        query.group_address = it.key();
+        iface.filter.send_group_query_round(
+            it.key(), pending, [this, &iface, &query](const Vector<IPAddress> &source_addresses, bool suppress) {
+                query.suppress_router_side_processing = suppress;
+                if (source_addresses.size() == 0)
+                    transmit_membership_query(iface, query);
+                else
+                    transmit_group_and_source_specific_queries(iface, query, source_addresses);
+            });
+
+        if (pending.finished())
+        {
+            finished_groups.push_back(it.key());
+            continue;
+        }
+
+        pending.due = next_tick + interval;
+        if (!next_due || pending.due < next_due)
+            next_due = pending.due;
+    }
+
+    for (const auto &group_address : finished_groups)
+    {
+        iface.pending_group_queries.erase(group_address);
+    }
+
+    if (next_due)
+    {
+        iface.group_query_timer.schedule_at_steady(next_due);
+    }
+    else
+    {
+        iface.group_query_timer.unschedule();
+    }
+}
+
+void IgmpRouter::transmit_group_and_source_specific_queries(
+    Interface &iface, IgmpMembershipQuery &query, const Vector<IPAddress> &source_addresses)
+{
+    for (int start = 0; start < source_addresses.size(); start += max_query_source_count)
     {
-        query.suppress_router_side_processing = true;
+        query.source_addresses.clear();
+        for (int i = start; i < source_addresses.size() && i < start + max_query_source_count; i++)
+        {
+            query.source_addresses.push_back(source_addresses[i]);
+        }
+        transmit_membership_query(iface, query);
     }
+    query.source_addresses.clear();
+}
 
-    query.robustness_variable = elem->filter.get_router_variables().get_robustness_variable();
+void IgmpRouter::cancel_group_specific_queries(Interface &iface)
+{
+    iface.pending_group_queries.clear();
+    iface.group_query_timer.unschedule();
+}
 
-    query.query_interval = elem->filter.get_router_variables().get_query_interval();
+void IgmpRouter::FlushGroupQueries::operator()() const
+{
+    IGMP_LATENCY_SCOPE(elem->latency.timers);
 
-    // Transmit the query.
-    elem->transmit_membership_query(query);
+    elem->flush_group_specific_queries(*iface);
 }
 
 void IgmpRouter::SendPeriodicGeneralQuery::operator()() const
 {
+    IGMP_LATENCY_SCOPE(elem->latency.timers);
+
     // IGMP routers should send periodic general queries, but the spec isn't abundantly
     // clear on when and how that should happen. What little information the spec holds
     // is scattered across various chapters.
@@ -414,52 +920,584 @@ void IgmpRouter::SendPeriodicGeneralQuery::operator()() const
     //
     // SPEC INTERPRETATION: we will send out [Startup Query Count] *General*
     // Queries with an interval of [Startup Query Interval] between them.
-    // To do so, we maintain a counter ('startup_general_queries_remaining') which
+    // To do so, the querier election keeps a counter of startup queries which
     // is set to the [Startup Query Count] at configure-time and is decremented
     // on every 'startup' General Query send. Once the counter reaches zero,
     // the [Query Interval] is used to space General Queries instead.
 
+    // Let the adaptive controller, if any, pick the variables that this query
+    // advertises and that the next one is scheduled by.
+    iface->load_controller.adjust(iface->filter.get_router_variables());
+
     // Construct a General Query.
     IgmpMembershipQuery query;
-    query.max_resp_time = elem->filter.get_router_variables().get_query_response_interval();
-    query.robustness_variable = elem->filter.get_router_variables().get_robustness_variable();
-    query.query_interval = elem->filter.get_router_variables().get_query_interval();
+    query.max_resp_time = iface->filter.get_router_variables().get_query_response_interval();
+    query.robustness_variable = iface->filter.get_router_variables().get_robustness_variable();
+    query.query_interval = iface->filter.get_router_variables().get_query_interval();
 
     // Transmit the Query.
-    elem->transmit_membership_query(query);
+    elem->transmit_membership_query(*iface, query);
 
-    // Reschedule the General Query timer.
-    auto interval = elem->filter.get_router_variables().get_query_interval();
-    elem->startup_general_queries_remaining--;
-    if (elem->startup_general_queries_remaining > 0)
+    // Reschedule the General Query timer. A querier that has taken over from
+    // another one has no startup queries left to begin with.
+    auto interval = iface->filter.get_router_variables().get_query_interval();
+    if (iface->election.count_general_query())
     {
-        interval = elem->filter.get_router_variables().get_startup_query_interval();
+        interval = iface->filter.get_router_variables().get_startup_query_interval();
     }
-    elem->general_query_timer.reschedule_after_dsec(interval);
+    iface->general_query_timer.reschedule_after_dsec(interval);
 }
 
 int IgmpRouter::config(const String &conf, Element *e, void *, ErrorHandler *errh)
 {
     IgmpRouter *self = (IgmpRouter *)e;
-    IgmpRouterVariables &router_vars = self->filter.get_router_variables();
-    if (cp_va_kparse(
-            conf, self, errh,
-            "ROBUSTNESS", cpkN, cpUnsigned, &router_vars.get_robustness_variable(),
-            "QUERY_INTERVAL", cpkN, cpUnsigned, &router_vars.get_query_interval(),
-            "QUERY_RESPONSE_INTERVAL", cpkN, cpUnsigned, &router_vars.get_query_response_interval(),
-            "LAST_MEMBER_QUERY_INTERVAL", cpkN, cpUnsigned, &router_vars.get_last_member_query_interval(),
-            "STARTUP_QUERY_COUNT", cpkN, cpUnsigned, &router_vars.get_startup_query_count(),
-            "STARTUP_QUERY_INTERVAL", cpkN, cpUnsigned, &router_vars.get_startup_query_interval(),
-            "LAST_MEMBER_QUERY_COUNT", cpkN, cpUnsigned, &router_vars.get_last_member_query_count(),
-            cpEnd) < 0)
-        return -1;
-    else
+
+    // The 'INTERFACE index' argument selects a single interface to configure. All
+    // interfaces are configured if it is absent.
+    Vector<String> args;
+    cp_argvec(conf, args);
+    int interface_index = -1;
+    for (int i = 0; i < args.size(); i++)
+    {
+        String keyword, rest;
+        if (cp_keyword(args[i], &keyword, &rest) && keyword == "INTERFACE")
+        {
+            if (!cp_integer(rest, &interface_index) || self->get_interface(interface_index) == nullptr)
+                return errh->error("INTERFACE must be the index of an interface, got '%s'", rest.c_str());
+            args.erase(args.begin() + i);
+            break;
+        }
+    }
+
+    // Every interface's settings are parsed and checked before any of them is
+    // applied, so a write that fails leaves all interfaces as they were.
+    struct Settings
+    {
+        Interface *iface;
+        IgmpRouterVariables router_vars;
+        bool fast_leave;
+        unsigned int adaptive_report_rate;
+        unsigned int adaptive_max_query_interval;
+    };
+    Vector<Settings> settings;
+    for (auto iface : self->interfaces)
+    {
+        if (interface_index >= 0 && iface->index != interface_index)
+            continue;
+
+        // Adapted variables are reconfigured relative to the configured ones.
+        Settings iface_settings;
+        iface_settings.iface = iface;
+        iface_settings.router_vars = iface->filter.get_router_variables();
+        iface->load_controller.restore_baseline(iface_settings.router_vars);
+        iface_settings.fast_leave = iface->filter.get_host_tracking();
+        iface_settings.adaptive_report_rate = iface->load_controller.get_target_report_rate();
+        iface_settings.adaptive_max_query_interval = iface->load_controller.get_max_query_interval();
+        IgmpRouterVariables &router_vars = iface_settings.router_vars;
+        if (cp_va_kparse(
+                args, self, errh,
+                "ROBUSTNESS", cpkN, cpUnsigned, &router_vars.get_robustness_variable(),
+                "QUERY_INTERVAL", cpkN, cpUnsigned, &router_vars.get_query_interval(),
+                "QUERY_RESPONSE_INTERVAL", cpkN, cpUnsigned, &router_vars.get_query_response_interval(),
+                "LAST_MEMBER_QUERY_INTERVAL", cpkN, cpUnsigned, &router_vars.get_last_member_query_interval(),
+                "STARTUP_QUERY_COUNT", cpkN, cpUnsigned, &router_vars.get_startup_query_count(),
+                "STARTUP_QUERY_INTERVAL", cpkN, cpUnsigned, &router_vars.get_startup_query_interval(),
+                "LAST_MEMBER_QUERY_COUNT", cpkN, cpUnsigned, &router_vars.get_last_member_query_count(),
+                "FAST_LEAVE", cpkN, cpBool, &iface_settings.fast_leave,
+                "ADAPTIVE_REPORT_RATE", cpkN, cpUnsigned, &iface_settings.adaptive_report_rate,
+                "ADAPTIVE_MAX_QUERY_INTERVAL", cpkN, cpUnsigned, &iface_settings.adaptive_max_query_interval,
+                cpEnd) < 0)
+        {
+            return -1;
+        }
+
+        if (iface_settings.adaptive_max_query_interval != 0 &&
+            iface_settings.adaptive_max_query_interval < router_vars.get_query_interval())
+        {
+            return errh->error("ADAPTIVE_MAX_QUERY_INTERVAL must be at least QUERY_INTERVAL");
+        }
+        settings.push_back(iface_settings);
+    }
+
+    for (const auto &iface_settings : settings)
+    {
+        auto iface = iface_settings.iface;
+        IgmpRouterVariables &router_vars = iface->filter.get_router_variables();
+        IgmpRouterVariables adapted_vars = router_vars;
+        router_vars = iface_settings.router_vars;
+
+        // The controller only starts over if one of its settings changes, so that
+        // setting, say, the Last Member Query Interval doesn't throw away the load
+        // and loss that it has measured.
+        if (iface->load_controller.is_configured(
+                iface_settings.adaptive_report_rate, iface_settings.adaptive_max_query_interval, router_vars))
+            iface->load_controller.restore_adapted(router_vars, adapted_vars);
+        else
+            iface->load_controller.configure(
+                iface_settings.adaptive_report_rate, iface_settings.adaptive_max_query_interval, router_vars);
+
+        // Fast leave means that the router tracks every host's state, so it
+        // knows when the last host stops listening to a group or source.
+        iface->filter.set_host_tracking(iface_settings.fast_leave);
+    }
+    return 0;
+}
+
+enum
+{
+    h_forwarded,
+    h_dropped,
+    h_reports,
+    h_queries_received,
+    h_queries_sent,
+    h_bad_packets,
+    h_group_records,
+    h_records_created,
+    h_records_expired,
+    h_sources_expired,
+    h_rate_limited,
+    h_queue_drops,
+    h_queue_length,
+    h_stats,
+    h_querier,
+    h_adaptive,
+    h_debug
+};
+
+String IgmpRouter::read_stat(Element *e, void *thunk)
+{
+    IgmpRouter *self = (IgmpRouter *)e;
+    const Stats &stats = self->stats;
+
+    IgmpRouterFilterStats filter_stats;
+    for (auto iface : self->interfaces)
+    {
+        const auto &iface_stats = iface->filter.get_stats();
+        filter_stats.records_created += iface_stats.records_created;
+        filter_stats.records_expired += iface_stats.records_expired;
+        filter_stats.sources_expired += iface_stats.sources_expired;
+    }
+
+    StringAccum sa;
+    switch ((intptr_t)thunk)
+    {
+    case h_forwarded:
+        return String(stats.forwarded.value());
+    case h_dropped:
+        return String(stats.dropped.value());
+    case h_reports:
+        return String(stats.reports_received);
+    case h_queries_received:
+        return String(stats.queries_received);
+    case h_queries_sent:
+        return String(stats.queries_sent);
+    case h_bad_packets:
+        return String(stats.bad_packets);
+    case h_group_records:
+        for (int i = 1; i < 7; i++)
+        {
+            sa << get_igmp_v3_group_record_type_string((IgmpV3GroupRecordType)i) << ' ' << stats.group_records[i] << '\n';
+        }
+        sa << "unknown " << stats.group_records[0] << '\n';
+        return sa.take_string();
+    case h_records_created:
+        return String(filter_stats.records_created);
+    case h_records_expired:
+        return String(filter_stats.records_expired);
+    case h_sources_expired:
+        return String(filter_stats.sources_expired);
+    case h_rate_limited:
+        return String(stats.rate_limited);
+    case h_queue_drops:
+        return String(stats.queue_drops);
+    case h_queue_length:
+        return String(self->igmp_queue.size());
+    case h_stats:
+        sa << "forwarded " << stats.forwarded.value() << '\n'
+           << "dropped " << stats.dropped.value() << '\n'
+           << "reports " << stats.reports_received << '\n'
+           << "queries_received " << stats.queries_received << '\n'
+           << "queries_sent " << stats.queries_sent << '\n'
+           << "bad_packets " << stats.bad_packets << '\n'
+           << "records_created " << filter_stats.records_created << '\n'
+           << "records_expired " << filter_stats.records_expired << '\n'
+           << "sources_expired " << filter_stats.sources_expired << '\n'
+           << "rate_limited " << stats.rate_limited << '\n'
+           << "queue_drops " << stats.queue_drops << '\n'
+           << "queue_length " << self->igmp_queue.size() << '\n';
+        for (int i = 1; i < 7; i++)
+        {
+            sa << get_igmp_v3_group_record_type_string((IgmpV3GroupRecordType)i) << ' ' << stats.group_records[i] << '\n';
+        }
+        sa << "unknown " << stats.group_records[0] << '\n';
+        return sa.take_string();
+    case h_querier:
+        for (auto iface : self->interfaces)
+        {
+            sa << iface->index << (iface->is_querier() ? " querier " : " non-querier ")
+               << iface->election.get_querier_address().unparse() << '\n';
+        }
+        return sa.take_string();
+    case h_adaptive:
+        for (auto iface : self->interfaces)
+        {
+            const auto &vars = iface->filter.get_router_variables();
+            sa << iface->index << " records " << iface->load_controller.get_mean_records_per_query()
+               << " loss " << iface->load_controller.get_loss_permille()
+               << " robustness " << vars.get_robustness_variable()
+               << " query_interval " << vars.get_query_interval()
+               << " query_response_interval " << vars.get_query_response_interval() << '\n';
+        }
+        return sa.take_string();
+    case h_debug:
+        return String(self->debug_level);
+    default:
+        return String();
+    }
+}
+
+/// Prints a single group record.
+static void unparse_record(
+    StringAccum &sa, int index, const IPAddress &multicast_address, const IgmpRouterFilterRecord &record)
+{
+    bool exclude = record.filter_mode == IgmpFilterMode::Exclude;
+    sa << "group " << index << ' ' << multicast_address.unparse() << ' '
+       << (exclude ? "exclude " : "include ") << (exclude ? record.timer.remaining_time_dsec() : 0);
+    for (const auto &source_record : record.source_records)
+    {
+        sa << ' ' << source_record.get_source_address().unparse() << '/' << source_record.remaining_time_dsec();
+    }
+    for (const auto &address : record.excluded_addresses)
+    {
+        sa << " !" << address.unparse();
+    }
+    sa << '\n';
+}
+
+void IgmpRouter::unparse_records(StringAccum &sa, const Interface &iface) const
+{
+    iface.filter.for_each_record([&sa, &iface](const IPAddress &multicast_address, const IgmpRouterFilterRecord &record) {
+        unparse_record(sa, iface.index, multicast_address, record);
+    });
+}
+
+String IgmpRouter::read_groups(Element *e, void *)
+{
+    IgmpRouter *self = (IgmpRouter *)e;
+    StringAccum sa;
+    sa << "generation " << self->generation << '\n';
+    for (auto iface : self->interfaces)
+    {
+        self->unparse_records(sa, *iface);
+    }
+    return sa.take_string();
+}
+
+int IgmpRouter::read_changes(int, String &data, Element *e, const Handler *, ErrorHandler *errh)
+{
+    IgmpRouter *self = (IgmpRouter *)e;
+    uint64_t since_generation;
+    if (!cp_integer(cp_uncomment(data), &since_generation))
+        return errh->error("expected a generation, got '%s'", data.c_str());
+
+    // Every interface must still know all changes since the given generation,
+    // or else the collector gets a full dump.
+    bool complete = true;
+    for (auto iface : self->interfaces)
+    {
+        complete = complete && iface->filter.for_each_change_since(since_generation, [](const IPAddress &) {});
+    }
+
+    StringAccum sa;
+    sa << "generation " << self->generation << (complete ? "\n" : " full\n");
+    for (auto iface : self->interfaces)
+    {
+        if (!complete)
+        {
+            self->unparse_records(sa, *iface);
+            continue;
+        }
+
+        // A group that has changed several times is printed only once.
+        HashMap<IPAddress, bool> printed;
+        iface->filter.for_each_change_since(since_generation, [&](const IPAddress &multicast_address) {
+            if (printed.findp(multicast_address) != nullptr)
+                return;
+            printed.insert(multicast_address, true);
+
+            auto record_ptr = iface->filter.get_record(multicast_address);
+            if (record_ptr == nullptr)
+                sa << "deleted " << iface->index << ' ' << multicast_address.unparse() << '\n';
+            else
+                unparse_record(sa, iface->index, multicast_address, *record_ptr);
+        });
+    }
+    data = sa.take_string();
+    return 0;
+}
+
+String IgmpRouter::take_snapshot() const
+{
+    uint64_t taken_msec = Timestamp::now().msecval();
+    IgmpRouterSnapshotHeader header;
+    header.magic = htonl(igmp_router_snapshot_magic);
+    header.version = htons(igmp_router_snapshot_version);
+    header.interface_count = htons(interfaces.size());
+    header.taken_msec_high = htonl((uint32_t)(taken_msec >> 32));
+    header.taken_msec_low = htonl((uint32_t)taken_msec);
+
+    StringAccum sa;
+    sa.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (auto iface : interfaces)
+    {
+        IgmpRouterSnapshotInterfaceHeader iface_header;
+        iface_header.address = iface->address.addr();
+        iface_header.record_count = htonl(iface->filter.get_record_count());
+        sa.append(reinterpret_cast<const char *>(&iface_header), sizeof(iface_header));
+        iface->filter.write_snapshot_records(sa);
+    }
+    return sa.take_string();
+}
+
+int IgmpRouter::restore_snapshot(const unsigned char *data, size_t size, ErrorHandler *errh)
+{
+    uint32_t elapsed_dsec = 0;
+    int restored_count = 0;
+
+    // The first pass only checks the snapshot. The second one restores it.
+    for (int pass = 0; pass < 2; pass++)
+    {
+        bool apply = pass == 1;
+        IgmpRouterSnapshotReader reader(data, size);
+        if (!reader.read_header())
+            return errh->error("not a router snapshot, or a snapshot of another version");
+
+        // A clock that has gone back makes the snapshot look as if it was taken just now.
+        uint64_t now_msec = Timestamp::now().msecval();
+        uint64_t taken_msec = reader.get_header().get_taken_msec();
+        uint64_t elapsed = now_msec > taken_msec ? (now_msec - taken_msec) / 100 : 0;
+        elapsed_dsec = elapsed > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)elapsed;
+
+        for (int i = 0; i < ntohs(reader.get_header().interface_count); i++)
+        {
+            auto iface_header = reader.read_interface();
+            if (iface_header == nullptr)
+                return errh->error("truncated snapshot");
+
+            // Interfaces that the router doesn't have anymore are skipped.
+            Interface *iface = nullptr;
+            for (auto candidate : interfaces)
+            {
+                if (candidate->address == IPAddress(iface_header->address))
+                    iface = candidate;
+            }
+            if (apply && iface != nullptr)
+            {
+                iface->filter.erase_all_records();
+                restored_count++;
+            }
+
+            for (uint32_t j = 0; j < ntohl(iface_header->record_count); j++)
+            {
+                auto record = reader.read_record();
+                if (record == nullptr)
+                    return errh->error("truncated snapshot");
+                if (apply && iface != nullptr)
+                    iface->filter.restore_snapshot_record(IgmpRouterSnapshotRecordView(record), elapsed_dsec);
+            }
+        }
+    }
+
+    for (auto iface : interfaces)
+    {
+        iface->filter.publish();
+    }
+    IGMP_ROUTER_DEBUG(
+        1, "%s: restored %d interfaces from a snapshot taken %u dsec ago",
+        name().c_str(), restored_count, elapsed_dsec);
+    return 0;
+}
+
+int IgmpRouter::load_snapshot_file(ErrorHandler *errh)
+{
+#if CLICK_USERLEVEL
+    if (snapshot_file.empty())
         return 0;
+
+    // A missing snapshot is what a router that has never run before sees.
+    int fd = open(snapshot_file.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+            return 0;
+        errh->warning("%s: %s", snapshot_file.c_str(), strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        errh->warning("%s: empty or unreadable snapshot", snapshot_file.c_str());
+        return -1;
+    }
+
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        errh->warning("%s: %s", snapshot_file.c_str(), strerror(errno));
+        return -1;
+    }
+
+    ContextErrorHandler cerrh(errh, "While restoring %s:", snapshot_file.c_str());
+    int result = restore_snapshot((const unsigned char *)data, st.st_size, &cerrh);
+    munmap(data, st.st_size);
+    return result;
+#else
+    return 0;
+#endif
+}
+
+int IgmpRouter::save_snapshot_file(ErrorHandler *errh) const
+{
+#if CLICK_USERLEVEL
+    if (snapshot_file.empty())
+        return errh->error("no SNAPSHOT file configured");
+
+    String snapshot = take_snapshot();
+    String temporary_file = snapshot_file + ".tmp";
+    FILE *f = fopen(temporary_file.c_str(), "wb");
+    if (f == nullptr)
+        return errh->error("%s: %s", temporary_file.c_str(), strerror(errno));
+
+    bool written = fwrite(snapshot.data(), 1, snapshot.length(), f) == (size_t)snapshot.length();
+    written = fclose(f) == 0 && written;
+    if (!written || rename(temporary_file.c_str(), snapshot_file.c_str()) < 0)
+    {
+        int error = errno;
+        unlink(temporary_file.c_str());
+        return errh->error("%s: %s", snapshot_file.c_str(), strerror(error));
+    }
+    return 0;
+#else
+    return errh->error("SNAPSHOT is only supported at user level");
+#endif
+}
+
+String IgmpRouter::read_snapshot(Element *e, void *)
+{
+    IgmpRouter *self = (IgmpRouter *)e;
+    return self->take_snapshot();
+}
+
+int IgmpRouter::write_restore(const String &conf, Element *e, void *, ErrorHandler *errh)
+{
+    IgmpRouter *self = (IgmpRouter *)e;
+    return self->restore_snapshot((const unsigned char *)conf.data(), conf.length(), errh);
+}
+
+int IgmpRouter::write_save_snapshot(const String &, Element *e, void *, ErrorHandler *errh)
+{
+    IgmpRouter *self = (IgmpRouter *)e;
+    return self->save_snapshot_file(errh);
+}
+
+int IgmpRouter::reset_stats(const String &, Element *e, void *, ErrorHandler *)
+{
+    IgmpRouter *self = (IgmpRouter *)e;
+    auto &stats = self->stats;
+    stats.forwarded.clear();
+    stats.dropped.clear();
+    stats.reports_received = 0;
+    stats.queries_received = 0;
+    stats.queries_sent = 0;
+    stats.bad_packets = 0;
+    stats.rate_limited = 0;
+    stats.queue_drops = 0;
+    for (auto &count : stats.group_records)
+    {
+        count = 0;
+    }
+    for (auto iface : self->interfaces)
+    {
+        iface->filter.get_stats() = IgmpRouterFilterStats();
+    }
+    return 0;
+}
+
+int IgmpRouter::write_debug(const String &conf, Element *e, void *, ErrorHandler *errh)
+{
+    IgmpRouter *self = (IgmpRouter *)e;
+    if (!cp_integer(cp_uncomment(conf), &self->debug_level))
+        return errh->error("debug level must be an integer");
+    return 0;
+}
+
+#if IGMP_LATENCY_STATS
+String IgmpRouter::read_latency(Element *e, void *)
+{
+    IgmpRouter *self = (IgmpRouter *)e;
+    const Latency &latency = self->latency;
+
+    StringAccum sa;
+    for (int i = 1; i < 7; i++)
+    {
+        String name = String("record ") + get_igmp_v3_group_record_type_string((IgmpV3GroupRecordType)i);
+        latency.group_records[i].unparse(sa, name.c_str());
+    }
+    latency.group_records[0].unparse(sa, "record unknown");
+    latency.lookups.unparse(sa, "lookup");
+    latency.timers.unparse(sa, "timer");
+    return sa.take_string();
+}
+
+int IgmpRouter::reset_latency(const String &, Element *e, void *, ErrorHandler *)
+{
+    IgmpRouter *self = (IgmpRouter *)e;
+    auto &latency = self->latency;
+    for (auto &histogram : latency.group_records)
+    {
+        histogram.clear();
+    }
+    latency.lookups.clear();
+    latency.timers.clear();
+    return 0;
 }
+#endif
 
 void IgmpRouter::add_handlers()
 {
     add_write_handler("config", &config, (void *)0);
+    add_read_handler("forwarded", &read_stat, (void *)h_forwarded);
+    add_read_handler("dropped", &read_stat, (void *)h_dropped);
+    add_read_handler("reports", &read_stat, (void *)h_reports);
+    add_read_handler("queries_received", &read_stat, (void *)h_queries_received);
+    add_read_handler("queries_sent", &read_stat, (void *)h_queries_sent);
+    add_read_handler("bad_packets", &read_stat, (void *)h_bad_packets);
+    add_read_handler("group_records", &read_stat, (void *)h_group_records);
+    add_read_handler("records_created", &read_stat, (void *)h_records_created);
+    add_read_handler("records_expired", &read_stat, (void *)h_records_expired);
+    add_read_handler("sources_expired", &read_stat, (void *)h_sources_expired);
+    add_read_handler("rate_limited", &read_stat, (void *)h_rate_limited);
+    add_read_handler("queue_drops", &read_stat, (void *)h_queue_drops);
+    add_read_handler("queue_length", &read_stat, (void *)h_queue_length);
+    add_read_handler("stats", &read_stat, (void *)h_stats);
+    add_read_handler("querier", &read_stat, (void *)h_querier);
+    add_read_handler("adaptive", &read_stat, (void *)h_adaptive);
+    add_read_handler("groups", &read_groups, (void *)0);
+    set_handler("changes", Handler::OP_READ | Handler::READ_PARAM, &read_changes);
+    add_read_handler("debug", &read_stat, (void *)h_debug);
+    add_write_handler("debug", &write_debug, (void *)0);
+    add_write_handler("reset_stats", &reset_stats, (void *)0);
+    // Snapshots are binary, so Click mustn't touch their bytes on the way in or out.
+    add_read_handler("snapshot", &read_snapshot, (void *)0, Handler::RAW);
+    add_write_handler("restore", &write_restore, (void *)0, Handler::RAW);
+    add_write_handler("save_snapshot", &write_save_snapshot, (void *)0);
+#if IGMP_LATENCY_STATS
+    add_read_handler("latency", &read_latency, (void *)0);
+    add_write_handler("reset_latency", &reset_latency, (void *)0);
+#endif
 }
 
 CLICK_ENDDECLS
@@ -2,31 +2,61 @@
 
 #include <click/config.h>
 #include <click/element.hh>
+#include <click/hashmap.hh>
+#include <click/straccum.hh>
+#include <click/task.hh>
+#include <click/timestamp.hh>
+#if HAVE_BATCH
+#include <click/batchelement.hh>
+#endif
 #include "CallbackTimer.hh"
-#include "EventSchedule.hh"
+#include "IgmpForwardingIndex.hh"
+#include "IgmpInputLimiter.hh"
 #include "IgmpMessageManip.hh"
+#include "IgmpQuerierElection.hh"
+#include "IgmpQueryLoadController.hh"
 #include "IgmpRouterFilter.hh"
+#include "LatencyHistogram.hh"
+#include "PerThreadCounter.hh"
 
 CLICK_DECLS
 
 class IgmpRouter;
 
+// When built against a batch-capable Click (such as FastClick), the router also
+// accepts whole packet batches on its data input and splits them into a forwarded
+// and a dropped sub-batch.
+#if HAVE_BATCH
+class IgmpRouter : public BatchElement
+#else
 class IgmpRouter : public Element
+#endif
 {
   public:
     IgmpRouter();
     ~IgmpRouter();
 
+    // The router manages any number of interfaces, which are numbered in the
+    // order of their ADDRESS arguments, starting at zero. Every interface has
+    // its own group records, timers and querier state, but all interfaces share
+    // a single element, so IGMP packets are parsed once no matter how many
+    // interfaces there are.
+    //
     // Description of ports:
     //
     //     Input:
     //         0. Incoming IP packets which are filtered based on their source
-    //            address.
+    //            address. The paint annotation of each packet is the index
+    //            of the interface it would be forwarded onto.
     //
-    //         1. Incoming IGMP packets.
+    //         1. Incoming IGMP packets, with their IP header annotation set.
+    //            The paint annotation of each packet is the index of the
+    //            interface it arrived on. These are queued and processed by
+    //            the router's task, see below.
     //
     //     Output:
-    //         0. Generated IGMP packets.
+    //         0. Generated IGMP packets. Their paint annotation is the index
+    //            of the interface they must be sent on.
     //
     //         1. Incoming IP packets which have been filtered based on their
     //            source address.
@@ -34,49 +64,203 @@ class IgmpRouter : public Element
     //         2. Incoming IP packets which were filtered out. The router does
     //            not believe that these are multicast packets intended for a
     //            client on the network.
+    //
+    //         3. Incoming IGMP packets which were dropped without being
+    //            processed, because their source host exceeded its rate or
+    //            because the IGMP queue was full.
+    //
+    // Input 0 may be pushed to from any number of threads at once: forwarding
+    // decisions read a snapshot of the filter state that is published without
+    // locks. IGMP packets, timers and handlers all change that state, so input 1
+    // must be pushed to from the router's home thread only.
+    //
+    // IGMP packets are not processed as they arrive. Every source host has a
+    // token bucket, and the packets that it admits are put in a bounded queue,
+    // which the router's task works through a few packets at a time. A host
+    // that floods the router with large reports thus only ever costs data
+    // packets on the same thread a single task run's worth of latency, and the
+    // packets that don't fit go to output 3 instead of piling up. The
+    // configuration keywords that control this are:
+    //
+    //     HOST_RATE: the number of IGMP packets per second that each source
+    //         host may send, or 0 for no limit. Default: 100.
+    //     HOST_BURST: the number of IGMP packets that a host may send at once,
+    //         on top of its rate. Default: twice HOST_RATE.
+    //     QUEUE_CAPACITY: the number of IGMP packets that may wait to be
+    //         processed. Default: 1024.
+    //     BUDGET: the largest number of IGMP packets that a single task run
+    //         processes. Default: 32.
 
     const char *class_name() const { return "IgmpRouter"; }
-    const char *port_count() const { return "2/3"; }
+    const char *port_count() const { return "2/4"; }
     const char *processing() const { return PUSH; }
 
+    // The router doesn't log anything by default. Its statistics can be read
+    // through handlers instead:
+    //
+    //     forwarded, dropped: the number of data packets that were forwarded
+    //         and dropped, respectively.
+    //     reports, queries_received, queries_sent: the number of IGMP
+    //         membership reports and queries that were received and sent.
+    //     bad_packets: the number of IGMP packets that were ignored because
+    //         they were malformed or arrived on an unknown interface.
+    //     group_records: the number of group records received, by type.
+    //     records_created, records_expired, sources_expired: the number of
+    //         group records created; the number of group records deleted, on
+    //         expiry or because a report left them in INCLUDE mode without
+    //         sources; and the number of source timers that ran out, summed
+    //         over all interfaces.
+    //     rate_limited, queue_drops: the number of IGMP packets that were sent
+    //         to output 3 because their host exceeded its rate, and because the
+    //         IGMP queue was full.
+    //     queue_length: the number of IGMP packets that wait to be processed.
+    //     stats: all of the above.
+    //     querier: one '<interface> querier|non-querier <querier address>'
+    //         line per interface, which tells if the router is the elected
+    //         querier on the interface's network and who is.
+    //     adaptive: one '<interface> records <records> loss <loss>
+    //         robustness <robustness> query_interval <interval>
+    //         query_response_interval <interval>' line per interface, with the
+    //         mean number of current-state records per general query, the
+    //         estimated loss of state-change records in thousandths and the
+    //         variables that the adaptive controller has picked. See below.
+    //
+    // The membership tables can be read as well. Both handlers below print
+    // one line per group record:
+    //
+    //     group <interface> <group> include|exclude <group timer>
+    //         <source>/<source timer>... !<excluded source>...
+    //
+    // with all timers in deciseconds, and the router's current generation on
+    // the first line:
+    //
+    //     groups: every group record of every interface.
+    //     changes <generation>: only the group records whose filter mode or
+    //         sources have changed since the given generation, plus one
+    //         'deleted <interface> <group>' line per deleted record. If the
+    //         router no longer knows all changes since that generation, the
+    //         first line ends in 'full' and all group records are printed, as
+    //         by 'groups'.
+    //
+    // When built with IGMP_LATENCY_STATS, the 'latency' handler prints cycle
+    // histograms of the time it takes to process a group record, by record
+    // type; to decide whether a data packet is forwarded; and to run a timer
+    // callback. Writing to 'reset_latency' clears them. Without that flag,
+    // neither handler exists and nothing is measured.
+    //
+    // When built with IGMP_SSM_ONLY, the router only supports Source-Specific
+    // Multicast: it ignores IS_EX and TO_EX records and never has a group record
+    // in EXCLUDE mode, which makes each group record much smaller.
+    //
+    // The 'config' handler also turns on an adaptive controller, which stretches
+    // the Query Interval and spreads the Query Response Interval when general
+    // queries cause more reports than the router wants to handle, and raises
+    // the Robustness Variable when state-change reports get lost. It never goes
+    // below the configured values, and comes back to them as the load drops.
+    // Its keywords are ADAPTIVE_REPORT_RATE, the number of group records per
+    // second that the controller aims for, or 0 to turn it off, which is the
+    // default; and ADAPTIVE_MAX_QUERY_INTERVAL, the largest Query Interval that
+    // it may pick, in deciseconds. Default: four times the Query Interval. See
+    // IgmpQueryLoadController.hh for the bounds that keep it RFC-safe.
+    //
+    // Writing to 'reset_stats' resets all of these. The 'debug' handler reads
+    // and writes the router's debug level. At level 1, the router logs every
+    // IGMP packet that it receives; at level 2, it logs every group record as
+    // well. The DEBUG configuration keyword sets the initial debug level.
+    //
+    // The membership tables can also be checkpointed, so that a restarted router
+    // forwards traffic right away instead of relearning every group over the
+    // Startup Query period:
+    //
+    //     snapshot: a compact binary snapshot of every interface's group records,
+    //         source records and remaining timers, in the format described in
+    //         IgmpRouterSnapshot.hh.
+    //     restore: replaces the group records of every interface in the given
+    //         snapshot by those in the snapshot. Interfaces are matched by
+    //         address. Timers are re-armed relative to the time at which the
+    //         snapshot was taken, so those that would have run out while the
+    //         router was down expire right away.
+    //     save_snapshot: writes a snapshot to the SNAPSHOT file.
+    //
+    // The SNAPSHOT configuration keyword names a file that the router restores
+    // when it is initialized, if the file exists, and that it saves to when it
+    // is cleaned up. The file is memory-mapped, so even large snapshots are
+    // read in place. The router still sends its startup queries after restoring
+    // a snapshot: they refresh the restored records and catch the hosts that
+    // left while the router was down.
+
     int configure(Vector<String> &, ErrorHandler *);
+    int initialize(ErrorHandler *);
+    void cleanup(CleanupStage stage);
 
     static int config(const String &conf, Element *e, void *thunk, ErrorHandler *errh);
+    static String read_stat(Element *e, void *thunk);
+    static String read_groups(Element *e, void *thunk);
+    static int read_changes(int op, String &data, Element *e, const Handler *handler, ErrorHandler *errh);
+    static int reset_stats(const String &conf, Element *e, void *thunk, ErrorHandler *errh);
+    static int write_debug(const String &conf, Element *e, void *thunk, ErrorHandler *errh);
+    static String read_snapshot(Element *e, void *thunk);
+    static int write_restore(const String &conf, Element *e, void *thunk, ErrorHandler *errh);
+    static int write_save_snapshot(const String &conf, Element *e, void *thunk, ErrorHandler *errh);
+#if IGMP_LATENCY_STATS
+    static String read_latency(Element *e, void *thunk);
+    static int reset_latency(const String &conf, Element *e, void *thunk, ErrorHandler *errh);
+#endif
 
     void add_handlers();
 
     void push(int port, Packet *packet);
 
+#if HAVE_BATCH
+    void push_batch(int port, PacketBatch *batch);
+#endif
+
+    bool run_task(Task *);
+
+    /// Gets the number of interfaces that this router manages.
+    int get_interface_count() const { return interfaces.size(); }
+
+    /// Gets the set of interfaces onto which traffic from the given source to the
+    /// given group should be forwarded, as a mask in which slot i stands for
+    /// interface i. All interfaces share a single forwarding index, so this takes
+    /// one lookup no matter how many interfaces there are. Like input 0, this is
+    /// safe to call from any thread.
+    IgmpSlotMask get_forwarding_mask(const IPAddress &multicast_address, const IPAddress &source_address) const;
+
   private:
+    struct Interface;
+
     /// A timer callback that sends periodic general queries.
     struct SendPeriodicGeneralQuery
     {
         SendPeriodicGeneralQuery()
-            : elem(nullptr)
+            : elem(nullptr), iface(nullptr)
         {
         }
-        SendPeriodicGeneralQuery(IgmpRouter *elem)
-            : elem(elem)
+        SendPeriodicGeneralQuery(IgmpRouter *elem, Interface *iface)
+            : elem(elem), iface(iface)
         {
         }
         IgmpRouter *elem;
+        Interface *iface;
 
         void operator()() const;
     };
 
-    /// A timer callback that sends a group-specific query.
-    struct SendGroupSpecificQuery
+    /// A timer callback that transmits all group-specific queries which are
+    /// due on an interface.
+    struct FlushGroupQueries
     {
-        SendGroupSpecificQuery()
-            : elem(nullptr), group_address()
+        FlushGroupQueries()
+            : elem(nullptr), iface(nullptr)
         {
         }
-        SendGroupSpecificQuery(IgmpRouter *elem, const IPAddress &group_address)
-            : elem(elem), group_address(group_address)
+        FlushGroupQueries(IgmpRouter *elem, Interface *iface)
+            : elem(elem), iface(iface)
         {
         }
         IgmpRouter *elem;
-        IPAddress group_address;
+        Interface *iface;
 
         void operator()() const;
     };
@@ -85,30 +269,208 @@ class IgmpRouter : public Element
     struct OtherQuerierGone
     {
         OtherQuerierGone()
-            : elem(nullptr)
+            : elem(nullptr), iface(nullptr)
         {
         }
-        OtherQuerierGone(IgmpRouter *elem)
-            : elem(elem)
+        OtherQuerierGone(IgmpRouter *elem, Interface *iface)
+            : elem(elem), iface(iface)
         {
         }
         IgmpRouter *elem;
+        Interface *iface;
 
         void operator()() const;
     };
 
+    /// The state of a single interface managed by the router.
+    struct Interface
+    {
+        Interface(IgmpRouter *elem, int index, const IPAddress &address)
+            : index(index), address(address), filter(elem), group_query_timer(elem, this),
+              general_query_timer(elem, this), election(address), other_querier_present_timer(elem, this)
+        {
+        }
+
+        /// Tests if the router is the querier on this interface's network.
+        bool is_querier() const { return election.is_querier(); }
+
+        int index;
+        IPAddress address;
+        IgmpRouterFilter filter;
+
+        /// The group-specific and group-and-source-specific queries that have
+        /// yet to be sent on this interface, by group address. All of them share a single timer,
+        /// and all queries that are due in the same tick are sent by a
+        /// single flush.
+        HashMap<IPAddress, IgmpPendingGroupQuery> pending_group_queries;
+        CallbackTimer<FlushGroupQueries> group_query_timer;
+
+        CallbackTimer<SendPeriodicGeneralQuery> general_query_timer;
+
+        /// Tracks the querier on this interface's network and the startup General
+        /// Queries that are left to send.
+        IgmpQuerierElection election;
+
+        /// Runs while another router is the querier. It is restarted by every query
+        /// from that router, and the router takes over when it runs out.
+        CallbackTimer<OtherQuerierGone> other_querier_present_timer;
+
+        /// Adapts this interface's query variables to the report load, if enabled.
+        IgmpQueryLoadController load_controller;
+    };
+
+    /// Gets the interface with the given index, or null if there is no such interface.
+    Interface *get_interface(int index) const
+    {
+        return index >= 0 && index < interfaces.size() ? interfaces[index] : nullptr;
+    }
+
+    /// Tells if the given data packet should be forwarded.
+    bool should_forward(Packet *packet) const;
+
+    /// Queues an incoming IGMP packet for the router's task, or sends it to
+    /// output 3 if its host has exceeded its rate or the queue is full.
+    void enqueue_igmp_packet(Packet *packet);
+
     void handle_igmp_packet(Packet *packet);
-    void handle_igmp_membership_query(const IgmpMembershipQuery &query, const IPAddress &source_address);
-    void transmit_membership_query(const IgmpMembershipQuery &query);
-    void init_startup_queries();
-
-    IPAddress address;
-    IgmpRouterFilter filter;
-    EventSchedule<SendGroupSpecificQuery> query_schedule;
-    CallbackTimer<SendPeriodicGeneralQuery> general_query_timer;
-    unsigned int startup_general_queries_remaining;
-    bool other_querier_present = false;
-    CallbackTimer<OtherQuerierGone> other_querier_present_timer;
+    void handle_igmp_membership_query(Interface &iface, const IgmpMembershipQuery &query, const IPAddress &source_address);
+    void transmit_membership_query(Interface &iface, const IgmpMembershipQuery &query);
+    void init_startup_queries(Interface &iface);
+
+    /// Applies the querier election rules to a query from the given source.
+    void elect_querier(Interface &iface, const IPAddress &source_address);
+
+    /// Makes the router the querier on the given interface again, after the
+    /// Other Querier Present timer has run out.
+    void take_over_as_querier(Interface &iface);
+
+    /// The granularity of group-specific query retransmissions, in milliseconds.
+    static const uint32_t group_query_tick_msec = 100;
+
+    /// The maximal number of sources in a single group-and-source-specific query.
+    /// Queries with more sources are split, so that none of them exceeds the MTU
+    /// of an Ethernet.
+    static const int max_query_source_count =
+        (1500 - igmp_ip_header_size - sizeof(IgmpMembershipQueryHeader)) / sizeof(uint32_t);
+
+    /// Starts new rounds of [Last Member Query Count] queries for the given group,
+    /// as called for by the given query action. The first queries are sent by the
+    /// next flush.
+    void queue_group_specific_queries(
+        Interface &iface, const IPAddress &group_address, const IgmpRouterQueryAction &action);
+
+    /// Sends every group-specific and group-and-source-specific query that is due on
+    /// the given interface and schedules the interface's query timer for the next
+    /// batch.
+    void flush_group_specific_queries(Interface &iface);
+
+    /// Sends group-and-source-specific queries for the given sources, based on the
+    /// given query. The sources are split across as many queries as necessary.
+    void transmit_group_and_source_specific_queries(
+        Interface &iface, IgmpMembershipQuery &query, const Vector<IPAddress> &source_addresses);
+
+    /// Cancels all group-specific queries that have yet to be sent on the given
+    /// interface.
+    void cancel_group_specific_queries(Interface &iface);
+
+    /// The interfaces managed by this router. They are allocated individually
+    /// because timers refer to them by address.
+    Vector<Interface *> interfaces;
+
+    /// The forwarding index that all interfaces' filters share. Every interface's
+    /// verdicts are kept in the slot that matches its index.
+    IgmpSharedForwardingIndex forwarding_index;
+
+    /// Scratch storage for the queries that a state-change record calls for.
+    IgmpRouterQueryAction query_action;
+
+    /// The statistics that the router keeps, apart from those of its filters.
+    struct Stats
+    {
+        Stats()
+            : reports_received(0), queries_received(0), queries_sent(0), bad_packets(0), rate_limited(0),
+              queue_drops(0), group_records()
+        {
+        }
+
+        /// Data packets are counted per thread, because they can be pushed from
+        /// any thread.
+        PerThreadCounter forwarded;
+        PerThreadCounter dropped;
+
+        uint64_t reports_received;
+        uint64_t queries_received;
+        uint64_t queries_sent;
+        uint64_t bad_packets;
+        uint64_t rate_limited;
+        uint64_t queue_drops;
+
+        /// The number of group records received, by type. Unknown types are
+        /// counted at index zero.
+        uint64_t group_records[7];
+    };
+
+    Stats stats;
+
+    /// The task that processes queued IGMP packets.
+    Task igmp_task;
+
+    /// Limits the rate at which each host's IGMP packets are queued.
+    IgmpHostRateLimiter host_rate_limiter;
+
+    /// The IGMP packets that wait to be processed by the router's task.
+    IgmpPacketQueue igmp_queue;
+
+    /// The largest number of IGMP packets that a single run of the task processes.
+    int igmp_budget = 32;
+
+#if IGMP_LATENCY_STATS
+    /// The latency histograms that the router keeps if built with IGMP_LATENCY_STATS.
+    /// Each has a slot per thread, like the data packet counters.
+    struct Latency
+    {
+        /// The time it takes to process a group record, by type. Unknown types are
+        /// measured at index zero.
+        LatencyHistogram group_records[7];
+
+        /// The time it takes to decide whether a data packet is forwarded.
+        LatencyHistogram lookups;
+
+        /// The time it takes to run a timer callback, including the filters' timers.
+        LatencyHistogram timers;
+    };
+
+    /// Mutable because forwarding decisions are made by const methods.
+    mutable Latency latency;
+#endif
+
+    /// The generation counter that all interfaces' filters share, so that a single
+    /// generation describes the whole router.
+    uint64_t generation = 0;
+
+    /// Prints the given interface's group records to the given string accumulator.
+    void unparse_records(StringAccum &sa, const Interface &iface) const;
+
+    /// Takes a snapshot of every interface's group records.
+    String take_snapshot() const;
+
+    /// Restores the given snapshot. The snapshot is checked in full before any
+    /// record is replaced, so a corrupt snapshot leaves the router as it was.
+    int restore_snapshot(const unsigned char *data, size_t size, ErrorHandler *errh);
+
+    /// Restores the SNAPSHOT file, if it exists.
+    int load_snapshot_file(ErrorHandler *errh);
+
+    /// Writes a snapshot to the SNAPSHOT file. The snapshot is written to a
+    /// temporary file first, which then replaces the SNAPSHOT file, so a router
+    /// that dies halfway through never leaves a torn snapshot behind.
+    int save_snapshot_file(ErrorHandler *errh) const;
+
+    /// The file that the router's snapshot is restored from and saved to, if any.
+    String snapshot_file;
+
+    /// The router's debug level. Nothing is logged at level zero.
+    int debug_level = 0;
 };
 
 CLICK_ENDDECLS
\ No newline at end of file
@@ -3,24 +3,36 @@
 #include <click/config.h>
 #include <click/element.hh>
 #include <click/hashmap.hh>
+#include <click/straccum.hh>
 #include <click/vector.hh>
 #include <click/timer.hh>
 #include <clicknet/ip.h>
-#include "CallbackTimer.hh"
+#include "IgmpForwardingIndex.hh"
 #include "IgmpMessage.hh"
 #include "IgmpMemberFilter.hh"
+#include "IgmpRouterFilterPolicy.hh"
+#include "IgmpRouterSnapshot.hh"
 #include "IgmpRouterVariables.hh"
+#include "IgmpSourceSet.hh"
+#include "LatencyHistogram.hh"
+#include "TimerWheel.hh"
 
 CLICK_DECLS
 
-class IgmpRouterFilter;
-
-/// A callback for source record timers.
-class IgmpRouterSourceRecordCallback final
+/// A callback for the group and source timers of an IGMP router filter.
+template <typename TFilter>
+class IgmpRouterTimerCallback final
 {
   public:
-    IgmpRouterSourceRecordCallback(const IPAddress &multicast_address, const IPAddress &source_address, IgmpRouterFilter *filter)
-        : multicast_address(multicast_address), source_address(source_address), filter(filter)
+    /// Creates a callback for a group timer.
+    IgmpRouterTimerCallback(const IPAddress &multicast_address, TFilter *filter)
+        : multicast_address(multicast_address), source_address(), is_source_timer(false), filter(filter)
+    {
+    }
+
+    /// Creates a callback for a source timer.
+    IgmpRouterTimerCallback(const IPAddress &multicast_address, const IPAddress &source_address, TFilter *filter)
+        : multicast_address(multicast_address), source_address(source_address), is_source_timer(true), filter(filter)
     {
     }
 
@@ -29,69 +41,122 @@ class IgmpRouterSourceRecordCallback final
   private:
     IPAddress multicast_address;
     IPAddress source_address;
-    IgmpRouterFilter *filter;
+    bool is_source_timer;
+    TFilter *filter;
 };
 
-/// Represents an IGMP source record in a router group record.
-class IgmpRouterSourceRecord final
+/// Represents an IGMP source record in a router group record. Its timer is an
+/// entry in the filter's timer wheel. Source records of filters without timers
+/// have no timer, as specialized below.
+template <typename TTimer>
+class IgmpBasicRouterSourceRecord final
 {
   public:
-    IgmpRouterSourceRecord(const IPAddress &multicast_address, const IPAddress &source_address, IgmpRouterFilter *filter)
-        : source_address(source_address), timer(multicast_address, source_address, filter)
+    IgmpBasicRouterSourceRecord()
+        : source_address(), timer()
+    {
+    }
+
+    IgmpBasicRouterSourceRecord(const IPAddress &source_address, const TTimer &timer)
+        : source_address(source_address), timer(timer)
     {
     }
 
     IPAddress get_source_address() const { return source_address; }
 
-    void initialize(Element *owner)
+    void schedule_after_dsec(uint32_t delta_dsec)
     {
-        timer.initialize(owner);
+        timer.schedule_after_dsec(delta_dsec);
     }
 
-    void schedule_after_sec(uint32_t delta_sec)
+    /// Tests if this source record's timer is running.
+    bool scheduled() const
     {
-        timer.schedule_after_sec(delta_sec);
+        return timer.scheduled();
     }
 
-    void schedule_after_msec(uint32_t delta_msec)
+    /// Gets the amount of time until this source record's timer expires, in deciseconds.
+    uint32_t remaining_time_dsec() const
     {
-        timer.schedule_after_msec(delta_msec);
+        return timer.remaining_time_dsec();
     }
 
-    void schedule_after_dsec(uint32_t delta_dsec)
+    /// Releases this source record's timer. This must be done before the source record
+    /// is erased.
+    void release()
     {
-        schedule_after_msec(delta_dsec * 100);
+        timer.release();
     }
 
   private:
     IPAddress source_address;
-    CallbackTimer<IgmpRouterSourceRecordCallback> timer;
+    TTimer timer;
 };
 
-/// A callback that converts group records in exclude mode to group records
-/// in include mode.
-class IgmpRouterGroupRecordCallback final
+/// A source record without a timer, which is just a source address: a null timer
+/// member would double the record's size with padding.
+template <>
+class IgmpBasicRouterSourceRecord<IgmpNullTimer> final
 {
   public:
-    IgmpRouterGroupRecordCallback()
-        : multicast_address(), filter(nullptr)
+    IgmpBasicRouterSourceRecord()
+        : source_address()
     {
     }
 
-    IgmpRouterGroupRecordCallback(const IPAddress &multicast_address, IgmpRouterFilter *filter)
-        : multicast_address(multicast_address), filter(filter)
+    IgmpBasicRouterSourceRecord(const IPAddress &source_address, const IgmpNullTimer &)
+        : source_address(source_address)
     {
     }
 
-    void operator()() const;
+    IPAddress get_source_address() const { return source_address; }
+
+    void schedule_after_dsec(uint32_t) {}
+
+    bool scheduled() const { return false; }
+
+    uint32_t remaining_time_dsec() const { return 0; }
+
+    void release() {}
 
   private:
-    IPAddress multicast_address;
-    IgmpRouterFilter *filter;
+    IPAddress source_address;
+};
+
+/// The reception state of a single host for a group, as learned from the host's
+/// own reports. Routers only keep these when they track hosts explicitly.
+struct IgmpRouterHostRecord
+{
+    IgmpRouterHostRecord()
+        : host_address(), filter_mode(IgmpFilterMode::Include), source_addresses()
+    {
+    }
+
+    IgmpRouterHostRecord(const IPAddress &host_address)
+        : host_address(host_address), filter_mode(IgmpFilterMode::Include), source_addresses()
+    {
+    }
+
+    /// The address of the host.
+    IPAddress host_address;
+
+    /// The host's filter mode for the group.
+    IgmpFilterMode filter_mode;
+
+    /// The host's source list for the group.
+    IgmpSourceSet source_addresses;
+
+    /// Tests if the host wants to receive traffic from the given source.
+    bool wants_source(const IPAddress &source_address) const
+    {
+        return source_addresses.contains(source_address) == (filter_mode == IgmpFilterMode::Include);
+    }
 };
 
-/// A record in an IGMP router filter.
-struct IgmpRouterFilterRecord
+/// A record in an IGMP router filter. Its filter mode, group timer and excluded
+/// addresses live in IgmpRouterGroupState, which SSM-only filters slim down.
+template <typename TPolicy, typename TSourceTimer, typename TGroupTimer>
+struct IgmpBasicRouterFilterRecord : public IgmpRouterGroupState<TGroupTimer, TPolicy::any_source_multicast>
 {
     // The spec on this data structure:
     //
@@ -106,28 +171,101 @@ struct IgmpRouterFilterRecord
     // desired set of sources for that group. Each source in the source
     // record list must be forwarded by some router on the network.
 
-    /// The filter record's mode.
-    IgmpFilterMode filter_mode;
+    typedef IgmpBasicRouterSourceRecord<TSourceTimer> source_record_type;
+    typedef typename IgmpRouterSourceListType<source_record_type, TPolicy::inline_source_count>::type source_list_type;
+
+    /// The filter record's list of source addresses and their timers, sorted by
+    /// source address.
+    source_list_type source_records;
+
+    /// Tells if every host that has reported on this group since the record was
+    /// created has been tracked. Only then do the host records tell the whole
+    /// story, and can a router act on them.
+    bool tracks_hosts = false;
 
-    /// The filter record's timer.
-    CallbackTimer<IgmpRouterGroupRecordCallback> timer;
+    /// The reception states of the hosts that have reported on this group, if
+    /// hosts are tracked.
+    Vector<IgmpRouterHostRecord> host_records;
+
+    /// Gets a pointer to the host record for the given address, or null if there
+    /// is no such record.
+    IgmpRouterHostRecord *find_host_record(const IPAddress &host_address)
+    {
+        for (auto &host_record : host_records)
+        {
+            if (host_record.host_address == host_address)
+            {
+                return &host_record;
+            }
+        }
+        return nullptr;
+    }
+
+    /// Tests if any tracked host wants to receive traffic from the given source.
+    bool is_source_wanted_by_hosts(const IPAddress &source_address) const
+    {
+        for (const auto &host_record : host_records)
+        {
+            if (host_record.wants_source(source_address))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
 
-    /// The filter record's list of source addresses and their timers.
-    Vector<IgmpRouterSourceRecord> source_records;
+    /// Tests if any tracked host is in EXCLUDE mode.
+    bool has_exclude_mode_hosts() const
+    {
+        for (const auto &host_record : host_records)
+        {
+            if (host_record.filter_mode == IgmpFilterMode::Exclude)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
 
-    /// The filter record's list of excluded addresses.
-    /// This list must be empty if the filter mode is INCLUDE.
-    Vector<IPAddress> excluded_addresses;
+    /// Gets the index of the first source record whose address is not less than
+    /// the given address.
+    int lower_bound_source_record(const IPAddress &source_address) const
+    {
+        int low = 0, high = source_records.size();
+        while (low < high)
+        {
+            int mid = low + (high - low) / 2;
+            if (IgmpSourceSet::less(source_records[mid].get_source_address(), source_address))
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        return low;
+    }
 
-    /// Gets a list of all source addresses.
-    Vector<IPAddress> get_source_addresses() const
+    /// Gets a pointer to the source record for the given address, or null if there is
+    /// no such record.
+    source_record_type *find_source_record(const IPAddress &source_address)
     {
-        Vector<IPAddress> results;
-        for (const auto &item : source_records)
+        int index = lower_bound_source_record(source_address);
+        if (index < source_records.size() && source_records[index].get_source_address() == source_address)
         {
-            results.push_back(item.get_source_address());
+            return &source_records[index];
         }
-        return results;
+        return nullptr;
+    }
+
+    /// Gets a pointer to the source record for the given address, or null if there is
+    /// no such record.
+    const source_record_type *find_source_record(const IPAddress &source_address) const
+    {
+        return const_cast<IgmpBasicRouterFilterRecord *>(this)->find_source_record(source_address);
+    }
+
+    /// Tests if this record has a source record for the given address.
+    bool has_source_record(const IPAddress &source_address) const
+    {
+        return find_source_record(source_address) != nullptr;
     }
 
     /// Erases all source records which match the given predicate. A Boolean
@@ -135,143 +273,1015 @@ struct IgmpRouterFilterRecord
     template <typename TPredicate>
     bool erase_source_records(const TPredicate &predicate)
     {
-        bool erased_any = false;
-        size_t i = 0;
-        while (i < source_records.size())
+        int j = 0;
+        for (int i = 0; i < source_records.size(); i++)
         {
             if (predicate(source_records[i]))
             {
-                source_records.erase(source_records.begin() + i);
-                erased_any = true;
+                source_records[i].release();
             }
             else
             {
-                i++;
+                source_records[j++] = source_records[i];
             }
         }
+        bool erased_any = j != source_records.size();
+        while (source_records.size() > j)
+        {
+            source_records.pop_back();
+        }
         return erased_any;
     }
+
+    /// Erases the source record for the given address. A Boolean result tells if
+    /// there was such a record.
+    bool erase_source_record(const IPAddress &source_address)
+    {
+        int index = lower_bound_source_record(source_address);
+        if (index < source_records.size() && source_records[index].get_source_address() == source_address)
+        {
+            source_records[index].release();
+            source_records.erase(source_records.begin() + index);
+            return true;
+        }
+        return false;
+    }
+};
+
+/// Describes the queries that a router must send in response to a state-change
+/// record, i.e., the "Send Q(G)" and "Send Q(G,X)" actions of the router state
+/// tables.
+struct IgmpRouterQueryAction
+{
+    IgmpRouterQueryAction()
+        : query_group(false), query_sources()
+    {
+    }
+
+    /// Tells if a group-specific query must be sent.
+    bool query_group;
+
+    /// The sources for which a group-and-source-specific query must be sent.
+    IgmpSourceSet query_sources;
+
+    /// Tests if this action does not call for any queries.
+    bool empty() const
+    {
+        return !query_group && query_sources.size() == 0;
+    }
+
+    /// Resets this action so that it does not call for any queries.
+    void clear()
+    {
+        query_group = false;
+        query_sources.clear();
+    }
+};
+
+/// The group-specific and group-and-source-specific queries that have yet to be
+/// transmitted for a group.
+struct IgmpPendingGroupQuery
+{
+    IgmpPendingGroupQuery()
+        : due(), group_remaining(0), source_remaining()
+    {
+    }
+
+    /// The steady time at which the next queries for the group are due.
+    Timestamp due;
+
+    /// The number of group-specific queries left, including the next one.
+    unsigned int group_remaining;
+
+    /// The number of queries left for each source that has retransmission
+    /// state, including the next one.
+    HashMap<IPAddress, unsigned int> source_remaining;
+
+    /// Tests if all queries for the group have been transmitted.
+    bool finished() const
+    {
+        return group_remaining == 0 && source_remaining.empty();
+    }
+};
+
+/// Counters that describe the life cycle of an IGMP router filter's records.
+struct IgmpRouterFilterStats
+{
+    IgmpRouterFilterStats()
+        : records_created(0), records_expired(0), sources_expired(0)
+    {
+    }
+
+    /// The number of group records that have been created.
+    uint64_t records_created;
+
+    /// The number of group records that have been deleted because their timers
+    /// ran out, or because a report left them in INCLUDE mode without sources.
+    uint64_t records_expired;
+
+    /// The number of source timers that have run out.
+    uint64_t sources_expired;
 };
 
 /// A router "filter" for IGMP packets. It decides which addresses are listened to and which are not.
-class IgmpRouterFilter
+/// The given IgmpRouterFilterPolicy decides, at compile time, if the filter runs timers, if it
+/// supports EXCLUDE mode and how many source records its records keep inline.
+template <typename TPolicy>
+class IgmpBasicRouterFilter
 {
   public:
-    IgmpRouterFilter(Element *owner, bool enable_timers)
-        : owner(owner), enable_timers(enable_timers)
+    typedef IgmpRouterTimerCallback<IgmpBasicRouterFilter> callback_type;
+
+    /// Creates source timers, and group timers too unless the filter is SSM-only.
+    typedef IgmpRouterFilterTimerType<callback_type, TPolicy::enable_timers> source_timer_factory;
+    typedef IgmpRouterFilterTimerType<callback_type, TPolicy::enable_timers && TPolicy::any_source_multicast>
+        group_timer_factory;
+
+    typedef IgmpBasicRouterFilterRecord<TPolicy, typename source_timer_factory::type, typename group_timer_factory::type>
+        record_type;
+    typedef typename record_type::source_record_type source_record_type;
+
+    explicit IgmpBasicRouterFilter(Element *owner)
+        : timers(owner), host_tracking(false),
+          index(&own_index), index_slot(0), own_generation(0), generation(&own_generation), change_log_start(0),
+          truncated_generation(0)
+    {
+        // Timer expiries change verdicts too, but a tick's worth of them is
+        // published at once.
+        timers.set_run_hook(&publish_thunk, this);
+    }
+
+    IgmpBasicRouterFilter(const IgmpBasicRouterFilter &) = delete;
+    IgmpBasicRouterFilter &operator=(const IgmpBasicRouterFilter &) = delete;
+
+    /// Gets the generation of this filter, which is bumped every time a record's filter
+    /// mode or source addresses change, and when a record is created or erased.
+    uint64_t get_generation() const { return *generation; }
+
+    /// Makes this filter draw its generations from the given counter, which may be
+    /// shared with other filters so that their changes can be ordered. This must be
+    /// done before the filter changes for the first time.
+    void set_generation_counter(uint64_t *counter)
+    {
+        generation = counter;
+        truncated_generation = *counter;
+    }
+
+    /// Makes this filter keep its forwarding verdicts in the given slot of the given
+    /// index, which may be shared with other filters so that a single lookup yields
+    /// all of their verdicts. This must be done before the filter changes for the
+    /// first time.
+    void set_forwarding_index(IgmpSharedForwardingIndex *shared_index, int slot)
+    {
+        index = shared_index;
+        index_slot = slot;
+    }
+
+#if IGMP_LATENCY_STATS
+    /// Gets the histogram that records the latency of this filter's timer callbacks,
+    /// if any.
+    LatencyHistogram *get_timer_latency_histogram() const { return timer_latency; }
+
+    /// Makes this filter record the latency of its timer callbacks in the given
+    /// histogram.
+    void set_timer_latency_histogram(LatencyHistogram *histogram) { timer_latency = histogram; }
+
+#endif
+    /// Calls the given action for the multicast address of every record that has
+    /// changed or has been deleted after the given generation, oldest change first.
+    /// A record that has changed more than once may be reported more than once. A
+    /// Boolean result tells if the change log still goes back to the given
+    /// generation; if it doesn't, the action is never called.
+    template <typename TAction>
+    bool for_each_change_since(uint64_t since_generation, const TAction &action) const
+    {
+        if (since_generation < truncated_generation)
+        {
+            return false;
+        }
+
+        for (int i = 0; i < change_log.size(); i++)
+        {
+            const auto &change = change_log[(change_log_start + i) % change_log.size()];
+            if (change.generation > since_generation)
+            {
+                action(change.multicast_address);
+            }
+        }
+        return true;
+    }
+
+    /// Calls the given action for every record in this filter, along with its
+    /// multicast address.
+    template <typename TAction>
+    void for_each_record(const TAction &action) const
     {
+        for (auto it = records.begin(); it != records.end(); ++it)
+        {
+            action(it.key(), it.value());
+        }
+    }
+
+    /// Tells if this filter keeps track of the reception state of individual hosts.
+    bool get_host_tracking() const { return host_tracking; }
+
+    /// Turns tracking of individual hosts on or off. Only records that are created
+    /// while host tracking is on track their hosts, because the hosts of older records
+    /// are unknown.
+    void set_host_tracking(bool enabled)
+    {
+        if (enabled == host_tracking)
+        {
+            return;
+        }
+
+        host_tracking = enabled;
+        if (!enabled)
+        {
+            for (auto it = records.begin(); it != records.end(); ++it)
+            {
+                it.value().tracks_hosts = false;
+                it.value().host_records.clear();
+            }
+        }
+    }
+
+    const IgmpRouterVariables &get_router_variables() const { return vars; }
+    IgmpRouterVariables &get_router_variables() { return vars; }
+
+    const IgmpRouterFilterStats &get_stats() const { return stats; }
+    IgmpRouterFilterStats &get_stats() { return stats; }
+
+    /// Gets a pointer to the record for the given multicast address.
+    record_type *get_record(const IPAddress &multicast_address)
+    {
+        return records.findp(multicast_address);
+    }
+
+    /// Gets a pointer to the record for the given multicast address.
+    const record_type *get_record(const IPAddress &multicast_address) const
+    {
+        return records.findp(multicast_address);
+    }
+
+    /// Gets or creates a source record in the given group record.
+    source_record_type &get_or_create_source_record(
+        record_type &group_record,
+        const IPAddress &multicast_address,
+        const IPAddress &source_address)
+    {
+        int index = group_record.lower_bound_source_record(source_address);
+        if (index < group_record.source_records.size() &&
+            group_record.source_records[index].get_source_address() == source_address)
+        {
+            return group_record.source_records[index];
+        }
+
+        group_record.source_records.insert(
+            group_record.source_records.begin() + index,
+            create_source_record(multicast_address, source_address));
+        return group_record.source_records[index];
+    }
+
+    /// Merges the given set of source addresses into the given group record's source
+    /// records, creating source records where necessary. The given action is applied
+    /// to the source record of every address in the set, along with a Boolean that
+    /// tells if the source record has just been created.
+    template <typename TAction>
+    void merge_source_records(
+        record_type &group_record,
+        const IPAddress &multicast_address,
+        const IgmpSourceSet &source_addresses,
+        const TAction &action)
+    {
+        auto &old_records = group_record.source_records;
+        merge_scratch.clear();
+        int i = 0, j = 0;
+        while (j < source_addresses.size())
+        {
+            if (i < old_records.size() && IgmpSourceSet::less(old_records[i].get_source_address(), source_addresses[j]))
+            {
+                merge_scratch.push_back(old_records[i++]);
+            }
+            else if (i < old_records.size() && old_records[i].get_source_address() == source_addresses[j])
+            {
+                merge_scratch.push_back(old_records[i++]);
+                action(merge_scratch.back(), false);
+                j++;
+            }
+            else
+            {
+                merge_scratch.push_back(create_source_record(multicast_address, source_addresses[j++]));
+                action(merge_scratch.back(), true);
+            }
+        }
+        for (; i < old_records.size(); i++)
+        {
+            merge_scratch.push_back(old_records[i]);
+        }
+        old_records.swap(merge_scratch);
+    }
+
+    /// Creates a new record for the given multicast address, assigns the given filter
+    /// mode to the newly-created record and returns it. A new record has no verdicts
+    /// in the forwarding index yet, so this begins a change to the record, which
+    /// must end with end_record_change.
+    record_type *create_record(const IPAddress &multicast_address, IgmpFilterMode filter_mode)
+    {
+        assert(get_record(multicast_address) == nullptr);
+        indexed_verdicts.indexed = false;
+        indexed_verdicts.addresses.clear();
+        records.insert(multicast_address, record_type());
+        auto record_ptr = records.findp(multicast_address);
+        record_ptr->filter_mode = filter_mode;
+        record_ptr->tracks_hosts = host_tracking;
+        stats.records_created++;
+        record_ptr->timer = group_timer_factory::create(&timers, callback_type(multicast_address, this));
+        return record_ptr;
+    }
+
+    /// Erases the record for the given multicast address, along with its source records.
+    void erase_record(const IPAddress &multicast_address)
+    {
+        auto record_ptr = get_record(multicast_address);
+        if (record_ptr == nullptr)
+        {
+            return;
+        }
+
+        begin_record_change(*record_ptr);
+        erase_changed_record(multicast_address);
+    }
+
+    /// Erases the record for the given multicast address, which is in the middle of a
+    /// change, along with its source records and the verdicts that it had before the
+    /// change. This ends the change.
+    void erase_changed_record(const IPAddress &multicast_address)
+    {
+        auto record_ptr = get_record(multicast_address);
+        assert(record_ptr != nullptr);
+
+        if (indexed_verdicts.indexed)
+        {
+            index->erase_default(multicast_address, index_slot);
+            for (const auto &address : indexed_verdicts.addresses)
+            {
+                index->erase(multicast_address, address, index_slot);
+            }
+        }
+        for (auto &source_record : record_ptr->source_records)
+        {
+            source_record.release();
+        }
+        record_ptr->timer.release();
+        records.erase(multicast_address);
+        log_change(multicast_address);
+    }
+
+    /// Erases every record in this filter.
+    void erase_all_records()
+    {
+        Vector<IPAddress> multicast_addresses;
+        for (auto it = records.begin(); it != records.end(); ++it)
+        {
+            multicast_addresses.push_back(it.key());
+        }
+        for (const auto &multicast_address : multicast_addresses)
+        {
+            erase_record(multicast_address);
+        }
+    }
+
+    /// Gets the number of records in this filter.
+    int get_record_count() const { return records.size(); }
+
+    /// Appends every record in this filter to the given router snapshot, in the
+    /// format described in IgmpRouterSnapshot.hh.
+    void write_snapshot_records(StringAccum &sa) const;
+
+    /// Replaces the record for the snapshot record's multicast address by the
+    /// snapshot record. Its timers are re-armed with the time that remained on them
+    /// when the snapshot was taken, minus the given amount of time that has elapsed
+    /// since. Timers that would have run out in the meantime expire right away, as
+    /// if the router had never stopped.
+    void restore_snapshot_record(const IgmpRouterSnapshotRecordView &snapshot_record, uint32_t elapsed_dsec);
+
+    /// Receives a record that describes a multicast address' current state.
+    void receive_current_state_record(const IPAddress &multicast_address, const IgmpFilterRecord &current_state_record);
+
+    /// Receives a record that describes a multicast address' current state. The record's
+    /// source addresses are read straight from a packet.
+    void receive_current_state_record(
+        const IPAddress &multicast_address,
+        IgmpFilterMode filter_mode,
+        const IgmpSourceSpan &source_addresses)
+    {
+        report_sources.assign(source_addresses.begin(), source_addresses.end());
+        receive_current_state_record(multicast_address, filter_mode, report_sources);
+    }
+
+    /// Receives a record that describes a multicast address' current state. The record's
+    /// source addresses are given as a source set.
+    void receive_current_state_record(
+        const IPAddress &multicast_address,
+        IgmpFilterMode filter_mode,
+        const IgmpSourceSet &source_addresses);
+
+    /// Receives a record that describes a change to a multicast address' state, i.e., a
+    /// TO_IN, TO_EX, ALLOW or BLOCK record. The queries that the change calls for are
+    /// stored in the given query action. Sending them is up to the caller, because only
+    /// the querier sends queries. The record's source addresses are read straight from
+    /// a packet.
+    void receive_state_change_record(
+        const IPAddress &multicast_address,
+        IgmpV3GroupRecordType type,
+        const IgmpSourceSpan &source_addresses,
+        IgmpRouterQueryAction &query_action)
+    {
+        report_sources.assign(source_addresses.begin(), source_addresses.end());
+        receive_state_change_record(multicast_address, type, report_sources, query_action);
+    }
+
+    /// Receives a record that describes a change to a multicast address' state. The
+    /// record's source addresses are given as a source set.
+    void receive_state_change_record(
+        const IPAddress &multicast_address,
+        IgmpV3GroupRecordType type,
+        const IgmpSourceSet &source_addresses,
+        IgmpRouterQueryAction &query_action);
+
+    /// Updates the reception state of the given host for the given group, based on a
+    /// group record of the given type that the host has sent. This does nothing unless
+    /// the group's record tracks hosts. The record's source addresses are read straight
+    /// from a packet.
+    void track_host(
+        const IPAddress &multicast_address,
+        const IPAddress &host_address,
+        IgmpV3GroupRecordType type,
+        const IgmpSourceSpan &source_addresses)
+    {
+        auto record_ptr = get_record(multicast_address);
+        if (record_ptr == nullptr || !record_ptr->tracks_hosts)
+        {
+            return;
+        }
+
+        report_sources.assign(source_addresses.begin(), source_addresses.end());
+        track_host(multicast_address, host_address, type, report_sources);
+    }
+
+    /// Updates the reception state of the given host for the given group. The record's
+    /// source addresses are given as a source set.
+    void track_host(
+        const IPAddress &multicast_address,
+        const IPAddress &host_address,
+        IgmpV3GroupRecordType type,
+        const IgmpSourceSet &source_addresses);
+
+    /// Immediately prunes the sources and the group that the given query action would
+    /// query, but which no tracked host wants anymore. Pruned sources and groups are
+    /// removed from the query action, so no queries are sent for them. This does
+    /// nothing unless the group's record tracks hosts.
+    void fast_leave(const IPAddress &multicast_address, IgmpRouterQueryAction &query_action);
+
+    /// Lowers the given group's group timer to LMQT, if it is larger than that.
+    void lower_group_timer(const IPAddress &multicast_address)
+    {
+        auto record_ptr = get_record(multicast_address);
+        auto lmqt = vars.get_last_member_query_time();
+        if (record_ptr != nullptr && record_ptr->timer.remaining_time_dsec() > lmqt)
+        {
+            record_ptr->timer.schedule_after_dsec(lmqt);
+        }
+    }
+
+    /// Lowers the source timers of the given sources of the given group to LMQT. Only
+    /// timers that are larger than LMQT are lowered; the given action is applied to the
+    /// address of every source whose timer has been lowered.
+    template <typename TAction>
+    void lower_source_timers(
+        const IPAddress &multicast_address,
+        const IgmpSourceSet &source_addresses,
+        const TAction &action)
+    {
+        auto record_ptr = get_record(multicast_address);
+        if (record_ptr == nullptr)
+        {
+            return;
+        }
+
+        auto lmqt = vars.get_last_member_query_time();
+        for (const auto &address : source_addresses)
+        {
+            auto source_ptr = record_ptr->find_source_record(address);
+            if (source_ptr != nullptr && source_ptr->remaining_time_dsec() > lmqt)
+            {
+                source_ptr->schedule_after_dsec(lmqt);
+                action(address);
+            }
+        }
+    }
+
+    /// Carries out the given query action for the given group: lowers the timers of the
+    /// queried group and sources to LMQT and gives them Last Member Query Count
+    /// retransmissions in the given pending queries. A round that is already pending
+    /// for the same group or source is superseded. A Boolean result tells if any
+    /// queries were queued.
+    bool queue_group_queries(
+        const IPAddress &multicast_address,
+        const IgmpRouterQueryAction &query_action,
+        IgmpPendingGroupQuery &pending)
+    {
+        auto count = vars.get_last_member_query_count();
+        if (query_action.empty() || count == 0)
+        {
+            return false;
+        }
+
+        bool queued_any = false;
+        if (query_action.query_group)
+        {
+            lower_group_timer(multicast_address);
+            pending.group_remaining = count;
+            queued_any = true;
+        }
+
+        lower_source_timers(multicast_address, query_action.query_sources, [&pending, &queued_any, count](const IPAddress &address) {
+            pending.source_remaining.insert(address, count);
+            queued_any = true;
+        });
+        return queued_any;
+    }
+
+    /// Sends the next round of the given group's pending queries and counts it off. The
+    /// given function is called once per query as send_query(sources, suppress), where
+    /// sources is empty for a group-specific query and suppress is the query's
+    /// "Suppress Router-Side Processing" flag.
+    template <typename TSendQuery>
+    void send_group_query_round(
+        const IPAddress &multicast_address,
+        IgmpPendingGroupQuery &pending,
+        const TSendQuery &send_query);
+
+    /// Makes all changes to this filter's forwarding verdicts visible to is_listening_to.
+    /// Changes are published in batches, typically once per report, to amortize the
+    /// cost of synchronizing with the data path. The changes of all timers that
+    /// expire in the same tick are published together.
+    void publish()
+    {
+        index->publish();
+    }
+
+    /// Tests if the IGMP filter is listening to the given source address for the given multicast
+    /// address, according to the last published changes. Unlike all other methods, this one is
+    /// safe to call from any thread, concurrently with changes to the filter.
+    bool is_listening_to(const IPAddress &multicast_address, const IPAddress &source_address) const;
+
+    /// Handles the expiry of the given group's group timer.
+    void expire_group_timer(const IPAddress &multicast_address);
+
+    /// Handles the expiry of the given source's source timer.
+    void expire_source_timer(const IPAddress &multicast_address, const IPAddress &source_address);
+
+  private:
+    static void publish_thunk(void *data)
+    {
+        ((IgmpBasicRouterFilter *)data)->publish();
+    }
+
+    /// Applies the current-state transition for the given filter mode and source
+    /// addresses. Sources that are new to an EXCLUDE-mode record that receives an
+    /// EXCLUDE-mode report get a source timer of the given value; the current-state
+    /// table sets them to the GMI, but the state-change table sets them to the group
+    /// timer.
+    void apply_current_state_record(
+        const IPAddress &multicast_address,
+        IgmpFilterMode filter_mode,
+        const IgmpSourceSet &source_addresses,
+        uint32_t new_excluded_source_timer_dsec);
+
+    /// Updates the host records of the given group record with the given action, which
+    /// returns true if it has changed a host record. Host records that end up in
+    /// INCLUDE mode without any sources are erased.
+    template <typename TAction>
+    static void forget_stale_hosts(record_type &record, const TAction &action)
+    {
+        auto &host_records = record.host_records;
+        for (int i = host_records.size() - 1; i >= 0; i--)
+        {
+            if (action(host_records[i]) && host_records[i].filter_mode == IgmpFilterMode::Include &&
+                host_records[i].source_addresses.size() == 0)
+            {
+                host_records.erase(host_records.begin() + i);
+            }
+        }
+    }
+
+    /// Remembers the given group record's verdicts in the forwarding index, so that
+    /// the index only needs to hear about the sources that a change to the record
+    /// adds or removes. This must happen before the record is changed.
+    void begin_record_change(const record_type &record)
+    {
+        indexed_verdicts.indexed = true;
+        indexed_verdicts.filter_mode = record.filter_mode;
+        indexed_verdicts.addresses.clear();
+        if (record.filter_mode == IgmpFilterMode::Exclude)
+        {
+            for (const auto &address : record.excluded_addresses)
+            {
+                indexed_verdicts.addresses.push_back(address);
+            }
+        }
+        else
+        {
+            for (const auto &source_record : record.source_records)
+            {
+                indexed_verdicts.addresses.push_back(source_record.get_source_address());
+            }
+        }
+
+        indexed_verdicts.forwarded_addresses.clear();
+        if (record.filter_mode == IgmpFilterMode::Exclude)
+        {
+            for (const auto &source_record : record.source_records)
+            {
+                indexed_verdicts.forwarded_addresses.push_back(source_record.get_source_address());
+            }
+        }
+    }
+
+    /// Records a change to the record for the given multicast address in the change
+    /// log. The oldest change is forgotten if the log is full.
+    void log_change(const IPAddress &multicast_address)
+    {
+        Change change(++*generation, multicast_address);
+        if (change_log.size() < change_log_capacity)
+        {
+            change_log.push_back(change);
+            return;
+        }
+
+        truncated_generation = change_log[change_log_start].generation;
+        change_log[change_log_start] = change;
+        change_log_start = (change_log_start + 1) % change_log.size();
+    }
+
+    /// Brings the given group record's verdicts in the forwarding index up to date
+    /// with the record, which may have changed since begin_record_change. Every
+    /// change to a record ends here, so this is also where changes are logged. Only
+    /// a new record, a new filter mode or a new set of source records or excluded
+    /// addresses is logged; a report that merely restarts timers is not.
+    void end_record_change(const IPAddress &multicast_address, const record_type &record)
+    {
+        bool changed;
+        if (record.filter_mode == IgmpFilterMode::Exclude)
+        {
+            changed = update_verdicts(multicast_address, true, record.excluded_addresses, [](const IPAddress &address) {
+                return address;
+            });
+
+            // The source records of an EXCLUDE-mode record are forwarded just like
+            // any other source, so the index doesn't notice when they change.
+            changed = !has_source_addresses(record, indexed_verdicts.forwarded_addresses) || changed;
+        }
+        else
+        {
+            changed = update_verdicts(multicast_address, false, record.source_records, [](const source_record_type &source_record) {
+                return source_record.get_source_address();
+            });
+        }
+
+        if (changed)
+        {
+            log_change(multicast_address);
+        }
+    }
+
+    /// Tests if the given group record's source records are for exactly the given
+    /// sorted addresses.
+    static bool has_source_addresses(const record_type &record, const Vector<IPAddress> &addresses)
+    {
+        if (record.source_records.size() != addresses.size())
+        {
+            return false;
+        }
+
+        for (int i = 0; i < addresses.size(); i++)
+        {
+            if (record.source_records[i].get_source_address() != addresses[i])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// Replaces the remembered verdicts for the given multicast address in the
+    /// forwarding index by the given default verdict, plus the opposite verdict for
+    /// every address in the given sorted range. Only addresses that are new to the
+    /// range or gone from it are touched, unless the default verdict changes. A
+    /// Boolean result tells if any verdict has changed.
+    template <typename TRange, typename TGetAddress>
+    bool update_verdicts(
+        const IPAddress &multicast_address, bool default_forward, const TRange &range, const TGetAddress &get_address)
+    {
+        const auto &old_addresses = indexed_verdicts.addresses;
+        if (!indexed_verdicts.indexed || (indexed_verdicts.filter_mode == IgmpFilterMode::Exclude) != default_forward)
+        {
+            // A new default verdict flips every address's verdict, so none of the old
+            // verdicts is worth keeping.
+            for (const auto &address : old_addresses)
+            {
+                index->erase(multicast_address, address, index_slot);
+            }
+            index->set_default(multicast_address, index_slot, default_forward);
+            for (const auto &item : range)
+            {
+                index->set(multicast_address, get_address(item), index_slot, !default_forward);
+            }
+            return true;
+        }
+
+        // Both the old addresses and the range are sorted, so a merge finds the
+        // addresses that either of them lacks.
+        bool changed = false;
+        int i = 0;
+        auto it = range.begin();
+        while (i < old_addresses.size() || it != range.end())
+        {
+            if (it == range.end() || (i < old_addresses.size() && IgmpSourceSet::less(old_addresses[i], get_address(*it))))
+            {
+                index->erase(multicast_address, old_addresses[i], index_slot);
+                changed = true;
+                i++;
+            }
+            else if (i == old_addresses.size() || IgmpSourceSet::less(get_address(*it), old_addresses[i]))
+            {
+                index->set(multicast_address, get_address(*it), index_slot, !default_forward);
+                changed = true;
+                ++it;
+            }
+            else
+            {
+                i++;
+                ++it;
+            }
+        }
+        return changed;
     }
 
-    const IgmpRouterVariables &get_router_variables() const { return vars; }
-    IgmpRouterVariables &get_router_variables() { return vars; }
-
-    /// Gets a pointer to the record for the given multicast address.
-    IgmpRouterFilterRecord *get_record(const IPAddress &multicast_address)
+    /// Creates a source record for the given source address, but does not add it to
+    /// a group record.
+    source_record_type create_source_record(const IPAddress &multicast_address, const IPAddress &source_address)
     {
-        return records.findp(multicast_address);
+        return source_record_type(
+            source_address, source_timer_factory::create(&timers, callback_type(multicast_address, source_address, this)));
     }
 
-    /// Gets a pointer to the record for the given multicast address.
-    const IgmpRouterFilterRecord *get_record(const IPAddress &multicast_address) const
-    {
-        return records.findp(multicast_address);
-    }
+    /// The timer wheel that drives every group and source timer in this filter. It
+    /// is never scheduled if the filter has no timers.
+    TimerWheel<callback_type> timers;
+    IgmpRouterVariables vars;
+    IgmpRouterFilterStats stats;
+    bool host_tracking;
+    HashMap<IPAddress, record_type> records;
 
-    /// Gets or creates a source record in the given group record.
-    IgmpRouterSourceRecord &get_or_create_source_record(
-        IgmpRouterFilterRecord &group_record,
-        const IPAddress &multicast_address,
-        const IPAddress &source_address)
+    /// A timer-free mirror of the records that answers forwarding queries. Every
+    /// change to a record's filter mode, source records or excluded addresses must
+    /// be bracketed by begin_record_change and end_record_change, or by
+    /// create_record and end_record_change for a new record. Changes reach the data path
+    /// when they are published, which lets the data path run on other threads. The
+    /// filter has an index of its own, unless it has been given a shared one.
+    IgmpSharedForwardingIndex own_index;
+    IgmpSharedForwardingIndex *index;
+    int index_slot;
+
+    /// The verdicts that the record which is being changed had in the forwarding
+    /// index before the change.
+    struct IndexedVerdicts
     {
-        for (auto &record : group_record.source_records)
+        IndexedVerdicts()
+            : indexed(false), filter_mode(IgmpFilterMode::Include), addresses(), forwarded_addresses()
         {
-            if (record.get_source_address() == source_address)
-            {
-                return record;
-            }
         }
 
-        group_record.source_records.push_back(
-            IgmpRouterSourceRecord(multicast_address, source_address, this));
-        auto &record = group_record.source_records[group_record.source_records.size() - 1];
-        if (enable_timers)
+        /// Tells if the record was in the index at all. New records aren't.
+        bool indexed;
+
+        IgmpFilterMode filter_mode;
+
+        /// The addresses with a verdict of their own: the sources of an INCLUDE-mode
+        /// record, or the excluded addresses of an EXCLUDE-mode record, in source set
+        /// order.
+        Vector<IPAddress> addresses;
+
+        /// The sources of an EXCLUDE-mode record, in source set order. These have no
+        /// verdict of their own, but a change to them is a change to the record.
+        Vector<IPAddress> forwarded_addresses;
+    };
+
+    IndexedVerdicts indexed_verdicts;
+
+    /// Scratch storage for set algebra. These are kept around so that processing a
+    /// report doesn't need to allocate once their capacities have settled.
+    IgmpSourceSet report_sources;
+    IgmpSourceSet difference_scratch;
+    typename record_type::source_list_type merge_scratch;
+    IgmpSourceSet host_scratch;
+    Vector<IPAddress> suppressed_scratch;
+    Vector<IPAddress> unsuppressed_scratch;
+    Vector<IPAddress> finished_scratch;
+
+    /// An entry in the change log.
+    struct Change
+    {
+        Change()
+            : generation(0), multicast_address()
         {
-            record.initialize(owner);
         }
-        return record;
-    }
 
-    /// Creates a new record for the given multicast address, assigns the given filter
-    /// mode to the newly-created record and returns it.
-    IgmpRouterFilterRecord *create_record(const IPAddress &multicast_address, IgmpFilterMode filter_mode)
-    {
-        assert(get_record(multicast_address) == nullptr);
-        records.insert(multicast_address, IgmpRouterFilterRecord());
-        auto record_ptr = records.findp(multicast_address);
-        record_ptr->filter_mode = filter_mode;
-        if (enable_timers)
+        Change(uint64_t generation, const IPAddress &multicast_address)
+            : generation(generation), multicast_address(multicast_address)
         {
-            record_ptr->timer = CallbackTimer<IgmpRouterGroupRecordCallback>(multicast_address, this);
-            record_ptr->timer.initialize(owner);
         }
-        return record_ptr;
-    }
 
-    /// Receives a record that describes a multicast address' current state.
-    void receive_current_state_record(const IPAddress &multicast_address, const IgmpFilterRecord &current_state_record);
+        uint64_t generation;
+        IPAddress multicast_address;
+    };
 
-    /// Tests if the IGMP filter is listening to the given source address for the given multicast
-    /// address.
-    bool is_listening_to(const IPAddress &multicast_address, const IPAddress &source_address) const;
+    /// The maximal number of changes in the change log.
+    static const int change_log_capacity = 4096;
 
-  private:
-    Element *owner;
-    IgmpRouterVariables vars;
-    bool enable_timers;
-    HashMap<IPAddress, IgmpRouterFilterRecord> records;
+    uint64_t own_generation;
+    uint64_t *generation;
+
+#if IGMP_LATENCY_STATS
+    LatencyHistogram *timer_latency = nullptr;
+#endif
+
+    /// A ring buffer of the most recent changes, oldest first, starting at
+    /// change_log_start.
+    Vector<Change> change_log;
+    int change_log_start;
+
+    /// The generation of the newest change that has been dropped from the change
+    /// log. Changes since older generations can't be told from the log.
+    uint64_t truncated_generation;
 };
 
-inline void IgmpRouterSourceRecordCallback::operator()() const
+template <typename TFilter>
+inline void IgmpRouterTimerCallback<TFilter>::operator()() const
+{
+#if IGMP_LATENCY_STATS
+    auto histogram = filter->get_timer_latency_histogram();
+    click_cycles_t start = click_get_cycles();
+#endif
+
+    if (is_source_timer)
+    {
+        filter->expire_source_timer(multicast_address, source_address);
+    }
+    else
+    {
+        filter->expire_group_timer(multicast_address);
+    }
+
+#if IGMP_LATENCY_STATS
+    if (histogram != nullptr)
+    {
+        histogram->record(click_get_cycles() - start);
+    }
+#endif
+}
+
+template <typename TPolicy>
+inline void IgmpBasicRouterFilter<TPolicy>::expire_source_timer(const IPAddress &multicast_address, const IPAddress &source_address)
 {
-    auto record_ptr = filter->get_record(multicast_address);
+    // According to the spec:
+    //
+    //     Group
+    //     Filter-Mode    Source Timer Value    Action
+    //     -----------    ------------------    ------
+    //
+    //     INCLUDE        TIMER == 0            Suggest to stop forwarding
+    //                                          traffic from source and
+    //                                          remove source record. If
+    //                                          there are no more source
+    //                                          records for the group, delete
+    //                                          group record.
+    //
+    //     EXCLUDE        TIMER == 0            Suggest to not forward
+    //                                          traffic from source
+    //                                          (DO NOT remove record)
+
+    auto record_ptr = get_record(multicast_address);
     if (record_ptr == nullptr)
     {
         return;
     }
 
-    bool erased_any = record_ptr->erase_source_records(
-        [=](const IgmpRouterSourceRecord &source_record) {
-            return source_record.get_source_address() == source_address;
-        });
+    if (!record_ptr->has_source_record(source_address))
+    {
+        return;
+    }
+
+    stats.sources_expired++;
+    begin_record_change(*record_ptr);
+    record_ptr->erase_source_record(source_address);
 
-    if (erased_any && record_ptr->filter_mode == IgmpFilterMode::Exclude)
+    // Hosts in INCLUDE mode that still asked for the source would have refreshed its
+    // timer, so they've stopped listening to it without telling us.
+    forget_stale_hosts(*record_ptr, [&source_address](IgmpRouterHostRecord &host_record) {
+        return host_record.filter_mode == IgmpFilterMode::Include &&
+               host_record.source_addresses.erase(source_address);
+    });
+
+    if (record_ptr->filter_mode == IgmpFilterMode::Exclude)
+    {
+        record_ptr->excluded_addresses.insert(source_address);
+    }
+    else if (record_ptr->source_records.size() == 0)
     {
-        record_ptr->excluded_addresses.push_back(source_address);
+        stats.records_expired++;
+        erase_changed_record(multicast_address);
+        return;
     }
+    end_record_change(multicast_address, *record_ptr);
 }
 
-inline void IgmpRouterGroupRecordCallback::operator()() const
+template <typename TPolicy>
+inline void IgmpBasicRouterFilter<TPolicy>::expire_group_timer(const IPAddress &multicast_address)
 {
-    if (filter == nullptr)
+    // According to the spec:
+    //
+    //     Group
+    //     Filter-Mode    Group Timer Value     Actions/Comments
+    //     -----------    -----------------     ----------------
+    //
+    //     INCLUDE        Group Timer           No action required.
+    //
+    //     EXCLUDE        Group Timer == 0      No more listeners to group.
+    //                                          If all source timers have
+    //                                          expired then delete Group
+    //                                          Record. If there are still
+    //                                          source record timers running,
+    //                                          switch to INCLUDE filter-mode
+    //                                          using those source records
+    //                                          with running timers as the
+    //                                          INCLUDE source record state.
+
+    auto record_ptr = get_record(multicast_address);
+    if (record_ptr == nullptr)
     {
         return;
     }
 
-    auto record_ptr = filter->get_record(multicast_address);
-    if (record_ptr == nullptr)
+    if (record_ptr->source_records.size() == 0)
     {
+        stats.records_expired++;
+        erase_record(multicast_address);
         return;
     }
 
     if (record_ptr->filter_mode == IgmpFilterMode::Exclude)
     {
+        begin_record_change(*record_ptr);
         record_ptr->filter_mode = IgmpFilterMode::Include;
         record_ptr->excluded_addresses.clear();
+        end_record_change(multicast_address, *record_ptr);
+
+        // Hosts in EXCLUDE mode would have refreshed the group timer, so they must
+        // be gone.
+        forget_stale_hosts(*record_ptr, [](IgmpRouterHostRecord &host_record) {
+            return host_record.filter_mode == IgmpFilterMode::Exclude;
+        });
     }
 }
 
-inline void IgmpRouterFilter::receive_current_state_record(
+template <typename TPolicy>
+inline void IgmpBasicRouterFilter<TPolicy>::receive_current_state_record(
     const IPAddress &multicast_address, const IgmpFilterRecord &current_state_record)
+{
+    report_sources.assign(current_state_record.source_addresses);
+    receive_current_state_record(multicast_address, current_state_record.filter_mode, report_sources);
+}
+
+template <typename TPolicy>
+inline void IgmpBasicRouterFilter<TPolicy>::receive_current_state_record(
+    const IPAddress &multicast_address,
+    IgmpFilterMode filter_mode,
+    const IgmpSourceSet &source_addresses)
+{
+    apply_current_state_record(
+        multicast_address, filter_mode, source_addresses, get_router_variables().get_group_membership_interval());
+}
+
+template <typename TPolicy>
+inline void IgmpBasicRouterFilter<TPolicy>::apply_current_state_record(
+    const IPAddress &multicast_address,
+    IgmpFilterMode filter_mode,
+    const IgmpSourceSet &source_addresses,
+    uint32_t new_excluded_source_timer_dsec)
 {
     // When receiving Current-State Records, a router updates both its group
     // and source timers. In some circumstances, the reception of a type of
@@ -326,26 +1336,46 @@ inline void IgmpRouterFilter::receive_current_state_record(
     //                                                          Delete (Y-A)
     //                                                          Group Timer=GMI
 
+    if (!TPolicy::any_source_multicast && filter_mode == IgmpFilterMode::Exclude)
+    {
+        // SPEC INTERPRETATION: RFC 4604, section 2.2.2, has SSM-aware routers ignore
+        // EXCLUDE-mode records for SSM groups, since a source-specific group has no
+        // use for "any source but these". An SSM-only filter treats every group as
+        // an SSM group, so its records stay in INCLUDE mode.
+        return;
+    }
+
     auto record_ptr = get_record(multicast_address);
     if (record_ptr == nullptr)
     {
+        if (filter_mode == IgmpFilterMode::Include && source_addresses.size() == 0)
+        {
+            // INCLUDE ({}) plus IS_IN ({}) is still INCLUDE ({}), which is the same as
+            // not having a record at all.
+            return;
+        }
         record_ptr = create_record(multicast_address, IgmpFilterMode::Include);
     }
+    else
+    {
+        begin_record_change(*record_ptr);
+    }
+
+    auto gmi = get_router_variables().get_group_membership_interval();
+    auto set_timer_to_gmi = [gmi](source_record_type &record, bool) {
+        record.schedule_after_dsec(gmi);
+    };
 
     if (record_ptr->filter_mode == IgmpFilterMode::Include)
     {
-        if (current_state_record.filter_mode == IgmpFilterMode::Include)
+        if (filter_mode == IgmpFilterMode::Include)
         {
             //    Router State   Report Rec'd  New Router State         Actions
             //    ------------   ------------  ----------------         -------
             //
             //    INCLUDE (A)    IS_IN (B)     INCLUDE (A+B)            (B)=GMI
 
-            for (const auto &source_address : current_state_record.source_addresses)
-            {
-                auto &record = get_or_create_source_record(*record_ptr, multicast_address, source_address);
-                record.schedule_after_dsec(get_router_variables().get_group_membership_interval());
-            }
+            merge_source_records(*record_ptr, multicast_address, source_addresses, set_timer_to_gmi);
         }
         else
         {
@@ -360,37 +1390,33 @@ inline void IgmpRouterFilter::receive_current_state_record(
             record_ptr->filter_mode = IgmpFilterMode::Exclude;
 
             // Set excluded addresses to B-A.
-            record_ptr->excluded_addresses = difference_vectors(
-                current_state_record.source_addresses, record_ptr->get_source_addresses());
+            record_ptr->excluded_addresses.assign_filtered(source_addresses, [record_ptr](const IPAddress &address) {
+                return !record_ptr->has_source_record(address);
+            });
 
             // Set source records to A*B by deleting all elements of A which are not in B.
-            record_ptr->erase_source_records([&current_state_record](const IgmpRouterSourceRecord &source_record) {
-                return !in_vector(
-                    source_record.get_source_address(),
-                    current_state_record.source_addresses);
+            record_ptr->erase_source_records([&source_addresses](const source_record_type &source_record) {
+                return !source_addresses.contains(source_record.get_source_address());
             });
 
             // Set the group timer to the GMI.
-            record_ptr->timer.schedule_after_dsec(get_router_variables().get_group_membership_interval());
+            record_ptr->timer.schedule_after_dsec(gmi);
         }
     }
     else
     {
-        if (current_state_record.filter_mode == IgmpFilterMode::Include)
+        if (filter_mode == IgmpFilterMode::Include)
         {
             //    Router State   Report Rec'd  New Router State         Actions
             //    ------------   ------------  ----------------         -------
             //
             //    EXCLUDE (X,Y)  IS_IN (A)     EXCLUDE (X+A,Y-A)        (A)=GMI
 
-            record_ptr->excluded_addresses = difference_vectors(
-                record_ptr->excluded_addresses, current_state_record.source_addresses);
+            record_ptr->excluded_addresses.erase_if([&source_addresses](const IPAddress &address) {
+                return source_addresses.contains(address);
+            });
 
-            for (const auto &source_address : current_state_record.source_addresses)
-            {
-                auto &record = get_or_create_source_record(*record_ptr, multicast_address, source_address);
-                record.schedule_after_dsec(get_router_variables().get_group_membership_interval());
-            }
+            merge_source_records(*record_ptr, multicast_address, source_addresses, set_timer_to_gmi);
         }
         else
         {
@@ -402,44 +1428,442 @@ inline void IgmpRouterFilter::receive_current_state_record(
             //                                                          Delete (Y-A)
             //                                                          Group Timer=GMI
 
-            auto prev_source_addresses = record_ptr->get_source_addresses();
+            auto &excluded_addresses = record_ptr->excluded_addresses;
 
             // Delete X-A from the source records by erasing all source records that are not
-            // in A. This nets us X-(X-A) = X*A.
-            record_ptr->erase_source_records([&current_state_record](const IgmpRouterSourceRecord &source_record) {
-                return !in_vector(
-                    source_record.get_source_address(),
-                    current_state_record.source_addresses);
+            // in A. This nets us X-(X-A) = X*A. X and Y are disjoint, so X*A is also A-Y
+            // minus the sources that are in A-X-Y.
+            record_ptr->erase_source_records([&source_addresses](const source_record_type &source_record) {
+                return !source_addresses.contains(source_record.get_source_address());
             });
 
-            // Now delete X*Y from the source records by erasing all source records that are
-            // in Y. This nets us X*A-(X*Y) = X*A - Y.
-            record_ptr->erase_source_records([record_ptr](const IgmpRouterSourceRecord &source_record) {
-                return in_vector(
-                    source_record.get_source_address(),
-                    record_ptr->excluded_addresses);
+            // Add A-X-Y to the source records and set their timers to the GMI. Sources
+            // that are already in X keep their timers.
+            IgmpSourceSet::set_difference(source_addresses, excluded_addresses, difference_scratch);
+            merge_source_records(
+                *record_ptr, multicast_address, difference_scratch,
+                [new_excluded_source_timer_dsec](source_record_type &record, bool created) {
+                    if (created)
+                    {
+                        record.schedule_after_dsec(new_excluded_source_timer_dsec);
+                    }
+                });
+
+            // Update the set of excluded addresses to Y*A, which deletes Y-A.
+            excluded_addresses.erase_if([&source_addresses](const IPAddress &address) {
+                return !source_addresses.contains(address);
+            });
+
+            // Set the group timer to the GMI.
+            record_ptr->timer.schedule_after_dsec(gmi);
+        }
+    }
+
+    if (record_ptr->filter_mode == IgmpFilterMode::Include && record_ptr->source_records.size() == 0)
+    {
+        // An INCLUDE-mode record without source records doesn't forward anything, and
+        // it has no timers that would ever delete it.
+        stats.records_expired++;
+        erase_changed_record(multicast_address);
+        return;
+    }
+
+    end_record_change(multicast_address, *record_ptr);
+}
+
+template <typename TPolicy>
+inline void IgmpBasicRouterFilter<TPolicy>::receive_state_change_record(
+    const IPAddress &multicast_address,
+    IgmpV3GroupRecordType type,
+    const IgmpSourceSet &source_addresses,
+    IgmpRouterQueryAction &query_action)
+{
+    // When a change in the global state of a group occurs in a host, the
+    // host sends a State-Change Record to its attached routers. Upon
+    // reception of a State-Change Record, the router may change its
+    // filter-mode and/or source records, and it may send queries. The
+    // table below describes the actions that occur, with the same notation
+    // as the table for Current-State Records.
+    //
+    //    Router State   Report Rec'd New Router State        Actions
+    //    ------------   ------------ ----------------        -------
+    //
+    //    INCLUDE (A)    ALLOW (B)    INCLUDE (A+B)           (B)=GMI
+    //
+    //    INCLUDE (A)    BLOCK (B)    INCLUDE (A)             Send Q(G,A*B)
+    //
+    //    INCLUDE (A)    TO_EX (B)    EXCLUDE (A*B,B-A)       (B-A)=0
+    //                                                        Delete (A-B)
+    //                                                        Send Q(G,A*B)
+    //                                                        Group Timer=GMI
+    //
+    //    INCLUDE (A)    TO_IN (B)    INCLUDE (A+B)           (B)=GMI
+    //                                                        Send Q(G,A-B)
+    //
+    //    EXCLUDE (X,Y)  ALLOW (A)    EXCLUDE (X+A,Y-A)       (A)=GMI
+    //
+    //    EXCLUDE (X,Y)  BLOCK (A)    EXCLUDE (X+(A-Y),Y)     (A-X-Y)=Group Timer
+    //                                                        Send Q(G,A-Y)
+    //
+    //    EXCLUDE (X,Y)  TO_EX (A)    EXCLUDE (A-Y,Y*A)       (A-X-Y)=Group Timer
+    //                                                        Delete (X-A)
+    //                                                        Delete (Y-A)
+    //                                                        Send Q(G,A-Y)
+    //                                                        Group Timer=GMI
+    //
+    //    EXCLUDE (X,Y)  TO_IN (A)    EXCLUDE (X+A,Y-A)       (A)=GMI
+    //                                                        Send Q(G,X-A)
+    //                                                        Send Q(G)
+
+    query_action.clear();
+
+    auto gmi = get_router_variables().get_group_membership_interval();
+    auto record_ptr = get_record(multicast_address);
+    switch (type)
+    {
+    case IgmpV3GroupRecordType::AllowNewSources:
+        // The new states and actions for ALLOW are exactly those for IS_IN.
+        apply_current_state_record(multicast_address, IgmpFilterMode::Include, source_addresses, gmi);
+        break;
+
+    case IgmpV3GroupRecordType::BlockOldSources:
+        if (record_ptr == nullptr)
+        {
+            // INCLUDE ({}) plus BLOCK (B) is INCLUDE ({}), and A*B is empty.
+            break;
+        }
+
+        if (record_ptr->filter_mode == IgmpFilterMode::Include)
+        {
+            // Send Q(G,A*B). The state doesn't change.
+            query_action.query_sources.assign_filtered(source_addresses, [record_ptr](const IPAddress &address) {
+                return record_ptr->has_source_record(address);
             });
+        }
+        else
+        {
+            // Add A-Y to X and set the timers of A-X-Y to the group timer. Sources that
+            // are already in X keep their timers. Then send Q(G,A-Y).
+            begin_record_change(*record_ptr);
+            IgmpSourceSet::set_difference(source_addresses, record_ptr->excluded_addresses, difference_scratch);
+            auto group_timer = record_ptr->timer.remaining_time_dsec();
+            merge_source_records(
+                *record_ptr, multicast_address, difference_scratch,
+                [group_timer](source_record_type &record, bool created) {
+                    if (created)
+                    {
+                        record.schedule_after_dsec(group_timer);
+                    }
+                });
+            query_action.query_sources.swap(difference_scratch);
+            end_record_change(multicast_address, *record_ptr);
+        }
+        break;
 
-            // Add A-X-Y to the source records and set their timers to the GMI.
-            for (const auto &source_address : difference_vectors(
-                     difference_vectors(current_state_record.source_addresses, prev_source_addresses),
-                     record_ptr->excluded_addresses))
+    case IgmpV3GroupRecordType::ChangeToIncludeMode:
+        // The new states for TO_IN are those for IS_IN. In both filter modes, the
+        // sources to query are the current source records minus the report's
+        // sources: that's A-B in INCLUDE mode and X-A in EXCLUDE mode.
+        if (record_ptr != nullptr)
+        {
+            for (const auto &source_record : record_ptr->source_records)
             {
-                auto &record = get_or_create_source_record(*record_ptr, multicast_address, source_address);
-                record.schedule_after_dsec(get_router_variables().get_group_membership_interval());
+                if (!source_addresses.contains(source_record.get_source_address()))
+                {
+                    query_action.query_sources.insert(source_record.get_source_address());
+                }
             }
+            query_action.query_group = record_ptr->filter_mode == IgmpFilterMode::Exclude;
+        }
+        apply_current_state_record(multicast_address, IgmpFilterMode::Include, source_addresses, gmi);
+        break;
+
+    case IgmpV3GroupRecordType::ChangeToExcludeMode:
+    {
+        if (!TPolicy::any_source_multicast)
+        {
+            // SSM-only filters ignore EXCLUDE-mode records, see apply_current_state_record.
+            break;
+        }
 
-            // Update the list of excluded addresses.
-            record_ptr->excluded_addresses = intersect_vectors(
-                record_ptr->excluded_addresses, current_state_record.source_addresses);
+        // The new states for TO_EX are those for IS_EX, except that sources in A-X-Y
+        // get the group timer rather than the GMI. In INCLUDE mode, there is no X or
+        // Y, so the timer value doesn't matter.
+        auto new_source_timer = record_ptr != nullptr && record_ptr->filter_mode == IgmpFilterMode::Exclude
+            ? record_ptr->timer.remaining_time_dsec()
+            : gmi;
+        apply_current_state_record(multicast_address, IgmpFilterMode::Exclude, source_addresses, new_source_timer);
 
-            // Set the group timer to the GMI.
-            record_ptr->timer.schedule_after_dsec(get_router_variables().get_group_membership_interval());
+        // Both A*B (in INCLUDE mode) and A-Y (in EXCLUDE mode) are exactly the new
+        // source records.
+        record_ptr = get_record(multicast_address);
+        for (const auto &source_record : record_ptr->source_records)
+        {
+            query_action.query_sources.insert(source_record.get_source_address());
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+template <typename TPolicy>
+inline void IgmpBasicRouterFilter<TPolicy>::track_host(
+    const IPAddress &multicast_address,
+    const IPAddress &host_address,
+    IgmpV3GroupRecordType type,
+    const IgmpSourceSet &source_addresses)
+{
+    auto record_ptr = get_record(multicast_address);
+    if (record_ptr == nullptr || !record_ptr->tracks_hosts)
+    {
+        return;
+    }
+
+    if (!TPolicy::any_source_multicast &&
+        (type == IgmpV3GroupRecordType::ModeIsExclude || type == IgmpV3GroupRecordType::ChangeToExcludeMode))
+    {
+        // The filter ignored the record, so the host's state doesn't change either.
+        return;
+    }
+
+    // Hosts that we haven't heard from yet are in INCLUDE ({}) mode, which is the same
+    // as not listening at all.
+    auto host_ptr = record_ptr->find_host_record(host_address);
+    if (host_ptr == nullptr)
+    {
+        record_ptr->host_records.push_back(IgmpRouterHostRecord(host_address));
+        host_ptr = &record_ptr->host_records.back();
+    }
+
+    // Apply the record to the host's state in the same way that the host itself
+    // computed the record from its state. ALLOW and BLOCK records add sources to and
+    // remove sources from the host's source list, where adding a source to an EXCLUDE
+    // list actually blocks it.
+    auto &host_sources = host_ptr->source_addresses;
+    bool include = host_ptr->filter_mode == IgmpFilterMode::Include;
+    switch (type)
+    {
+    case IgmpV3GroupRecordType::ModeIsInclude:
+    case IgmpV3GroupRecordType::ChangeToIncludeMode:
+        host_ptr->filter_mode = IgmpFilterMode::Include;
+        host_sources = source_addresses;
+        break;
+    case IgmpV3GroupRecordType::ModeIsExclude:
+    case IgmpV3GroupRecordType::ChangeToExcludeMode:
+        host_ptr->filter_mode = IgmpFilterMode::Exclude;
+        host_sources = source_addresses;
+        break;
+    case IgmpV3GroupRecordType::AllowNewSources:
+    case IgmpV3GroupRecordType::BlockOldSources:
+        if (include == (type == IgmpV3GroupRecordType::AllowNewSources))
+            IgmpSourceSet::set_union(host_sources, source_addresses, host_scratch);
+        else
+            IgmpSourceSet::set_difference(host_sources, source_addresses, host_scratch);
+        host_sources.swap(host_scratch);
+        break;
+    default:
+        break;
+    }
+
+    if (host_ptr->filter_mode == IgmpFilterMode::Include && host_sources.size() == 0)
+    {
+        record_ptr->host_records.erase(host_ptr);
+    }
+}
+
+template <typename TPolicy>
+inline void IgmpBasicRouterFilter<TPolicy>::fast_leave(const IPAddress &multicast_address, IgmpRouterQueryAction &query_action)
+{
+    auto record_ptr = get_record(multicast_address);
+    if (record_ptr == nullptr || !record_ptr->tracks_hosts)
+    {
+        return;
+    }
+
+    // Sources that no host wants anymore are pruned as if their source timers had
+    // just expired. The record may be erased along the way, so we'll collect the
+    // sources first.
+    host_scratch.assign_filtered(query_action.query_sources, [record_ptr](const IPAddress &address) {
+        return !record_ptr->is_source_wanted_by_hosts(address);
+    });
+    query_action.query_sources.erase_if([this](const IPAddress &address) {
+        return host_scratch.contains(address);
+    });
+    for (const auto &address : host_scratch)
+    {
+        expire_source_timer(multicast_address, address);
+    }
+
+    // If no host is in EXCLUDE mode anymore, then the group is pruned as if its group
+    // timer had just expired.
+    record_ptr = get_record(multicast_address);
+    if (query_action.query_group && (record_ptr == nullptr || !record_ptr->has_exclude_mode_hosts()))
+    {
+        query_action.query_group = false;
+        expire_group_timer(multicast_address);
+    }
+}
+
+template <typename TPolicy>
+template <typename TSendQuery>
+inline void IgmpBasicRouterFilter<TPolicy>::send_group_query_round(
+    const IPAddress &multicast_address,
+    IgmpPendingGroupQuery &pending,
+    const TSendQuery &send_query)
+{
+    auto lmqt = vars.get_last_member_query_time();
+    auto record_ptr = get_record(multicast_address);
+
+    bool sent_group_query = false;
+    if (pending.group_remaining > 0)
+    {
+        // Spec says:
+        //
+        //     When transmitting a group specific query, if the group timer is
+        //     larger than LMQT, the "Suppress Router-Side Processing" bit is set in
+        //     the query message.
+        unsuppressed_scratch.clear();
+        send_query(
+            unsuppressed_scratch,
+            record_ptr != nullptr && record_ptr->timer.scheduled() && record_ptr->timer.remaining_time_dsec() > lmqt);
+        pending.group_remaining--;
+        sent_group_query = true;
+    }
+
+    if (pending.source_remaining.empty())
+    {
+        return;
+    }
+
+    // Spec says:
+    //
+    //     When building a group and source specific query for a group G,
+    //     two separate query messages are sent for the group. The first one
+    //     has the "Suppress Router-Side Processing" bit set and contains all
+    //     the sources with retransmission state and timers greater than
+    //     LMQT. The second has the "Suppress Router-Side Processing" bit
+    //     clear and contains all the sources with retransmission state and
+    //     timers lower or equal to LMQT. If either of the two calculated
+    //     messages does not contain any sources, then its transmission is
+    //     suppressed.
+    suppressed_scratch.clear();
+    unsuppressed_scratch.clear();
+    finished_scratch.clear();
+    for (auto it = pending.source_remaining.begin(); it != pending.source_remaining.end(); ++it)
+    {
+        auto source_ptr = record_ptr != nullptr ? record_ptr->find_source_record(it.key()) : nullptr;
+        if (source_ptr != nullptr && source_ptr->remaining_time_dsec() > lmqt)
+            suppressed_scratch.push_back(it.key());
+        else
+            unsuppressed_scratch.push_back(it.key());
+
+        if (--it.value() == 0)
+            finished_scratch.push_back(it.key());
+    }
+    for (const auto &source_address : finished_scratch)
+    {
+        pending.source_remaining.erase(source_address);
+    }
+
+    if (unsuppressed_scratch.size() != 0)
+    {
+        send_query(unsuppressed_scratch, false);
+    }
+
+    // Spec says:
+    //
+    //     If a group specific query is scheduled to be transmitted at the
+    //     same time as a group and source specific query for the same
+    //     group, then transmission of the group and source specific message
+    //     with the "Suppress Router-Side Processing" bit set may be
+    //     suppressed.
+    if (!sent_group_query && suppressed_scratch.size() != 0)
+    {
+        send_query(suppressed_scratch, true);
+    }
+}
+
+template <typename TPolicy>
+inline void IgmpBasicRouterFilter<TPolicy>::write_snapshot_records(StringAccum &sa) const
+{
+    for (auto it = records.begin(); it != records.end(); ++it)
+    {
+        const auto &record = it.value();
+        bool exclude = record.filter_mode == IgmpFilterMode::Exclude;
+
+        IgmpRouterSnapshotRecordHeader header;
+        header.multicast_address = it.key().addr();
+        header.filter_mode = (uint8_t)(IgmpFilterMode)record.filter_mode;
+        header.reserved[0] = header.reserved[1] = header.reserved[2] = 0;
+        // The group timer only means something in EXCLUDE mode.
+        header.group_timer_dsec = htonl(exclude ? record.timer.remaining_time_dsec() : 0);
+        header.source_count = htonl(record.source_records.size());
+        header.excluded_count = htonl(record.excluded_addresses.size());
+        sa.append(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        for (const auto &source_record : record.source_records)
+        {
+            append_igmp_router_snapshot_word(sa, source_record.get_source_address().addr());
+            append_igmp_router_snapshot_word(sa, htonl(source_record.remaining_time_dsec()));
+        }
+        for (const auto &address : record.excluded_addresses)
+        {
+            append_igmp_router_snapshot_word(sa, address.addr());
+        }
+    }
+}
+
+template <typename TPolicy>
+inline void IgmpBasicRouterFilter<TPolicy>::restore_snapshot_record(
+    const IgmpRouterSnapshotRecordView &snapshot_record, uint32_t elapsed_dsec)
+{
+    auto multicast_address = snapshot_record.get_multicast_address();
+    auto filter_mode = snapshot_record.get_filter_mode();
+    erase_record(multicast_address);
+    if (filter_mode != IgmpFilterMode::Exclude &&
+        (filter_mode != IgmpFilterMode::Include || snapshot_record.get_source_count() == 0))
+    {
+        // INCLUDE ({}) is the same as not having a record at all, and a mode that is
+        // neither can only come from a corrupt snapshot.
+        return;
+    }
+    if (!TPolicy::any_source_multicast && filter_mode == IgmpFilterMode::Exclude)
+    {
+        // SSM-only filters can't hold EXCLUDE-mode records, so a snapshot taken by a
+        // full filter loses those, just as if their reports had been ignored.
+        return;
+    }
+
+    // The record is built before it is indexed, like a record that is created by
+    // a report.
+    auto record_ptr = create_record(multicast_address, filter_mode);
+    record_ptr->tracks_hosts = false;
+    for (uint32_t i = 0; i < snapshot_record.get_source_count(); i++)
+    {
+        const auto &source = snapshot_record.get_source(i);
+        auto &source_record = get_or_create_source_record(*record_ptr, multicast_address, IPAddress(source.source_address));
+        source_record.schedule_after_dsec(get_igmp_router_snapshot_remaining_dsec(ntohl(source.timer_dsec), elapsed_dsec));
+    }
+    if (filter_mode == IgmpFilterMode::Exclude)
+    {
+        for (const auto &address : snapshot_record.get_excluded_addresses())
+        {
+            if (!record_ptr->has_source_record(address))
+            {
+                record_ptr->excluded_addresses.insert(address);
+            }
         }
+        record_ptr->timer.schedule_after_dsec(
+            get_igmp_router_snapshot_remaining_dsec(snapshot_record.get_group_timer_dsec(), elapsed_dsec));
     }
+    end_record_change(multicast_address, *record_ptr);
 }
 
-inline bool IgmpRouterFilter::is_listening_to(const IPAddress &multicast_address, const IPAddress &source_address) const
+template <typename TPolicy>
+inline bool IgmpBasicRouterFilter<TPolicy>::is_listening_to(const IPAddress &multicast_address, const IPAddress &source_address) const
 {
     if (multicast_address == all_systems_multicast_address)
     {
@@ -463,27 +1887,23 @@ inline bool IgmpRouterFilter::is_listening_to(const IPAddress &multicast_address
         return true;
     }
 
-    const IgmpRouterFilterRecord *record_ptr = get_record(multicast_address);
-    if (record_ptr == nullptr)
-    {
-        return false;
-    }
-
-    if (record_ptr->filter_mode == IgmpFilterMode::Exclude)
-    {
-        return !in_vector(source_address, record_ptr->excluded_addresses);
-    }
-    else
-    {
-        for (const auto &item : record_ptr->source_records)
-        {
-            if (item.get_source_address() == source_address)
-            {
-                return true;
-            }
-        }
-        return false;
-    }
+    // The forwarding index is kept in sync with the records, so there is no need
+    // to look at the records themselves here.
+    return index->lookup(multicast_address, source_address, index_slot);
 }
 
+/// The router filter that IgmpRouter uses. It is a full filter, unless the router is
+/// built with IGMP_SSM_ONLY, in which case it is an SSM-only filter whose records
+/// take less than half the memory.
+#if IGMP_SSM_ONLY
+typedef IgmpBasicRouterFilter<IgmpRouterSsmPolicy> IgmpRouterFilter;
+#else
+typedef IgmpBasicRouterFilter<IgmpRouterFullPolicy> IgmpRouterFilter;
+#endif
+
+typedef IgmpRouterFilter::record_type IgmpRouterFilterRecord;
+
+/// A full router filter without timers.
+typedef IgmpBasicRouterFilter<IgmpRouterTimerlessPolicy> IgmpTimerlessRouterFilter;
+
 CLICK_ENDDECLS
\ No newline at end of file
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <click/config.h>
+#include <click/glue.hh>
+#include <click/ipaddress.hh>
+#include <click/vector.hh>
+#include "IgmpMemberFilter.hh"
+#include "IgmpSourceSet.hh"
+#include "InlineVector.hh"
+#include "TimerWheel.hh"
+
+CLICK_DECLS
+
+/// Describes the features of an IGMP router filter. Every feature is decided at
+/// compile time, so a filter doesn't pay for what it doesn't use, neither in the
+/// branches that it takes on every report nor in the size of its records.
+///
+///     Timers: tells if group and source timers run. Filters without timers never
+///         expire anything, which is what benchmarks want. Their source records
+///         don't store timers at all.
+///
+///     AnySourceMulticast: tells if the filter supports EXCLUDE mode for
+///         Any-Source Multicast, on top of INCLUDE mode for Source-Specific
+///         Multicast. Records of SSM-only filters are always in INCLUDE mode, so
+///         they store neither a filter mode, nor a group timer, nor excluded
+///         addresses.
+///
+///     InlineSourceCount: the number of source records that a group record keeps
+///         inline before it moves them to the heap. SSM groups rarely have more
+///         than one source, so their records keep that one inline without allocating.
+template <bool Timers, bool AnySourceMulticast, int InlineSourceCount>
+struct IgmpRouterFilterPolicy
+{
+    static const bool enable_timers = Timers;
+    static const bool any_source_multicast = AnySourceMulticast;
+    static const int inline_source_count = InlineSourceCount;
+};
+
+/// The policy of a full IGMP router filter, with timers and both filter modes.
+typedef IgmpRouterFilterPolicy<true, true, 0> IgmpRouterFullPolicy;
+
+/// The policy of a router filter without timers, which benchmarks use because
+/// timers need a running router.
+typedef IgmpRouterFilterPolicy<false, true, 0> IgmpRouterTimerlessPolicy;
+
+/// The policy of a router filter for Source-Specific Multicast only, which keeps
+/// a group's source record inline as long as it has just the one.
+typedef IgmpRouterFilterPolicy<true, false, 1> IgmpRouterSsmPolicy;
+
+/// A timer that ignores everything, like a null TimerWheelEntry, but has no state
+/// at all. Filters without timers use it for all of theirs. Source records with a
+/// null timer only store their address, and SSM-only records share a single null
+/// group timer, but like any empty member, the group timer of a timerless record
+/// that supports EXCLUDE mode still takes up a byte, or rather, a byte's worth of
+/// padding.
+class IgmpNullTimer final
+{
+  public:
+    void release() {}
+    bool scheduled() const { return false; }
+    void schedule_after_dsec(uint32_t) {}
+    void unschedule() {}
+    uint32_t remaining_time_dsec() const { return 0; }
+};
+
+/// Picks the type of a router filter's timers: entries in the filter's timer wheel
+/// if timers are enabled, or null timers if they are not.
+template <typename TCallback, bool Timers>
+struct IgmpRouterFilterTimerType
+{
+    typedef TimerWheelEntry<TCallback> type;
+
+    static type create(TimerWheel<TCallback> *wheel, const TCallback &callback) { return type(wheel, callback); }
+};
+
+template <typename TCallback>
+struct IgmpRouterFilterTimerType<TCallback, false>
+{
+    typedef IgmpNullTimer type;
+
+    static type create(TimerWheel<TCallback> *, const TCallback &) { return type(); }
+};
+
+/// Picks the type of a group record's list of source records: an InlineVector
+/// that keeps the given number of them inline, or a plain Vector if that number
+/// is zero.
+template <typename TSourceRecord, int InlineSourceCount>
+struct IgmpRouterSourceListType
+{
+    typedef InlineVector<TSourceRecord, InlineSourceCount> type;
+};
+
+template <typename TSourceRecord>
+struct IgmpRouterSourceListType<TSourceRecord, 0>
+{
+    typedef Vector<TSourceRecord> type;
+};
+
+/// The filter mode of a record in an SSM-only filter, which is always INCLUDE. It
+/// reads like an IgmpFilterMode, so that code which tests for EXCLUDE mode compiles
+/// for any filter, but it's a constant, so those tests fold away.
+struct IgmpIncludeOnlyFilterMode
+{
+    operator IgmpFilterMode() const { return IgmpFilterMode::Include; }
+
+    IgmpIncludeOnlyFilterMode &operator=(IgmpFilterMode filter_mode)
+    {
+        assert(filter_mode == IgmpFilterMode::Include);
+        (void)filter_mode;
+        return *this;
+    }
+};
+
+/// The excluded addresses of a record in an SSM-only filter, which are always
+/// empty. It has the same interface as an IgmpSourceSet, but adding an address to
+/// it is a bug: SSM-only filters never switch a record to EXCLUDE mode.
+class IgmpNoExcludedAddresses final
+{
+  public:
+    typedef const IPAddress *const_iterator;
+    typedef const IPAddress *iterator;
+
+    int size() const { return 0; }
+    bool empty() const { return true; }
+    bool contains(const IPAddress &) const { return false; }
+    const IPAddress &operator[](int) const
+    {
+        assert(false);
+        static const IPAddress none;
+        return none;
+    }
+    const_iterator begin() const { return nullptr; }
+    const_iterator end() const { return nullptr; }
+
+    void clear() {}
+
+    template <typename TPredicate>
+    bool erase_if(const TPredicate &)
+    {
+        return false;
+    }
+
+    bool insert(const IPAddress &)
+    {
+        assert(false);
+        return false;
+    }
+
+    template <typename TSet, typename TPredicate>
+    void assign_filtered(const TSet &, const TPredicate &)
+    {
+        assert(false);
+    }
+};
+
+/// The state that a group record only needs in EXCLUDE mode: its filter mode, its
+/// group timer and its excluded addresses. Records of SSM-only filters get a
+/// stand-in for each of these instead, whose group timer is a null timer. The
+/// stand-ins have no state, so they are static members that all records share:
+/// an empty member would still take up a byte of every record, plus padding.
+template <typename TTimer, bool AnySourceMulticast>
+struct IgmpRouterGroupState
+{
+    /// The filter record's mode.
+    IgmpFilterMode filter_mode;
+
+    /// The filter record's timer.
+    TTimer timer;
+
+    /// The filter record's set of excluded addresses.
+    /// This set must be empty if the filter mode is INCLUDE.
+    IgmpSourceSet excluded_addresses;
+};
+
+template <typename TTimer>
+struct IgmpRouterGroupState<TTimer, false>
+{
+    static IgmpIncludeOnlyFilterMode filter_mode;
+    static TTimer timer;
+    static IgmpNoExcludedAddresses excluded_addresses;
+};
+
+template <typename TTimer>
+IgmpIncludeOnlyFilterMode IgmpRouterGroupState<TTimer, false>::filter_mode;
+
+template <typename TTimer>
+TTimer IgmpRouterGroupState<TTimer, false>::timer;
+
+template <typename TTimer>
+IgmpNoExcludedAddresses IgmpRouterGroupState<TTimer, false>::excluded_addresses;
+
+CLICK_ENDDECLS
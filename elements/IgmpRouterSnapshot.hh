@@ -0,0 +1,246 @@
+#pragma once
+
+#include <click/config.h>
+#include <click/glue.hh>
+#include <click/ipaddress.hh>
+#include <click/straccum.hh>
+#include "IgmpMemberFilter.hh"
+
+CLICK_DECLS
+
+// A snapshot of a router's membership state, which a restarted router can reload
+// so that it forwards traffic right away instead of relearning its groups over
+// the Startup Query period. A snapshot looks like this:
+//
+//     IgmpRouterSnapshotHeader
+//     for every interface:
+//         IgmpRouterSnapshotInterfaceHeader
+//         for every group record of the interface:
+//             IgmpRouterSnapshotRecordHeader
+//             IgmpRouterSnapshotSource[source_count]
+//             uint32_t excluded_addresses[excluded_count]
+//
+// Like IGMP messages, every field is in network byte order. Every field is also
+// 32-bit aligned, which means that a snapshot can be read in place, straight from
+// a memory-mapped file. Timers are stored as the number of deciseconds that
+// remained when the snapshot was taken; the time at which it was taken is in the
+// header, so they can be re-armed relative to it. Host records are not stored,
+// so restored records don't track hosts.
+
+/// The magic number at the start of every snapshot: "IGMS" in ASCII.
+const uint32_t igmp_router_snapshot_magic = 0x49474D53;
+
+/// The version of the snapshot format. Snapshots of other versions are rejected.
+const uint16_t igmp_router_snapshot_version = 1;
+
+/// Describes the header of a router snapshot.
+struct IgmpRouterSnapshotHeader
+{
+    /// The snapshot's magic number, which should always equal
+    /// igmp_router_snapshot_magic.
+    uint32_t magic;
+
+    /// The version of the snapshot format.
+    uint16_t version;
+
+    /// The number of interfaces in the snapshot.
+    uint16_t interface_count;
+
+    /// The wall-clock time at which the snapshot was taken, in milliseconds since
+    /// the epoch, split into its high and low 32 bits. Steady time doesn't carry
+    /// over from one run of Click to the next, so wall-clock time it is.
+    uint32_t taken_msec_high;
+    uint32_t taken_msec_low;
+
+    /// Gets the wall-clock time at which the snapshot was taken, in milliseconds
+    /// since the epoch.
+    uint64_t get_taken_msec() const
+    {
+        return ((uint64_t)ntohl(taken_msec_high) << 32) | ntohl(taken_msec_low);
+    }
+} CLICK_SIZE_PACKED_ATTRIBUTE;
+
+/// Describes the header of an interface in a router snapshot.
+struct IgmpRouterSnapshotInterfaceHeader
+{
+    /// The interface's address, which identifies the interface when the snapshot
+    /// is restored.
+    uint32_t address;
+
+    /// The number of group records of the interface.
+    uint32_t record_count;
+} CLICK_SIZE_PACKED_ATTRIBUTE;
+
+/// Describes the header of a group record in a router snapshot.
+struct IgmpRouterSnapshotRecordHeader
+{
+    /// The record's multicast address.
+    uint32_t multicast_address;
+
+    /// The record's filter mode, as an IgmpFilterMode value.
+    uint8_t filter_mode;
+
+    uint8_t reserved[3];
+
+    /// The time that remained on the record's group timer, in deciseconds.
+    uint32_t group_timer_dsec;
+
+    /// The number of source records that follow this header.
+    uint32_t source_count;
+
+    /// The number of excluded addresses that follow the source records.
+    uint32_t excluded_count;
+
+    /// Gets the size of the record's payload, in bytes.
+    size_t get_payload_size() const;
+} CLICK_SIZE_PACKED_ATTRIBUTE;
+
+/// Describes a source record in a router snapshot.
+struct IgmpRouterSnapshotSource
+{
+    /// The source's address.
+    uint32_t source_address;
+
+    /// The time that remained on the source's timer, in deciseconds.
+    uint32_t timer_dsec;
+} CLICK_SIZE_PACKED_ATTRIBUTE;
+
+inline size_t IgmpRouterSnapshotRecordHeader::get_payload_size() const
+{
+    return sizeof(IgmpRouterSnapshotSource) * (size_t)ntohl(source_count) +
+           sizeof(uint32_t) * (size_t)ntohl(excluded_count);
+}
+
+/// Gets the amount of time that remains on a timer that had the given amount of
+/// time left when a snapshot was taken, the given amount of time ago. Timers that
+/// would have run out in the meantime expire right away.
+inline uint32_t get_igmp_router_snapshot_remaining_dsec(uint32_t timer_dsec, uint32_t elapsed_dsec)
+{
+    return timer_dsec > elapsed_dsec ? timer_dsec - elapsed_dsec : 0;
+}
+
+/// A non-owning view of a group record in a router snapshot.
+class IgmpRouterSnapshotRecordView final
+{
+  public:
+    IgmpRouterSnapshotRecordView(const IgmpRouterSnapshotRecordHeader *header)
+        : header(header)
+    {
+    }
+
+    IPAddress get_multicast_address() const { return IPAddress(header->multicast_address); }
+
+    IgmpFilterMode get_filter_mode() const { return (IgmpFilterMode)header->filter_mode; }
+
+    uint32_t get_group_timer_dsec() const { return ntohl(header->group_timer_dsec); }
+
+    uint32_t get_source_count() const { return ntohl(header->source_count); }
+
+    /// Gets the source record with the given index.
+    const IgmpRouterSnapshotSource &get_source(uint32_t index) const
+    {
+        return reinterpret_cast<const IgmpRouterSnapshotSource *>(header + 1)[index];
+    }
+
+    /// Gets the record's excluded addresses.
+    IgmpSourceSpan get_excluded_addresses() const
+    {
+        auto data = reinterpret_cast<const unsigned char *>(&get_source(get_source_count()));
+        return IgmpSourceSpan(data, ntohl(header->excluded_count));
+    }
+
+    /// Gets the size of the record, including its header, in bytes.
+    size_t get_size() const
+    {
+        return sizeof(IgmpRouterSnapshotRecordHeader) + header->get_payload_size();
+    }
+
+  private:
+    const IgmpRouterSnapshotRecordHeader *header;
+};
+
+/// A reader that walks a router snapshot in place. The snapshot's layout is
+/// checked as it goes, so a truncated or corrupt snapshot never makes the reader
+/// step outside its buffer.
+class IgmpRouterSnapshotReader final
+{
+  public:
+    IgmpRouterSnapshotReader(const unsigned char *data, size_t size)
+        : data(data), end(data + size), header(nullptr)
+    {
+    }
+
+    /// Reads and validates the snapshot's header. A Boolean result tells if the
+    /// header is valid.
+    bool read_header()
+    {
+        if (!has_room(sizeof(IgmpRouterSnapshotHeader)))
+        {
+            return false;
+        }
+
+        header = reinterpret_cast<const IgmpRouterSnapshotHeader *>(data);
+        data += sizeof(IgmpRouterSnapshotHeader);
+        return ntohl(header->magic) == igmp_router_snapshot_magic &&
+               ntohs(header->version) == igmp_router_snapshot_version;
+    }
+
+    /// Gets the snapshot's header. read_header must have succeeded.
+    const IgmpRouterSnapshotHeader &get_header() const { return *header; }
+
+    /// Reads the header of the next interface, or returns null if the snapshot
+    /// is truncated.
+    const IgmpRouterSnapshotInterfaceHeader *read_interface()
+    {
+        if (!has_room(sizeof(IgmpRouterSnapshotInterfaceHeader)))
+        {
+            return nullptr;
+        }
+
+        auto result = reinterpret_cast<const IgmpRouterSnapshotInterfaceHeader *>(data);
+        data += sizeof(IgmpRouterSnapshotInterfaceHeader);
+        return result;
+    }
+
+    /// Reads the next group record, or returns null if the snapshot is truncated.
+    const IgmpRouterSnapshotRecordHeader *read_record()
+    {
+        if (!has_room(sizeof(IgmpRouterSnapshotRecordHeader)))
+        {
+            return nullptr;
+        }
+
+        auto result = reinterpret_cast<const IgmpRouterSnapshotRecordHeader *>(data);
+        // The counts come from the snapshot, so they're checked one at a time to
+        // keep their product from overflowing.
+        size_t remaining = end - data - sizeof(IgmpRouterSnapshotRecordHeader);
+        if (ntohl(result->source_count) > remaining / sizeof(IgmpRouterSnapshotSource) ||
+            ntohl(result->excluded_count) > remaining / sizeof(uint32_t) ||
+            result->get_payload_size() > remaining)
+        {
+            return nullptr;
+        }
+
+        data += IgmpRouterSnapshotRecordView(result).get_size();
+        return result;
+    }
+
+  private:
+    bool has_room(size_t size) const
+    {
+        return (size_t)(end - data) >= size;
+    }
+
+    const unsigned char *data;
+    const unsigned char *end;
+    const IgmpRouterSnapshotHeader *header;
+};
+
+/// Appends a 32-bit word in network byte order to the given string accumulator.
+/// The word must already be in network byte order.
+inline void append_igmp_router_snapshot_word(StringAccum &sa, uint32_t network_word)
+{
+    sa.append(reinterpret_cast<const char *>(&network_word), sizeof(network_word));
+}
+
+CLICK_ENDDECLS
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <click/config.h>
+#include <click/ipaddress.hh>
+#include <click/vector.hh>
+#include <clicknet/ip.h>
+#include <algorithm>
+
+CLICK_DECLS
+
+/// A set of IP source addresses, stored as a sorted vector. Membership tests are
+/// binary searches and the RFC 3376 set operations are linear merges, which
+/// keeps report processing fast for groups with hundreds of sources.
+class IgmpSourceSet final
+{
+  public:
+    typedef Vector<IPAddress>::const_iterator const_iterator;
+    typedef Vector<IPAddress>::const_iterator iterator;
+
+    IgmpSourceSet()
+    {
+    }
+
+    explicit IgmpSourceSet(const Vector<IPAddress> &addresses)
+    {
+        assign(addresses.begin(), addresses.end());
+    }
+
+    /// Defines the order of the addresses in a source set.
+    static bool less(const IPAddress &left, const IPAddress &right)
+    {
+        return ntohl(left.addr()) < ntohl(right.addr());
+    }
+
+    /// Replaces this set's contents by the addresses in the given range, which
+    /// may be unsorted and contain duplicates.
+    template <typename TIterator>
+    void assign(TIterator first, TIterator last)
+    {
+        addresses.clear();
+        for (; first != last; ++first)
+        {
+            addresses.push_back(*first);
+        }
+        normalize();
+    }
+
+    /// Replaces this set's contents by the addresses in the given vector.
+    void assign(const Vector<IPAddress> &other)
+    {
+        assign(other.begin(), other.end());
+    }
+
+    /// Replaces this set's contents by the addresses in the given set that
+    /// satisfy the given predicate.
+    template <typename TPredicate>
+    void assign_filtered(const IgmpSourceSet &other, const TPredicate &predicate)
+    {
+        assert(&other != this);
+        addresses.clear();
+        for (const auto &address : other.addresses)
+        {
+            if (predicate(address))
+            {
+                addresses.push_back(address);
+            }
+        }
+    }
+
+    /// Erases all addresses that satisfy the given predicate. A Boolean result tells
+    /// if any addresses were actually erased.
+    template <typename TPredicate>
+    bool erase_if(const TPredicate &predicate)
+    {
+        int j = 0;
+        for (int i = 0; i < addresses.size(); i++)
+        {
+            if (!predicate(addresses[i]))
+            {
+                addresses[j++] = addresses[i];
+            }
+        }
+        bool erased_any = j != addresses.size();
+        while (addresses.size() > j)
+        {
+            addresses.pop_back();
+        }
+        return erased_any;
+    }
+
+    /// Tests if this set contains the given address.
+    bool contains(const IPAddress &address) const
+    {
+        int index = lower_bound(address);
+        return index < addresses.size() && addresses[index] == address;
+    }
+
+    /// Inserts the given address into this set. A Boolean result tells if the address
+    /// was not in the set yet.
+    bool insert(const IPAddress &address)
+    {
+        int index = lower_bound(address);
+        if (index < addresses.size() && addresses[index] == address)
+        {
+            return false;
+        }
+        addresses.insert(addresses.begin() + index, address);
+        return true;
+    }
+
+    /// Erases the given address from this set. A Boolean result tells if the address
+    /// was in the set.
+    bool erase(const IPAddress &address)
+    {
+        int index = lower_bound(address);
+        if (index < addresses.size() && addresses[index] == address)
+        {
+            addresses.erase(addresses.begin() + index);
+            return true;
+        }
+        return false;
+    }
+
+    /// Removes all addresses from this set. Its storage is kept for reuse.
+    void clear()
+    {
+        addresses.clear();
+    }
+
+    void swap(IgmpSourceSet &other)
+    {
+        addresses.swap(other.addresses);
+    }
+
+    int size() const { return addresses.size(); }
+    bool empty() const { return addresses.size() == 0; }
+    const IPAddress &operator[](int index) const { return addresses[index]; }
+    const_iterator begin() const { return addresses.begin(); }
+    const_iterator end() const { return addresses.end(); }
+
+    /// Gets this set's addresses as a sorted vector.
+    const Vector<IPAddress> &get_addresses() const { return addresses; }
+
+    bool operator==(const IgmpSourceSet &other) const
+    {
+        if (size() != other.size())
+        {
+            return false;
+        }
+        for (int i = 0; i < size(); i++)
+        {
+            if (addresses[i] != other.addresses[i])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool operator!=(const IgmpSourceSet &other) const
+    {
+        return !(*this == other);
+    }
+
+    /// Computes the union of the given sets.
+    static void set_union(const IgmpSourceSet &left, const IgmpSourceSet &right, IgmpSourceSet &result)
+    {
+        assert(&result != &left && &result != &right);
+        result.clear();
+        int i = 0, j = 0;
+        while (i < left.size() && j < right.size())
+        {
+            if (less(left[i], right[j]))
+                result.addresses.push_back(left[i++]);
+            else if (less(right[j], left[i]))
+                result.addresses.push_back(right[j++]);
+            else
+            {
+                result.addresses.push_back(left[i++]);
+                j++;
+            }
+        }
+        for (; i < left.size(); i++)
+            result.addresses.push_back(left[i]);
+        for (; j < right.size(); j++)
+            result.addresses.push_back(right[j]);
+    }
+
+    /// Computes the intersection of the given sets.
+    static void set_intersection(const IgmpSourceSet &left, const IgmpSourceSet &right, IgmpSourceSet &result)
+    {
+        assert(&result != &left && &result != &right);
+        result.clear();
+        int i = 0, j = 0;
+        while (i < left.size() && j < right.size())
+        {
+            if (less(left[i], right[j]))
+                i++;
+            else if (less(right[j], left[i]))
+                j++;
+            else
+            {
+                result.addresses.push_back(left[i++]);
+                j++;
+            }
+        }
+    }
+
+    /// Computes the difference of the given sets, i.e., all elements of the left-hand
+    /// set which are not in the right-hand set. The right-hand set may be anything
+    /// that looks like a sorted source set.
+    template <typename TRight>
+    static void set_difference(const IgmpSourceSet &left, const TRight &right, IgmpSourceSet &result)
+    {
+        assert(&result != &left && (const void *)&result != (const void *)&right);
+        result.clear();
+        int i = 0, j = 0;
+        while (i < left.size() && j < right.size())
+        {
+            if (less(left[i], right[j]))
+                result.addresses.push_back(left[i++]);
+            else if (less(right[j], left[i]))
+                j++;
+            else
+            {
+                i++;
+                j++;
+            }
+        }
+        for (; i < left.size(); i++)
+            result.addresses.push_back(left[i]);
+    }
+
+  private:
+    /// Gets the index of the first address that is not less than the given address.
+    int lower_bound(const IPAddress &address) const
+    {
+        int low = 0, high = addresses.size();
+        while (low < high)
+        {
+            int mid = low + (high - low) / 2;
+            if (less(addresses[mid], address))
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        return low;
+    }
+
+    /// Sorts the addresses and removes duplicates.
+    void normalize()
+    {
+        if (addresses.size() < 2)
+        {
+            return;
+        }
+
+        std::sort(addresses.begin(), addresses.end(), less);
+        int j = 1;
+        for (int i = 1; i < addresses.size(); i++)
+        {
+            if (addresses[i] != addresses[j - 1])
+            {
+                addresses[j++] = addresses[i];
+            }
+        }
+        while (addresses.size() > j)
+        {
+            addresses.pop_back();
+        }
+    }
+
+    Vector<IPAddress> addresses;
+};
+
+CLICK_ENDDECLS
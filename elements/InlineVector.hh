@@ -0,0 +1,204 @@
+#pragma once
+
+#include <click/config.h>
+#include <click/glue.hh>
+#include <algorithm>
+
+CLICK_DECLS
+
+/// A vector that keeps up to InlineCount elements inside itself and only moves
+/// them to the heap once there are more. Lists that are almost always short,
+/// such as the source records of a source-specific group, thus cost no heap
+/// allocation at all.
+///
+/// Elements must be default-constructible and copyable. Like Vector's, a vector's
+/// storage is kept when it is cleared, so a vector that is reused doesn't allocate
+/// once its capacity has settled.
+template <typename T, int InlineCount>
+class InlineVector final
+{
+  public:
+    typedef T *iterator;
+    typedef const T *const_iterator;
+
+    InlineVector()
+        : heap_items(nullptr), count(0), capacity(InlineCount)
+    {
+    }
+
+    InlineVector(const InlineVector &other)
+        : heap_items(nullptr), count(0), capacity(InlineCount)
+    {
+        *this = other;
+    }
+
+    ~InlineVector() { delete[] heap_items; }
+
+    InlineVector &operator=(const InlineVector &other)
+    {
+        if (&other == this)
+        {
+            return *this;
+        }
+
+        clear();
+        reserve(other.count);
+        for (int i = 0; i < other.count; i++)
+        {
+            data()[i] = other.data()[i];
+        }
+        count = other.count;
+        return *this;
+    }
+
+    int size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    T &operator[](int index) { return data()[index]; }
+    const T &operator[](int index) const { return data()[index]; }
+
+    T &back() { return data()[count - 1]; }
+    const T &back() const { return data()[count - 1]; }
+
+    iterator begin() { return data(); }
+    iterator end() { return data() + count; }
+    const_iterator begin() const { return data(); }
+    const_iterator end() const { return data() + count; }
+
+    void push_back(const T &value)
+    {
+        if (count == capacity)
+        {
+            // The value may live in this vector, so it's copied before the
+            // elements move.
+            T copy = value;
+            reserve(capacity * 2 > 4 ? capacity * 2 : 4);
+            data()[count++] = copy;
+            return;
+        }
+        data()[count++] = value;
+    }
+
+    void pop_back()
+    {
+        assert(count > 0);
+        data()[--count] = T();
+    }
+
+    /// Inserts the given value before the given position.
+    iterator insert(iterator position, const T &value)
+    {
+        int index = position - begin();
+        T copy = value;
+        push_back(copy);
+        T *items = data();
+        for (int i = count - 1; i > index; i--)
+        {
+            items[i] = items[i - 1];
+        }
+        items[index] = copy;
+        return begin() + index;
+    }
+
+    /// Erases the element at the given position.
+    iterator erase(iterator position)
+    {
+        int index = position - begin();
+        T *items = data();
+        for (int i = index; i + 1 < count; i++)
+        {
+            items[i] = items[i + 1];
+        }
+        pop_back();
+        return begin() + index;
+    }
+
+    /// Removes every element. The vector's storage is kept for reuse.
+    void clear()
+    {
+        while (count > 0)
+        {
+            pop_back();
+        }
+    }
+
+    /// Swaps the contents of the given vectors. Heap storage changes hands, so this
+    /// never allocates.
+    void swap(InlineVector &other)
+    {
+        if (heap_items != nullptr && other.heap_items != nullptr)
+        {
+            std::swap(heap_items, other.heap_items);
+            std::swap(capacity, other.capacity);
+            std::swap(count, other.count);
+        }
+        else if (heap_items == nullptr && other.heap_items == nullptr)
+        {
+            int common = count > other.count ? count : other.count;
+            for (int i = 0; i < common; i++)
+            {
+                std::swap(inline_items[i], other.inline_items[i]);
+            }
+            std::swap(count, other.count);
+        }
+        else if (heap_items != nullptr)
+        {
+            swap_with_inline(other);
+        }
+        else
+        {
+            other.swap_with_inline(*this);
+        }
+    }
+
+  private:
+    T *data() { return heap_items != nullptr ? heap_items : inline_items; }
+    const T *data() const { return heap_items != nullptr ? heap_items : inline_items; }
+
+    /// Makes room for at least the given number of elements.
+    void reserve(int wanted)
+    {
+        if (wanted <= capacity)
+        {
+            return;
+        }
+
+        T *items = new T[wanted];
+        for (int i = 0; i < count; i++)
+        {
+            items[i] = data()[i];
+        }
+        if (heap_items == nullptr)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                inline_items[i] = T();
+            }
+        }
+        delete[] heap_items;
+        heap_items = items;
+        capacity = wanted;
+    }
+
+    /// Swaps the contents of this vector, whose elements are on the heap, with those
+    /// of the given vector, whose elements are inline.
+    void swap_with_inline(InlineVector &other)
+    {
+        for (int i = 0; i < other.count; i++)
+        {
+            inline_items[i] = other.inline_items[i];
+            other.inline_items[i] = T();
+        }
+        other.heap_items = heap_items;
+        heap_items = nullptr;
+        std::swap(capacity, other.capacity);
+        std::swap(count, other.count);
+    }
+
+    T *heap_items;
+    int count;
+    int capacity;
+    T inline_items[InlineCount];
+};
+
+CLICK_ENDDECLS
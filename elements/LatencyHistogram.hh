@@ -0,0 +1,182 @@
+#pragma once
+
+#include <click/config.h>
+#include <click/glue.hh>
+#include <click/straccum.hh>
+#include <click/string.hh>
+#include "PerThreadCounter.hh"
+
+// Latency instrumentation is compiled out unless IGMP_LATENCY_STATS is set to a
+// nonzero value, e.g., by building with 'make LATENCY_STATS=1'. When it is
+// compiled out, IGMP_LATENCY_SCOPE expands to nothing and elements register no
+// latency handlers, so the hot paths are exactly as they'd be without it.
+#ifndef IGMP_LATENCY_STATS
+#define IGMP_LATENCY_STATS 0
+#endif
+
+CLICK_DECLS
+
+/// A histogram of latencies, in CPU cycles. Bucket i > 0 counts the samples of
+/// [2^i, 2^(i+1)) cycles and bucket 0 counts the samples of zero or one cycles,
+/// so recording a sample takes no more than a few instructions.
+///
+/// Like PerThreadCounter, every thread records its samples in a slot of its
+/// own, so recording is neither atomic nor contended.
+class LatencyHistogram final
+{
+  public:
+    LatencyHistogram()
+        : slots()
+    {
+    }
+
+    /// Gives this histogram a slot for each of the given number of threads. This
+    /// clears the histogram.
+    void initialize(int thread_count)
+    {
+        slots.initialize(thread_count);
+    }
+
+    /// Records a single sample.
+    void record(click_cycles_t cycles)
+    {
+        auto &slot = slots.local();
+        slot.buckets[bucket_of(cycles)]++;
+        slot.count++;
+        slot.total += cycles;
+        if (cycles > slot.max)
+        {
+            slot.max = cycles;
+        }
+    }
+
+    /// Clears this histogram.
+    void clear()
+    {
+        for (int i = 0; i < slots.size(); i++)
+        {
+            slots[i] = Slot();
+        }
+    }
+
+    /// Prints this histogram as a line with the given name, the sample count, the
+    /// mean, the upper bounds of the buckets that hold the median and the 99th
+    /// percentile, and the maximum, followed by one line per nonempty bucket.
+    void unparse(StringAccum &sa, const char *name) const
+    {
+        Slot sum;
+        for (int index = 0; index < slots.size(); index++)
+        {
+            const auto &slot = slots[index];
+            for (int i = 0; i < bucket_count; i++)
+            {
+                sum.buckets[i] += slot.buckets[i];
+            }
+            sum.count += slot.count;
+            sum.total += slot.total;
+            if (slot.max > sum.max)
+            {
+                sum.max = slot.max;
+            }
+        }
+
+        sa << name << " count " << sum.count;
+        if (sum.count == 0)
+        {
+            sa << '\n';
+            return;
+        }
+        sa << " mean " << sum.total / sum.count << " p50 " << percentile(sum, 50) << " p99 "
+           << percentile(sum, 99) << " max " << sum.max << '\n';
+        for (int i = 0; i < bucket_count; i++)
+        {
+            if (sum.buckets[i] != 0)
+            {
+                sa << "  " << bucket_lower_bound(i) << '-' << bucket_lower_bound(i + 1) - 1 << ' ' << sum.buckets[i]
+                   << '\n';
+            }
+        }
+    }
+
+  private:
+    static const int bucket_count = 40;
+
+    struct Slot
+    {
+        Slot()
+            : buckets(), count(0), total(0), max(0)
+        {
+        }
+
+        uint64_t buckets[bucket_count];
+        uint64_t count;
+        uint64_t total;
+        uint64_t max;
+    };
+
+    static int bucket_of(click_cycles_t cycles)
+    {
+        int bucket = 0;
+        while (cycles > 1 && bucket < bucket_count - 1)
+        {
+            cycles >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+
+    static uint64_t bucket_lower_bound(int bucket)
+    {
+        return bucket == 0 ? 0 : (uint64_t)1 << bucket;
+    }
+
+    /// Gets the upper bound of the bucket that holds the given percentile.
+    static uint64_t percentile(const Slot &sum, int percent)
+    {
+        uint64_t threshold = (sum.count * percent + 99) / 100;
+        uint64_t seen = 0;
+        for (int i = 0; i < bucket_count; i++)
+        {
+            seen += sum.buckets[i];
+            if (seen >= threshold)
+            {
+                return bucket_lower_bound(i + 1) - 1;
+            }
+        }
+        return sum.max;
+    }
+
+    PerThreadSlots<Slot> slots;
+};
+
+/// Records the number of cycles between its construction and its destruction
+/// in a latency histogram.
+class LatencyProbe final
+{
+  public:
+    LatencyProbe(LatencyHistogram &histogram)
+        : histogram(histogram), start(click_get_cycles())
+    {
+    }
+
+    LatencyProbe(const LatencyProbe &) = delete;
+    LatencyProbe &operator=(const LatencyProbe &) = delete;
+
+    ~LatencyProbe()
+    {
+        histogram.record(click_get_cycles() - start);
+    }
+
+  private:
+    LatencyHistogram &histogram;
+    click_cycles_t start;
+};
+
+#if IGMP_LATENCY_STATS
+/// Measures the latency of the rest of the enclosing scope.
+#define IGMP_LATENCY_SCOPE(histogram) LatencyProbe latency_probe(histogram)
+#else
+#define IGMP_LATENCY_SCOPE(histogram)
+#endif
+
+CLICK_ENDDECLS
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <click/config.h>
+#include <click/glue.hh>
+#include <new>
+#include <stdint.h>
+
+CLICK_DECLS
+
+/// An array of per-thread slots, each on a cache line of its own so that threads
+/// don't keep stealing each other's cache lines. A Vector's storage is only as
+/// aligned as the heap makes it, which doesn't honor the alignment of over-aligned
+/// types, so the slots are laid out by hand at cache-line boundaries in storage
+/// that has room to spare for the alignment.
+template <typename T>
+class PerThreadSlots final
+{
+  public:
+    PerThreadSlots()
+        : storage(nullptr), first(nullptr), count(0)
+    {
+        initialize(1);
+    }
+
+    ~PerThreadSlots() { destroy(); }
+
+    PerThreadSlots(const PerThreadSlots &) = delete;
+    PerThreadSlots &operator=(const PerThreadSlots &) = delete;
+
+    /// Replaces the slots by a default-constructed slot for each of the given
+    /// number of threads.
+    void initialize(int thread_count)
+    {
+        destroy();
+        count = thread_count > 0 ? thread_count : 1;
+        storage = new unsigned char[count * stride + cache_line_size - 1];
+        first = reinterpret_cast<unsigned char *>(
+            ((uintptr_t)storage + cache_line_size - 1) & ~(uintptr_t)(cache_line_size - 1));
+        for (int i = 0; i < count; i++)
+        {
+            new (first + i * stride) T();
+        }
+    }
+
+    /// Gets the number of slots.
+    int size() const { return count; }
+
+    T &operator[](int index) { return *reinterpret_cast<T *>(first + index * stride); }
+    const T &operator[](int index) const { return *reinterpret_cast<const T *>(first + index * stride); }
+
+    /// Gets the slot of the thread that runs this code. Threads beyond the number
+    /// of slots share the first slot.
+    T &local()
+    {
+        unsigned int index = click_current_processor();
+        return (*this)[index < (unsigned int)count ? (int)index : 0];
+    }
+
+  private:
+    static const size_t cache_line_size = 64;
+
+    /// The distance between two slots, which is a whole number of cache lines.
+    static const size_t stride = (sizeof(T) + cache_line_size - 1) / cache_line_size * cache_line_size;
+
+    void destroy()
+    {
+        for (int i = 0; i < count; i++)
+        {
+            (*this)[i].~T();
+        }
+        delete[] storage;
+        storage = nullptr;
+        first = nullptr;
+        count = 0;
+    }
+
+    unsigned char *storage;
+    unsigned char *first;
+    int count;
+};
+
+/// A statistics counter that can be incremented from any number of threads at
+/// once. Every thread increments a slot of its own, so increments are neither
+/// atomic nor contended; reading the counter sums all slots.
+class PerThreadCounter final
+{
+  public:
+    PerThreadCounter()
+        : slots()
+    {
+    }
+
+    /// Gives this counter a slot for each of the given number of threads. This
+    /// resets the counter.
+    void initialize(int thread_count)
+    {
+        slots.initialize(thread_count);
+    }
+
+    /// Adds the given amount to this counter.
+    void add(uint64_t amount)
+    {
+        slots.local() += amount;
+    }
+
+    /// Increments this counter by one.
+    void increment()
+    {
+        add(1);
+    }
+
+    /// Gets the value of this counter. Increments that happen concurrently may
+    /// or may not be included.
+    uint64_t value() const
+    {
+        uint64_t result = 0;
+        for (int i = 0; i < slots.size(); i++)
+        {
+            result += slots[i];
+        }
+        return result;
+    }
+
+    /// Resets this counter to zero.
+    void clear()
+    {
+        for (int i = 0; i < slots.size(); i++)
+        {
+            slots[i] = 0;
+        }
+    }
+
+  private:
+    PerThreadSlots<uint64_t> slots;
+};
+
+CLICK_ENDDECLS
@@ -1,35 +1,117 @@
 #pragma once
 
 #include <click/config.h>
+#include <new>
 
 CLICK_DECLS
 
+/// A pool of fixed-size blocks that are carved out of larger slabs. Blocks are
+/// recycled through a free list, so allocating a block is usually just a pointer
+/// swap. Slabs are never returned to the system.
+///
+/// Pools are per block size and per thread, which keeps them free of locks. A block
+/// that is released on another thread than the one that allocated it simply
+/// migrates to the releasing thread's pool.
+template <size_t BlockSize, size_t BlockAlign>
+class BlockPool final
+{
+  public:
+    /// Gets the pool for the current thread.
+    static BlockPool &get()
+    {
+        static thread_local BlockPool pool;
+        return pool;
+    }
+
+    /// Allocates an uninitialized block.
+    void *allocate()
+    {
+        if (free_list == nullptr)
+        {
+            grow();
+        }
+        FreeBlock *block = free_list;
+        free_list = block->next;
+        return block;
+    }
+
+    /// Returns a block to the pool.
+    void release(void *ptr)
+    {
+        FreeBlock *block = static_cast<FreeBlock *>(ptr);
+        block->next = free_list;
+        free_list = block;
+    }
+
+  private:
+    BlockPool()
+        : free_list(nullptr), slab_block_count(initial_slab_block_count)
+    {
+    }
+
+    BlockPool(const BlockPool &) = delete;
+    BlockPool &operator=(const BlockPool &) = delete;
+
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    static const size_t initial_slab_block_count = 16;
+    static const size_t max_slab_block_count = 1024;
+
+    static const size_t block_align = BlockAlign > alignof(FreeBlock) ? BlockAlign : alignof(FreeBlock);
+    static const size_t raw_block_size = BlockSize > sizeof(FreeBlock) ? BlockSize : sizeof(FreeBlock);
+    static const size_t block_size = (raw_block_size + block_align - 1) / block_align * block_align;
+
+    /// Allocates a new slab and adds its blocks to the free list. Slabs double in
+    /// size until they reach a maximum, so small pools stay small.
+    void grow()
+    {
+        char *slab = static_cast<char *>(::operator new(slab_block_count * block_size + block_align));
+        char *first = slab + (block_align - (uintptr_t)slab % block_align) % block_align;
+        for (size_t i = slab_block_count; i > 0; i--)
+        {
+            release(first + (i - 1) * block_size);
+        }
+        if (slab_block_count < max_slab_block_count)
+        {
+            slab_block_count *= 2;
+        }
+    }
+
+    FreeBlock *free_list;
+    size_t slab_block_count;
+};
+
 /// A reference-counted non-null pointer to a shared value that resides in the heap.
+/// The value and its reference count live in a single block, which is allocated
+/// from a pool rather than straight from the heap.
 template <typename T>
 class Rc final
 {
   public:
     template <typename... TArgs>
     Rc(const TArgs &... values)
-        : val(new T(values...)), ref_count(new size_t(1))
+        : block(new (Pool::get().allocate()) Block(values...))
     {
     }
 
     Rc(const Rc<T> &other)
-        : val(other.val), ref_count(other.ref_count)
+        : block(other.block)
     {
         inc_ref_count();
     }
 
     Rc<T> &operator=(const Rc<T> &other)
     {
-        if (this != &other)
+        if (block != other.block)
         {
             dec_ref_count();
-            val = other.val;
-            ref_count = other.ref_count;
+            block = other.block;
             inc_ref_count();
         }
+        return *this;
     }
 
     ~Rc()
@@ -37,30 +119,42 @@ class Rc final
         dec_ref_count();
     }
 
-    T *get() const { return val; }
-    T &operator*() const { return *val; }
-    T *operator->() const { return val; }
+    T *get() const { return &block->value; }
+    T &operator*() const { return block->value; }
+    T *operator->() const { return &block->value; }
 
   private:
+    /// A value, along with its reference count.
+    struct Block
+    {
+        template <typename... TArgs>
+        Block(const TArgs &... values)
+            : ref_count(1), value(values...)
+        {
+        }
+
+        size_t ref_count;
+        T value;
+    };
+
+    typedef BlockPool<sizeof(Block), alignof(Block)> Pool;
+
     void inc_ref_count()
     {
-        (*ref_count)++;
+        block->ref_count++;
     }
 
     void dec_ref_count()
     {
-        (*ref_count)--;
-        if (*ref_count == 0)
+        if (--block->ref_count == 0)
         {
-            delete val;
-            delete ref_count;
+            block->~Block();
+            Pool::get().release(block);
         }
     }
 
-    /// The value that is managed.
-    T *val;
-    /// The value's reference count.
-    size_t *ref_count;
+    /// The block that holds the value and its reference count.
+    Block *block;
 };
 
 template <typename T, typename... TArgs>
@@ -69,4 +163,4 @@ Rc<T> make_rc(const TArgs &... args)
     return Rc<T>(args...);
 }
 
-CLICK_ENDDECLS
\ No newline at end of file
+CLICK_ENDDECLS
@@ -0,0 +1,411 @@
+#pragma once
+
+#include <click/config.h>
+#include <click/element.hh>
+#include <click/timer.hh>
+#include <click/timestamp.hh>
+#include <click/vector.hh>
+
+CLICK_DECLS
+
+/// The clock that timer wheels run on by default: Click's steady clock.
+struct TimerWheelSteadyClock
+{
+    static Timestamp now() { return Timestamp::recent_steady(); }
+};
+
+/// A hierarchical timer wheel with decisecond granularity. Every entry in the
+/// wheel has a strongly-typed callback, but the wheel as a whole is driven by
+/// a single Click timer. (Re)scheduling an entry is a constant-time list
+/// operation, which beats pushing one timer per entry onto Click's timer heap
+/// when there are tens of thousands of entries.
+///
+/// A wheel without an owner element has no Click timer. Whoever created it
+/// must call run to fire the entries that are due, which lets tests drive a
+/// wheel with a clock of their own.
+template <typename TCallback, typename TClock = TimerWheelSteadyClock>
+class TimerWheel final
+{
+  public:
+    /// A handle to an entry in the timer wheel.
+    typedef int handle_type;
+
+    /// A handle that does not refer to any entry.
+    static const handle_type null_handle = -1;
+
+    TimerWheel(Element *owner)
+        : owner(owner), timer(&timer_thunk, this), epoch(TClock::now()), free_list(null_handle),
+          current_tick(0), wake_tick(0), scheduled_count(0), running(false), run_hook(nullptr),
+          run_hook_data(nullptr)
+    {
+        for (int i = 0; i < level_count * slot_count; i++)
+        {
+            slots[i] = null_handle;
+        }
+    }
+
+    /// Sets a function that is called with the given data every time run has
+    /// fired one or more entries, after the last of them. Owners use it to
+    /// finish, once, work that the entries of a tick have in common.
+    void set_run_hook(void (*hook)(void *), void *data)
+    {
+        run_hook = hook;
+        run_hook_data = data;
+    }
+
+    /// Creates a new, unscheduled entry with the given callback.
+    handle_type create(const TCallback &callback)
+    {
+        handle_type handle;
+        if (free_list == null_handle)
+        {
+            handle = entries.size();
+            entries.push_back(Entry(callback));
+        }
+        else
+        {
+            handle = free_list;
+            free_list = entries[handle].next;
+            entries[handle] = Entry(callback);
+        }
+        return handle;
+    }
+
+    /// Unschedules and destroys the entry with the given handle. Its slot
+    /// is reused by later entries.
+    void destroy(handle_type handle)
+    {
+        unschedule(handle);
+        entries[handle].next = free_list;
+        free_list = handle;
+    }
+
+    /// Schedules the entry with the given handle to fire after the given
+    /// amount of deciseconds. Any previous expiry is forgotten.
+    void schedule_after_dsec(handle_type handle, uint32_t delta_dsec)
+    {
+        if (owner != nullptr && !timer.initialized())
+        {
+            timer.initialize(owner);
+        }
+
+        unschedule(handle);
+        if (scheduled_count == 0 && !running)
+        {
+            // Nothing is pending, so there's no point in walking the ticks
+            // that went by while the wheel was idle. A callback that is being
+            // run must leave the current tick alone, though: run is still
+            // draining that tick's slot.
+            current_tick = now_tick();
+        }
+
+        // Entries fire no sooner than the next tick. This keeps callbacks that
+        // reschedule themselves from firing over and over within a tick.
+        if (delta_dsec == 0)
+        {
+            delta_dsec = 1;
+        }
+        else if (delta_dsec > max_delta)
+        {
+            delta_dsec = max_delta;
+        }
+        entries[handle].expiry = now_tick() + delta_dsec;
+        insert(handle);
+        scheduled_count++;
+
+        auto expiry = entries[handle].expiry;
+        if (!timer.scheduled() || expiry < wake_tick)
+        {
+            wake_at(expiry);
+        }
+    }
+
+    /// Unschedules the entry with the given handle.
+    void unschedule(handle_type handle)
+    {
+        if (entries[handle].slot >= 0)
+        {
+            unlink(handle);
+            scheduled_count--;
+        }
+    }
+
+    /// Tests if the entry with the given handle is scheduled to fire.
+    bool scheduled(handle_type handle) const
+    {
+        return entries[handle].slot >= 0;
+    }
+
+    /// Gets the amount of time remaining until the entry with the given
+    /// handle fires, in deciseconds.
+    uint32_t remaining_time_dsec(handle_type handle) const
+    {
+        if (!scheduled(handle))
+        {
+            return 0;
+        }
+
+        auto now = now_tick();
+        auto expiry = entries[handle].expiry;
+        return expiry > now ? expiry - now : 0;
+    }
+
+    /// Runs all entries whose expiry has passed. The Click timer of a wheel
+    /// with an owner does this by itself.
+    void run()
+    {
+        auto target = now_tick();
+        bool fired = false;
+        running = true;
+        while (current_tick <= target && scheduled_count > 0)
+        {
+            uint32_t index = current_tick & slot_mask;
+            if (index == 0)
+            {
+                for (int level = 1; level < level_count && cascade(level) == 0; level++)
+                {
+                }
+            }
+
+            handle_type handle;
+            while ((handle = slots[index]) != null_handle)
+            {
+                unlink(handle);
+                scheduled_count--;
+
+                // The callback may create, destroy or reschedule entries,
+                // which can move the entry vector around.
+                TCallback callback = entries[handle].callback;
+                callback();
+                fired = true;
+            }
+            current_tick++;
+        }
+        running = false;
+
+        if (fired && run_hook != nullptr)
+        {
+            run_hook(run_hook_data);
+        }
+
+        if (scheduled_count == 0)
+        {
+            return;
+        }
+
+        if (current_tick <= target)
+        {
+            current_tick = target + 1;
+        }
+
+        // Wake up for the next non-empty slot in the first level, or at the
+        // next cascade if there is no such slot. The current tick may itself
+        // be due for a cascade.
+        uint32_t next_cascade = (current_tick + slot_mask) & ~slot_mask;
+        uint32_t tick = current_tick;
+        while (tick < next_cascade && slots[tick & slot_mask] == null_handle)
+        {
+            tick++;
+        }
+        wake_at(tick);
+    }
+
+  private:
+    /// The number of slots per level.
+    static const int slot_bits = 6;
+    static const int slot_count = 1 << slot_bits;
+    static const uint32_t slot_mask = slot_count - 1;
+
+    /// The number of levels. Four levels of 64 slots cover a bit over 19 days,
+    /// which is way more than any IGMP timer needs.
+    static const int level_count = 4;
+
+    /// The maximal delay that can be scheduled, in ticks.
+    static const uint32_t max_delta = (1u << (slot_bits * level_count)) - 1;
+
+    struct Entry
+    {
+        Entry(const TCallback &callback)
+            : callback(callback), expiry(0), prev(null_handle), next(null_handle), slot(-1)
+        {
+        }
+
+        TCallback callback;
+
+        /// The tick at which this entry fires.
+        uint32_t expiry;
+
+        /// The previous and next entries in this entry's slot. The next entry
+        /// doubles as the next free entry for entries that are not in use.
+        handle_type prev;
+        handle_type next;
+
+        /// The slot that holds this entry, or -1 if it is not scheduled.
+        int slot;
+    };
+
+    /// Gets the current time, in ticks.
+    uint32_t now_tick() const
+    {
+        return (TClock::now() - epoch).msecval() / 100;
+    }
+
+    /// Links the entry with the given handle into the slot for its expiry.
+    void insert(handle_type handle)
+    {
+        auto &entry = entries[handle];
+        uint32_t delta = entry.expiry > current_tick ? entry.expiry - current_tick : 0;
+
+        int level = 0;
+        while (level < level_count - 1 && delta >= (1u << (slot_bits * (level + 1))))
+        {
+            level++;
+        }
+        // Entries that are already overdue end up in the current tick's slot.
+        uint32_t tick = delta == 0 ? current_tick : entry.expiry;
+        int slot = level * slot_count + ((tick >> (slot_bits * level)) & slot_mask);
+
+        entry.slot = slot;
+        entry.prev = null_handle;
+        entry.next = slots[slot];
+        if (entry.next != null_handle)
+        {
+            entries[entry.next].prev = handle;
+        }
+        slots[slot] = handle;
+    }
+
+    /// Unlinks the entry with the given handle from its slot.
+    void unlink(handle_type handle)
+    {
+        auto &entry = entries[handle];
+        if (entry.prev == null_handle)
+        {
+            slots[entry.slot] = entry.next;
+        }
+        else
+        {
+            entries[entry.prev].next = entry.next;
+        }
+        if (entry.next != null_handle)
+        {
+            entries[entry.next].prev = entry.prev;
+        }
+        entry.prev = null_handle;
+        entry.next = null_handle;
+        entry.slot = -1;
+    }
+
+    /// Moves the entries in the current slot of the given level to lower
+    /// levels. Returns the index of that slot.
+    uint32_t cascade(int level)
+    {
+        uint32_t index = (current_tick >> (slot_bits * level)) & slot_mask;
+        int slot = level * slot_count + index;
+        handle_type handle = slots[slot];
+        slots[slot] = null_handle;
+        while (handle != null_handle)
+        {
+            handle_type next = entries[handle].next;
+            insert(handle);
+            handle = next;
+        }
+        return index;
+    }
+
+    /// Schedules the Click timer to fire at the given tick.
+    void wake_at(uint32_t tick)
+    {
+        wake_tick = tick;
+        if (owner != nullptr)
+        {
+            timer.schedule_at_steady(epoch + Timestamp::make_msec((Timestamp::value_type)tick * 100));
+        }
+    }
+
+    static void timer_thunk(Timer *, void *data)
+    {
+        ((TimerWheel *)data)->run();
+    }
+
+    Element *owner;
+    Timer timer;
+    Timestamp epoch;
+    Vector<Entry> entries;
+    handle_type free_list;
+    handle_type slots[level_count * slot_count];
+    uint32_t current_tick;
+    uint32_t wake_tick;
+    uint32_t scheduled_count;
+
+    /// Tells if run is firing entries.
+    bool running;
+
+    void (*run_hook)(void *);
+    void *run_hook_data;
+};
+
+/// A non-owning reference to an entry in a timer wheel. It exposes the same
+/// scheduling operations as CallbackTimer, so records can use either. A null
+/// reference, i.e., one that was not created by a wheel, ignores everything.
+template <typename TCallback, typename TClock = TimerWheelSteadyClock>
+class TimerWheelEntry final
+{
+  public:
+    TimerWheelEntry()
+        : wheel(nullptr), handle(TimerWheel<TCallback, TClock>::null_handle)
+    {
+    }
+
+    TimerWheelEntry(TimerWheel<TCallback, TClock> *wheel, const TCallback &callback)
+        : wheel(wheel), handle(wheel->create(callback))
+    {
+    }
+
+    /// Destroys the entry this reference points to. This must be done exactly
+    /// once for every entry, by whoever owns the reference.
+    void release()
+    {
+        if (wheel != nullptr)
+        {
+            wheel->destroy(handle);
+            wheel = nullptr;
+        }
+    }
+
+    /// Tests if this timer is scheduled to expire at some point.
+    bool scheduled() const
+    {
+        return wheel != nullptr && wheel->scheduled(handle);
+    }
+
+    /// Schedules the timer to fire after the given amount of deciseconds.
+    void schedule_after_dsec(uint32_t delta_dsec)
+    {
+        if (wheel != nullptr)
+        {
+            wheel->schedule_after_dsec(handle, delta_dsec);
+        }
+    }
+
+    /// Unschedules this timer.
+    void unschedule()
+    {
+        if (wheel != nullptr)
+        {
+            wheel->unschedule(handle);
+        }
+    }
+
+    /// Gets the amount of time remaining until this timer fires, in deciseconds.
+    uint32_t remaining_time_dsec() const
+    {
+        return wheel == nullptr ? 0 : wheel->remaining_time_dsec(handle);
+    }
+
+  private:
+    TimerWheel<TCallback, TClock> *wheel;
+    typename TimerWheel<TCallback, TClock>::handle_type handle;
+};
+
+CLICK_ENDDECLS
@@ -1,5 +1,5 @@
 #!/usr/bin/env bash
 
-echo "write router/igmp_multicast_server/igmp.config $@" | telnet localhost 10000
-echo "write router/igmp_client1/igmp.config $@" | telnet localhost 10000
-echo "write router/igmp_client2/igmp.config $@" | telnet localhost 10000
\ No newline at end of file
+# Configures every interface of the router. Add 'INTERFACE index' to the
+# arguments to configure a single interface instead.
+echo "write router/igmp.config $@" | telnet localhost 10000
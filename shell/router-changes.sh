@@ -0,0 +1,6 @@
+#!/usr/bin/env bash
+
+# Prints the router's group records that have changed since the given
+# generation. Usage: router-changes.sh generation
+
+echo "read router/igmp.changes $1" | telnet localhost 10000
@@ -0,0 +1,6 @@
+#!/usr/bin/env bash
+
+# Prints the router's group records: every group's filter mode, sources and
+# remaining timers, per interface.
+
+echo "read router/igmp.groups" | telnet localhost 10000
@@ -0,0 +1,7 @@
+#!/usr/bin/env bash
+
+# Prints the router's statistics: IGMP reports and queries, group records by
+# type and group record life cycles, followed by the multicast forwarder's
+# forwarded and dropped data packets and the number of copies it sent.
+
+(echo "read router/igmp.stats"; echo "read router/multicast_forwarder.stats"; echo "quit") | telnet localhost 10000
@@ -0,0 +1,7 @@
+#!/usr/bin/env bash
+
+# Writes a snapshot of the router's group records and timers to the file that
+# its SNAPSHOT keyword names. A router that is restarted with the same SNAPSHOT
+# file restores the snapshot and forwards traffic right away.
+
+echo "write router/igmp.save_snapshot" | telnet localhost 10000
@@ -0,0 +1,6 @@
+#!/usr/bin/env bash
+
+# Prints the statistics of the router and the simulated hosts in
+# scripts/scale.click.
+
+(echo "read router.stats"; echo "read hosts.stats"; echo "quit") | telnet localhost 10000
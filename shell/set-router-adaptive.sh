@@ -0,0 +1,9 @@
+#!/usr/bin/env bash
+
+# Has the router adapt its Query Response Interval and Query Interval to the
+# number of reports that its General Queries elicit, so that the reports to a
+# General Query arrive at about the given number of group records per second.
+# The router also raises its Robustness Variable when state-change reports get
+# lost. 0 turns adaptation off and restores the configured values.
+
+$(dirname $0)/configure-router.sh "ADAPTIVE_REPORT_RATE $1"
@@ -0,0 +1,7 @@
+#!/usr/bin/env bash
+
+# Sets the router's debug level. At level 0, the router doesn't log anything.
+# At level 1, it logs every IGMP packet it receives. At level 2, it also logs
+# every group record in every membership report.
+
+echo "write router/igmp.debug $1" | telnet localhost 10000
@@ -0,0 +1,7 @@
+#!/usr/bin/env bash
+
+# Fast leave makes the router track the reception state of every host, so it
+# can stop forwarding a group or source as soon as the last host that wants it
+# leaves, instead of querying the network for remaining listeners first.
+
+$(dirname $0)/configure-router.sh "FAST_LEAVE $1"
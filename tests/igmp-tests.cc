@@ -0,0 +1,1469 @@
+// Unit tests for the parts of the IGMP elements whose behavior is easy to get
+// subtly wrong and hard to observe in a running router.
+//
+// Usage: igmp-tests
+//
+// Every test prints its name and whether it passed. The exit status is nonzero
+// if any test failed.
+
+#include <click/config.h>
+#include <click/atomic.hh>
+#include <click/glue.hh>
+#include <click/ipaddress.hh>
+#include <click/straccum.hh>
+#include <click/timestamp.hh>
+#include <click/vector.hh>
+#include <stdio.h>
+#include <thread>
+#include "EventSchedule.hh"
+#include "IgmpForwardingIndex.hh"
+#include "IgmpMessage.hh"
+#include "IgmpMessageManip.hh"
+#include "IgmpQuerierElection.hh"
+#include "IgmpQueryLoadController.hh"
+#include "IgmpRouterFilter.hh"
+#include "IgmpRouterSnapshot.hh"
+#include "IgmpRouterVariables.hh"
+#include "TimerWheel.hh"
+
+CLICK_DECLS
+
+/// The number of checks that have failed so far.
+static int failure_count = 0;
+
+/// Counts a failed check, and reports it along with the test that made it.
+static void check(bool condition, const char *test, const char *description)
+{
+    if (!condition)
+    {
+        printf("%s: FAILED: %s\n", test, description);
+        failure_count++;
+    }
+}
+
+/// A small, deterministic pseudo-random number generator (xorshift64).
+class TestRandom final
+{
+  public:
+    TestRandom()
+        : state(0x9E3779B97F4A7C15ull)
+    {
+    }
+
+    uint32_t next(uint32_t bound)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return (uint32_t)(state % bound);
+    }
+
+  private:
+    uint64_t state;
+};
+
+/// Gets the address of the given host.
+static IPAddress host_address(int index)
+{
+    return IPAddress(htonl(0x0A010000u + 1 + index));
+}
+
+/// Gets the address of the given group.
+static IPAddress group_address(int index)
+{
+    return IPAddress(htonl(0xE8010000u + 1 + index));
+}
+
+/// Runs the given number of query cycles on the given controller. In every cycle,
+/// each of the given number of hosts makes a state change and sends the given
+/// number of copies of it, of which the given percentage are lost. Hosts that
+/// send zero copies adopt the router's Robustness Variable instead.
+static void run_lossy_cycles(
+    IgmpQueryLoadController &controller, IgmpRouterVariables &vars, TestRandom &random, int cycles, int hosts,
+    uint32_t loss_percent, unsigned int host_robustness = 0)
+{
+    IgmpV3MembershipReport report;
+    IgmpV3GroupRecord record;
+    record.type = IgmpV3GroupRecordType::AllowNewSources;
+    record.multicast_address = IPAddress("232.1.0.1");
+    record.source_addresses.push_back(IPAddress("10.0.0.1"));
+    report.group_records.push_back(record);
+
+    Vector<unsigned char> buffer(report.get_size(), 0);
+    report.write(buffer.begin());
+    IgmpV3MembershipReportView view(buffer.begin(), buffer.size());
+    IgmpV3GroupRecordView record_view = *view.begin();
+
+    for (int cycle = 0; cycle < cycles; cycle++)
+    {
+        unsigned int copies = host_robustness != 0 ? host_robustness : vars.get_robustness_variable();
+        for (int host = 0; host < hosts; host++)
+        {
+            for (unsigned int copy = 0; copy < copies; copy++)
+            {
+                if (random.next(100) >= loss_percent)
+                {
+                    controller.observe_state_change_record(host_address(host), record_view);
+                }
+            }
+        }
+        controller.adjust(vars);
+    }
+}
+
+/// Tests that the load controller raises the Robustness Variable when most
+/// state-change copies are lost, even though most records then arrive only once,
+/// and that it lowers the Robustness Variable again once the loss stops.
+static void test_load_controller_heavy_loss(const char *test)
+{
+    IgmpRouterVariables vars;
+    IgmpQueryLoadController controller;
+    controller.configure(1000, 0, vars);
+    TestRandom random;
+
+    run_lossy_cycles(controller, vars, random, 20, 1000, 60);
+    check(controller.get_loss_permille() > 500, test, "a loss of 60% is estimated as over 50%");
+    check(vars.get_robustness_variable() > 2, test, "the Robustness Variable goes up");
+
+    run_lossy_cycles(controller, vars, random, 40, 1000, 0);
+    check(controller.get_loss_permille() < 20, test, "no loss is estimated once the loss stops");
+    check(vars.get_robustness_variable() == 2, test, "the Robustness Variable goes back down");
+}
+
+/// Tests that reports which only confirm a group's state leave the router
+/// filter's generation and change log alone, even when there are more groups than
+/// the change log holds, and that reports which change the state are logged.
+static void test_router_filter_refresh_keeps_generation(const char *test)
+{
+    IgmpTimerlessRouterFilter filter(nullptr);
+    IgmpSourceSet sources;
+    sources.insert(IPAddress("10.0.0.1"));
+    sources.insert(IPAddress("10.0.0.2"));
+
+    const int group_count = 5000;
+    for (int i = 0; i < group_count; i++)
+    {
+        filter.receive_current_state_record(group_address(i), IgmpFilterMode::Include, sources);
+    }
+    uint64_t generation = filter.get_generation();
+    check(generation == (uint64_t)group_count, test, "every new record is logged once");
+
+    for (int i = 0; i < group_count; i++)
+    {
+        filter.receive_current_state_record(group_address(i), IgmpFilterMode::Include, sources);
+    }
+    check(filter.get_generation() == generation, test, "refreshing INCLUDE-mode records changes nothing");
+
+    int change_count = 0;
+    bool complete = filter.for_each_change_since(generation, [&change_count](const IPAddress &) {
+        change_count++;
+    });
+    check(complete && change_count == 0, test, "refreshes don't push changes out of the log");
+
+    IgmpSourceSet excluded;
+    excluded.insert(IPAddress("10.0.0.3"));
+    filter.receive_current_state_record(group_address(0), IgmpFilterMode::Exclude, excluded);
+    check(filter.get_generation() == generation + 1, test, "a new filter mode is logged");
+
+    generation = filter.get_generation();
+    filter.receive_current_state_record(group_address(0), IgmpFilterMode::Exclude, excluded);
+    check(filter.get_generation() == generation, test, "refreshing an EXCLUDE-mode record changes nothing");
+
+    IgmpRouterQueryAction query_action;
+    IgmpSourceSet allowed;
+    allowed.insert(IPAddress("10.0.0.4"));
+    filter.receive_state_change_record(
+        group_address(0), IgmpV3GroupRecordType::AllowNewSources, allowed, query_action);
+    check(filter.get_generation() == generation + 1, test, "a new source record of an EXCLUDE-mode record is logged");
+
+    generation = filter.get_generation();
+    filter.receive_current_state_record(group_address(1), IgmpFilterMode::Include, allowed);
+    check(filter.get_generation() == generation + 1, test, "a new source of an INCLUDE-mode record is logged");
+
+    change_count = 0;
+    IPAddress changed_address;
+    complete = filter.for_each_change_since(generation, [&](const IPAddress &multicast_address) {
+        change_count++;
+        changed_address = multicast_address;
+    });
+    check(complete && change_count == 1 && changed_address == group_address(1), test,
+          "the change log holds just the changed record");
+}
+
+/// Gets a set of sources, where bit i of the given mask stands for source i.
+static IgmpSourceSet make_source_set(uint32_t mask)
+{
+    IgmpSourceSet sources;
+    for (int i = 0; i < 32; i++)
+    {
+        if ((mask >> i) & 1)
+        {
+            sources.insert(host_address(i));
+        }
+    }
+    return sources;
+}
+
+/// Tests if the given source set holds exactly the sources of the given mask.
+static bool source_set_is(const IgmpSourceSet &sources, uint32_t mask)
+{
+    return sources == make_source_set(mask);
+}
+
+/// Tests if the given timer value is the expected one. The clock may tick once while
+/// a test runs, so a timer may be a decisecond short.
+static bool timer_is(uint32_t remaining_dsec, uint32_t expected_dsec)
+{
+    return remaining_dsec == expected_dsec || remaining_dsec + 1 == expected_dsec;
+}
+
+/// A row of the router state table for state-change records, with the sources of
+/// the router state and of the report as masks for make_source_set.
+struct StateChangeCase
+{
+    const char *description;
+
+    /// The router state: INCLUDE (include_or_x), or EXCLUDE (include_or_x, y).
+    IgmpFilterMode mode;
+    uint32_t include_or_x;
+    uint32_t y;
+
+    /// The report.
+    IgmpV3GroupRecordType type;
+    uint32_t report_sources;
+
+    /// The new router state.
+    IgmpFilterMode new_mode;
+    uint32_t new_include_or_x;
+    uint32_t new_y;
+
+    /// The sources whose timers are set to the GMI and those whose timers are set to
+    /// the group timer. All other sources keep their timers.
+    uint32_t gmi_sources;
+    uint32_t group_timer_sources;
+
+    /// Tells if the group timer is set to the GMI.
+    bool group_timer_to_gmi;
+
+    /// The queries to send.
+    uint32_t query_sources;
+    bool query_group;
+};
+
+/// Tests every row of the router state table for state-change records (RFC 3376,
+/// section 6.4.2) and the query actions that follow (section 6.6.3): new states,
+/// source timers that are set to the GMI or to the group timer, and queried groups
+/// and sources whose timers are lowered to LMQT.
+static void test_router_filter_state_changes(const char *test)
+{
+    // A and X are {0, 1}, Y is {2, 3} and B (or A in EXCLUDE mode) is {1, 2, 4}.
+    const uint32_t a = 0x03, x = 0x03, y = 0x0C, b = 0x16;
+    const StateChangeCase cases[] = {
+        {"INCLUDE (A) + ALLOW (B)", IgmpFilterMode::Include, a, 0, IgmpV3GroupRecordType::AllowNewSources, b,
+         IgmpFilterMode::Include, a | b, 0, b, 0, false, 0, false},
+        {"INCLUDE (A) + BLOCK (B)", IgmpFilterMode::Include, a, 0, IgmpV3GroupRecordType::BlockOldSources, b,
+         IgmpFilterMode::Include, a, 0, 0, 0, false, a & b, false},
+        {"INCLUDE (A) + TO_EX (B)", IgmpFilterMode::Include, a, 0, IgmpV3GroupRecordType::ChangeToExcludeMode, b,
+         IgmpFilterMode::Exclude, a & b, b & ~a, 0, 0, true, a & b, false},
+        {"INCLUDE (A) + TO_IN (B)", IgmpFilterMode::Include, a, 0, IgmpV3GroupRecordType::ChangeToIncludeMode, b,
+         IgmpFilterMode::Include, a | b, 0, b, 0, false, a & ~b, false},
+        {"EXCLUDE (X,Y) + ALLOW (A)", IgmpFilterMode::Exclude, x, y, IgmpV3GroupRecordType::AllowNewSources, b,
+         IgmpFilterMode::Exclude, x | b, y & ~b, b, 0, false, 0, false},
+        {"EXCLUDE (X,Y) + BLOCK (A)", IgmpFilterMode::Exclude, x, y, IgmpV3GroupRecordType::BlockOldSources, b,
+         IgmpFilterMode::Exclude, x | (b & ~y), y, 0, b & ~x & ~y, false, b & ~y, false},
+        {"EXCLUDE (X,Y) + TO_EX (A)", IgmpFilterMode::Exclude, x, y, IgmpV3GroupRecordType::ChangeToExcludeMode, b,
+         IgmpFilterMode::Exclude, b & ~y, y & b, 0, b & ~x & ~y, true, b & ~y, false},
+        {"EXCLUDE (X,Y) + TO_IN (A)", IgmpFilterMode::Exclude, x, y, IgmpV3GroupRecordType::ChangeToIncludeMode, b,
+         IgmpFilterMode::Exclude, x | b, y & ~b, b, 0, false, x & ~b, true},
+    };
+
+    char description[128];
+    for (const auto &row : cases)
+    {
+        IgmpRouterFilter filter(nullptr);
+        auto &vars = filter.get_router_variables();
+        auto group = group_address(0);
+
+        // Set up the router state. Its source timers are at the initial GMI.
+        IgmpRouterQueryAction query_action;
+        auto initial_timer = vars.get_group_membership_interval();
+        if (row.mode == IgmpFilterMode::Include)
+        {
+            filter.receive_current_state_record(group, IgmpFilterMode::Include, make_source_set(row.include_or_x));
+        }
+        else
+        {
+            filter.receive_current_state_record(group, IgmpFilterMode::Exclude, make_source_set(row.y));
+            filter.receive_state_change_record(
+                group, IgmpV3GroupRecordType::AllowNewSources, make_source_set(row.include_or_x), query_action);
+
+            // Lower the group timer to a value of its own.
+            vars.get_last_member_query_count() = 5;
+            filter.lower_group_timer(group);
+        }
+        auto group_timer = vars.get_last_member_query_time();
+
+        // Give the GMI and LMQT values of their own as well.
+        vars.get_query_response_interval() += 300;
+        vars.get_last_member_query_count() = 2;
+        auto gmi = vars.get_group_membership_interval();
+        auto lmqt = vars.get_last_member_query_time();
+
+        filter.receive_state_change_record(group, row.type, make_source_set(row.report_sources), query_action);
+
+        auto record_ptr = filter.get_record(group);
+        if (record_ptr == nullptr)
+        {
+            snprintf(description, sizeof(description), "%s: the record exists", row.description);
+            check(false, test, description);
+            continue;
+        }
+
+        IgmpSourceSet forwarded;
+        for (const auto &source_record : record_ptr->source_records)
+        {
+            forwarded.insert(source_record.get_source_address());
+        }
+        snprintf(description, sizeof(description), "%s: new router state", row.description);
+        check(record_ptr->filter_mode == row.new_mode && source_set_is(forwarded, row.new_include_or_x) &&
+                  source_set_is(record_ptr->excluded_addresses, row.new_y),
+              test, description);
+
+        bool timers_ok = true;
+        for (const auto &source_record : record_ptr->source_records)
+        {
+            int i = ntohl(source_record.get_source_address().addr()) - ntohl(host_address(0).addr());
+            uint32_t expected = initial_timer;
+            if ((row.gmi_sources >> i) & 1)
+                expected = gmi;
+            else if ((row.group_timer_sources >> i) & 1)
+                expected = group_timer;
+            timers_ok = timers_ok && timer_is(source_record.remaining_time_dsec(), expected);
+        }
+        snprintf(description, sizeof(description), "%s: source timers", row.description);
+        check(timers_ok, test, description);
+
+        if (row.new_mode == IgmpFilterMode::Exclude)
+        {
+            snprintf(description, sizeof(description), "%s: group timer", row.description);
+            check(timer_is(record_ptr->timer.remaining_time_dsec(), row.group_timer_to_gmi ? gmi : group_timer), test,
+                  description);
+        }
+
+        snprintf(description, sizeof(description), "%s: queries", row.description);
+        check(query_action.query_group == row.query_group && source_set_is(query_action.query_sources, row.query_sources),
+              test, description);
+
+        // Queue the queries. Every queried source and group whose timer is larger than
+        // LMQT is lowered to LMQT and gets Last Member Query Count retransmissions.
+        IgmpPendingGroupQuery pending;
+        filter.queue_group_queries(group, query_action, pending);
+        record_ptr = filter.get_record(group);
+
+        bool lowered_ok = pending.group_remaining == (row.query_group ? 2u : 0u);
+        if (row.query_group)
+        {
+            lowered_ok = lowered_ok && timer_is(record_ptr->timer.remaining_time_dsec(), lmqt);
+        }
+        for (const auto &address : query_action.query_sources)
+        {
+            auto source_ptr = record_ptr->find_source_record(address);
+            auto count_ptr = pending.source_remaining.findp(address);
+            lowered_ok = lowered_ok && source_ptr != nullptr && timer_is(source_ptr->remaining_time_dsec(), lmqt) &&
+                count_ptr != nullptr && *count_ptr == 2;
+        }
+        snprintf(description, sizeof(description), "%s: queried timers are lowered to LMQT", row.description);
+        check(lowered_ok, test, description);
+    }
+}
+
+/// A query that a router filter's query round asked to send.
+struct SentGroupQuery
+{
+    IgmpSourceSet sources;
+    bool suppress;
+};
+
+/// Sends the next query round for the given group, and collects its queries.
+static Vector<SentGroupQuery> send_test_query_round(
+    IgmpRouterFilter &filter, const IPAddress &group, IgmpPendingGroupQuery &pending)
+{
+    Vector<SentGroupQuery> sent;
+    filter.send_group_query_round(group, pending, [&sent](const Vector<IPAddress> &sources, bool suppress) {
+        SentGroupQuery query;
+        query.sources.assign(sources.begin(), sources.end());
+        query.suppress = suppress;
+        sent.push_back(query);
+    });
+    return sent;
+}
+
+/// Tests the retransmissions of group-specific and group-and-source-specific queries,
+/// and their "Suppress Router-Side Processing" flags (RFC 3376, section 6.6.3).
+static void test_router_filter_query_rounds(const char *test)
+{
+    IgmpRouterFilter filter(nullptr);
+    IgmpRouterQueryAction query_action;
+    auto group = group_address(0);
+
+    // INCLUDE ({0, 1}) + BLOCK ({0, 1}) queries both sources.
+    filter.receive_current_state_record(group, IgmpFilterMode::Include, make_source_set(0x03));
+    filter.receive_state_change_record(group, IgmpV3GroupRecordType::BlockOldSources, make_source_set(0x03), query_action);
+    IgmpPendingGroupQuery pending;
+    filter.queue_group_queries(group, query_action, pending);
+
+    auto sent = send_test_query_round(filter, group, pending);
+    check(sent.size() == 1 && source_set_is(sent[0].sources, 0x03) && !sent[0].suppress, test,
+          "sources with timers at LMQT are queried with a clear S flag");
+    check(!pending.finished(), test, "the first round is followed by a retransmission");
+
+    // A host still wants source 1, which resets its timer to the GMI.
+    filter.receive_state_change_record(group, IgmpV3GroupRecordType::AllowNewSources, make_source_set(0x02), query_action);
+    sent = send_test_query_round(filter, group, pending);
+    check(sent.size() == 2 && source_set_is(sent[0].sources, 0x01) && !sent[0].suppress &&
+              source_set_is(sent[1].sources, 0x02) && sent[1].suppress,
+          test, "sources with timers above LMQT are queried separately, with the S flag set");
+    check(pending.finished(), test, "each source is queried Last Member Query Count times");
+
+    // EXCLUDE ({0, 1}, {2}) + TO_IN ({1}) queries the group and source 0.
+    group = group_address(1);
+    filter.receive_current_state_record(group, IgmpFilterMode::Exclude, make_source_set(0x04));
+    filter.receive_state_change_record(group, IgmpV3GroupRecordType::AllowNewSources, make_source_set(0x03), query_action);
+    filter.receive_state_change_record(group, IgmpV3GroupRecordType::ChangeToIncludeMode, make_source_set(0x02), query_action);
+    pending = IgmpPendingGroupQuery();
+    filter.queue_group_queries(group, query_action, pending);
+
+    sent = send_test_query_round(filter, group, pending);
+    check(sent.size() == 2 && sent[0].sources.size() == 0 && !sent[0].suppress &&
+              source_set_is(sent[1].sources, 0x01) && !sent[1].suppress,
+          test, "a group-specific query is sent along with the group-and-source-specific query");
+
+    // Hosts still want the group and source 0, which resets their timers to the GMI.
+    filter.receive_current_state_record(group, IgmpFilterMode::Exclude, make_source_set(0x07));
+    filter.receive_current_state_record(group, IgmpFilterMode::Include, make_source_set(0x01));
+    sent = send_test_query_round(filter, group, pending);
+    check(sent.size() == 1 && sent[0].sources.size() == 0 && sent[0].suppress, test,
+          "a group timer above LMQT sets the S flag, and suppresses the suppressed-source query");
+    check(pending.finished(), test, "the group is queried Last Member Query Count times");
+}
+
+/// Tests that hosts which stick to their own Robustness Variable, instead of
+/// adopting the router's, don't look like loss to the load controller on a
+/// lossless network, and that their loss is still noticed.
+static void test_load_controller_non_adopting_hosts(const char *test)
+{
+    for (unsigned int host_robustness = 1; host_robustness <= 2; host_robustness++)
+    {
+        IgmpRouterVariables vars;
+        IgmpQueryLoadController controller;
+        controller.configure(1000, 0, vars);
+        TestRandom random;
+
+        run_lossy_cycles(controller, vars, random, 40, 1000, 0, host_robustness);
+        check(controller.get_loss_permille() == 0, test, "no loss is estimated on a lossless network");
+        check(vars.get_robustness_variable() == 2, test, "the Robustness Variable stays put");
+    }
+
+    IgmpRouterVariables vars;
+    IgmpQueryLoadController controller;
+    controller.configure(1000, 0, vars);
+    TestRandom random;
+
+    run_lossy_cycles(controller, vars, random, 20, 1000, 30, 2);
+    check(controller.get_loss_permille() > 200 && controller.get_loss_permille() < 400, test,
+          "a loss of 30% is estimated as such");
+}
+
+/// Counts the General Queries that a querier sends within the given window, when it
+/// sends its first one right away and spaces the others like the router does.
+static int count_general_queries_within(
+    IgmpQuerierElection &election, uint32_t window_dsec, uint32_t startup_query_interval, uint32_t query_interval)
+{
+    int count = 0;
+    for (uint32_t time = 0; time < window_dsec;)
+    {
+        count++;
+        time += election.count_general_query() ? startup_query_interval : query_interval;
+    }
+    return count;
+}
+
+/// Tests the querier election (RFC 3376, section 6.6.2): addresses are compared as
+/// whole numbers in host byte order, the router yields to a lower address only, and
+/// a router that takes over from another querier sends a single General Query
+/// instead of a startup burst.
+static void test_querier_election(const char *test)
+{
+    IgmpRouterVariables vars;
+    auto startup_query_interval = vars.get_startup_query_interval();
+    auto query_interval = vars.get_query_interval();
+    auto startup_query_count = vars.get_startup_query_count();
+
+    IgmpQuerierElection election(IPAddress("10.0.0.5"));
+    election.start(startup_query_count);
+    check(election.is_querier() && election.get_querier_address() == IPAddress("10.0.0.5"), test,
+          "a router starts up as the querier");
+
+    // 10.0.1.2 is higher as a whole, but its network-order word is lower on
+    // little-endian hosts.
+    check(!election.receive_query(IPAddress("10.0.1.2")) && election.is_querier(), test,
+          "a query from a higher address doesn't affect the election");
+    check(!election.receive_query(IPAddress("10.0.0.5")) && election.is_querier(), test,
+          "a looped-back query of our own doesn't affect the election");
+    check(count_general_queries_within(election, query_interval, startup_query_interval, query_interval) ==
+              (int)startup_query_count,
+          test, "a querier that starts up sends a burst of startup queries");
+
+    // 9.255.255.255 is lower as a whole, but its network-order word and its last
+    // octet are higher.
+    election.start(startup_query_count);
+    election.count_general_query();
+    check(election.receive_query(IPAddress("9.255.255.255")) && !election.is_querier() &&
+              election.get_querier_address() == IPAddress("9.255.255.255"),
+          test, "the router yields to a lower address");
+    check(!election.receive_query(IPAddress("10.0.0.6")) && !election.is_querier() &&
+              election.get_querier_address() == IPAddress("9.255.255.255"),
+          test, "a non-querier ignores queries from higher addresses");
+    check(election.receive_query(IPAddress("9.255.255.255")) && !election.is_querier(), test,
+          "every query from the querier restarts the other querier present timer");
+
+    election.take_over();
+    check(election.is_querier() && election.get_querier_address() == IPAddress("10.0.0.5"), test,
+          "the router takes over as the querier");
+    check(count_general_queries_within(election, query_interval, startup_query_interval, query_interval) == 1, test,
+          "a router that takes over sends one General Query and no startup burst");
+}
+
+/// A verdict that a forwarding index test expects to find.
+struct ExpectedVerdict
+{
+    IPAddress multicast_address;
+    IPAddress source_address;
+    uint32_t forward_mask;
+};
+
+/// Tests if the given slot mask holds exactly the slots whose bits are set in the
+/// given word.
+static bool slot_mask_is(const IgmpSlotMask &mask, uint32_t low_slots)
+{
+    bool ok = mask.word(0) == low_slots;
+    for (int i = 1; i < IgmpSlotMask::word_count; i++)
+    {
+        ok = ok && mask.word(i) == 0;
+    }
+    return ok;
+}
+
+/// Checks every expected verdict against the given index. Verdicts whose mask is
+/// zero must look like they aren't there at all.
+static void check_verdicts(
+    const IgmpForwardingIndex &index, const Vector<ExpectedVerdict> &expected, const char *test, const char *description)
+{
+    bool ok = true;
+    for (const auto &verdict : expected)
+    {
+        ok = ok && slot_mask_is(index.lookup_mask(verdict.multicast_address, verdict.source_address), verdict.forward_mask);
+    }
+    check(ok, test, description);
+}
+
+/// Computes the bucket in which a key starts probing, in a forwarding index of
+/// the given capacity. This mirrors IgmpForwardingIndex's hash function, so that
+/// the test can pick keys that collide.
+static int forwarding_index_home(const IPAddress &multicast_address, const IPAddress &source_address, int capacity)
+{
+    uint64_t key = ((uint64_t)multicast_address.addr() << 32) | source_address.addr();
+    key *= 0x9E3779B97F4A7C15ull;
+    return (int)((uint32_t)(key >> 32) & (capacity - 1));
+}
+
+/// Tests that erasing from the middle of a probe run, including a run that wraps
+/// around the end of the table, keeps every other entry reachable.
+static void test_forwarding_index_colliding_erase(const char *test)
+{
+    // Twenty keys that start probing in the last two buckets of the initial table
+    // form a single run that wraps around, and keys that start in the first two
+    // buckets get pushed behind it.
+    const int capacity = 64;
+    Vector<ExpectedVerdict> expected;
+    int wrapping = 0, displaced = 0;
+    for (uint32_t i = 1; expected.size() < 24; i++)
+    {
+        IPAddress multicast_address("232.1.0.1");
+        IPAddress source_address(htonl(0x0A000000u + i));
+        int home = forwarding_index_home(multicast_address, source_address, capacity);
+        if (home >= capacity - 2 && wrapping < 20)
+        {
+            wrapping++;
+        }
+        else if (home <= 1 && displaced < 4)
+        {
+            displaced++;
+        }
+        else
+        {
+            continue;
+        }
+        ExpectedVerdict verdict = {multicast_address, source_address, (uint32_t)(1 + (i % 3))};
+        expected.push_back(verdict);
+    }
+
+    IgmpForwardingIndex index;
+    for (const auto &verdict : expected)
+    {
+        for (int slot = 0; slot < 2; slot++)
+        {
+            index.set(verdict.multicast_address, verdict.source_address, slot, (verdict.forward_mask >> slot) & 1);
+        }
+    }
+    check(index.size() == expected.size(), test, "every key has an entry");
+    check_verdicts(index, expected, test, "every key is found after the inserts");
+
+    // Erasing one of two slots keeps the entry.
+    index.erase(expected[0].multicast_address, expected[0].source_address, 0);
+    expected[0].forward_mask &= 2;
+    check(index.size() == expected.size(), test, "erasing one slot keeps the entry");
+    check_verdicts(index, expected, test, "every key is found after erasing a slot");
+
+    // Erase every other key, starting in the middle of the run, then the rest.
+    bool ok = true;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int i = pass; i < expected.size(); i += 2)
+        {
+            index.erase(expected[i].multicast_address, expected[i].source_address, 0);
+            index.erase(expected[i].multicast_address, expected[i].source_address, 1);
+            expected[i].forward_mask = 0;
+            for (const auto &verdict : expected)
+            {
+                ok = ok &&
+                    slot_mask_is(index.lookup_mask(verdict.multicast_address, verdict.source_address), verdict.forward_mask);
+            }
+        }
+    }
+    check(ok, test, "every remaining key is found after every erase");
+    check(index.size() == 0, test, "erasing every key empties the index");
+}
+
+/// Tests random inserts and erases, with group defaults, against a plain list of
+/// the verdicts that should be in the index. The slots are spread over the whole
+/// range of slot masks, so the index widens its masks while it has entries.
+static void test_forwarding_index_random_changes(const char *test)
+{
+    const int slots[] = {0, 37, IgmpSlotMask::max_slots - 1};
+
+    struct Verdict
+    {
+        int group;
+        int source;
+        int slot;
+        bool forward;
+    };
+
+    IgmpForwardingIndex index;
+    Vector<Verdict> verdicts;
+    TestRandom random;
+    bool ok = true;
+    for (int step = 0; step < 4000; step++)
+    {
+        Verdict change = {(int)random.next(4), (int)random.next(40), slots[random.next(3)], random.next(2) == 0};
+        IPAddress multicast_address = group_address(change.group);
+        IPAddress source_address = change.source == 0 ? IPAddress() : host_address(change.source);
+
+        int found = -1;
+        for (int i = 0; i < verdicts.size(); i++)
+        {
+            if (verdicts[i].group == change.group && verdicts[i].source == change.source &&
+                verdicts[i].slot == change.slot)
+            {
+                found = i;
+            }
+        }
+
+        if (random.next(3) == 0)
+        {
+            index.erase(multicast_address, source_address, change.slot);
+            if (found != -1)
+            {
+                verdicts.erase(verdicts.begin() + found);
+            }
+        }
+        else
+        {
+            index.set(multicast_address, source_address, change.slot, change.forward);
+            if (found != -1)
+            {
+                verdicts[found] = change;
+            }
+            else
+            {
+                verdicts.push_back(change);
+            }
+        }
+
+        for (int group = 0; group < 4; group++)
+        {
+            for (int source = 1; source < 40; source++)
+            {
+                IgmpSlotMask expected;
+                for (int slot : slots)
+                {
+                    // A slot without a verdict for the source falls back to the
+                    // group's default verdict.
+                    int verdict = -1, default_verdict = -1;
+                    for (const auto &other : verdicts)
+                    {
+                        if (other.group == group && other.slot == slot && other.source == source)
+                            verdict = other.forward;
+                        else if (other.group == group && other.slot == slot && other.source == 0)
+                            default_verdict = other.forward;
+                    }
+                    bool forward = verdict == 1 || (verdict == -1 && default_verdict == 1);
+                    if (forward)
+                    {
+                        expected.set(slot);
+                    }
+                    ok = ok && index.lookup(group_address(group), host_address(source), slot) == forward;
+                }
+
+                auto mask = index.lookup_mask(group_address(group), host_address(source));
+                for (int i = 0; i < IgmpSlotMask::word_count; i++)
+                {
+                    ok = ok && mask.word(i) == expected.word(i);
+                }
+            }
+        }
+    }
+    check(ok, test, "every lookup matches the verdicts that were set");
+}
+
+/// Tests the slot masks that the forwarder walks to find the interfaces that a
+/// packet goes out on, with more interfaces than fit in a single word.
+static void test_forwarding_index_slot_mask(const char *test)
+{
+    IgmpSlotMask mask;
+    check(mask.empty() && mask.find_next(0) == -1, test, "a new mask is empty");
+
+    mask.set_first(48);
+    int count = 0, last = -1;
+    for (int slot = mask.find_next(0); slot >= 0; slot = mask.find_next(slot + 1))
+    {
+        count++;
+        last = slot;
+    }
+    check(count == 48 && last == 47 && mask.word(1) == 0xFFFF, test, "set_first spans words");
+
+    mask.reset(40);
+    mask.set(IgmpSlotMask::max_slots - 1);
+    check(!mask.test(40) && mask.find_next(40) == 41, test, "find_next skips a removed slot");
+    check(mask.find_next(48) == IgmpSlotMask::max_slots - 1 && mask.find_next(IgmpSlotMask::max_slots) == -1, test,
+          "find_next reaches the last slot and stops there");
+}
+
+/// Tests that a shared index only shows published changes, and that both of its
+/// copies have every change once they have both been published.
+static void test_shared_forwarding_index_publish(const char *test)
+{
+    IgmpSharedForwardingIndex index;
+    IPAddress group = group_address(0);
+    IPAddress source_a = host_address(1), source_b = host_address(2);
+
+    index.set(group, source_a, 0, true);
+    check(slot_mask_is(index.lookup_mask(group, source_a), 0), test, "an unpublished change is invisible");
+    index.publish();
+    check(slot_mask_is(index.lookup_mask(group, source_a), 1), test, "a published change is visible");
+
+    // The next changes go to the other copy, which must have caught up with the
+    // first change.
+    index.set(group, source_b, 1, true);
+    index.publish();
+    check(slot_mask_is(index.lookup_mask(group, source_a), 1) && slot_mask_is(index.lookup_mask(group, source_b), 2), test,
+          "the second copy has the first change as well");
+
+    index.erase(group, source_a, 0);
+    check(slot_mask_is(index.lookup_mask(group, source_a), 1), test, "an unpublished erase is invisible");
+    index.publish();
+    index.publish();
+    check(slot_mask_is(index.lookup_mask(group, source_a), 0) && slot_mask_is(index.lookup_mask(group, source_b), 2), test,
+          "a published erase is visible");
+
+    index.erase(group, source_b, 1);
+    index.publish();
+    index.set(group, source_a, 0, false);
+    index.publish();
+    check(slot_mask_is(index.lookup_mask(group, source_b), 0) && index.size() == 1, test,
+          "both copies have every change after two publications");
+}
+
+/// Tests that a reader on another thread never sees half of a published batch of
+/// changes while the writer keeps publishing.
+static void test_shared_forwarding_index_concurrent_reader(const char *test)
+{
+    IgmpSharedForwardingIndex index;
+    IPAddress group = group_address(0);
+    IPAddress source = host_address(1);
+    index.set(group, source, 0, false);
+    index.set(group, source, 1, false);
+    index.publish();
+
+    atomic_uint32_t done, lookups;
+    done = 0;
+    lookups = 0;
+    bool torn = false;
+    std::thread reader([&]() {
+        while (done.value() == 0)
+        {
+            auto mask = index.lookup_mask(group, source);
+            if (mask.test(0) != mask.test(1))
+            {
+                torn = true;
+            }
+            lookups++;
+        }
+    });
+
+    // Both slots always change together, within a single publication. The writer
+    // keeps going until the reader has had plenty of chances to catch it midway.
+    for (int i = 0; i < 20000 || lookups.value() < 20000; i++)
+    {
+        bool forward = (i & 1) == 0;
+        index.set(group, source, 0, forward);
+        index.set(group, source, 1, forward);
+        index.publish();
+    }
+    done = 1;
+    reader.join();
+    check(!torn, test, "the reader only sees whole publications");
+
+    index.set(group, source, 0, false);
+    index.set(group, source, 1, false);
+    index.publish();
+    check(slot_mask_is(index.lookup_mask(group, source), 0), test, "the last publication is visible");
+}
+
+/// Creates a group record of the given type for the given group, with the given
+/// number of consecutive sources.
+static IgmpV3GroupRecord make_group_record(IgmpV3GroupRecordType type, int group, int source_count)
+{
+    IgmpV3GroupRecord record;
+    record.type = type;
+    record.multicast_address = group_address(group);
+    for (int i = 0; i < source_count; i++)
+    {
+        record.source_addresses.push_back(host_address(i));
+    }
+    return record;
+}
+
+/// Tests that splitting a report keeps every report within the size limit, splits
+/// records that don't fit in a report into pieces which together hold every
+/// source, truncates EXCLUDE-mode records that don't fit to the same sources every
+/// time, and leaves records that do fit whole.
+static void test_split_membership_report(const char *test)
+{
+    const size_t max_report_size = 576 - igmp_ip_header_size;
+    const int max_sources =
+        (max_report_size - sizeof(IgmpV3MembershipReportHeader) - sizeof(IgmpV3GroupRecordHeader)) / sizeof(uint32_t);
+
+    IgmpV3MembershipReport report;
+    report.group_records.push_back(make_group_record(IgmpV3GroupRecordType::ModeIsInclude, 0, 3 * max_sources + 5));
+    report.group_records.push_back(make_group_record(IgmpV3GroupRecordType::ChangeToExcludeMode, 1, 2 * max_sources));
+    report.group_records.push_back(make_group_record(IgmpV3GroupRecordType::ModeIsExclude, 2, max_sources + 1));
+    report.group_records.push_back(make_group_record(IgmpV3GroupRecordType::AllowNewSources, 3, max_sources));
+    for (int group = 4; group < 40; group++)
+    {
+        report.group_records.push_back(make_group_record(IgmpV3GroupRecordType::ModeIsInclude, group, group % 7));
+    }
+
+    Vector<IgmpV3MembershipReport> results;
+    split_igmp_v3_membership_report(report, max_report_size, results);
+
+    bool fit = true;
+    Vector<int> record_counts(40, 0), source_counts(40, 0);
+    Vector<IPAddress> excluded_sources[3];
+    for (const auto &result : results)
+    {
+        fit = fit && result.get_size() <= max_report_size;
+        for (const auto &record : result.group_records)
+        {
+            int group = ntohl(record.multicast_address.addr()) - ntohl(group_address(0).addr());
+            record_counts[group]++;
+            source_counts[group] += record.source_addresses.size();
+            if (group == 1 || group == 2)
+            {
+                check(record.type == report.group_records[group].type, test, "truncated records keep their type");
+                excluded_sources[group] = record.source_addresses;
+            }
+        }
+    }
+    check(fit, test, "every report fits in the size limit");
+
+    check(record_counts[0] == 4 && source_counts[0] == 3 * max_sources + 5, test,
+          "an oversized INCLUDE-mode record is split into pieces that hold every source");
+    for (int group = 1; group <= 2; group++)
+    {
+        bool first_sources = excluded_sources[group].size() == max_sources;
+        for (int i = 0; first_sources && i < max_sources; i++)
+        {
+            first_sources = excluded_sources[group][i] == host_address(i);
+        }
+        check(record_counts[group] == 1 && first_sources, test,
+              "an oversized EXCLUDE-mode record is truncated to its first sources");
+    }
+    check(record_counts[3] == 1 && source_counts[3] == max_sources, test, "a record that just fits is left whole");
+
+    bool whole = true;
+    for (int group = 4; group < 40; group++)
+    {
+        whole = whole && record_counts[group] == 1 && source_counts[group] == group % 7;
+    }
+    check(whole, test, "small records are left whole");
+
+    // The records take up at least this many reports, and first-fit decreasing
+    // packing shouldn't need many more.
+    size_t total_size = 0;
+    for (const auto &result : results)
+    {
+        total_size += result.get_size() - sizeof(IgmpV3MembershipReportHeader);
+    }
+    size_t capacity = max_report_size - sizeof(IgmpV3MembershipReportHeader);
+    check((size_t)results.size() <= (total_size + capacity - 1) / capacity + 1, test, "the records are packed tightly");
+
+    // Splitting is deterministic, so retransmissions report the same sources.
+    Vector<IgmpV3MembershipReport> again;
+    split_igmp_v3_membership_report(report, max_report_size, again);
+    bool same = again.size() == results.size();
+    for (int i = 0; same && i < results.size(); i++)
+    {
+        same = again[i].group_records.size() == results[i].group_records.size();
+        for (int j = 0; same && j < results[i].group_records.size(); j++)
+        {
+            same = again[i].group_records[j].multicast_address == results[i].group_records[j].multicast_address &&
+                   again[i].group_records[j].source_addresses.size() ==
+                       results[i].group_records[j].source_addresses.size();
+        }
+    }
+    check(same, test, "splitting the same report twice gives the same reports");
+}
+
+/// Tests that a view of a report that has been cut short visits exactly the group
+/// records that fit in the message, and flags the report as truncated. Every cut
+/// is copied into a buffer of its own size, so that a memory checker catches any
+/// read past its end.
+static void test_report_view_truncated(const char *test)
+{
+    IgmpV3MembershipReport report;
+    report.group_records.push_back(make_group_record(IgmpV3GroupRecordType::ModeIsInclude, 0, 2));
+    report.group_records.push_back(make_group_record(IgmpV3GroupRecordType::ChangeToExcludeMode, 1, 0));
+    report.group_records.push_back(make_group_record(IgmpV3GroupRecordType::AllowNewSources, 2, 5));
+
+    Vector<unsigned char> buffer(report.get_size(), 0);
+    report.write(buffer.begin());
+
+    // The message sizes at which each record is complete.
+    Vector<size_t> record_ends;
+    size_t record_end = sizeof(IgmpV3MembershipReportHeader);
+    for (const auto &record : report.group_records)
+    {
+        record_end += record.get_size();
+        record_ends.push_back(record_end);
+    }
+
+    bool ok = true;
+    for (size_t size = 0; size <= (size_t)buffer.size(); size++)
+    {
+        unsigned char *cut = new unsigned char[size == 0 ? 1 : size];
+        memcpy(cut, buffer.begin(), size);
+        IgmpV3MembershipReportView view(cut, size);
+
+        int complete = 0;
+        while (complete < record_ends.size() && record_ends[complete] <= size)
+        {
+            complete++;
+        }
+        ok = ok && view.size() == complete && view.is_truncated() == (size < (size_t)buffer.size());
+
+        int visited = 0;
+        for (auto record : view)
+        {
+            const auto &expected = report.group_records[visited];
+            ok = ok && record.get_multicast_address() == expected.multicast_address &&
+                 record.get_type() == expected.type &&
+                 record.get_source_addresses().size() == expected.source_addresses.size();
+            int source_index = 0;
+            for (const auto &address : record.get_source_addresses())
+            {
+                ok = ok && address == expected.source_addresses[source_index++];
+            }
+            visited++;
+        }
+        ok = ok && visited == complete;
+        delete[] cut;
+    }
+    check(ok, test, "every cut visits just the complete records");
+
+    // A header that claims more records than there are.
+    auto header = reinterpret_cast<IgmpV3MembershipReportHeader *>(buffer.begin());
+    header->number_of_group_records = htons(4);
+    IgmpV3MembershipReportView extra_view(buffer.begin(), buffer.size());
+    check(extra_view.size() == 3 && extra_view.is_truncated(), test, "records that aren't there are ignored");
+
+    // A record that claims more sources, or more auxiliary data, than fit.
+    header->number_of_group_records = htons(3);
+    auto last_record = reinterpret_cast<IgmpV3GroupRecordHeader *>(
+        buffer.begin() + record_ends[1]);
+    last_record->number_of_sources = htons(6);
+    IgmpV3MembershipReportView sources_view(buffer.begin(), buffer.size());
+    check(sources_view.size() == 2 && sources_view.is_truncated(), test, "a record with too many sources is ignored");
+
+    last_record->number_of_sources = htons(5);
+    last_record->aux_data_length = 1;
+    IgmpV3MembershipReportView aux_view(buffer.begin(), buffer.size());
+    check(aux_view.size() == 2 && aux_view.is_truncated(), test, "a record with too much auxiliary data is ignored");
+}
+
+/// Appends the headers of a snapshot with a single interface, which holds the
+/// given number of group records, to the given string accumulator.
+static void append_snapshot_headers(StringAccum &sa, uint32_t record_count)
+{
+    IgmpRouterSnapshotHeader header;
+    header.magic = htonl(igmp_router_snapshot_magic);
+    header.version = htons(igmp_router_snapshot_version);
+    header.interface_count = htons(1);
+    header.taken_msec_high = 0;
+    header.taken_msec_low = 0;
+    sa.append(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    IgmpRouterSnapshotInterfaceHeader iface_header;
+    iface_header.address = IPAddress("10.0.0.1").addr();
+    iface_header.record_count = htonl(record_count);
+    sa.append(reinterpret_cast<const char *>(&iface_header), sizeof(iface_header));
+}
+
+/// Walks a snapshot with a single interface, and restores the records that it
+/// reads into the given filter. Returns the number of records that were read.
+static int restore_test_snapshot(const unsigned char *data, size_t size, IgmpTimerlessRouterFilter &filter)
+{
+    IgmpRouterSnapshotReader reader(data, size);
+    if (!reader.read_header() || reader.read_interface() == nullptr)
+    {
+        return -1;
+    }
+
+    int record_count = 0;
+    while (auto record = reader.read_record())
+    {
+        filter.restore_snapshot_record(IgmpRouterSnapshotRecordView(record), 0);
+        record_count++;
+    }
+    return record_count;
+}
+
+/// Tests that truncated and corrupt snapshots are read only as far as they are
+/// intact, and that records with a corrupt filter mode aren't restored.
+static void test_snapshot_corrupt(const char *test)
+{
+    IgmpTimerlessRouterFilter original(nullptr);
+    IgmpSourceSet sources;
+    sources.insert(host_address(0));
+    sources.insert(host_address(1));
+    original.receive_current_state_record(group_address(0), IgmpFilterMode::Include, sources);
+    IgmpSourceSet excluded;
+    excluded.insert(host_address(2));
+    original.receive_current_state_record(group_address(1), IgmpFilterMode::Exclude, excluded);
+
+    StringAccum sa;
+    append_snapshot_headers(sa, original.get_record_count() + 1);
+    size_t records_offset = sa.length();
+    original.write_snapshot_records(sa);
+
+    // A record whose filter mode is neither INCLUDE nor EXCLUDE.
+    IgmpRouterSnapshotRecordHeader corrupt_header;
+    memset(&corrupt_header, 0, sizeof(corrupt_header));
+    corrupt_header.multicast_address = group_address(2).addr();
+    corrupt_header.filter_mode = 7;
+    corrupt_header.source_count = htonl(1);
+    sa.append(reinterpret_cast<const char *>(&corrupt_header), sizeof(corrupt_header));
+    IgmpRouterSnapshotSource corrupt_source;
+    corrupt_source.source_address = host_address(3).addr();
+    corrupt_source.timer_dsec = htonl(100);
+    sa.append(reinterpret_cast<const char *>(&corrupt_source), sizeof(corrupt_source));
+
+    Vector<unsigned char> buffer(sa.length(), 0);
+    memcpy(buffer.begin(), sa.data(), sa.length());
+
+    // The snapshot sizes at which each record is complete.
+    Vector<size_t> record_ends;
+    size_t record_end = records_offset;
+    while (record_end < (size_t)buffer.size())
+    {
+        auto header = reinterpret_cast<const IgmpRouterSnapshotRecordHeader *>(buffer.begin() + record_end);
+        record_end += IgmpRouterSnapshotRecordView(header).get_size();
+        record_ends.push_back(record_end);
+    }
+    check(record_ends.size() == 3 && record_end == (size_t)buffer.size(), test, "the snapshot holds three records");
+
+    bool ok = true;
+    for (size_t size = 0; size <= (size_t)buffer.size(); size++)
+    {
+        // Each cut gets a buffer of its own, so that reading past it is caught
+        // by the address sanitizer.
+        unsigned char *cut = new unsigned char[size == 0 ? 1 : size];
+        memcpy(cut, buffer.begin(), size);
+
+        int complete = 0;
+        while (complete < record_ends.size() && record_ends[complete] <= size)
+        {
+            complete++;
+        }
+        IgmpTimerlessRouterFilter filter(nullptr);
+        int record_count = restore_test_snapshot(cut, size, filter);
+        ok = ok && record_count == (size < records_offset ? -1 : complete);
+        ok = ok && filter.get_record_count() == (complete < 2 ? complete : 2);
+        delete[] cut;
+    }
+    check(ok, test, "every cut restores just the complete records");
+
+    IgmpTimerlessRouterFilter filter(nullptr);
+    check(restore_test_snapshot(buffer.begin(), buffer.size(), filter) == 3, test, "an intact snapshot is read in full");
+    filter.publish();
+    check(filter.is_listening_to(group_address(0), host_address(1)) &&
+              !filter.is_listening_to(group_address(0), host_address(2)),
+          test, "an INCLUDE-mode record is restored");
+    check(filter.is_listening_to(group_address(1), host_address(1)) &&
+              !filter.is_listening_to(group_address(1), host_address(2)),
+          test, "an EXCLUDE-mode record is restored");
+    check(filter.get_record(group_address(2)) == nullptr, test, "a record with a corrupt filter mode is dropped");
+
+    // Counts that claim more data than there is, including counts whose product
+    // with the entry size would overflow.
+    auto first_record = reinterpret_cast<IgmpRouterSnapshotRecordHeader *>(buffer.begin() + records_offset);
+    uint32_t source_count = first_record->source_count;
+    const uint32_t corrupt_counts[] = {0x20000000, 0x40000001, 0xFFFFFFFF};
+    ok = true;
+    for (uint32_t count : corrupt_counts)
+    {
+        IgmpTimerlessRouterFilter source_filter(nullptr);
+        first_record->source_count = htonl(count);
+        ok = ok && restore_test_snapshot(buffer.begin(), buffer.size(), source_filter) == 0;
+
+        IgmpTimerlessRouterFilter excluded_filter(nullptr);
+        first_record->source_count = source_count;
+        first_record->excluded_count = htonl(count + 0x40000000);
+        ok = ok && restore_test_snapshot(buffer.begin(), buffer.size(), excluded_filter) == 0;
+        first_record->excluded_count = 0;
+    }
+    check(ok, test, "a record whose counts overrun the snapshot ends it");
+
+    auto header = reinterpret_cast<IgmpRouterSnapshotHeader *>(buffer.begin());
+    header->version = htons(igmp_router_snapshot_version + 1);
+    check(restore_test_snapshot(buffer.begin(), buffer.size(), filter) == -1, test, "another version is rejected");
+    header->version = htons(igmp_router_snapshot_version);
+    header->magic = htonl(igmp_router_snapshot_magic + 1);
+    check(restore_test_snapshot(buffer.begin(), buffer.size(), filter) == -1, test, "a bad magic number is rejected");
+}
+
+/// A clock for timer wheels that only moves when a test moves it.
+struct TestClock
+{
+    static Timestamp now() { return Timestamp::make_msec(now_msec); }
+
+    static Timestamp::value_type now_msec;
+};
+
+Timestamp::value_type TestClock::now_msec = 0;
+
+/// Gets the test clock's time, in deciseconds.
+static uint32_t test_clock_dsec()
+{
+    return (uint32_t)(TestClock::now_msec / 100);
+}
+
+struct TestTimerCallback;
+
+typedef TimerWheel<TestTimerCallback, TestClock> TestTimerWheel;
+
+/// The state that the callbacks of a test's timer wheel share.
+struct TestTimerState
+{
+    TestTimerWheel *wheel;
+
+    /// The time at which each entry last fired, in deciseconds, and the number
+    /// of times it fired.
+    Vector<uint32_t> fired_dsec;
+    Vector<int> fire_count;
+
+    /// An entry that the first entry schedules when it fires, and its delay.
+    TestTimerWheel::handle_type follow_up;
+    uint32_t follow_up_dsec;
+};
+
+/// A timer wheel callback that records when its entry fires.
+struct TestTimerCallback
+{
+    TestTimerState *state;
+    int id;
+
+    void operator()() const
+    {
+        state->fired_dsec[id] = test_clock_dsec();
+        state->fire_count[id]++;
+        if (id == 0 && state->follow_up != TestTimerWheel::null_handle)
+        {
+            state->wheel->schedule_after_dsec(state->follow_up, state->follow_up_dsec);
+        }
+    }
+};
+
+/// Creates the given number of entries in the timer wheel of the given state.
+static void create_test_timers(const char *test, TestTimerState &state, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        TestTimerCallback callback = {&state, i};
+        check(state.wheel->create(callback) == i, test, "entries are created in order");
+        state.fired_dsec.push_back(0);
+        state.fire_count.push_back(0);
+    }
+}
+
+/// Tests that entries fire at their expiry when they are cascaded down from the
+/// upper levels, both when the wheel runs every tick and when it runs late.
+static void test_timer_wheel_cascade(const char *test)
+{
+    const uint32_t deltas[] = {
+        1, 2, 62, 63, 64, 65, 127, 128, 129, 4031, 4095, 4096, 4097, 4159, 8191, 8192,
+        262143, 262144, 262145, 266240, 300000};
+    const int fixed_count = sizeof(deltas) / sizeof(deltas[0]);
+
+    for (int late = 0; late < 2; late++)
+    {
+        TestClock::now_msec = 0;
+        TestTimerState state;
+        TestTimerWheel wheel(nullptr);
+        state.wheel = &wheel;
+        state.follow_up = TestTimerWheel::null_handle;
+
+        // The entries are scheduled at an odd tick, so that their expiries don't
+        // line up with the cascades.
+        TestClock::now_msec = 3700;
+
+        const int count = fixed_count + 200;
+        create_test_timers(test, state, count);
+        TestRandom random;
+        Vector<uint32_t> expiries;
+        uint32_t last_expiry = 0;
+        for (int i = 0; i < count; i++)
+        {
+            uint32_t delta = i < fixed_count ? deltas[i] : 1 + random.next(320000);
+            wheel.schedule_after_dsec(i, delta);
+            expiries.push_back(test_clock_dsec() + delta);
+            last_expiry = expiries[i] > last_expiry ? expiries[i] : last_expiry;
+        }
+
+        bool ok = true;
+        uint32_t previous_run_dsec = test_clock_dsec();
+        while (test_clock_dsec() <= last_expiry)
+        {
+            TestClock::now_msec += 100 * (late ? 1 + random.next(700) : 1);
+            wheel.run();
+            for (int i = 0; i < count; i++)
+            {
+                // Entries fire in the first run at or after their expiry.
+                bool due = expiries[i] <= test_clock_dsec();
+                ok = ok && state.fire_count[i] == (due ? 1 : 0);
+                ok = ok && (!due || expiries[i] > previous_run_dsec || state.fired_dsec[i] <= previous_run_dsec);
+                ok = ok && (!due || state.fired_dsec[i] >= expiries[i]);
+            }
+            previous_run_dsec = test_clock_dsec();
+        }
+        check(ok, test, late ? "entries fire in the first late run after their expiry" : "entries fire right at their expiry");
+    }
+}
+
+/// Tests that a callback which fires the last pending entry and schedules another
+/// one doesn't make that entry fire early.
+static void test_timer_wheel_reschedule_last(const char *test)
+{
+    TestClock::now_msec = 0;
+    TestTimerState state;
+    TestTimerWheel wheel(nullptr);
+    state.wheel = &wheel;
+    create_test_timers(test, state, 2);
+    state.follow_up = 1;
+
+    // The wheel runs late, and the follow-up lands in the slot that is being
+    // drained, but a full revolution of the first level later.
+    wheel.schedule_after_dsec(0, 5);
+    TestClock::now_msec = 1000;
+    state.follow_up_dsec = 64 + 5 - 10;
+    wheel.run();
+    check(state.fire_count[0] == 1, test, "the first entry fires");
+    check(state.fire_count[1] == 0 && wheel.scheduled(1), test, "the follow-up doesn't fire right away");
+    check(wheel.remaining_time_dsec(1) == state.follow_up_dsec, test, "the follow-up keeps its delay");
+
+    bool ok = true;
+    while (state.fire_count[1] == 0 && test_clock_dsec() < 200)
+    {
+        TestClock::now_msec += 100;
+        wheel.run();
+        ok = ok && (state.fire_count[1] == 0 || state.fired_dsec[1] == 10 + state.follow_up_dsec);
+    }
+    check(ok && state.fire_count[1] == 1, test, "the follow-up fires at its expiry");
+}
+
+/// Counts the runs of a timer wheel that fired entries.
+static void count_timer_wheel_run(void *data)
+{
+    (*(int *)data)++;
+}
+
+/// Tests that the run hook is called once for every run that fires entries, no
+/// matter how many it fires.
+static void test_timer_wheel_run_hook(const char *test)
+{
+    TestClock::now_msec = 0;
+    TestTimerState state;
+    TestTimerWheel wheel(nullptr);
+    state.wheel = &wheel;
+    state.follow_up = TestTimerWheel::null_handle;
+    create_test_timers(test, state, 10);
+    int run_count = 0;
+    wheel.set_run_hook(&count_timer_wheel_run, &run_count);
+
+    for (int i = 0; i < 10; i++)
+    {
+        wheel.schedule_after_dsec(i, i < 8 ? 5 : 7);
+    }
+    TestClock::now_msec = 400;
+    wheel.run();
+    check(run_count == 0, test, "a run that fires nothing doesn't call the hook");
+
+    TestClock::now_msec = 500;
+    wheel.run();
+    check(state.fire_count[7] == 1 && run_count == 1, test, "a run that fires many entries calls the hook once");
+
+    TestClock::now_msec = 1000;
+    wheel.run();
+    check(state.fire_count[9] == 1 && run_count == 2, test, "every run that fires entries calls the hook");
+}
+
+/// An event schedule that runs on the test clock.
+struct TestEvent;
+typedef EventSchedule<TestEvent, TestClock> TestEventSchedule;
+
+/// An event that counts how often it fires, and that can schedule a follow-up.
+struct TestEvent
+{
+    TestEvent()
+        : fire_counts(nullptr), id(0), schedule(nullptr)
+    {
+    }
+    TestEvent(Vector<int> *fire_counts, int id, TestEventSchedule *schedule = nullptr)
+        : fire_counts(fire_counts), id(id), schedule(schedule)
+    {
+    }
+
+    Vector<int> *fire_counts;
+    int id;
+
+    /// The schedule to put a follow-up event in, if any.
+    TestEventSchedule *schedule;
+
+    void operator()() const
+    {
+        (*fire_counts)[id]++;
+        if (schedule != nullptr)
+        {
+            schedule->schedule_after_dsec(1, TestEvent(fire_counts, id + 1));
+        }
+    }
+};
+
+/// Tests that an event schedule releases a slot as soon as its event fires or is
+/// cancelled, that stale handles refer to nothing, and that freed slots are reused.
+static void test_event_schedule_cancel_and_reuse(const char *test)
+{
+    TestClock::now_msec = 0;
+    TestEventSchedule schedule(nullptr);
+    Vector<int> fire_counts(4, 0);
+
+    auto first = schedule.schedule_after_dsec(5, TestEvent(&fire_counts, 0));
+    auto second = schedule.schedule_after_dsec(5, TestEvent(&fire_counts, 1));
+    check(schedule.size() == 2 && schedule.scheduled(first) && schedule.scheduled(second), test,
+          "scheduled events are pending");
+
+    check(schedule.cancel(second) && !schedule.scheduled(second) && schedule.size() == 1, test,
+          "a cancelled event is no longer pending");
+    check(!schedule.cancel(second), test, "an event can't be cancelled twice");
+
+    // The cancelled event's slot goes to the next event, but the old handle
+    // doesn't refer to the new event.
+    auto third = schedule.schedule_after_dsec(5, TestEvent(&fire_counts, 2));
+    check(third.index == second.index && !schedule.scheduled(second) && !schedule.cancel(second) &&
+              schedule.scheduled(third),
+          test, "a freed slot is reused, and its stale handle refers to nothing");
+
+    TestClock::now_msec = 500;
+    schedule.run();
+    check(fire_counts[0] == 1 && fire_counts[1] == 0 && fire_counts[2] == 1, test,
+          "due events fire once, and cancelled ones don't");
+    check(schedule.size() == 0 && !schedule.scheduled(first) && !schedule.cancel(first), test,
+          "a slot is released as soon as its event fires");
+
+    // An event may schedule another one while it fires. Its own slot has been
+    // released by then, so the follow-up takes the slot that it just freed.
+    auto chained = schedule.schedule_after_dsec(1, TestEvent(&fire_counts, 2, &schedule));
+    TestClock::now_msec = 600;
+    schedule.run();
+    check(fire_counts[2] == 2 && schedule.size() == 1 && !schedule.scheduled(chained), test,
+          "an event can schedule a follow-up");
+    TestClock::now_msec = 700;
+    schedule.run();
+    check(fire_counts[3] == 1 && schedule.size() == 0, test, "the follow-up fires in turn");
+
+    schedule.schedule_after_dsec(1, TestEvent(&fire_counts, 0));
+    schedule.schedule_after_dsec(1, TestEvent(&fire_counts, 1));
+    schedule.clear();
+    TestClock::now_msec = 800;
+    schedule.run();
+    check(schedule.size() == 0 && fire_counts[0] == 1 && fire_counts[1] == 0, test, "clear cancels every event");
+}
+
+CLICK_ENDDECLS
+
+int main()
+{
+    const struct
+    {
+        const char *name;
+        void (*run)(const char *test);
+    } tests[] = {
+        {"event_schedule.cancel_and_reuse", test_event_schedule_cancel_and_reuse},
+        {"forwarding_index.colliding_erase", test_forwarding_index_colliding_erase},
+        {"forwarding_index.random_changes", test_forwarding_index_random_changes},
+        {"forwarding_index.slot_mask", test_forwarding_index_slot_mask},
+        {"forwarding_index.shared_publish", test_shared_forwarding_index_publish},
+        {"forwarding_index.shared_concurrent_reader", test_shared_forwarding_index_concurrent_reader},
+        {"load_controller.heavy_loss", test_load_controller_heavy_loss},
+        {"load_controller.non_adopting_hosts", test_load_controller_non_adopting_hosts},
+        {"querier_election", test_querier_election},
+        {"router_filter.query_rounds", test_router_filter_query_rounds},
+        {"router_filter.refresh_keeps_generation", test_router_filter_refresh_keeps_generation},
+        {"router_filter.state_changes", test_router_filter_state_changes},
+        {"report.split", test_split_membership_report},
+        {"report.view_truncated", test_report_view_truncated},
+        {"snapshot.corrupt", test_snapshot_corrupt},
+        {"timer_wheel.cascade", test_timer_wheel_cascade},
+        {"timer_wheel.reschedule_last", test_timer_wheel_reschedule_last},
+        {"timer_wheel.run_hook", test_timer_wheel_run_hook},
+    };
+
+    for (const auto &test : tests)
+    {
+        int previous_failure_count = failure_count;
+        test.run(test.name);
+        printf("%s: %s\n", test.name, failure_count == previous_failure_count ? "ok" : "FAILED");
+    }
+    return failure_count == 0 ? 0 : 1;
+}